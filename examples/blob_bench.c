@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include <blobpack/blobpack.h>
+
+#include "../src/ubus_srv_blob.h"
+
+/**
+Echo benchmark for the blob server. Server side runs in the main thread and sends every
+message back. Client thread keeps BENCH_PIPELINE frames in flight on each of BENCH_CONNECTIONS
+connections. Build as poll-bench and uring-bench to compare backends.
+**/
+
+#define BENCH_SOCKET "/tmp/ubus-blob-bench.sock"
+#define BENCH_CONNECTIONS 1000
+#define BENCH_PIPELINE 4
+#define BENCH_ROUNDS 50
+
+#ifdef CONFIG_IO_URING
+#define BENCH_BACKEND "io_uring"
+#else
+#define BENCH_BACKEND "poll"
+#endif
+
+static const char bench_msg[] = "[\"call\",1,{\"object\":\"bench\",\"method\":\"echo\",\"data\":[1,2,3,4,5,6,7,8]}]"; 
+static volatile bool done = false; 
+
+// legacy frame header. The server answers with the same so every reply is as long as the request.
+struct bench_header {
+	uint8_t hdr_size; 
+	uint16_t crc; 
+	uint32_t data_size; 
+} __attribute__((packed)) __attribute__((__aligned__(4))); 
+
+static double now(void){
+	struct timespec t; 
+	clock_gettime(CLOCK_MONOTONIC, &t); 
+	return t.tv_sec + t.tv_nsec / 1e9; 
+}
+
+static void *client_thread(void *arg){
+	int *fds = calloc(BENCH_CONNECTIONS, sizeof(int)); 
+	struct pollfd *pfd = calloc(BENCH_CONNECTIONS, sizeof(struct pollfd)); 
+	long *pending = calloc(BENCH_CONNECTIONS, sizeof(long)); 
+	struct sockaddr_un addr = { .sun_family = AF_UNIX }; 
+	strcpy(addr.sun_path, BENCH_SOCKET); 
+
+	struct blob msg; 
+	blob_init(&msg, 0, 0); 
+	blob_put_json(&msg, bench_msg); 
+	struct blob_field *field = blob_field_first_child(blob_head(&msg)); 
+	struct bench_header hdr = {
+		.hdr_size = sizeof(struct bench_header),
+		.crc = ubus_crc16(field, blob_field_raw_len(field)),
+		.data_size = blob_field_raw_pad_len(field)
+	}; 
+	size_t frame_size = sizeof(hdr) + hdr.data_size; 
+	char *frames = malloc(frame_size * BENCH_PIPELINE); 
+	for(int c = 0; c < BENCH_PIPELINE; c++){
+		memcpy(frames + c * frame_size, &hdr, sizeof(hdr)); 
+		memcpy(frames + c * frame_size + sizeof(hdr), field, hdr.data_size); 
+	}
+
+	for(int c = 0; c < BENCH_CONNECTIONS; c++){
+		fds[c] = socket(AF_UNIX, SOCK_STREAM, 0); 
+		if(connect(fds[c], (struct sockaddr*)&addr, sizeof(addr)) < 0){
+			perror("connect"); 
+			exit(1); 
+		}
+		pfd[c] = (struct pollfd){ .fd = fds[c], .events = POLLIN }; 
+	}
+
+	char buf[16384]; 
+	long total = 0; 
+	double start = now(); 
+	for(int round = 0; round < BENCH_ROUNDS; round++){
+		long outstanding = 0; 
+		for(int c = 0; c < BENCH_CONNECTIONS; c++){
+			if(write(fds[c], frames, frame_size * BENCH_PIPELINE) < 0) perror("write"); 
+			pending[c] = frame_size * BENCH_PIPELINE; 
+			outstanding += pending[c]; 
+		}
+		// replies are counted in bytes since they are exactly as long as what we sent
+		while(outstanding > 0){
+			if(poll(pfd, BENCH_CONNECTIONS, 1000) <= 0){
+				fprintf(stderr, "timed out with %ld bytes outstanding\n", outstanding); 
+				exit(1); 
+			}
+			for(int c = 0; c < BENCH_CONNECTIONS; c++){
+				if(!(pfd[c].revents & POLLIN)) continue; 
+				int rc = read(fds[c], buf, sizeof(buf)); 
+				if(rc <= 0) continue; 
+				pending[c] -= rc; 
+				outstanding -= rc; 
+			}
+		}
+		total += BENCH_CONNECTIONS * BENCH_PIPELINE; 
+	}
+	double t = now() - start; 
+	printf("%-10s %d connections: %8.0f msg/s (%ld messages in %.2fs)\n", BENCH_BACKEND, BENCH_CONNECTIONS, total / t, total, t); 
+
+	for(int c = 0; c < BENCH_CONNECTIONS; c++) close(fds[c]); 
+	free(fds); 
+	free(pfd); 
+	free(pending); 
+	free(frames); 
+	blob_free(&msg); 
+	done = true; 
+	return NULL; 
+}
+
+int main(int argc, char **argv){
+	// we need one descriptor for each end of every connection
+	struct rlimit rl = { .rlim_cur = 4 * BENCH_CONNECTIONS, .rlim_max = 4 * BENCH_CONNECTIONS }; 
+	if(setrlimit(RLIMIT_NOFILE, &rl) < 0) perror("setrlimit"); 
+
+	ubus_server_t server = ubus_srv_blob_new(); 
+	if(ubus_server_listen(server, BENCH_SOCKET) < 0){
+		fprintf(stderr, "could not listen on %s\n", BENCH_SOCKET); 
+		return -1; 
+	}
+
+	pthread_t thread; 
+	pthread_create(&thread, NULL, client_thread, NULL); 
+	while(!done){
+		ubus_server_wait(server, -1, 100); 
+		struct ubus_message *msg; 
+		while(ubus_server_recv(server, &msg) == 1){
+			// message goes back to the peer it came from
+			if(ubus_server_send(server, &msg) < 0) ubus_message_delete(&msg); 
+		}
+	}
+	pthread_join(thread, NULL); 
+
+	ubus_server_delete(server); 
+	unlink(BENCH_SOCKET); 
+	return 0; 
+}
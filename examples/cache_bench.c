@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <blobpack/blobpack.h>
+#include "../src/ubus_cache.h"
+
+#define BENCH_ROUNDS 200000
+
+// replies as a peer resolves them and as the hub and the proxy put them into the cache
+static const char *replies[][2] = {
+	{ "info", "{\"uptime\":86132,\"localtime\":1476822123,\"load\":[2048,4096,1024],\"memory\":{\"total\":128000,\"free\":64000,\"shared\":0,\"buffered\":2000}}" },
+	{ "board", "{\"kernel\":\"4.4.14\",\"hostname\":\"OpenWrt\",\"system\":\"MIPS 24Kc V7.4\",\"model\":\"TP-Link TL-WR841N/ND v9\",\"release\":{\"distribution\":\"OpenWrt\",\"version\":\"15.05\"}}" },
+	{ "dump", "[{\"interface\":\"lan\",\"up\":true},{\"interface\":\"wan\",\"up\":false}]" },
+	{ "empty", "{}" }
+}; 
+
+static double now(void){
+	struct timespec t; 
+	clock_gettime(CLOCK_MONOTONIC, &t); 
+	return t.tv_sec + t.tv_nsec / 1e9; 
+}
+
+static void bench(struct ubus_cache *cache, const char *method, const char *json){
+	struct blob msg, out; 
+	blob_init(&msg, 0, 0); 
+	blob_init(&out, 0, 0); 
+	blob_put_json(&msg, json); 
+	struct blob_field *reply = blob_field_first_child(blob_head(&msg)); 
+	char *text = blob_field_to_json(reply); 
+	uint64_t hash = ubus_cache_hash(NULL); 
+
+	// a miss delivers the reply of the peer as it is so a hit has to deliver exactly the same field
+	if(ubus_cache_get(cache, "system", method, hash, NULL, &out)) printf("%s: hit before anything was stored!\n", method); 
+	ubus_cache_put(cache, "system", method, hash, NULL, reply); 
+	struct blob_field *hit = ubus_cache_get(cache, "system", method, hash, NULL, &out); 
+	if(!hit){
+		printf("%s: miss after the reply was stored!\n", method); 
+	} else {
+		char *back = blob_field_to_json(hit); 
+		if(blob_field_type(hit) != blob_field_type(reply) || strcmp(back, text) != 0) printf("%s: hit differs from miss: %s\n", method, back); 
+		free(back); 
+	}
+	// a call that only shares the hash must not get the reply
+	struct blob other; 
+	blob_init(&other, 0, 0); 
+	blob_put_int(&other, 1); 
+	if(ubus_cache_get(cache, "system", method, hash, blob_head(&other), &out)) printf("%s: hit for other arguments with the same hash!\n", method); 
+	blob_free(&other); 
+
+	double start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++) ubus_cache_put(cache, "system", method, hash, NULL, reply); 
+	double t_put = now() - start; 
+
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++) ubus_cache_get(cache, "system", method, hash, NULL, &out); 
+	double t_get = now() - start; 
+
+	printf("%-6s %4u bytes: put %6.0f ns, get %6.0f ns\n", method, blob_field_raw_pad_len(reply),
+		t_put / BENCH_ROUNDS * 1e9, t_get / BENCH_ROUNDS * 1e9); 
+
+	free(text); 
+	blob_free(&out); 
+	blob_free(&msg); 
+}
+
+int main(int argc, char **argv){
+	struct ubus_cache *cache = ubus_cache_new(); 
+	ubus_cache_set_rule(cache, NULL, "info", 60000); 
+	ubus_cache_set_rule(cache, "system", "board", 60000); 
+	ubus_cache_set_rule(cache, NULL, "dump", 60000); 
+	ubus_cache_set_rule(cache, NULL, "empty", 60000); 
+
+	printf("%d rounds per reply\n", BENCH_ROUNDS); 
+	for(size_t c = 0; c < sizeof(replies) / sizeof(replies[0]); c++){
+		bench(cache, replies[c][0], replies[c][1]); 
+	}
+
+	struct ubus_cache_stats stats; 
+	ubus_cache_get_stats(cache, &stats); 
+	printf("hits %llu, misses %llu, stores %llu, entries %u\n", (unsigned long long)stats.hits,
+		(unsigned long long)stats.misses, (unsigned long long)stats.stores, stats.entries); 
+
+	ubus_cache_delete(&cache); 
+	return 0; 
+}
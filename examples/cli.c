@@ -6,7 +6,7 @@
 #include "../src/libubus2.h"
 #include "../sockets/json_socket.h"
 
-static int done = 0; 
+static int timeout = UBUS_DEFAULT_TIMEOUT; 
 
 static int usage(const char *prog)
 {
@@ -25,18 +25,11 @@ static int usage(const char *prog)
 		" - send <type> [<message>]		Send an event\n"
 		" - wait_for <object> [<object>...]	Wait for multiple objects to appear on ubus\n"
 		"\n", prog);
-	done = 1; 
 	return 1;
 }
 
-void _on_call_done(struct ubus_request *req, struct blob_field *res){
+static void _dump_list(struct blob_field *res){
 	blob_field_dump_json(res); 
-	done = 1; 
-}
-
-void _on_list_done(struct ubus_request *req, struct blob_field *res){
-	blob_field_dump_json(res); 
-	done = 1; 
 	return; 
 	res = blob_field_first_child(res); 
 	if(!blob_field_validate(res, "s{sa}")) {
@@ -71,18 +64,6 @@ void _on_list_done(struct ubus_request *req, struct blob_field *res){
 			}
 		}
 	}
-	done = 1; 
-}
-
-void _on_request_failed(struct ubus_request *req, struct blob_field *res){
-	struct blob_field *code = blob_field_first_child(res); 
-	if(!blob_field_validate(code, "i")){
-		fprintf(stderr, "request failed, invalid error message!\n"); 
-		return; 
-	}
-	int c = blob_field_get_int(blob_field_first_child(code)); 
-	printf("request failed: %s\n", ubus_status_to_string(c)); 
-	done = 1; 
 }
 
 static int _command_list(struct ubus_context *ctx, int argc, char **argv){
@@ -90,13 +71,15 @@ static int _command_list(struct ubus_context *ctx, int argc, char **argv){
 	blob_init(&buf, 0, 0); 
 	blob_offset_t ofs = blob_open_table(&buf); 
 	blob_close_table(&buf, ofs); 
-	struct ubus_request *req = ubus_request_new("server", "/ubus/peer", "ubus.peer.list", blob_field_first_child(blob_head(&buf))); 
-	ubus_request_on_resolve(req, &_on_list_done); 
-	ubus_request_on_reject(req, &_on_request_failed); 
-	ubus_send_request(ctx, &req); 
+	struct blob reply; 
+	blob_init(&reply, 0, 0); 
+	int ret = ubus_call_sync(ctx, "server", "/ubus/peer", "ubus.peer.list", blob_field_first_child(blob_head(&buf)), timeout, &reply); 
+	if(ret == UBUS_STATUS_OK) _dump_list(blob_head(&reply)); 
+	else printf("request failed: %s\n", ubus_status_to_string(ret)); 
+	blob_free(&reply); 
 	blob_free(&buf); 
 
-	return 0; 
+	return ret; 
 }
 
 static int _command_call(struct ubus_context *ctx, int argc, char **argv){
@@ -105,12 +88,14 @@ static int _command_call(struct ubus_context *ctx, int argc, char **argv){
 	if(argc < 2) return usage("prog"); 
 	if(argc == 3)
 		blob_put_json(&buf, argv[2]); 
-	struct ubus_request *req = ubus_request_new("server", argv[0], argv[1], blob_field_first_child(blob_head(&buf))); 
-	ubus_request_on_resolve(req, &_on_call_done); 
-	ubus_request_on_reject(req, &_on_request_failed); 
-	ubus_send_request(ctx, &req); 
+	struct blob reply; 
+	blob_init(&reply, 0, 0); 
+	int ret = ubus_call_sync(ctx, "server", argv[0], argv[1], blob_field_first_child(blob_head(&buf)), timeout, &reply); 
+	if(ret == UBUS_STATUS_OK) blob_field_dump_json(blob_head(&reply)); 
+	else printf("request failed: %s\n", ubus_status_to_string(ret)); 
+	blob_free(&reply); 
 	blob_free(&buf); 
-	return 0; 
+	return ret; 
 }
 
 struct {
@@ -144,6 +129,9 @@ int main(int argc, char **argv)
 		case 'v':
 			verbose++;
 			break;
+		case 't':
+			timeout = atoi(optarg) * 1000; 
+			break; 
 		default:
 			return usage(progname);
 		}
@@ -179,10 +167,6 @@ int main(int argc, char **argv)
 		break;
 	}
 
-	while(!done){
-		ubus_handle_events(ctx); 
-	}
-	
 	if (ret != 0)
 		fprintf(stderr, "Command failed!");
 	else if (ret == -2)
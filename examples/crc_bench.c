@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/ubus_crc.h"
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_ROUNDS 8
+
+static double now(void){
+	struct timespec t; 
+	clock_gettime(CLOCK_MONOTONIC, &t); 
+	return t.tv_sec + t.tv_nsec / 1e9; 
+}
+
+static void bench(const char *name, uint32_t (*fn)(enum ubus_frame_check, const void*, size_t), enum ubus_frame_check type, const char *buf){
+	volatile uint32_t sum = 0; 
+	double start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		sum += fn(type, buf, BENCH_SIZE); 
+	}
+	double t = now() - start; 
+	printf("%-16s %8.2f GB/s (%08x)\n", name, ((double)BENCH_SIZE * BENCH_ROUNDS) / t / 1e9, sum); 
+}
+
+static uint32_t _crc32c_sw(enum ubus_frame_check type, const void *buf, size_t size){
+	return ubus_crc32c_sw(0, buf, size); 
+}
+
+int main(int argc, char **argv){
+	char *buf = malloc(BENCH_SIZE); 
+	for(int c = 0; c < BENCH_SIZE; c++) buf[c] = rand(); 
+
+	printf("checksum throughput over %d MB buffer\n", BENCH_SIZE / (1024 * 1024)); 
+	bench("none", ubus_frame_checksum, UBUS_FRAME_CHECK_NONE, buf); 
+	bench("crc16", ubus_frame_checksum, UBUS_FRAME_CHECK_CRC16, buf); 
+	bench("crc32c (sw)", _crc32c_sw, UBUS_FRAME_CHECK_CRC32C, buf); 
+	bench("crc32c", ubus_frame_checksum, UBUS_FRAME_CHECK_CRC32C, buf); 
+
+	free(buf); 
+	return 0; 
+}
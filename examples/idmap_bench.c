@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/ubus_id.h"
+
+#define BENCH_LOOKUPS 10000000
+
+static double now(void){
+	struct timespec t; 
+	clock_gettime(CLOCK_MONOTONIC, &t); 
+	return t.tv_sec + t.tv_nsec / 1e9; 
+}
+
+static void bench(int count){
+	struct ubus_id *ids = calloc(count, sizeof(struct ubus_id)); 
+	struct ubus_id *mids = calloc(count, sizeof(struct ubus_id)); 
+	uint32_t *keys = calloc(BENCH_LOOKUPS, sizeof(uint32_t)); 
+	struct avl_tree tree; 
+	struct ubus_id_map map; 
+	ubus_id_tree_init(&tree); 
+	ubus_id_map_init(&map); 
+
+	for(int c = 0; c < count; c++){
+		ubus_id_alloc(&tree, &ids[c], 0); 
+		ubus_id_map_alloc(&map, &mids[c], ids[c].id); 
+	}
+	// look up existing ids in random order so that we do not just measure the cache
+	for(int c = 0; c < BENCH_LOOKUPS; c++){
+		keys[c] = ids[rand() % count].id; 
+	}
+
+	volatile uintptr_t sum = 0; 
+	double start = now(); 
+	for(int c = 0; c < BENCH_LOOKUPS; c++){
+		sum += (uintptr_t)ubus_id_find(&tree, keys[c]); 
+	}
+	double t_tree = now() - start; 
+
+	start = now(); 
+	for(int c = 0; c < BENCH_LOOKUPS; c++){
+		sum += (uintptr_t)ubus_id_map_find(&map, keys[c]); 
+	}
+	double t_map = now() - start; 
+
+	printf("%8d entries: avl %6.1f M lookups/s, map %6.1f M lookups/s\n", count, 
+		BENCH_LOOKUPS / t_tree / 1e6, BENCH_LOOKUPS / t_map / 1e6); 
+
+	for(int c = 0; c < count; c++){
+		ubus_id_free(&tree, &ids[c]); 
+		ubus_id_map_free(&map, &mids[c]); 
+	}
+	ubus_id_map_destroy(&map); 
+	free(keys); 
+	free(mids); 
+	free(ids); 
+}
+
+int main(int argc, char **argv){
+	bench(100); 
+	bench(10000); 
+	bench(1000000); 
+	return 0; 
+}
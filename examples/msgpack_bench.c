@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <blobpack/blobpack.h>
+#include "../src/ubus_msgpack.h"
+#include "../src/ubus_json.h"
+
+#define BENCH_ROUNDS 200000
+
+// messages as they go over the wire between ubus peers
+static const char *payloads[][2] = {
+	{ "call", "{\"jsonrpc\":\"2.0\",\"id\":1234,\"method\":\"call\",\"params\":[\"network.interface.lan\",\"status\",{}]}" },
+	{ "status reply", "{\"jsonrpc\":\"2.0\",\"id\":1234,\"result\":{\"up\":true,\"pending\":false,\"available\":true,\"autostart\":true,"
+		"\"uptime\":86132,\"l3_device\":\"br-lan\",\"proto\":\"static\",\"device\":\"br-lan\",\"metric\":0,\"dns_metric\":0,"
+		"\"delegation\":true,\"ipv4-address\":[{\"address\":\"192.168.1.1\",\"mask\":24}],\"ipv6-address\":[],"
+		"\"ipv6-prefix-assignment\":[{\"address\":\"fd6c:2a1e:3b5f::\",\"mask\":60,\"local-address\":{\"address\":\"fd6c:2a1e:3b5f::1\",\"mask\":60}}],"
+		"\"route\":[],\"dns-server\":[],\"dns-search\":[],\"inactive\":{\"ipv4-address\":[],\"ipv6-address\":[],\"route\":[],\"dns-server\":[],\"dns-search\":[]},"
+		"\"data\":{}}}" },
+	{ "list reply", "{\"jsonrpc\":\"2.0\",\"id\":77,\"result\":{\"network\":{\"restart\":{},\"reload\":{},\"add_host_route\":{\"target\":\"s\",\"v6\":\"b\",\"interface\":\"s\"},"
+		"\"get_proto_handlers\":{},\"add_dynamic\":{\"name\":\"s\"}},\"network.device\":{\"status\":{\"name\":\"s\"},\"set_alias\":{\"alias\":\"a\",\"device\":\"s\"},"
+		"\"set_state\":{\"name\":\"s\",\"defer\":\"b\"}},\"system\":{\"board\":{},\"info\":{},\"reboot\":{},\"watchdog\":{\"frequency\":\"i\",\"timeout\":\"i\",\"magicclose\":\"b\",\"stop\":\"b\"},"
+		"\"signal\":{\"pid\":\"i\",\"signum\":\"i\"},\"sysupgrade\":{\"path\":\"s\",\"force\":\"b\",\"backup\":\"s\",\"prefix\":\"s\",\"command\":\"s\",\"options\":\"t\"}}}}" },
+	{ "batch", "[{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"call\",\"params\":[\"system\",\"info\",{}]},"
+		"{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"call\",\"params\":[\"system\",\"board\",{}]},"
+		"{\"jsonrpc\":\"2.0\",\"id\":3,\"method\":\"call\",\"params\":[\"network.device\",\"status\",{\"name\":\"eth0\"}]}]" }
+}; 
+
+static double now(void){
+	struct timespec t; 
+	clock_gettime(CLOCK_MONOTONIC, &t); 
+	return t.tv_sec + t.tv_nsec / 1e9; 
+}
+
+static void report(const char *codec, const char *what, double t, size_t bytes){
+	printf("  %-8s %-6s %8.0f ns/msg %8.1f MB/s\n", codec, what, t / BENCH_ROUNDS * 1e9, (double)bytes * BENCH_ROUNDS / t / 1e6); 
+}
+
+static void bench(const char *name, const char *json){
+	struct blob msg, out; 
+	blob_init(&msg, 0, 0); 
+	blob_init(&out, 0, 0); 
+	blob_put_json(&msg, json); 
+	struct blob_field *field = blob_field_first_child(blob_head(&msg)); 
+
+	char *text = blob_field_to_json(field); 
+	size_t json_size = strlen(text); 
+	size_t blob_size = blob_field_raw_pad_len(field); 
+	size_t mp_size = ubus_msgpack_size(field); 
+	char *packed = malloc(mp_size); 
+	ubus_msgpack_encode(field, packed); 
+
+	printf("%s: json %zu bytes, blobpack %zu bytes (%.0f%%), msgpack %zu bytes (%.0f%%)\n", name,
+		json_size, blob_size, 100.0 * blob_size / json_size, mp_size, 100.0 * mp_size / json_size); 
+
+	double start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++) free(blob_field_to_json(field)); 
+	report("json", "encode", now() - start, json_size); 
+
+	// what the json transports use to write their frames: size pass and then the text in place
+	char *frame = malloc(ubus_json_size(field)); 
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		if(ubus_json_size(field)) ubus_json_encode(field, frame); 
+	}
+	report("json", "writer", now() - start, json_size); 
+	free(frame); 
+
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		blob_reset(&out); 
+		blob_put_json(&out, text); 
+	}
+	report("json", "decode", now() - start, json_size); 
+
+	// what the json transports use to read their frames
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		blob_reset(&out); 
+		if(!ubus_json_parse(&out, text, json_size)) { printf("parse failed!\n"); break; }
+	}
+	report("json", "parser", now() - start, json_size); 
+
+	// blobpack is its own wire format so both ways are a copy of the buffer
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		blob_reset(&out); 
+		blob_put_attr(&out, field); 
+	}
+	report("blobpack", "copy", now() - start, blob_size); 
+
+	char *buf = malloc(mp_size); 
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++) ubus_msgpack_encode(field, buf); 
+	report("msgpack", "encode", now() - start, mp_size); 
+
+	start = now(); 
+	for(int c = 0; c < BENCH_ROUNDS; c++){
+		blob_reset(&out); 
+		if(ubus_msgpack_decode(&out, packed, mp_size) != mp_size) { printf("decode failed!\n"); break; }
+	}
+	report("msgpack", "decode", now() - start, mp_size); 
+
+	char *back = blob_field_to_json(blob_field_first_child(blob_head(&out))); 
+	if(strcmp(back, text) != 0) printf("  msgpack does not round trip: %s\n", back); 
+
+	free(back); 
+	free(buf); 
+	free(packed); 
+	free(text); 
+	blob_free(&out); 
+	blob_free(&msg); 
+}
+
+int main(int argc, char **argv){
+	printf("%d rounds per message\n", BENCH_ROUNDS); 
+	for(size_t c = 0; c < sizeof(payloads) / sizeof(payloads[0]); c++){
+		bench(payloads[c][0], payloads[c][1]); 
+	}
+	return 0; 
+}
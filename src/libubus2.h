@@ -26,5 +26,14 @@
 #include "ubus_server.h"
 #include "ubus_client.h"
 #include "ubus_srv_ws.h"
+#include "ubus_srv_shm.h"
+#include "ubus_slab.h"
+#include "ubus_intern.h"
+#include "ubus_executor.h"
+#include "ubus_hub.h"
+#include "ubus_cache.h"
+#include "ubus_msgpack.h"
+#include "ubus_json.h"
+#include "ubus_validator.h"
 
 bool url_scanf(const char *url, char *proto, char *host, int *port, char *path); 
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libutype/list.h>
+#include <libusys/uloop_timeout.h>
+
+#include "ubus_cache.h"
+#include "ubus_intern.h"
+
+// power of two, at least UBUS_CACHE_MAX_ENTRIES so that chains stay short
+#define UBUS_CACHE_BUCKETS 1024
+
+struct ubus_cache_rule {
+	struct list_head list; 
+	const char *object; // interned, NULL for any object
+	const char *method; // interned
+	int ttl; 
+}; 
+
+struct ubus_cache_entry {
+	struct ubus_cache_entry *next; // bucket chain
+	struct list_head list; // all entries oldest first
+	uint64_t hash; 
+	const char *object; // interned
+	const char *method; // interned
+	struct blob_field *args; // arguments of the call, compared on every hash match
+	utick_t expires; 
+	struct blob reply; 
+}; 
+
+struct ubus_cache {
+	pthread_mutex_t lock; 
+	struct list_head rules; 
+	struct ubus_cache_entry *buckets[UBUS_CACHE_BUCKETS]; 
+	struct list_head entries; 
+	struct ubus_cache_stats stats; 
+}; 
+
+// finalizer of splitmix64. Spreads every input bit over the whole result.
+static inline uint64_t _ubus_cache_mix(uint64_t h){
+	h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL; 
+	h ^= h >> 27; h *= 0x94d049bb133111ebULL; 
+	h ^= h >> 31; 
+	return h; 
+}
+
+// fnv-1a
+static uint64_t _ubus_cache_hash_bytes(uint64_t h, const void *data, size_t len){
+	const uint8_t *p = (const uint8_t*)data; 
+	for(size_t c = 0; c < len; c++){
+		h ^= p[c]; 
+		h *= 0x100000001b3ULL; 
+	}
+	return h; 
+}
+
+uint64_t ubus_cache_hash(struct blob_field *args){
+	uint64_t h = 0xcbf29ce484222325ULL; 
+	if(!args) return h; 
+	int type = blob_field_type(args); 
+	switch(type){
+		case BLOB_FIELD_TABLE: {
+			// pairs are added up so that their order does not matter
+			uint64_t sum = 0; 
+			struct blob_field *key, *value; 
+			blob_field_for_each_kv(args, key, value){
+				const char *k = blob_field_get_string(key); 
+				sum += _ubus_cache_mix(_ubus_cache_hash_bytes(h, k, strlen(k)) ^ ubus_cache_hash(value)); 
+			}
+			return _ubus_cache_mix(h ^ BLOB_FIELD_TABLE ^ sum); 
+		}
+		case BLOB_FIELD_ARRAY: {
+			struct blob_field *child; 
+			h ^= BLOB_FIELD_ARRAY; 
+			blob_field_for_each_child(args, child){
+				h = _ubus_cache_mix(h ^ ubus_cache_hash(child)); 
+			}
+			return h; 
+		}
+		case BLOB_FIELD_INT8:
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64: {
+			// the same number may be packed in any width depending on where it came from
+			long long v = blob_field_get_int(args); 
+			return _ubus_cache_mix(_ubus_cache_hash_bytes(h ^ BLOB_FIELD_INT64, &v, sizeof(v))); 
+		}
+		case BLOB_FIELD_FLOAT32:
+		case BLOB_FIELD_FLOAT64: {
+			double v = blob_field_get_real(args); 
+			return _ubus_cache_mix(_ubus_cache_hash_bytes(h ^ BLOB_FIELD_FLOAT64, &v, sizeof(v))); 
+		}
+		default:
+			return _ubus_cache_mix(_ubus_cache_hash_bytes(h ^ type, blob_field_data(args), blob_field_data_len(args))); 
+	}
+}
+
+bool ubus_cache_args_equal(struct blob_field *a, struct blob_field *b){
+	if(!a || !b) return a == b; 
+	uint32_t len = blob_field_raw_len(a); 
+	return len == blob_field_raw_len(b) && memcmp(a, b, len) == 0; 
+}
+
+struct blob_field *ubus_cache_args_dup(struct blob_field *args){
+	if(!args) return NULL; 
+	uint32_t len = blob_field_raw_len(args); 
+	struct blob_field *copy = malloc(len); 
+	memcpy(copy, args, len); 
+	return copy; 
+}
+
+struct ubus_cache *ubus_cache_new(void){
+	struct ubus_cache *self = calloc(1, sizeof(struct ubus_cache)); 
+	pthread_mutex_init(&self->lock, NULL); 
+	INIT_LIST_HEAD(&self->rules); 
+	INIT_LIST_HEAD(&self->entries); 
+	return self; 
+}
+
+// must be called with the cache locked
+static void _ubus_cache_remove(struct ubus_cache *self, struct ubus_cache_entry *entry){
+	struct ubus_cache_entry **pp = &self->buckets[entry->hash & (UBUS_CACHE_BUCKETS - 1)]; 
+	while(*pp && *pp != entry) pp = &(*pp)->next; 
+	if(*pp) *pp = entry->next; 
+	list_del_init(&entry->list); 
+	ubus_intern_release(entry->object); 
+	ubus_intern_release(entry->method); 
+	free(entry->args); 
+	blob_free(&entry->reply); 
+	free(entry); 
+	self->stats.entries--; 
+}
+
+void ubus_cache_delete(struct ubus_cache **_self){
+	struct ubus_cache *self = *_self; 
+	struct ubus_cache_entry *entry, *etmp; 
+	list_for_each_entry_safe(entry, etmp, &self->entries, list){
+		_ubus_cache_remove(self, entry); 
+	}
+	struct ubus_cache_rule *rule, *rtmp; 
+	list_for_each_entry_safe(rule, rtmp, &self->rules, list){
+		list_del_init(&rule->list); 
+		ubus_intern_release(rule->object); 
+		ubus_intern_release(rule->method); 
+		free(rule); 
+	}
+	pthread_mutex_destroy(&self->lock); 
+	free(self); 
+	*_self = NULL;
+}
+
+// must be called with the cache locked
+static struct ubus_cache_rule *_ubus_cache_find_rule(struct ubus_cache *self, const char *object, const char *method, bool exact){
+	struct ubus_cache_rule *rule, *any = NULL; 
+	list_for_each_entry(rule, &self->rules, list){
+		if(!ubus_intern_equal(rule->method, method)) continue; 
+		if(rule->object && ubus_intern_equal(rule->object, object)) return rule; 
+		if(!rule->object && (!exact || !object)) any = rule; 
+	}
+	return any; 
+}
+
+int ubus_cache_set_rule(struct ubus_cache *self, const char *object, const char *method, int ttl){
+	if(!method || ttl < 0) return -1; 
+	pthread_mutex_lock(&self->lock); 
+	struct ubus_cache_rule *rule = _ubus_cache_find_rule(self, object, method, true); 
+	if(rule && ttl == 0){
+		list_del_init(&rule->list); 
+		ubus_intern_release(rule->object); 
+		ubus_intern_release(rule->method); 
+		free(rule); 
+	} else if(rule){
+		rule->ttl = ttl; 
+	} else if(ttl > 0){
+		rule = calloc(1, sizeof(struct ubus_cache_rule)); 
+		rule->object = ubus_intern(object); 
+		rule->method = ubus_intern(method); 
+		rule->ttl = ttl; 
+		list_add_tail(&rule->list, &self->rules); 
+	}
+	pthread_mutex_unlock(&self->lock); 
+	return 0; 
+}
+
+int ubus_cache_ttl(struct ubus_cache *self, const char *object, const char *method){
+	if(!method) return 0; 
+	pthread_mutex_lock(&self->lock); 
+	struct ubus_cache_rule *rule = _ubus_cache_find_rule(self, object, method, false); 
+	int ttl = (rule)?rule->ttl:0; 
+	pthread_mutex_unlock(&self->lock); 
+	return ttl; 
+}
+
+// must be called with the cache locked
+static struct ubus_cache_entry *_ubus_cache_find(struct ubus_cache *self, const char *object, const char *method, uint64_t hash, struct blob_field *args){
+	struct ubus_cache_entry *entry = self->buckets[hash & (UBUS_CACHE_BUCKETS - 1)]; 
+	for(; entry; entry = entry->next){
+		if(entry->hash != hash || !ubus_intern_equal(entry->method, method) || !ubus_intern_equal(entry->object, object)) continue; 
+		if(ubus_cache_args_equal(entry->args, args)) return entry; 
+	}
+	return NULL; 
+}
+
+struct blob_field *ubus_cache_get(struct ubus_cache *self, const char *object, const char *method, uint64_t hash, struct blob_field *args, struct blob *out){
+	pthread_mutex_lock(&self->lock); 
+	struct ubus_cache_entry *entry = _ubus_cache_find(self, object, method, hash, args); 
+	if(entry && utick_expired(entry->expires)){
+		_ubus_cache_remove(self, entry); 
+		entry = NULL; 
+	}
+	if(!entry){
+		self->stats.misses++; 
+		pthread_mutex_unlock(&self->lock); 
+		return NULL; 
+	}
+	// the reply is the only field of entry and ends up the only field of out
+	blob_reset(out); 
+	blob_put_attr(out, blob_field_first_child(blob_head(&entry->reply))); 
+	self->stats.hits++; 
+	pthread_mutex_unlock(&self->lock); 
+	return blob_field_first_child(blob_head(out)); 
+}
+
+void ubus_cache_put(struct ubus_cache *self, const char *object, const char *method, uint64_t hash, struct blob_field *args, struct blob_field *reply){
+	if(!reply) return; 
+	int ttl = ubus_cache_ttl(self, object, method); 
+	if(!ttl) return; 
+
+	pthread_mutex_lock(&self->lock); 
+	struct ubus_cache_entry *entry = _ubus_cache_find(self, object, method, hash, args); 
+	if(entry) _ubus_cache_remove(self, entry); 
+
+	// make room by dropping the oldest entries
+	struct ubus_cache_entry *tmp; 
+	list_for_each_entry_safe(entry, tmp, &self->entries, list){
+		if(self->stats.entries < UBUS_CACHE_MAX_ENTRIES) break; 
+		if(!utick_expired(entry->expires)) self->stats.evictions++; 
+		_ubus_cache_remove(self, entry); 
+	}
+
+	entry = calloc(1, sizeof(struct ubus_cache_entry)); 
+	INIT_LIST_HEAD(&entry->list); 
+	entry->hash = hash; 
+	entry->object = ubus_intern(object); 
+	entry->method = ubus_intern(method); 
+	entry->args = ubus_cache_args_dup(args); 
+	entry->expires = utick_now() + (utick_t)ttl * 1000UL; 
+	blob_init(&entry->reply, 0, 0); 
+	blob_put_attr(&entry->reply, reply); 
+
+	struct ubus_cache_entry **bucket = &self->buckets[hash & (UBUS_CACHE_BUCKETS - 1)]; 
+	entry->next = *bucket; 
+	*bucket = entry;
+	list_add_tail(&entry->list, &self->entries); 
+	self->stats.entries++; 
+	self->stats.stores++; 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void ubus_cache_invalidate(struct ubus_cache *self, const char *object){
+	pthread_mutex_lock(&self->lock); 
+	struct ubus_cache_entry *entry, *tmp; 
+	list_for_each_entry_safe(entry, tmp, &self->entries, list){
+		if(!object || ubus_intern_equal(entry->object, object)) _ubus_cache_remove(self, entry); 
+	}
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void ubus_cache_get_stats(struct ubus_cache *self, struct ubus_cache_stats *stats){
+	pthread_mutex_lock(&self->lock); 
+	*stats = self->stats;
+	pthread_mutex_unlock(&self->lock); 
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <blobpack/blobpack.h>
+
+/**
+Cache for replies of methods that only read data (status, info, list and so on) so that the
+same call repeated by many clients is answered without going to the peer that owns the object.
+
+Nothing is cached unless a rule has been added for the method. Entries are keyed by object,
+method and a hash of the arguments. Every entry keeps a copy of the arguments it was stored
+with and only answers calls whose arguments are the same byte for byte, so two calls that
+happen to share a hash never share a reply. Every entry lives for the time given in the rule of
+its method. Only calls that match a rule are counted as hits or misses.
+
+All functions may be called from any thread.
+**/
+
+// entries kept before the oldest ones are dropped to make room
+#define UBUS_CACHE_MAX_ENTRIES 1024
+
+struct ubus_cache; 
+
+struct ubus_cache_stats {
+	uint64_t hits; 
+	uint64_t misses; 
+	uint64_t stores; 
+	uint64_t evictions; // entries dropped before they expired to make room
+	uint32_t entries; 
+}; 
+
+struct ubus_cache *ubus_cache_new(void); 
+void ubus_cache_delete(struct ubus_cache **self); 
+
+//! Cache replies of method for ttl ms. Object NULL applies the rule to the method on every object. Zero ttl removes the rule.
+int ubus_cache_set_rule(struct ubus_cache *self, const char *object, const char *method, int ttl); 
+//! Time in ms that replies of method are kept or 0 if they are not cached
+int ubus_cache_ttl(struct ubus_cache *self, const char *object, const char *method); 
+
+//! Hash of arguments that is the same no matter what order keys of tables come in
+uint64_t ubus_cache_hash(struct blob_field *args); 
+
+//! Copy the cached reply to a call with args (hash is ubus_cache_hash() of them) into out. Returns the reply (the only field of out) or NULL (and counts a miss) if there is none.
+struct blob_field *ubus_cache_get(struct ubus_cache *self, const char *object, const char *method, uint64_t hash, struct blob_field *args, struct blob *out); 
+//! Store the reply to a call with args for as long as the rule of method says. A NULL reply is not stored.
+void ubus_cache_put(struct ubus_cache *self, const char *object, const char *method, uint64_t hash, struct blob_field *args, struct blob_field *reply); 
+//! True if both are NULL or both hold the same bytes
+bool ubus_cache_args_equal(struct blob_field *a, struct blob_field *b); 
+//! Copy of args that is freed with free(). NULL for NULL. 
+struct blob_field *ubus_cache_args_dup(struct blob_field *args); 
+//! Drop every entry of object (or all entries if object is NULL)
+void ubus_cache_invalidate(struct ubus_cache *self, const char *object); 
+
+void ubus_cache_get_stats(struct ubus_cache *self, struct ubus_cache_stats *stats); 
@@ -27,6 +27,10 @@ struct ubus_client_api {
 	int 	(*disconnect)(ubus_client_t ptr);
 	int 	(*send)(ubus_client_t ptr, struct ubus_message **msg); 
 	int 	(*recv)(ubus_client_t ptr, struct ubus_message **msg); 
+	//! block until recv has something to return, wake_fd (unless -1) becomes readable or timeout (ms) expires. Returns > 0 when ready or woken, 0 on timeout and < 0 on error. wake_fd is not read. 
+	int 	(*wait)(ubus_client_t ptr, int wake_fd, int timeout); 
+	//! bytes of messages that are queued and not written out yet
+	size_t	(*backlog)(ubus_client_t ptr); 
 	void*	(*userdata)(ubus_client_t ptr, void *data); 
 }; 
 
@@ -37,5 +41,7 @@ struct ubus_client_api {
 #define ubus_client_connect(sock, path) (*sock)->connect(sock, path) 
 #define ubus_client_send(sock, msg) (*sock)->send(sock, msg)
 #define ubus_client_recv(sock, msg) (*sock)->recv(sock, msg)
+#define ubus_client_wait(sock, wake_fd, timeout) (*sock)->wait(sock, wake_fd, timeout)
+#define ubus_client_backlog(sock) (((*sock)->backlog)?(*sock)->backlog(sock):0)
 #define ubus_client_get_userdata(sock) (*sock)->userdata(sock, NULL)
 #define ubus_client_set_userdata(sock, ptr) (*sock)->userdata(sock, ptr)
@@ -34,6 +34,9 @@
 #include "ubus_cli.h"
 #include "ubus_cli_js.h"
 #include "ubus_message.h"
+#include "ubus_slab.h"
+#include "ubus_msgpack.h"
+#include "ubus_json.h"
 #include <assert.h>
 
 #define STATIC_IOV(_var) { .iov_base = (char *) &(_var), .iov_len = sizeof(_var) }
@@ -50,13 +53,20 @@ struct ubus_json_frame {
 }; 
 
 struct ubus_cli_js {
-	struct list_head tx_queue; 
-	struct list_head rx_queue; 
+	struct ubus_prio_queue tx_queue; 
+	struct ubus_prio_queue rx_queue; 
+	// frame that is partly written. It has to be finished before a more urgent one can go out. 
+	struct ubus_json_frame *tx_current; 
+	size_t tx_bytes; // size of tx_current and all frames on tx_queue
 	int fd; 
 
 	char *recv_buffer; 
 	int recv_size; 
 	int recv_count; 
+
+	// codec asked for with ubus_cli_js_set_codec() and the one we send in. They only become the same once the server has agreed. 
+	enum ubus_codec codec; 
+	enum ubus_codec tx_codec; 
 	
 	struct ubus_message *msg; 
 	const struct ubus_client_api *api; 
@@ -64,28 +74,48 @@ struct ubus_cli_js {
 	void *user_data; 
 }; 
 
-struct ubus_json_frame *ubus_json_frame_new(struct blob_field *msg){
+static struct ubus_slab _json_frame_slab = UBUS_SLAB_INITIALIZER("cli_js_frame", struct ubus_json_frame, NULL); 
+
+struct ubus_json_frame *ubus_json_frame_new(struct blob_field *msg, enum ubus_codec codec){
 	assert(msg); 
-	struct ubus_json_frame *self = calloc(1, sizeof(struct ubus_json_frame)); 
-	char *json = blob_field_to_json(msg); 
-	self->data_size = strlen(json) + 1; 
+	struct ubus_json_frame *self = ubus_slab_alloc(&_json_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
+	if(codec == UBUS_CODEC_MSGPACK){
+		self->data_size = ubus_msgpack_size(msg); 
+		self->data = malloc(self->data_size + 1); 
+		ubus_msgpack_encode(msg, self->data); 
+	} else {
+		// json is written straight into the frame and followed by the separator
+		self->data_size = ubus_json_size(msg) + 1; 
+		self->data = malloc(self->data_size); 
+		ubus_json_encode(msg, self->data); 
+		self->data[self->data_size - 1] = '\n'; 
+	}
+	INIT_LIST_HEAD(&self->list); 
+	return self; 
+}
+
+// asks the server to talk msgpack. Servers that do not know about it see an empty line. 
+static struct ubus_json_frame *ubus_json_frame_new_handshake(void){
+	struct ubus_json_frame *self = ubus_slab_alloc(&_json_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
+	self->data_size = 2; 
 	self->data = calloc(1, self->data_size + 1); 
-	sprintf(self->data, "%s\n", json); 
-	//printf("new frame %s\n", self->data); 
-	free(json); 
+	self->data[0] = (char)UBUS_MSGPACK_MAGIC; 
+	self->data[1] = '\n'; 
 	INIT_LIST_HEAD(&self->list); 
 	return self; 
 }
 
 void ubus_json_frame_delete(struct ubus_json_frame **self){
 	free((*self)->data); 
-	free(*self); 
+	ubus_slab_free(&_json_frame_slab, *self); 
 	*self = NULL; 
 }
 
 static void ubus_cli_js_init(struct ubus_cli_js *self){
-	INIT_LIST_HEAD(&self->tx_queue); 
-	INIT_LIST_HEAD(&self->rx_queue); 
+	ubus_prio_queue_init(&self->tx_queue); 
+	ubus_prio_queue_init(&self->rx_queue); 
 	self->fd = -1; 
 	self->recv_size = 16535; 
 	self->recv_buffer = calloc(1, self->recv_size); 
@@ -112,6 +142,8 @@ static void _split_address_port(char *address, int addrlen, char **port){
 	}
 }
 
+static void _ubus_client_send(struct ubus_cli_js *self); 
+
 static int _ubus_cli_js_connect(ubus_client_t socket, const char *_address){
 	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
 	int flags = 0; 
@@ -128,18 +160,29 @@ static int _ubus_cli_js_connect(ubus_client_t socket, const char *_address){
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK | O_CLOEXEC);
 
 	self->fd = fd; 
+	self->tx_codec = UBUS_CODEC_DEFAULT; 
+
+	// we keep sending json until the server answers the handshake
+	if(self->codec == UBUS_CODEC_MSGPACK){
+		struct ubus_json_frame *req = ubus_json_frame_new_handshake(); 
+		ubus_prio_queue_add(&self->tx_queue, &req->list, UBUS_MSG_PRIO_CONTROL); 
+		self->tx_bytes += req->data_size; 
+		_ubus_client_send(self); 
+	}
 
 	return 0; 
 }
 
+// put the message in buf on the rx queue and start a new one if buf holds a valid message
+static void _ubus_cli_js_queue_msg(struct ubus_cli_js *self){
+	ubus_prio_queue_add(&self->rx_queue, &self->msg->list, ubus_message_read_priority(self->msg)); 
+	self->msg = ubus_message_new();  
+}
+
 static int _ubus_cli_js_recv(ubus_client_t client, struct ubus_message **msg){
 	struct ubus_cli_js *self = container_of(client, struct ubus_cli_js, api); 
 
-	if(!list_empty(&self->rx_queue)){
-		*msg = list_first_entry(&self->rx_queue, struct ubus_message, list); 
-		list_del_init(&(*msg)->list); 
-		return 1; 
-	}
+	if((*msg = ubus_prio_queue_pop_entry(&self->rx_queue, struct ubus_message, list))) return 1; 
 
 	int rc = recv(self->fd, self->recv_buffer + self->recv_count, self->recv_size - self->recv_count, 0); 
 	if(rc == 0){
@@ -157,50 +200,62 @@ static int _ubus_cli_js_recv(ubus_client_t client, struct ubus_message **msg){
 			close(self->fd); 
 		}
 
-		// process as many messages as we can and save any extra data in the recv buffer 
-		while(true){
-			char *ch; 
-			for(ch = self->recv_buffer; 
-				*ch && *ch != '\n' && ch < (self->recv_buffer + self->recv_count); ch++){
-			}
-			if(*ch == '\n'){
-				*ch = 0; 
+		// process as many messages as we can and save any extra data in the recv buffer. Messages that start above ascii are msgpack. 
+		while(self->recv_count > 0){
+			uint8_t first = self->recv_buffer[0]; 
+			int pos = 0; 
+			if(first == UBUS_MSGPACK_MAGIC){
+				// server has agreed to msgpack
+				if(self->codec == UBUS_CODEC_MSGPACK) self->tx_codec = UBUS_CODEC_MSGPACK; 
+				pos = 1; 
+			} else if(first >= 0x80){
 				blob_reset(&self->msg->buf); 
-				if(blob_put_json(&self->msg->buf, self->recv_buffer)){
+				ssize_t len = ubus_msgpack_decode(&self->msg->buf, self->recv_buffer, self->recv_count); 
+				if(len < 0){
+					// there is no separator to find the next message by
+					printf("bad msgpack message!\n"); 
+					close(self->fd); 
+					self->fd = -1; 
+					self->recv_count = 0; 
+					return -1; 
+				}
+				if(len == 0) break; 
+				_ubus_cli_js_queue_msg(self); 
+				pos = len; 
+			} else {
+				char *ch; 
+				char *end = self->recv_buffer + self->recv_count; 
+				for(ch = self->recv_buffer; 
+					ch < end && *ch && *ch != '\n'; ch++){
+				}
+				if(ch == end || *ch != '\n') break; 
+				blob_reset(&self->msg->buf); 
+				if(ubus_json_parse(&self->msg->buf, self->recv_buffer, ch - self->recv_buffer)){
 					//printf("json data received!\n"); 
-					list_add_tail(&self->msg->list, &self->rx_queue); 
-					self->msg = ubus_message_new();  
+					_ubus_cli_js_queue_msg(self); 
 				}
+				pos = (ch - self->recv_buffer + 1); 
+			}
 
-				int pos = (ch - self->recv_buffer + 1); 
-				int rest_size = self->recv_count - pos; 
-				//printf("rest size %d\n", rest_size); 
-				if(rest_size > 0){
-					char *rest = calloc(1, self->recv_size); 
-					memcpy(rest, self->recv_buffer + pos, rest_size); 
-					free(self->recv_buffer); 
-					self->recv_buffer = rest; 
-					self->recv_count = rest_size; 
-					continue; 
-				} else {
-					self->recv_count = 0; 
-				}
-			} 
-			break; 
+			int rest_size = self->recv_count - pos; 
+			//printf("rest size %d\n", rest_size); 
+			// move the rest to the start of the buffer instead of allocating a new buffer
+			if(rest_size > 0) memmove(self->recv_buffer, self->recv_buffer + pos, rest_size); 
+			self->recv_count = rest_size; 
 		}
 	} 
-	if(list_empty(&self->rx_queue)) return rc; 
-	*msg = list_first_entry(&self->rx_queue, struct ubus_message, list); 
-	list_del_init(&(*msg)->list); 
+	if(!(*msg = ubus_prio_queue_pop_entry(&self->rx_queue, struct ubus_message, list))) return rc; 
 	return 1; 
 }
 
-static void _ubus_client_send(struct ubus_cli_js *self){
-	if(list_empty(&self->tx_queue)){
-		return; 
-	}
+static bool _ubus_client_tx_pending(struct ubus_cli_js *self){
+	return self->tx_current || !ubus_prio_queue_empty(&self->tx_queue); 
+}
 
-	struct ubus_json_frame *req = list_first_entry(&self->tx_queue, struct ubus_json_frame, list);
+static void _ubus_client_send(struct ubus_cli_js *self){
+	if(!self->tx_current) self->tx_current = ubus_prio_queue_pop_entry(&self->tx_queue, struct ubus_json_frame, list); 
+	struct ubus_json_frame *req = self->tx_current; 
+	if(!req) return; 
 
 	int sc; 
 	while((sc = send(self->fd, req->data + req->send_count, req->data_size - req->send_count, MSG_NOSIGNAL)) > 0){
@@ -209,9 +264,9 @@ static void _ubus_client_send(struct ubus_cli_js *self){
 
 	// TODO: handle disconnect
 	if(req->send_count == req->data_size){
-		printf("sent frame %s\n", req->data); 
 		// full buffer was transmitted so we destroy the request
-		list_del_init(&req->list); 
+		self->tx_current = NULL; 
+		self->tx_bytes -= req->data_size; 
 		//printf("removed completed request from queue! %d bytes\n", req->send_count); 
 		ubus_json_frame_delete(&req); 
 	} else {
@@ -222,8 +277,9 @@ static void _ubus_client_send(struct ubus_cli_js *self){
 static int _ubus_cli_js_send(ubus_client_t socket, struct ubus_message **msg){
 	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
 	
-	struct ubus_json_frame *req = ubus_json_frame_new(blob_field_first_child(blob_head(&(*msg)->buf)));
-	list_add_tail(&req->list, &self->tx_queue); 
+	struct ubus_json_frame *req = ubus_json_frame_new(blob_field_first_child(blob_head(&(*msg)->buf)), self->tx_codec); 
+	ubus_prio_queue_add(&self->tx_queue, &req->list, (*msg)->priority); 
+	self->tx_bytes += req->data_size; 
 	
 	_ubus_client_send(self); 
 
@@ -232,6 +288,33 @@ static int _ubus_cli_js_send(ubus_client_t socket, struct ubus_message **msg){
 	return 0; 	
 }
 
+static int _ubus_cli_js_wait(ubus_client_t socket, int wake_fd, int timeout){
+	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
+	if(!ubus_prio_queue_empty(&self->rx_queue)) return 1; 
+	if(self->fd < 0) return -1; 
+
+	// poll skips a wake_fd of -1
+	struct pollfd pfd[2] = {
+		{ .fd = self->fd, .events = POLLIN }, 
+		{ .fd = wake_fd, .events = POLLIN }
+	}; 
+	// while we are waiting anyway we may as well finish writing out anything that is still queued
+	if(_ubus_client_tx_pending(self)) pfd[0].events |= POLLOUT; 
+	while(true){
+		int ret = poll(pfd, 2, timeout); 
+		if(ret <= 0) return (ret < 0 && errno != EINTR)?-1:0; 
+		if(pfd[0].revents & POLLOUT) _ubus_client_send(self); 
+		if((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) || pfd[1].revents) return 1; 
+		// only writable. Keep waiting for data but stop asking for POLLOUT once everything is sent.
+		if(!_ubus_client_tx_pending(self)) pfd[0].events = POLLIN; 
+	}
+}
+
+static size_t _ubus_cli_js_backlog(ubus_client_t socket){
+	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
+	return self->tx_bytes; 
+}
+
 static void *_ubus_cli_js_userdata(ubus_client_t socket, void *ptr){
 	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
 	if(!ptr) return self->user_data; 
@@ -247,6 +330,11 @@ static int _ubus_cli_js_disconnect(ubus_client_t socket){
 	return 0; 
 }
 
+void ubus_cli_js_set_codec(ubus_client_t socket, enum ubus_codec codec){
+	struct ubus_cli_js *self = container_of(socket, struct ubus_cli_js, api); 
+	self->codec = codec; 
+}
+
 ubus_client_t ubus_cli_js_new(void){
 	struct ubus_cli_js *self = calloc(1, sizeof(struct ubus_cli_js)); 
 	ubus_cli_js_init(self); 
@@ -256,6 +344,8 @@ ubus_client_t ubus_cli_js_new(void){
 		.disconnect = _ubus_cli_js_disconnect, 
 		.send = _ubus_cli_js_send, 
 		.recv = _ubus_cli_js_recv, 
+		.wait = _ubus_cli_js_wait, 
+		.backlog = _ubus_cli_js_backlog, 
 		.userdata = _ubus_cli_js_userdata
 	}; 
 	self->api = &api; 
@@ -15,9 +15,11 @@
 
 #include <inttypes.h>
 #include "ubus_cli.h"
+#include "ubus_msgpack.h"
 
 struct ubus_client_api; 
 typedef const struct ubus_client_api** ubus_client_t; 
 
 ubus_client_t ubus_cli_js_new(void); 
-
+//! Ask the server to talk msgpack. Must be set before connecting. Json is used until the server agrees and if it never does.
+void ubus_cli_js_set_codec(ubus_client_t client, enum ubus_codec codec); 
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <libusys/usock.h>
+#include <blobpack/blobpack.h>
+
+#include "ubus_cli.h"
+#include "ubus_cli_shm.h"
+#include "ubus_message.h"
+#include "ubus_shm.h"
+
+struct ubus_cli_shm {
+	struct ubus_shm_channel chan; 
+	bool connected; 
+	struct ubus_prio_queue tx_queue; // messages that did not fit into the ring yet
+	struct ubus_message *tx_msg; // message that is partly in the ring and has to be finished first
+	size_t tx_bytes; // size of tx_msg and all messages on tx_queue
+	struct ubus_message *msg; 
+	const struct ubus_client_api *api; 
+	void *user_data; 
+}; 
+
+static int _cli_shm_write(struct ubus_cli_shm *self, struct ubus_message *msg){
+	struct blob_field *data = blob_head(&msg->buf); 
+	return ubus_shm_channel_write(&self->chan, data, blob_field_raw_pad_len(data)); 
+}
+
+// write a message and keep it if only some of its fragments went in. Returns -EAGAIN if the message is not completely in the ring.
+static int _cli_shm_put(struct ubus_cli_shm *self, struct ubus_message **msg){
+	int ret = _cli_shm_write(self, *msg); 
+	if(ret == -EAGAIN && self->chan.tx_done){
+		list_del_init(&(*msg)->list); 
+		self->tx_msg = *msg; 
+		*msg = NULL; 
+	}
+	return ret; 
+}
+
+// most urgent messages get into the ring first once there is room again. Messages are checked against the size limit before they are queued so anything that fails here is dropped. 
+static void _cli_shm_flush(struct ubus_cli_shm *self){
+	struct ubus_message *msg; 
+	if((msg = self->tx_msg)){
+		if(_cli_shm_write(self, msg) == -EAGAIN) return; 
+		self->tx_bytes -= blob_field_raw_pad_len(blob_head(&msg->buf)); 
+		ubus_message_delete(&self->tx_msg); 
+	}
+	while((msg = ubus_prio_queue_first_entry(&self->tx_queue, struct ubus_message, list))){
+		size_t size = blob_field_raw_pad_len(blob_head(&msg->buf)); 
+		if(_cli_shm_put(self, &msg) == -EAGAIN) break; 
+		self->tx_bytes -= size; 
+		ubus_message_delete(&msg); 
+	}
+}
+
+static int _cli_shm_disconnect(ubus_client_t socket){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	if(!self->connected) return 0; 
+	ubus_shm_channel_destroy(&self->chan); 
+	// a message that was cut off half way has to start over on the next connection
+	if(self->tx_msg) ubus_prio_queue_add(&self->tx_queue, &self->tx_msg->list, self->tx_msg->priority); 
+	self->tx_msg = NULL; 
+	self->connected = false; 
+	return 0; 
+}
+
+static void _cli_shm_destroy(ubus_client_t socket){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	_cli_shm_disconnect(socket); 
+	struct ubus_message *msg; 
+	while((msg = ubus_prio_queue_pop_entry(&self->tx_queue, struct ubus_message, list))){
+		ubus_message_delete(&msg); 
+	}
+	ubus_message_delete(&self->msg); 
+	free(self); 
+}
+
+static int _cli_shm_connect(ubus_client_t socket, const char *path){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	_cli_shm_disconnect(socket); 
+	int fd = usock(USOCK_UNIX, path, NULL); 
+	if(fd < 0) return -1; 
+	if(ubus_shm_channel_connect(&self->chan, fd) < 0) return -1; 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK | O_CLOEXEC); 
+	self->connected = true; 
+	return 0; 
+}
+
+static int _cli_shm_recv(ubus_client_t socket, struct ubus_message **msg){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	if(!self->connected) return -1; 
+
+	_cli_shm_flush(self); 
+
+	int ret = ubus_shm_channel_read(&self->chan, self->msg); 
+	if(ret > 0){
+		ubus_message_read_priority(self->msg); 
+		*msg = self->msg; 
+		self->msg = ubus_message_new(); 
+		return 1; 
+	} else if(ret != -EAGAIN){
+		fprintf(stderr, "shm: server sent a corrupt ring\n"); 
+		_cli_shm_disconnect(socket); 
+		return 0; 
+	}
+
+	// ring is empty. Check whether the server is still there. 
+	char ch; 
+	if(recv(self->chan.sock, &ch, 1, MSG_DONTWAIT | MSG_PEEK) == 0){
+		_cli_shm_disconnect(socket); 
+		return 0; 
+	}
+	return -EAGAIN; 
+}
+
+static int _cli_shm_wait(ubus_client_t socket, int wake_fd, int timeout){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	if(!self->connected) return -1; 
+
+	_cli_shm_flush(self); 
+	if(!ubus_shm_channel_prepare_wait(&self->chan)) return 1; 
+
+	// server writes to the eventfd only after we have announced that we are going to sleep. 
+	// poll skips a wake_fd of -1. 
+	struct pollfd pfd[3] = {
+		{ .fd = self->chan.rx_efd, .events = POLLIN }, 
+		{ .fd = self->chan.sock, .events = POLLIN }, 
+		{ .fd = wake_fd, .events = POLLIN }
+	}; 
+	int ret = poll(pfd, 3, timeout); 
+	ubus_shm_channel_finish_wait(&self->chan); 
+	if(ret < 0) return (errno == EINTR)?0:-1; 
+	return ret; 
+}
+
+static int _cli_shm_send(ubus_client_t socket, struct ubus_message **msg){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	if(!self->connected) return -1; 
+
+	size_t size = blob_field_raw_pad_len(blob_head(&(*msg)->buf)); 
+	_cli_shm_flush(self); 
+	if(!self->tx_msg && ubus_prio_queue_empty(&self->tx_queue)){
+		int ret = _cli_shm_put(self, msg); 
+		if(ret == 0){
+			ubus_message_delete(msg); 
+			return 0; 
+		} else if(ret != -EAGAIN){
+			// too large for the server to ever accept. The message stays with the caller.
+			return -1; 
+		}
+	} else if(size > UBUS_SHM_MAX_MESSAGE){
+		return -1; 
+	}
+	self->tx_bytes += size; 
+	if(!*msg) return 0; 
+	ubus_prio_queue_add(&self->tx_queue, &(*msg)->list, (*msg)->priority); 
+	*msg = NULL; 
+	return 0; 
+}
+
+static size_t _cli_shm_backlog(ubus_client_t socket){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	return self->tx_bytes; 
+}
+
+static void *_cli_shm_userdata(ubus_client_t socket, void *ptr){
+	struct ubus_cli_shm *self = container_of(socket, struct ubus_cli_shm, api); 
+	if(!ptr) return self->user_data; 
+	self->user_data = ptr; 
+	return ptr; 
+}
+
+ubus_client_t ubus_cli_shm_new(void){
+	struct ubus_cli_shm *self = calloc(1, sizeof(struct ubus_cli_shm)); 
+	ubus_prio_queue_init(&self->tx_queue); 
+	self->msg = ubus_message_new(); 
+	static const struct ubus_client_api api = {
+		.destroy = _cli_shm_destroy, 
+		.connect = _cli_shm_connect, 
+		.disconnect = _cli_shm_disconnect, 
+		.send = _cli_shm_send, 
+		.recv = _cli_shm_recv, 
+		.wait = _cli_shm_wait, 
+		.backlog = _cli_shm_backlog, 
+		.userdata = _cli_shm_userdata
+	}; 
+	self->api = &api; 
+	return &self->api; 
+}
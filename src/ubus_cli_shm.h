@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include "ubus_cli.h"
+
+//! Create a client that connects to a ubus_srv_shm server on the same host. 
+ubus_client_t ubus_cli_shm_new(void); 
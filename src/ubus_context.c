@@ -11,10 +11,17 @@
  * GNU General Public License for more details.
  */
 
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <libutype/avl-cmp.h>
 #include "ubus_context.h"
 #include "ubus_srv.h"
+#include "ubus_socket.h"
 #include "ubus_peer.h"
+#include "ubus_slab.h"
+#include "ubus_executor.h"
 
 struct ubus_peer *_find_peer_by_name(struct ubus_context *self, const char *client_name){
 	struct avl_node *avl = avl_find(&self->peers_by_name, client_name); 
@@ -55,6 +62,7 @@ struct ubus_object *_find_object_by_name(struct ubus_context *self, const char *
 }
 */
 static void _send_well_known_name(struct ubus_context *self, uint32_t peer);
+static void _send_window(struct ubus_context *self, uint32_t peer); 
 
 void _on_msg_signal(struct ubus_context *self, struct ubus_peer *peer, const char *method, struct blob_field *msg){
 	// first argument is always signal type
@@ -77,7 +85,47 @@ void _on_msg_signal(struct ubus_context *self, struct ubus_peer *peer, const cha
 
 		// send our name to the other peer as well
 		_send_well_known_name(self, peer->id); 
-	} 
+		_send_window(self, peer->id); 
+	} else if(strcmp(method, "ubus.peer.window") == 0){
+		struct blob_field *attr = blob_field_first_child(msg); 
+		int window = (attr)?blob_field_get_int(attr):0; 
+		if(window > 0) peer->window = window; 
+	}
+}
+
+// normal priority is the default so it is left out of the envelope
+static void _ubus_put_priority(struct blob *buf, int priority){
+	if(priority == UBUS_MSG_PRIO_NORMAL) return; 
+	blob_put_string(buf, "priority"); 
+	blob_put_int(buf, priority); 
+}
+
+// fill in the fields of a reply. Type is either "result" or "error". 
+static void _ubus_put_reply(struct blob *buf, uint32_t seq, const char *type, struct blob_field *data, int priority){
+	blob_put_string(buf, "jsonrpc"); 
+	blob_put_string(buf, "2.0"); 
+	blob_put_string(buf, "id"); 
+	blob_put_int(buf, seq); 
+	_ubus_put_priority(buf, priority); 
+	blob_put_string(buf, type); 
+	blob_put_attr(buf, data); 
+}
+
+// fill in the fields of a method call
+static void _ubus_put_request(struct blob *buf, uint32_t seq, const char *rpc_method, const char *object, const char *method, struct blob_field *data, int priority){
+	blob_put_string(buf, "jsonrpc"); 
+	blob_put_string(buf, "2.0"); 
+	blob_put_string(buf, "id"); 
+	blob_put_int(buf, seq); 
+	_ubus_put_priority(buf, priority); 
+	blob_put_string(buf, "method"); 
+	blob_put_string(buf, rpc_method); 
+	blob_put_string(buf, "params"); 
+	blob_offset_t arr = blob_open_array(buf); 
+		blob_put_string(buf, object); 
+		blob_put_string(buf, method); 
+		blob_put_attr(buf, data); 
+	blob_close_array(buf, arr); 
 }
 
 static void _on_resolve_method_call(struct ubus_request *req, struct blob_field *data){
@@ -85,54 +133,49 @@ static void _on_resolve_method_call(struct ubus_request *req, struct blob_field
 	
 	struct ubus_message *msg = ubus_socket_new_message(self->socket); 
 	msg->peer = req->src_id; 
+	msg->priority = req->priority; 
 	blob_reset(&msg->buf); 
 	blob_set_type(&msg->buf, BLOB_FIELD_TABLE); 
-	blob_put_string(&msg->buf, "jsonrpc"); 
-	blob_put_string(&msg->buf, "2.0"); 
-	blob_put_string(&msg->buf, "id"); 
-	blob_put_int(&msg->buf, req->seq); 
-	blob_put_string(&msg->buf, "result"); 
-	blob_put_attr(&msg->buf, data); 
+	_ubus_put_reply(&msg->buf, req->seq, "result", data, req->priority); 
 
 	if(ubus_socket_send(self->socket, &msg) < 0){
 		printf("resolve failed\n"); 
 	}
 }
 
-static void _ubus_send_error(struct ubus_context *self, uint32_t peer, uint32_t seq, struct blob_field *data){
+static void _ubus_send_error(struct ubus_context *self, uint32_t peer, uint32_t seq, struct blob_field *data, int priority){
 	struct ubus_message *msg = ubus_socket_new_message(self->socket); 
 	msg->peer = peer; 
+	msg->priority = priority; 
 	blob_reset(&msg->buf); 
 	blob_set_type(&msg->buf, BLOB_FIELD_TABLE); 
-	blob_put_string(&msg->buf, "jsonrpc"); 
-	blob_put_string(&msg->buf, "2.0"); 
-	blob_put_string(&msg->buf, "id"); 
-	blob_put_int(&msg->buf, seq); 
-	blob_put_string(&msg->buf, "error"); 
-	blob_put_attr(&msg->buf, data); 
+	_ubus_put_reply(&msg->buf, seq, "error", data, priority); 
 
 	if(ubus_socket_send(self->socket, &msg) < 0){
 		printf("send error failed\n"); 
 	}
 }
 
-static int _ubus_send_request(struct ubus_context *self, uint32_t peer, uint32_t seq, const char *rpc_method, const char *object, const char *method, struct blob_field *data){
+static void _ubus_send_chunk(struct ubus_context *self, uint32_t peer, uint32_t seq, struct blob_field *data, int priority){
 	struct ubus_message *msg = ubus_socket_new_message(self->socket); 
 	msg->peer = peer; 
+	msg->priority = priority; 
 	blob_reset(&msg->buf); 
 	blob_set_type(&msg->buf, BLOB_FIELD_TABLE); 
-	blob_put_string(&msg->buf, "jsonrpc"); 
-	blob_put_string(&msg->buf, "2.0"); 
-	blob_put_string(&msg->buf, "id"); 
-	blob_put_int(&msg->buf, seq); 
-	blob_put_string(&msg->buf, "method"); 
-	blob_put_string(&msg->buf, rpc_method); 
-	blob_put_string(&msg->buf, "params"); 
-	blob_offset_t arr = blob_open_array(&msg->buf); 
-		blob_put_string(&msg->buf, object); 
-		blob_put_string(&msg->buf, method); 
-		blob_put_attr(&msg->buf, data); 
-	blob_close_array(&msg->buf, arr); 
+	_ubus_put_reply(&msg->buf, seq, "chunk", data, priority); 
+
+	if(ubus_socket_send(self->socket, &msg) < 0){
+		printf("send chunk failed\n"); 
+	}
+}
+
+static int _ubus_send_request(struct ubus_context *self, uint32_t peer, uint32_t seq, const char *rpc_method, const char *object, const char *method, struct blob_field *data, int priority){
+	struct ubus_message *msg = ubus_socket_new_message(self->socket); 
+	msg->peer = peer; 
+	msg->priority = priority; 
+	blob_reset(&msg->buf); 
+	blob_set_type(&msg->buf, BLOB_FIELD_TABLE); 
+	_ubus_put_request(&msg->buf, seq, rpc_method, object, method, data, priority); 
 
 	if(ubus_socket_send(self->socket, &msg) < 0){
 		printf("send failed!\n"); 
@@ -144,10 +187,13 @@ static int _ubus_send_request(struct ubus_context *self, uint32_t peer, uint32_t
 static int _ubus_send_signal(struct ubus_context *self, uint32_t peer, const char *signal, struct blob_field *data){
 	struct ubus_message *msg = ubus_socket_new_message(self->socket); 
 	msg->peer = peer; 
+	// signals only carry peer management so they overtake everything else
+	msg->priority = UBUS_MSG_PRIO_CONTROL; 
 	blob_reset(&msg->buf); 
 	blob_set_type(&msg->buf, BLOB_FIELD_TABLE); 
 	blob_put_string(&msg->buf, "jsonrpc"); 
 	blob_put_string(&msg->buf, "2.0"); 
+	_ubus_put_priority(&msg->buf, UBUS_MSG_PRIO_CONTROL); 
 	blob_put_string(&msg->buf, "method"); 
 	blob_put_string(&msg->buf, signal); 
 	blob_put_string(&msg->buf, "params"); 
@@ -168,37 +214,561 @@ static void _send_well_known_name(struct ubus_context *self, uint32_t peer) {
 	blob_free(&buf); 
 }
 
+static void _send_window(struct ubus_context *self, uint32_t peer){
+	struct blob buf; 
+	blob_init(&buf, 0, 0); 
+	blob_put_int(&buf, self->window); 
+	_ubus_send_signal(self, peer, "ubus.peer.window", blob_head(&buf)); 
+	blob_free(&buf); 
+}
+
+/**
+Flow control is credit based. Every side announces a window: the number of calls the other
+side may have outstanding with it. Calls over the window stay in the local request queue until
+replies come back, so a slow peer pushes back on its callers instead of piling up work in the
+transport buffers. A peer that ignores our window gets UBUS_STATUS_BUSY right away without its
+call ever reaching a handler. 
+**/
+static void _ubus_incoming_done(struct ubus_context *self, struct ubus_request *req){
+	struct ubus_peer *peer = _find_peer_by_id(self, req->src_id); 
+	if(peer && peer->received) peer->received--; 
+}
+
+static void _ubus_outgoing_done(struct ubus_context *self, struct ubus_request *req){
+	struct ubus_peer *peer = _find_peer_by_id(self, req->dst_id); 
+	if(peer && peer->sent) peer->sent--; 
+}
+
+static void _on_chunk_method_call(struct ubus_request *req, struct blob_field *msg){
+	struct ubus_context *self = (struct ubus_context*)ubus_request_get_userdata(req); 
+	_ubus_send_chunk(self, req->src_id, req->seq, msg, req->priority); 
+}
+
+static bool _ubus_peer_backlogged(struct ubus_context *self, uint32_t peer){
+	return ubus_socket_backlog(self->socket, peer) >= self->chunk_backlog; 
+}
+
+static bool _chunk_busy_method_call(struct ubus_request *req){
+	return _ubus_peer_backlogged((struct ubus_context*)ubus_request_get_userdata(req), req->src_id); 
+}
+
 static void _on_reject_method_call(struct ubus_request *req, struct blob_field *msg){
 	struct ubus_context *self = (struct ubus_context*)ubus_request_get_userdata(req); 
 
 	// send reply with the same serial as the original request
 	//printf("sending error to %08x\n", req->src_id); 
 
-	_ubus_send_error(self, req->src_id, req->seq, msg); 
+	_ubus_send_error(self, req->src_id, req->seq, msg, req->priority); 
+}
+
+/**
+Replies to the calls of a batch (a json-rpc array of calls) are collected here and sent back
+as one array once every call in the batch has been resolved or rejected. The batch holds
+one reference for every call that is still running plus one for the code that is parsing
+the batch so that it is not sent out before all calls have been dispatched. The reply and the
+chunks of all calls in the batch go out at the priority of the most urgent call in it. Messages of
+the same priority leave in order, so the reply can not overtake a chunk of one of its calls. 
+**/
+struct ubus_batch_reply {
+	struct ubus_context *ctx; 
+	struct ubus_message *msg; 
+	blob_offset_t arr; 
+	int refcount; 
+	int count; 
+}; 
+
+static struct ubus_batch_reply *_ubus_batch_reply_new(struct ubus_context *self, uint32_t peer, int priority){
+	struct ubus_batch_reply *batch = calloc(1, sizeof(struct ubus_batch_reply)); 
+	batch->ctx = self; 
+	batch->refcount = 1; 
+	batch->msg = ubus_socket_new_message(self->socket); 
+	batch->msg->peer = peer; 
+	batch->msg->priority = priority; 
+	blob_reset(&batch->msg->buf); 
+	blob_set_type(&batch->msg->buf, BLOB_FIELD_ARRAY); 
+	return batch; 
+}
+
+static void _ubus_batch_reply_add(struct ubus_batch_reply *batch, uint32_t seq, const char *type, struct blob_field *data, int priority){
+	blob_offset_t ofs = blob_open_table(&batch->msg->buf); 
+	_ubus_put_reply(&batch->msg->buf, seq, type, data, priority); 
+	blob_close_table(&batch->msg->buf, ofs); 
+	batch->count++; 
+}
+
+static void _ubus_batch_reply_put(struct ubus_batch_reply **_batch){
+	struct ubus_batch_reply *batch = *_batch; 
+	*_batch = NULL; 
+	if(--batch->refcount > 0) return; 
+	// a batch made up only of notifications gets no reply at all
+	if(batch->count > 0){
+		if(ubus_socket_send(batch->ctx->socket, &batch->msg) < 0){
+			printf("send batch reply failed\n"); 
+		}
+	}
+	if(batch->msg) ubus_message_delete(&batch->msg); 
+	free(batch); 
+}
+
+// drop a reference without sending anything. For calls of the batch that will never be answered. 
+static void _ubus_batch_reply_drop(struct ubus_batch_reply **_batch){
+	struct ubus_batch_reply *batch = *_batch; 
+	*_batch = NULL; 
+	if(--batch->refcount > 0) return; 
+	if(batch->msg) ubus_message_delete(&batch->msg); 
+	free(batch); 
+}
+
+static void _on_resolve_batch_call(struct ubus_request *req, struct blob_field *data){
+	struct ubus_batch_reply *batch = ubus_request_get_userdata(req); 
+	_ubus_batch_reply_add(batch, req->seq, "result", data, req->priority); 
+	_ubus_batch_reply_put(&batch); 
+}
+
+static void _on_reject_batch_call(struct ubus_request *req, struct blob_field *data){
+	struct ubus_batch_reply *batch = ubus_request_get_userdata(req); 
+	_ubus_batch_reply_add(batch, req->seq, "error", data, req->priority); 
+	_ubus_batch_reply_put(&batch); 
+}
+
+// chunks are not held back until the end of the batch. That would defeat the point of streaming. 
+static void _on_chunk_batch_call(struct ubus_request *req, struct blob_field *data){
+	struct ubus_batch_reply *batch = ubus_request_get_userdata(req); 
+	_ubus_send_chunk(batch->ctx, req->src_id, req->seq, data, batch->msg->priority); 
+}
+
+static bool _chunk_busy_batch_call(struct ubus_request *req){
+	struct ubus_batch_reply *batch = ubus_request_get_userdata(req); 
+	return _ubus_peer_backlogged(batch->ctx, req->src_id); 
+}
+
+/**
+Events carry something that happened to a request (a chunk, the reply or a new request to
+send) from one thread to another. They are pushed onto a lock free stack (any number of
+threads can push) and the one thread that consumes the stack takes all of it at once. 
+**/
+enum {
+	UBUS_REQUEST_EVENT_CHUNK, 
+	UBUS_REQUEST_EVENT_RESOLVE, 
+	UBUS_REQUEST_EVENT_REJECT, 
+	UBUS_REQUEST_EVENT_SUBMIT, 
+	// handler has returned and the worker is done with the request
+	UBUS_REQUEST_EVENT_RETURN
+}; 
+
+struct ubus_request_event {
+	struct ubus_request_event *next; 
+	struct ubus_request *req; 
+	int type; 
+	struct blob data; 
+}; 
+
+static void _ubus_request_event_ctor(void *obj){
+	struct ubus_request_event *self = obj; 
+	blob_init(&self->data, 0, 0); 
+}
+
+static struct ubus_slab _request_event_slab = UBUS_SLAB_INITIALIZER("request_event", struct ubus_request_event, _ubus_request_event_ctor); 
+
+static struct ubus_request_event *_ubus_request_event_new(struct ubus_request *req, int type, struct blob_field *data){
+	struct ubus_request_event *ev = ubus_slab_alloc(&_request_event_slab); 
+	ev->req = req; 
+	ev->type = type; 
+	blob_reset(&ev->data); 
+	if(data) blob_put_attr(&ev->data, data); 
+	return ev; 
 }
 
-static void _on_msg_call(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, const char *rpc_method, struct blob_field *params){
+static void _ubus_request_event_delete(struct ubus_request_event **ev){
+	ubus_slab_free(&_request_event_slab, *ev); 
+	*ev = NULL; 
+}
+
+// returns true if the stack was empty before
+static bool _ubus_event_push(struct ubus_request_event **stack, struct ubus_request_event *ev){
+	struct ubus_request_event *head = __atomic_load_n(stack, __ATOMIC_RELAXED); 
+	do {
+		ev->next = head; 
+	} while(!__atomic_compare_exchange_n(stack, &head, ev, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)); 
+	return head == NULL; 
+}
+
+static void _ubus_wake(int fd){
+	uint64_t one = 1; 
+	if(write(fd, &one, sizeof(one)) < 0){
+		// counter can only overflow if nobody reads it in which case nobody is waiting either
+	}
+}
+
+// take everything off the stack and return it oldest first
+static struct ubus_request_event *_ubus_event_take(struct ubus_request_event **stack){
+	struct ubus_request_event *list = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE); 
+	struct ubus_request_event *ev = NULL; 
+	while(list){
+		struct ubus_request_event *next = list->next; 
+		list->next = ev; 
+		ev = list; 
+		list = next; 
+	}
+	return ev; 
+}
+
+/**
+Calls to methods that have an executor run on a worker thread. Whatever the handler does with
+the request (chunks, resolve, reject) is copied into an event and pushed onto a lock free stack
+in the context. The context thread takes the whole stack at once in ubus_handle_events() and
+sends the replies out, so the socket and the request lists are only ever touched by the context
+thread. The request is owned by the task from the moment it is handed to the worker until both
+its reply and the return of the handler have been processed, since a handler may answer before it
+returns or long after. Chunks sent after the reply are dropped. 
+
+Workers can not look at the transport so a task counts the bytes of the chunks that it has pushed
+and not yet sent and the context thread copies the backlog of the transport for the caller into
+the task. A worker that finds the sum over the chunk backlog wakes the context thread, which then
+keeps the copy up to date until the backlog is back under the limit. 
+**/
+struct ubus_handler_task {
+	struct ubus_executor_task task; 
+	struct list_head list; // on the handlers list of the context. Only touched by the context thread. 
+	struct ubus_context *ctx; 
+	struct ubus_method *method; 
+	struct ubus_object *obj; 
+	struct ubus_request *req; 
+	// callbacks and user data the request had before it was handed to the worker
+	void *user_data; 
+	ubus_request_cb_t on_resolve; 
+	ubus_request_cb_t on_fail; 
+	// UBUS_TASK_FINAL is set by the first resolve or reject. The bits above it count chunks that
+	// are being pushed right now. Any thread may answer so this is atomic. 
+	int state; 
+	// chunks pushed and not sent yet, backlog of the transport for the caller and whether the worker was held back. All atomic. 
+	size_t chunk_bytes; 
+	size_t backlog; 
+	bool throttled; 
+	// only touched by the context thread
+	bool replied; 
+	bool returned; 
+}; 
+
+#define UBUS_TASK_FINAL 1
+#define UBUS_TASK_CHUNK 2
+
+static inline bool _ubus_task_is_final(struct ubus_handler_task *t){
+	return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & UBUS_TASK_FINAL; 
+}
+
+// called on the worker thread
+static void _ubus_push_request_event(struct ubus_request *req, int type, struct blob_field *data){
+	struct ubus_handler_task *t = ubus_request_get_userdata(req); 
+	struct ubus_context *ctx = t->ctx; 
+	if(type == UBUS_REQUEST_EVENT_CHUNK){
+		// chunks after the reply are dropped. The task and the request may be gone as soon as the reply is out. 
+		int state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE); 
+		do {
+			if(state & UBUS_TASK_FINAL) return; 
+		} while(!__atomic_compare_exchange_n(&t->state, &state, state + UBUS_TASK_CHUNK, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)); 
+		__atomic_fetch_add(&t->chunk_bytes, blob_field_raw_pad_len(data), __ATOMIC_RELAXED); 
+		struct ubus_request_event *ev = _ubus_request_event_new(req, type, data); 
+		bool wake = _ubus_event_push(&ctx->completions, ev); 
+		__atomic_fetch_sub(&t->state, UBUS_TASK_CHUNK, __ATOMIC_RELEASE); 
+		if(wake) _ubus_wake(ctx->wake_fd); 
+		return; 
+	}
+	// only one reply ever goes out no matter how often the handler answers
+	if(__atomic_fetch_or(&t->state, UBUS_TASK_FINAL, __ATOMIC_ACQ_REL) & UBUS_TASK_FINAL) return; 
+	struct ubus_request_event *ev = _ubus_request_event_new(req, type, data); 
+	// chunks that got in before us have to be on the stack first so that they go out before the reply
+	while(__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != UBUS_TASK_FINAL) sched_yield(); 
+	if(_ubus_event_push(&ctx->completions, ev)) _ubus_wake(ctx->wake_fd); 
+}
+
+static void _on_resolve_deferred(struct ubus_request *req, struct blob_field *data){
+	_ubus_push_request_event(req, UBUS_REQUEST_EVENT_RESOLVE, data); 
+}
+
+static void _on_reject_deferred(struct ubus_request *req, struct blob_field *data){
+	_ubus_push_request_event(req, UBUS_REQUEST_EVENT_REJECT, data); 
+}
+
+static void _on_chunk_deferred(struct ubus_request *req, struct blob_field *data){
+	_ubus_push_request_event(req, UBUS_REQUEST_EVENT_CHUNK, data); 
+}
+
+// called on the worker thread
+static bool _chunk_busy_deferred(struct ubus_request *req){
+	struct ubus_handler_task *t = ubus_request_get_userdata(req); 
+	size_t queued = __atomic_load_n(&t->chunk_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&t->backlog, __ATOMIC_RELAXED); 
+	if(queued < t->ctx->chunk_backlog) return false; 
+	// context thread only watches the transport for us from now on
+	if(!__atomic_exchange_n(&t->throttled, true, __ATOMIC_RELAXED)) _ubus_wake(t->ctx->wake_fd); 
+	return true; 
+}
+
+// copy the backlog of the transport into tasks whose worker is being held back
+static void _ubus_update_handler_backlogs(struct ubus_context *self){
+	struct ubus_handler_task *t; 
+	list_for_each_entry(t, &self->handlers, list){
+		if(!__atomic_load_n(&t->throttled, __ATOMIC_RELAXED)) continue; 
+		size_t backlog = ubus_socket_backlog(self->socket, t->req->src_id); 
+		__atomic_store_n(&t->backlog, backlog, __ATOMIC_RELAXED); 
+		if(backlog < self->chunk_backlog) __atomic_store_n(&t->throttled, false, __ATOMIC_RELAXED); 
+	}
+}
+
+static void _ubus_run_handler(struct ubus_executor_task *task){
+	struct ubus_handler_task *t = container_of(task, struct ubus_handler_task, task); 
+	struct ubus_request *req = t->req; 
+	// a handler that has answered already and then returns an error does not get rejected on top
+	if(ubus_method_invoke(t->method, t->ctx, t->obj, req, blob_head(&req->buf)) < 0 && !_ubus_task_is_final(t)){
+		ubus_request_reject(req, NULL); 
+	}
+	// last thing we do with the task. The context thread may free it right after so the context is read first. 
+	struct ubus_context *ctx = t->ctx; 
+	if(_ubus_event_push(&ctx->completions, _ubus_request_event_new(req, UBUS_REQUEST_EVENT_RETURN, NULL))) _ubus_wake(ctx->wake_fd); 
+}
+
+static void _ubus_process_completions(struct ubus_context *self){
+	struct ubus_request_event *ev = _ubus_event_take(&self->completions); 
+	while(ev){
+		struct ubus_request_event *next = ev->next; 
+		struct ubus_request *req = ev->req; 
+		// worker does not change the user data so reading it here is safe
+		struct ubus_handler_task *t = ubus_request_get_userdata(req); 
+		if(ev->type == UBUS_REQUEST_EVENT_CHUNK){
+			// worker may still be using the request so we only read from it here
+			int priority = req->priority; 
+			if(t->on_resolve == &_on_resolve_batch_call) priority = ((struct ubus_batch_reply*)t->user_data)->msg->priority; 
+			_ubus_send_chunk(self, req->src_id, req->seq, blob_head(&ev->data), priority); 
+			__atomic_fetch_sub(&t->chunk_bytes, blob_field_raw_pad_len(blob_head(&ev->data)), __ATOMIC_RELAXED); 
+			__atomic_store_n(&t->backlog, ubus_socket_backlog(self->socket, req->src_id), __ATOMIC_RELAXED); 
+		} else {
+			if(ev->type == UBUS_REQUEST_EVENT_RETURN){
+				t->returned = true; 
+			} else {
+				t->replied = true; 
+				ubus_request_set_userdata(req, t->user_data); 
+				if(ev->type == UBUS_REQUEST_EVENT_RESOLVE && t->on_resolve) t->on_resolve(req, blob_head(&ev->data)); 
+				else if(ev->type == UBUS_REQUEST_EVENT_REJECT && t->on_fail) t->on_fail(req, blob_head(&ev->data)); 
+				// the worker may not have returned yet and finds the task through the request
+				ubus_request_set_userdata(req, t); 
+				_ubus_incoming_done(self, req); 
+			}
+			if(t->replied && t->returned){
+				ubus_request_delete(&req); 
+				list_del(&t->list); 
+				free(t); 
+				self->handlers_running--; 
+			}
+		}
+		_ubus_request_event_delete(&ev); 
+		ev = next; 
+	}
+}
+
+/**
+Every thread that sends requests through a context it is not handling events for gets a reply
+queue. The event thread pushes the outcome of those requests onto the queue instead of calling
+their callbacks and wakes the owner through an eventfd (only when the queue was empty, so a
+burst of replies costs one write). A thread that handles events for a context of its own (like
+the shards of a hub) sleeps in ubus_wait_events() on that context, so it is woken up through the
+wake_fd of its own context as well (so that context must not be deleted before this one). Queues live until the context is deleted because replies
+can still be on their way when a thread stops caring about them. 
+**/
+struct ubus_reply_queue {
+	struct ubus_reply_queue *next; 
+	struct ubus_request_event *events; 
+	int efd; 
+	// wake_fd of the context the owning thread handles events for, -1 if none
+	int wake_fd; 
+}; 
+
+// context that the calling thread last handled events for
+static __thread struct ubus_context *_event_context = NULL; 
+
+static bool _ubus_is_event_thread(struct ubus_context *self){
+	return pthread_equal(__atomic_load_n(&self->event_thread, __ATOMIC_RELAXED), pthread_self()); 
+}
+
+static struct ubus_reply_queue *_ubus_reply_queue(struct ubus_context *self){
+	struct ubus_reply_queue *q = pthread_getspecific(self->reply_key); 
+	if(q) return q; 
+	q = calloc(1, sizeof(struct ubus_reply_queue)); 
+	q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	q->wake_fd = (_event_context && _event_context != self)?_event_context->wake_fd:-1; 
+	pthread_setspecific(self->reply_key, q); 
+	struct ubus_reply_queue *head = __atomic_load_n(&self->reply_queues, __ATOMIC_RELAXED); 
+	do {
+		q->next = head; 
+	} while(!__atomic_compare_exchange_n(&self->reply_queues, &head, q, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)); 
+	return q; 
+}
+
+static void _ubus_reply_queue_push(struct ubus_reply_queue *q, struct ubus_request *req, int type, struct blob_field *data){
+	if(_ubus_event_push(&q->events, _ubus_request_event_new(req, type, data))){
+		_ubus_wake(q->efd); 
+		if(q->wake_fd >= 0) _ubus_wake(q->wake_fd); 
+	}
+}
+
+// ids of requests are 16 bits on the wire and 0 marks a signal so it is skipped when the counter wraps
+static uint16_t _ubus_next_seq(struct ubus_context *self){
+	uint16_t seq; 
+	while(!(seq = __atomic_fetch_add(&self->request_seq, 1, __ATOMIC_RELAXED))); 
+	return seq; 
+}
+
+// hand a request from another thread over to the event thread
+static void _ubus_submit_request(struct ubus_context *self, struct ubus_request *req, int timeout){
+	req->seq = _ubus_next_seq(self); 
+	req->timeout = utick_now() + (utick_t)timeout * 1000UL; 
+	req->reply_queue = _ubus_reply_queue(self); 
+	if(_ubus_event_push(&self->submissions, _ubus_request_event_new(req, UBUS_REQUEST_EVENT_SUBMIT, NULL))) _ubus_wake(self->wake_fd); 
+}
+
+static void _ubus_process_submissions(struct ubus_context *self){
+	struct ubus_request_event *ev = _ubus_event_take(&self->submissions); 
+	while(ev){
+		struct ubus_request_event *next = ev->next; 
+		list_add_tail(&ev->req->list, &self->requests); 
+		_ubus_request_event_delete(&ev); 
+		ev = next; 
+	}
+}
+
+// resolve or reject an outgoing request that is no longer in any list. Consumes the request. 
+static void _ubus_finish_request(struct ubus_context *self, struct ubus_request *req, int type, struct blob_field *data){
+	if(req->reply_queue){
+		// sending thread deletes it once it has run the callbacks
+		_ubus_reply_queue_push(req->reply_queue, req, type, data); 
+		return; 
+	}
+	if(type == UBUS_REQUEST_EVENT_RESOLVE) ubus_request_resolve(req, data); 
+	else ubus_request_reject(req, data); 
+	ubus_request_delete(&req); 
+}
+
+static void _ubus_request_chunk(struct ubus_context *self, struct ubus_request *req, struct blob_field *data){
+	if(req->reply_queue) _ubus_reply_queue_push(req->reply_queue, req, UBUS_REQUEST_EVENT_CHUNK, data); 
+	else ubus_request_send_chunk(req, data); 
+}
+
+int ubus_process_replies(struct ubus_context *self){
+	struct ubus_reply_queue *q = pthread_getspecific(self->reply_key); 
+	if(!q) return 0; 
+	int count = 0; 
+	struct ubus_request_event *ev = _ubus_event_take(&q->events); 
+	while(ev){
+		struct ubus_request_event *next = ev->next; 
+		struct ubus_request *req = ev->req; 
+		if(ev->type == UBUS_REQUEST_EVENT_CHUNK){
+			ubus_request_send_chunk(req, blob_head(&ev->data)); 
+		} else {
+			if(ev->type == UBUS_REQUEST_EVENT_RESOLVE) ubus_request_resolve(req, blob_head(&ev->data)); 
+			else ubus_request_reject(req, blob_head(&ev->data)); 
+			ubus_request_delete(&req); 
+		}
+		_ubus_request_event_delete(&ev); 
+		ev = next; 
+		count++; 
+	}
+	return count; 
+}
+
+int ubus_wait_replies(struct ubus_context *self, int timeout){
+	struct ubus_reply_queue *q = pthread_getspecific(self->reply_key); 
+	if(!q) return 0; 
+	if(__atomic_load_n(&q->events, __ATOMIC_ACQUIRE)) return 1; 
+	// the event thread writes the eventfd after every push onto an empty queue so we can not miss a wakeup
+	struct pollfd pfd = { .fd = q->efd, .events = POLLIN }; 
+	int ret = poll(&pfd, 1, timeout); 
+	if(ret <= 0) return ret; 
+	uint64_t count; 
+	if(read(q->efd, &count, sizeof(count)) < 0){
+		// someone else cleared it already
+	}
+	return (__atomic_load_n(&q->events, __ATOMIC_ACQUIRE))?1:0; 
+}
+
+static void _on_msg_call(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, const char *rpc_method, struct blob_field *params, int priority, struct ubus_batch_reply *batch){
 	if(!self->root_obj) return; 
 
 	struct blob buf; 
 	blob_init(&buf, 0, 0); 
 
+	struct ubus_method *m = ubus_object_find_method(self->root_obj, rpc_method); 
+	if(!m) {
+		blob_put_int(&buf, UBUS_STATUS_METHOD_NOT_FOUND); 
+		blob_put_string(&buf, "UBUS_STATUS_METHOD_NOT_FOUND"); 
+		if(batch) _ubus_batch_reply_add(batch, serial, "error", blob_head(&buf), priority); 
+		else _ubus_send_error(self, peer->id, serial, blob_head(&buf), priority); 
+		blob_free(&buf); 
+		return; 
+	}
+
+	// bad calls never reach the handler
+	if(!ubus_method_validate(m, params)){
+		blob_put_int(&buf, UBUS_STATUS_INVALID_ARGUMENT); 
+		blob_put_string(&buf, "UBUS_STATUS_INVALID_ARGUMENT"); 
+		if(batch) _ubus_batch_reply_add(batch, serial, "error", blob_head(&buf), priority); 
+		else _ubus_send_error(self, peer->id, serial, blob_head(&buf), priority); 
+		blob_free(&buf); 
+		return; 
+	}
+
+	if(peer->received >= self->window){
+		blob_put_int(&buf, UBUS_STATUS_BUSY); 
+		blob_put_string(&buf, "UBUS_STATUS_BUSY"); 
+		if(batch) _ubus_batch_reply_add(batch, serial, "error", blob_head(&buf), priority); 
+		else _ubus_send_error(self, peer->id, serial, blob_head(&buf), priority); 
+		blob_free(&buf); 
+		return; 
+	}
+
 	// now we have to create a new request object which we bind to reply functions
 	// so that when the application code calls ubus_request_resolve() we can 
 	// send back the result over the network to the other peer
+	// peer, object and method names are all interned already so this does not allocate any strings
 
-	struct ubus_request *req = ubus_request_new(peer->name, self->root_obj->name, rpc_method, params); 
+	struct ubus_request *req = ubus_request_new_interned(peer->name, self->root_obj->name, m->name, params); 
 	req->src_id = peer->id; 
 	req->seq = serial; 
-	ubus_request_set_userdata(req, self); 
-	ubus_request_on_resolve(req, &_on_resolve_method_call); 
-	ubus_request_on_reject(req, &_on_reject_method_call); 
+	req->priority = priority; 
+	if(batch){
+		// reference is dropped when the request is resolved or rejected
+		batch->refcount++; 
+		ubus_request_set_userdata(req, batch); 
+		ubus_request_on_resolve(req, &_on_resolve_batch_call); 
+		ubus_request_on_reject(req, &_on_reject_batch_call); 
+		ubus_request_on_chunk(req, &_on_chunk_batch_call); 
+		req->chunk_busy = &_chunk_busy_batch_call; 
+	} else {
+		ubus_request_set_userdata(req, self); 
+		ubus_request_on_resolve(req, &_on_resolve_method_call); 
+		ubus_request_on_reject(req, &_on_reject_method_call); 
+		ubus_request_on_chunk(req, &_on_chunk_method_call); 
+		req->chunk_busy = &_chunk_busy_method_call; 
+	}
 
-	struct ubus_method *m = ubus_object_find_method(self->root_obj, rpc_method); 
-	if(!m) {
-		blob_put_int(&buf, UBUS_STATUS_METHOD_NOT_FOUND); 
-		blob_put_string(&buf, "UBUS_STATUS_METHOD_NOT_FOUND"); 
-		_ubus_send_error(self, peer->id, serial, blob_head(&buf)); 
+	struct ubus_executor *executor = (m->executor)?m->executor:self->root_obj->executor; 
+	if(executor){
+		struct ubus_handler_task *t = calloc(1, sizeof(struct ubus_handler_task)); 
+		ubus_executor_task_init(&t->task, _ubus_run_handler); 
+		t->ctx = self; 
+		t->method = m; 
+		t->obj = self->root_obj; 
+		t->req = req; 
+		t->user_data = ubus_request_get_userdata(req); 
+		t->on_resolve = req->on_resolve; 
+		t->on_fail = req->on_fail; 
+		ubus_request_set_userdata(req, t); 
+		ubus_request_on_resolve(req, &_on_resolve_deferred); 
+		ubus_request_on_reject(req, &_on_reject_deferred); 
+		ubus_request_on_chunk(req, &_on_chunk_deferred); 
+		req->chunk_busy = &_chunk_busy_deferred; 
+		list_add(&t->list, &self->handlers); 
+		self->handlers_running++; 
+		peer->received++; 
+		ubus_executor_submit(executor, &t->task); 
 		blob_free(&buf); 
 		return; 
 	}
@@ -210,12 +780,101 @@ static void _on_msg_call(struct ubus_context *self, struct ubus_peer *peer, uint
 	} else {
 		// add the request to the list of pending requests 
 		list_add(&req->list, &self->pending_incoming); 
+		peer->received++; 
 	}
 	blob_free(&buf); 
 }
 
-static void _on_msg_return(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, struct blob_field *msg){
+/**
+Calls relayed with ubus_forward_request() do not get a request of their own. We only remember
+which incoming call a relayed call belongs to and answer that call straight from the reply
+message once it comes back. 
+**/
+struct ubus_forward {
+	struct list_head list; 
+	uint16_t seq; 			// id of the relayed call
+	uint32_t dst_id; 		// peer it was relayed to
+	struct ubus_request *req; 	// incoming call that is answered by the reply
+	utick_t timeout; 
+}; 
+
+static struct ubus_slab _forward_slab = UBUS_SLAB_INITIALIZER("forward", struct ubus_forward, NULL); 
+
+// find the relayed call that a reply belongs to and take it off the list
+static struct ubus_forward *_ubus_take_forward(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial){
+	struct ubus_forward *fw; 
+	list_for_each_entry(fw, &self->forwards, list){
+		if(fw->seq != serial || fw->dst_id != peer->id) continue; 
+		list_del_init(&fw->list); 
+		if(peer->sent) peer->sent--; 
+		return fw; 
+	}
+	return NULL; 
+}
+
+static void _ubus_forward_delete(struct ubus_forward **fw){
+	ubus_slab_free(&_forward_slab, *fw); 
+	*fw = NULL; 
+}
+
+/**
+A reply to a relayed call goes back to the caller in the message it came in. Only the id in its
+envelope is swapped for the id of the original call, in place, so this works as long as the new
+id packs into as many bytes as the old one. Otherwise, and for calls whose replies are collected
+into a batch or run through a thread pool, the reply goes through the callbacks of the call and
+is copied into a new message. Returns true if the message was taken. 
+**/
+static bool _ubus_relay_reply(struct ubus_context *self, struct ubus_request *req, struct ubus_message **relay, struct blob_field *id, int type){
+	if(!relay || !*relay || !id) return false; 
+	ubus_request_cb_t cb = (type == UBUS_MSG_METHOD_RETURN)?req->on_resolve:(type == UBUS_MSG_ERROR)?req->on_fail:req->on_chunk; 
+	ubus_request_cb_t direct = (type == UBUS_MSG_METHOD_RETURN)?&_on_resolve_method_call:(type == UBUS_MSG_ERROR)?&_on_reject_method_call:&_on_chunk_method_call; 
+	if(cb != direct) return false; 
+
+	blob_reset(&self->buf); 
+	blob_put_int(&self->buf, req->seq); 
+	struct blob_field *seq = blob_field_first_child(blob_head(&self->buf)); 
+	if(blob_field_raw_pad_len(seq) != blob_field_raw_pad_len(id)) return false; 
+	memcpy(id, seq, blob_field_raw_pad_len(seq)); 
+
+	(*relay)->peer = req->src_id; 
+	(*relay)->priority = req->priority; 
+	if(ubus_socket_send(self->socket, relay) < 0){
+		printf("relay reply failed\n"); 
+	}
+	// the call is answered as if its callback had sent the reply
+	if(type == UBUS_MSG_METHOD_RETURN) req->resolved = true; 
+	else if(type == UBUS_MSG_ERROR) req->failed = true; 
+	return true; 
+}
+
+int ubus_forward_request(struct ubus_context *self, struct ubus_request *req, const char *peer_name, const char *object, const char *method, struct blob_field *args){
+	// the socket belongs to the event thread
+	if(!_ubus_is_event_thread(self)) return -1; 
+	struct ubus_peer *peer = _find_peer_by_name(self, peer_name); 
+	if(!peer || peer->sent >= peer->window) return -1; 
+
+	uint16_t seq = _ubus_next_seq(self); 
+	if(_ubus_send_request(self, peer->id, seq, "call", object, method, args, req->priority) < 0) return -1; 
+
+	struct ubus_forward *fw = ubus_slab_alloc(&_forward_slab); 
+	INIT_LIST_HEAD(&fw->list); 
+	fw->seq = seq; 
+	fw->dst_id = peer->id; 
+	fw->req = req; 
+	fw->timeout = utick_now() + (utick_t)UBUS_DEFAULT_TIMEOUT * 1000UL; 
+	list_add_tail(&fw->list, &self->forwards); 
+	peer->sent++; 
+	return 0; 
+}
+
+static void _on_msg_return(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, struct blob_field *msg, struct blob_field *id, struct ubus_message **relay){
 	//printf("got return for request %d\n", serial); 
+	struct ubus_forward *fw = _ubus_take_forward(self, peer, serial); 
+	if(fw){
+		if(!_ubus_relay_reply(self, fw->req, relay, id, UBUS_MSG_METHOD_RETURN)) ubus_request_resolve(fw->req, msg); 
+		_ubus_forward_delete(&fw); 
+		return; 
+	}
 	struct ubus_request *req, *tmp, *found = NULL; 
 	// find the pending outgoing request that has the same serial 
 	list_for_each_entry_safe(req, tmp, &self->pending, list){
@@ -226,11 +885,35 @@ static void _on_msg_return(struct ubus_context *self, struct ubus_peer *peer, ui
 	}
 	if(!found) return; 
 	list_del_init(&req->list); 
-	ubus_request_resolve(req, msg); 
-	ubus_request_delete(&req); 
+	_ubus_outgoing_done(self, req); 
+	_ubus_finish_request(self, req, UBUS_REQUEST_EVENT_RESOLVE, msg); 
+}
+
+static void _on_msg_chunk(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, struct blob_field *msg, struct blob_field *id, struct ubus_message **relay){
+	struct ubus_forward *fw; 
+	list_for_each_entry(fw, &self->forwards, list){
+		if(fw->seq != serial || fw->dst_id != peer->id) continue; 
+		fw->timeout = utick_now() + (utick_t)UBUS_DEFAULT_TIMEOUT * 1000UL; 
+		if(!_ubus_relay_reply(self, fw->req, relay, id, UBUS_MSG_METHOD_CHUNK)) ubus_request_forward_chunk(fw->req, msg); 
+		return; 
+	}
+	struct ubus_request *req; 
+	list_for_each_entry(req, &self->pending, list){
+		if(req->seq != serial) continue; 
+		// the other side is obviously still working on it so the request gets more time
+		req->timeout = utick_now() + (utick_t)UBUS_DEFAULT_TIMEOUT * 1000UL; 
+		_ubus_request_chunk(self, req, msg); 
+		return; 
+	}
 }
 
-static void _on_msg_error(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, struct blob_field *msg){
+static void _on_msg_error(struct ubus_context *self, struct ubus_peer *peer, uint32_t serial, struct blob_field *msg, struct blob_field *id, struct ubus_message **relay){
+	struct ubus_forward *fw = _ubus_take_forward(self, peer, serial); 
+	if(fw){
+		if(!_ubus_relay_reply(self, fw->req, relay, id, UBUS_MSG_ERROR)) ubus_request_reject(fw->req, msg); 
+		_ubus_forward_delete(&fw); 
+		return; 
+	}
 	struct ubus_request *req, *tmp, *found = NULL; 
 	// find the pending outgoing request that has the same serial 
 	list_for_each_entry_safe(req, tmp, &self->pending, list){
@@ -244,8 +927,8 @@ static void _on_msg_error(struct ubus_context *self, struct ubus_peer *peer, uin
 		return; 
 	}
 	list_del_init(&req->list); 
-	ubus_request_reject(req, msg); 
-	ubus_request_delete(&req); 
+	_ubus_outgoing_done(self, req); 
+	_ubus_finish_request(self, req, UBUS_REQUEST_EVENT_REJECT, msg); 
 }
 /*
 struct ubus_peer* _on_msg_client_connected(struct ubus_context *self, uint32_t peer_id){
@@ -261,62 +944,64 @@ struct ubus_peer* _on_msg_client_connected(struct ubus_context *self, uint32_t p
 */
 struct rpc_message {
 	uint32_t id; 
+	struct blob_field *id_field; 
 	int type; 
 	const char *method; 
 	struct blob_field *params; 
 	struct blob_field *error; 
 	struct blob_field *result; 
+	struct blob_field *chunk; 
+	int priority; 
 }; 
 
 static bool _parse_rpc_message(struct blob_field *field, struct rpc_message *self){
 	struct blob_field *key, *value; 
 	bool valid = false; 
 	memset(self, 0, sizeof(*self)); 	
+	self->priority = UBUS_MSG_PRIO_NORMAL; 
 
 	blob_field_for_each_kv(field, key, value){
 		const char *k = blob_field_get_string(key); 
 		if(strcmp(k, "jsonrpc") == 0 && strcmp(blob_field_get_string(value), "2.0") == 0) valid = true; 
-		else if(strcmp(k, "id") == 0) self->id = blob_field_get_int(value); 
+		else if(strcmp(k, "id") == 0){ self->id = blob_field_get_int(value); self->id_field = value; }
 		else if(strcmp(k, "method") == 0) self->method = blob_field_get_string(value); 
 		else if(strcmp(k, "params") == 0) self->params = value; 
 		else if(strcmp(k, "result") == 0) self->result = value; 
 		else if(strcmp(k, "error") == 0) self->error = value;
+		else if(strcmp(k, "chunk") == 0) self->chunk = value; 
+		else if(strcmp(k, "priority") == 0) self->priority = blob_field_get_int(value); 
 	}
 	if(!valid) return false; 
 	if(self->id && self->method) self->type = UBUS_MSG_METHOD_CALL; 
 	else if(!self->id && self->method) self->type = UBUS_MSG_SIGNAL; 
 	else if(self->result) self->type = UBUS_MSG_METHOD_RETURN;  
 	else if(self->error) self->type = UBUS_MSG_ERROR;  
+	else if(self->chunk) self->type = UBUS_MSG_METHOD_CHUNK; 
 	else return false; 
+	// replies to a call and calls it forwards go out at this priority so a peer does not get to pick any it likes
+	self->priority = ubus_message_peer_priority(self->priority, self->type); 
 	return true; 
 }
 
-static void _ubus_handle_message(struct ubus_context *self, struct ubus_message *data){
-	assert(self); 
-
-	struct ubus_peer *p = _find_peer_by_id(self, data->peer);  
-	if(!p){
-		//printf("creating new peer context %08x\n", peer); 
-		p = _create_peer(self, data->peer); 
-	}
-
+// relay is the message that field is the root of. Replies to relayed calls may take it (see _ubus_relay_reply()). 
+static void _ubus_handle_rpc(struct ubus_context *self, struct ubus_peer *p, struct blob_field *field, struct ubus_batch_reply *batch, struct ubus_message **relay){
 	// parse json message
 	struct rpc_message msg; 
-	if(!_parse_rpc_message(blob_head(&data->buf), &msg)){
+	if(!_parse_rpc_message(field, &msg)){
 		printf("could not parse rpc message: "); 
-		blob_field_dump_json(blob_head(&data->buf)); 
+		blob_field_dump_json(field); 
 		return;  	
 	}
 
 	switch(msg.type){
 		case UBUS_MSG_METHOD_CALL: {
 			if(!p) break; 
-			_on_msg_call(self, p, msg.id, msg.method, msg.params); 
+			_on_msg_call(self, p, msg.id, msg.method, msg.params, msg.priority, batch); 
 			break; 
 		}
 		case UBUS_MSG_METHOD_RETURN: {		
 			if(!p) break; 
-			_on_msg_return(self, p, msg.id, msg.result); 
+			_on_msg_return(self, p, msg.id, msg.result, msg.id_field, relay); 
 			break; 
 		}
 		case UBUS_MSG_SIGNAL: {
@@ -326,12 +1011,43 @@ static void _ubus_handle_message(struct ubus_context *self, struct ubus_message
 		}
 		case UBUS_MSG_ERROR: {
 			if(!p) break; 
-			_on_msg_error(self, p, msg.id, msg.error); 
+			_on_msg_error(self, p, msg.id, msg.error, msg.id_field, relay); 
+			break; 
+		}
+		case UBUS_MSG_METHOD_CHUNK: {
+			if(!p) break; 
+			_on_msg_chunk(self, p, msg.id, msg.chunk, msg.id_field, relay); 
 			break; 
 		}
 	}
 }
 
+// data is set to NULL if the message was sent on as it is
+static void _ubus_handle_message(struct ubus_context *self, struct ubus_message **_data){
+	assert(self); 
+	struct ubus_message *data = *_data; 
+
+	struct ubus_peer *p = _find_peer_by_id(self, data->peer);  
+	if(!p){
+		//printf("creating new peer context %08x\n", peer); 
+		p = _create_peer(self, data->peer); 
+	}
+
+	struct blob_field *root = blob_head(&data->buf); 
+	if(blob_field_type(root) != BLOB_FIELD_ARRAY){
+		_ubus_handle_rpc(self, p, root, NULL, _data); 
+		return; 
+	}
+
+	// batch: replies to calls in it are sent back together as one array
+	struct ubus_batch_reply *batch = (p)?_ubus_batch_reply_new(self, p->id, ubus_message_envelope_priority(root, true)):NULL; 
+	struct blob_field *child; 
+	blob_field_for_each_child(root, child){
+		_ubus_handle_rpc(self, p, child, batch, NULL); 
+	}
+	if(batch) _ubus_batch_reply_put(&batch); 
+}
+
 void ubus_context_init(struct ubus_context *self, const char *name){
 	INIT_LIST_HEAD(&self->requests); 
 	INIT_LIST_HEAD(&self->pending); 
@@ -344,6 +1060,17 @@ void ubus_context_init(struct ubus_context *self, const char *name){
 	blob_init(&self->buf, 0, 0); 
 	self->name = strdup(name);
 	self->request_seq = 1; 
+	self->window = UBUS_PEER_DEFAULT_WINDOW; 
+	self->chunk_backlog = UBUS_DEFAULT_CHUNK_BACKLOG; 
+	self->completions = NULL; 
+	INIT_LIST_HEAD(&self->handlers); 
+	self->handlers_running = 0; 
+	self->submissions = NULL; 
+	self->reply_queues = NULL; 
+	pthread_key_create(&self->reply_key, NULL); 
+	self->event_thread = pthread_self(); 
+	self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	INIT_LIST_HEAD(&self->forwards); 
 }
 
 void ubus_context_destroy(struct ubus_context *self){
@@ -360,8 +1087,39 @@ void ubus_context_destroy(struct ubus_context *self){
 	}
 	list_for_each_entry_safe(req, tmp, &self->pending_incoming, list){
 		//ubus_request_reject(req, NULL); 
+		// calls that are part of a batch hold a reference to it until they are answered
+		if(req->on_resolve == &_on_resolve_batch_call && !req->resolved && !req->failed){
+			struct ubus_batch_reply *batch = ubus_request_get_userdata(req); 
+			_ubus_batch_reply_drop(&batch); 
+		}
+		ubus_request_delete(&req); 
+	}
+	// incoming calls they belong to are gone already
+	struct ubus_forward *fw, *fwtmp; 
+	list_for_each_entry_safe(fw, fwtmp, &self->forwards, list){
+		_ubus_forward_delete(&fw); 
+	}
+	// executors must have been stopped by now. Replies that were not sent yet are dropped. 
+	_ubus_process_completions(self); 
+
+	// requests from other threads that never went out and replies nobody picked up
+	_ubus_process_submissions(self); 
+	list_for_each_entry_safe(req, tmp, &self->requests, list){
 		ubus_request_delete(&req); 
 	}
+	struct ubus_reply_queue *q = self->reply_queues, *qnext; 
+	for(; q; q = qnext){
+		qnext = q->next; 
+		struct ubus_request_event *ev = _ubus_event_take(&q->events), *next; 
+		for(; ev; ev = next){
+			next = ev->next; 
+			if(ev->type != UBUS_REQUEST_EVENT_CHUNK) ubus_request_delete(&ev->req); 
+			_ubus_request_event_delete(&ev); 
+		}
+		close(q->efd); 
+		free(q); 
+	}
+	pthread_key_delete(self->reply_key); 
 
 	// remove all peers
 	struct ubus_peer *peer = 0, *ptr; 
@@ -377,6 +1135,7 @@ void ubus_context_destroy(struct ubus_context *self){
 	// objects_by_id does not need to be freed!
 
 	ubus_socket_delete(&self->socket); 
+	close(self->wake_fd); 
 	blob_free(&self->buf); 
 	free(self->name); 
 }
@@ -404,6 +1163,7 @@ int ubus_connect(struct ubus_context *self, const char *path, uint32_t *peer_id)
 	if(ret < 0) return ret; 
 
 	_send_well_known_name(self, peer);
+	_send_window(self, peer); 
 
 	if(peer_id) *peer_id = peer; 
 	return 0; 
@@ -413,6 +1173,17 @@ int ubus_listen(struct ubus_context *self, const char *path){
 	return ubus_socket_listen(self->socket, path); 	
 }
 
+int ubus_serve(struct ubus_context *self, const char *path){
+	return ubus_socket_serve(self->socket, path); 
+}
+
+int ubus_adopt(struct ubus_context *self, int fd){
+	if(ubus_socket_adopt(self->socket, fd) < 0) return -1; 
+	// the transport may only look at new connections when it waits
+	ubus_wakeup(self); 
+	return 0; 
+}
+
 int ubus_set_peer_localname(struct ubus_context *self, uint32_t peer_id, const char *localname){
 	struct ubus_peer *peer = _find_peer_by_name(self, localname); 
 	if(peer) return -1; 
@@ -424,27 +1195,48 @@ int ubus_set_peer_localname(struct ubus_context *self, uint32_t peer_id, const c
 	return avl_insert(&self->peers_by_name, &peer->avl_name); 
 }
 
+void ubus_set_chunk_backlog(struct ubus_context *self, size_t bytes){
+	self->chunk_backlog = bytes; 
+}
+
+void ubus_set_peer_window(struct ubus_context *self, uint32_t window){
+	if(window == 0) window = 1; 
+	self->window = window; 
+	struct ubus_peer *peer; 
+	avl_for_each_element(&self->peers_by_id, peer, avl_id){
+		_send_window(self, peer->id); 
+	}
+}
+
+// fail a request that did not get a reply in time with a proper status code instead of an empty error. Consumes the request. 
+static void _ubus_request_timeout(struct ubus_context *self, struct ubus_request *req){
+	blob_reset(&self->buf); 
+	blob_put_int(&self->buf, UBUS_STATUS_TIMEOUT); 
+	blob_put_string(&self->buf, "UBUS_STATUS_TIMEOUT"); 
+	_ubus_finish_request(self, req, UBUS_REQUEST_EVENT_REJECT, blob_head(&self->buf)); 
+}
+
 static void _ubus_send_pending(struct ubus_context *self){
 	struct ubus_request *req, *tmp; 	
 	list_for_each_entry_safe(req, tmp, &self->requests, list){
 		if(utick_expired(req->timeout)){
 			printf("request timed out to %s %s!\n", req->object, req->method); 
 			list_del_init(&req->list); 
-			ubus_request_reject(req, blob_head(&self->buf)); 
-			ubus_request_delete(&req); 
+			_ubus_request_timeout(self, req); 
 			continue; 
 		}
 		// see if we have the target client
 		struct ubus_peer *peer = _find_peer_by_name(self, req->dst_name); 
 
 		if(!peer) continue; 
+		// no credits left. The request waits here until replies come back (or it times out). 
+		if(peer->sent >= peer->window) continue; 
 		//printf("found peer for request %s %08x\n", req->dst_name, peer->id); 
 
-		if(_ubus_send_request(self, peer->id, req->seq, "call", req->object, req->method, blob_head(&req->buf)) < 0){
+		if(_ubus_send_request(self, peer->id, req->seq, "call", req->object, req->method, blob_head(&req->buf), req->priority) < 0){
 			printf("request failed to %s %s!\n", req->object, req->method); 
 			list_del_init(&req->list); 
-			ubus_request_reject(req, blob_head(&self->buf)); 
-			ubus_request_delete(&req); 
+			_ubus_finish_request(self, req, UBUS_REQUEST_EVENT_REJECT, blob_head(&self->buf)); 
 			continue; 
 		}
 
@@ -454,19 +1246,178 @@ static void _ubus_send_pending(struct ubus_context *self){
 		list_del_init(&req->list); 
 		req->dst_id = peer->id; 
 		list_add(&req->list, &self->pending); 
+		peer->sent++; 
 	}
 }
 
-int ubus_send_request(struct ubus_context *self, struct ubus_request **_req){
-	struct ubus_request *req = *_req; 
-	req->seq = self->request_seq++; 
+static void _ubus_queue_request(struct ubus_context *self, struct ubus_request *req, int timeout){
+	req->seq = _ubus_next_seq(self); 
 	//printf("sending request %08x\n", req->seq); 
-	req->timeout = utick_now() + 5000000UL; 
+	req->timeout = utick_now() + (utick_t)timeout * 1000UL; 
 	list_add(&req->list, &self->requests); 
 	_ubus_send_pending(self); 
+}
+
+int ubus_send_request(struct ubus_context *self, struct ubus_request **_req){
+	if(_ubus_is_event_thread(self)) _ubus_queue_request(self, *_req, UBUS_DEFAULT_TIMEOUT); 
+	else _ubus_submit_request(self, *_req, UBUS_DEFAULT_TIMEOUT); 
+	*_req = NULL; 
+	return 0; 
+}
+
+int ubus_send_request_batch(struct ubus_context *self, struct ubus_request **reqs, int count){
+	if(!_ubus_is_event_thread(self)){
+		// only the event thread may touch the socket so requests from other threads can not be packed together
+		for(int c = 0; c < count; c++) ubus_send_request(self, &reqs[c]); 
+		return 0; 
+	}
+	struct ubus_peer **peers = alloca(sizeof(struct ubus_peer*) * count); 
+	for(int c = 0; c < count; c++){
+		reqs[c]->seq = _ubus_next_seq(self); 
+		reqs[c]->timeout = utick_now() + (utick_t)UBUS_DEFAULT_TIMEOUT * 1000UL; 
+		list_add_tail(&reqs[c]->list, &self->requests); 
+		// names are interned so requests going to the same peer share the same pointer
+		if(c > 0 && reqs[c]->dst_name == reqs[c - 1]->dst_name) peers[c] = peers[c - 1]; 
+		else peers[c] = _find_peer_by_name(self, reqs[c]->dst_name); 
+	}
+	// take credits up front. Requests that do not fit into the window of their peer stay queued. 
+	for(int c = 0; c < count; c++){
+		if(!peers[c]) continue; 
+		if(peers[c]->sent >= peers[c]->window) peers[c] = NULL; 
+		else peers[c]->sent++; 
+	}
+
+	for(int c = 0; c < count; c++){
+		struct ubus_peer *peer = peers[c]; 
+		// requests to peers we do not know yet stay queued and go out one by one once the peer shows up
+		if(!peer) continue; 
+
+		struct ubus_message *msg = ubus_socket_new_message(self->socket); 
+		msg->peer = peer->id; 
+		blob_reset(&msg->buf); 
+		blob_set_type(&msg->buf, BLOB_FIELD_ARRAY); 
+		msg->priority = UBUS_MSG_PRIO_BULK; 
+		for(int d = c; d < count; d++){
+			if(peers[d] != peer) continue; 
+			// the whole batch goes out with the priority of its most urgent call
+			if(reqs[d]->priority < msg->priority) msg->priority = reqs[d]->priority; 
+			blob_offset_t ofs = blob_open_table(&msg->buf); 
+			_ubus_put_request(&msg->buf, reqs[d]->seq, "call", reqs[d]->object, reqs[d]->method, blob_head(&reqs[d]->buf), reqs[d]->priority); 
+			blob_close_table(&msg->buf, ofs); 
+		}
 
+		int ret = ubus_socket_send(self->socket, &msg); 
+		for(int d = c; d < count; d++){
+			if(peers[d] != peer) continue; 
+			peers[d] = NULL; 
+			list_del_init(&reqs[d]->list); 
+			if(ret < 0){
+				printf("batch request failed to %s %s!\n", reqs[d]->object, reqs[d]->method); 
+				peer->sent--; 
+				_ubus_finish_request(self, reqs[d], UBUS_REQUEST_EVENT_REJECT, blob_head(&self->buf)); 
+				continue; 
+			}
+			reqs[d]->dst_id = peer->id; 
+			list_add(&reqs[d]->list, &self->pending); 
+		}
+	}
+	// all requests are owned by the context now
+	memset(reqs, 0, sizeof(struct ubus_request*) * count); 
 	return 0; 
 }
+
+// time in ms until the first outgoing request or relayed call times out, -1 if there are none
+static int _ubus_next_timeout(struct ubus_context *self){
+	utick_t next = 0; 
+	struct ubus_request *req; 
+	list_for_each_entry(req, &self->requests, list){
+		if(!next || req->timeout < next) next = req->timeout; 
+	}
+	list_for_each_entry(req, &self->pending, list){
+		if(!next || req->timeout < next) next = req->timeout; 
+	}
+	struct ubus_forward *fw; 
+	list_for_each_entry(fw, &self->forwards, list){
+		if(!next || fw->timeout < next) next = fw->timeout; 
+	}
+	if(!next) return -1; 
+	utick_t now = utick_now(); 
+	// round up so that the deadline has passed when we wake up
+	return (next > now)?(int)((next - now + 999UL) / 1000UL):0; 
+}
+
+struct ubus_sync_call {
+	struct blob *reply; 
+	int status; 
+	bool done; 
+}; 
+
+static void _on_sync_call_resolve(struct ubus_request *req, struct blob_field *msg){
+	struct ubus_sync_call *call = ubus_request_get_userdata(req); 
+	if(call->reply){
+		blob_reset(call->reply); 
+		blob_put_attr(call->reply, msg); 
+	}
+	call->status = UBUS_STATUS_OK; 
+	call->done = true; 
+}
+
+static void _on_sync_call_reject(struct ubus_request *req, struct blob_field *msg){
+	struct ubus_sync_call *call = ubus_request_get_userdata(req); 
+	// errors are sent as [code, "description"]
+	struct blob_field *code = blob_field_first_child(msg); 
+	call->status = (code)?blob_field_get_int(code):UBUS_STATUS_UNKNOWN_ERROR; 
+	if(call->status == UBUS_STATUS_OK) call->status = UBUS_STATUS_UNKNOWN_ERROR; 
+	if(call->reply){
+		blob_reset(call->reply); 
+		blob_put_attr(call->reply, msg); 
+	}
+	call->done = true; 
+}
+
+int ubus_call_sync(struct ubus_context *self, const char *peer, const char *object, const char *method, struct blob_field *args, int timeout, struct blob *reply){
+	struct ubus_sync_call call = { .reply = reply, .status = UBUS_STATUS_UNKNOWN_ERROR, .done = false }; 
+	if(timeout <= 0) timeout = UBUS_DEFAULT_TIMEOUT; 
+
+	struct ubus_request *req = ubus_request_new(peer, object, method, args); 
+	ubus_request_set_userdata(req, &call); 
+	ubus_request_on_resolve(req, &_on_sync_call_resolve); 
+	ubus_request_on_reject(req, &_on_sync_call_reject); 
+
+	if(!_ubus_is_event_thread(self)){
+		// the event thread fails the request when it times out so this loop always ends as well
+		_ubus_submit_request(self, req, timeout); 
+		while(!call.done){
+			ubus_wait_replies(self, timeout); 
+			ubus_process_replies(self); 
+		}
+		return call.status; 
+	}
+
+	_ubus_queue_request(self, req, timeout); 
+
+	// the request is failed by ubus_handle_events once its timeout runs out so this loop always ends. 
+	// In between we sleep on the socket and keep dispatching whatever else arrives. 
+	// The request stays alive until it is done so we can look at its timeout (chunks extend it). 
+	while(true){
+		ubus_handle_events(self); 
+		if(call.done) break; 
+		// our own request is one of the deadlines so this never sleeps past it
+		if(ubus_wait_events(self, -1) < 0) break; 
+	}
+	// request is still queued only if the socket failed. Its callbacks point to our stack so it has to go. 
+	if(!call.done){
+		struct ubus_request *pos, *tmp; 
+		list_for_each_entry_safe(pos, tmp, &self->requests, list){
+			if(pos == req) { list_del_init(&req->list); ubus_request_delete(&req); break; }
+		}
+		list_for_each_entry_safe(pos, tmp, &self->pending, list){
+			if(pos == req) { list_del_init(&req->list); _ubus_outgoing_done(self, req); ubus_request_delete(&req); break; }
+		}
+		return UBUS_STATUS_CONNECTION_FAILED; 
+	}
+	return call.status; 
+}
 /*
 uint32_t ubus_add_object(struct ubus_context *self, struct ubus_object **_obj){
 	// add the object to our local list of objects and tell all peers that we have this object
@@ -488,20 +1439,42 @@ int ubus_handle_events(struct ubus_context *self){
 	struct ubus_request *req; 
 	struct ubus_request *tmp; 
 
+	if(!_ubus_is_event_thread(self)) __atomic_store_n(&self->event_thread, pthread_self(), __ATOMIC_RELAXED); 
+	_event_context = self; 
+
+	// send out replies of handlers that have finished on an executor
+	_ubus_process_completions(self); 
+	_ubus_update_handler_backlogs(self); 
+	// pick up requests sent from other threads. They go out with the rest below. 
+	_ubus_process_submissions(self); 
+
 	// check if any of the pending requests has timed out
 	list_for_each_entry_safe(req, tmp, &self->pending, list){
 		if(utick_expired(req->timeout)){
 			printf("pending request timed out! %s %s\n", req->object, req->method); 
 			list_del_init(&req->list); 
-			ubus_request_reject(req, blob_head(&self->buf)); 
-			ubus_request_delete(&req); 
+			_ubus_outgoing_done(self, req); 
+			_ubus_request_timeout(self, req); 
 		}
 	}
+	struct ubus_forward *fw, *fwtmp; 
+	list_for_each_entry_safe(fw, fwtmp, &self->forwards, list){
+		if(!utick_expired(fw->timeout)) continue; 
+		struct ubus_peer *peer = _find_peer_by_id(self, fw->dst_id); 
+		list_del_init(&fw->list); 
+		if(peer && peer->sent) peer->sent--; 
+		blob_reset(&self->buf); 
+		blob_put_int(&self->buf, UBUS_STATUS_TIMEOUT); 
+		blob_put_string(&self->buf, "UBUS_STATUS_TIMEOUT"); 
+		ubus_request_reject(fw->req, blob_head(&self->buf)); 
+		_ubus_forward_delete(&fw); 
+	}
 
 	list_for_each_entry_safe(req, tmp, &self->pending_incoming, list){
 		if(req->failed || req->resolved){
 			//printf("deleting completed request\n");
 			list_del_init(&req->list); 
+			_ubus_incoming_done(self, req); 
 			ubus_request_delete(&req); 
 		}
 	}
@@ -511,11 +1484,31 @@ int ubus_handle_events(struct ubus_context *self){
 	// try reading a message
 	struct ubus_message *msg; 
 	while(ubus_socket_recv(self->socket, &msg) > 0){
-		_ubus_handle_message(self, msg); 
+		_ubus_handle_message(self, &msg); 
+		// return the message to the pool unless it went out again
+		if(msg) ubus_message_delete(&msg); 
 	}
 	return 0; 
 }
 
+int ubus_wait_events(struct ubus_context *self, int timeout){
+	if(__atomic_load_n(&self->submissions, __ATOMIC_ACQUIRE) || __atomic_load_n(&self->completions, __ATOMIC_ACQUIRE)) return 1; 
+	// wake up in time to fail whatever times out first
+	int next = _ubus_next_timeout(self); 
+	if(next >= 0 && (timeout < 0 || next < timeout)) timeout = next; 
+	int ret = ubus_socket_wait(self->socket, self->wake_fd, timeout); 
+	// reset before the caller looks for work. Anything queued after this writes it again. 
+	uint64_t count; 
+	if(read(self->wake_fd, &count, sizeof(count)) < 0){
+		// nobody woke us up
+	}
+	return ret; 
+}
+
+void ubus_wakeup(struct ubus_context *self){
+	_ubus_wake(self->wake_fd); 
+}
+
 const char *ubus_status_to_string(int8_t status){
 	static const char *code[] = {
 		"UBUS_STATUS_OK",
@@ -528,7 +1521,8 @@ const char *ubus_status_to_string(int8_t status){
 		"UBUS_STATUS_TIMEOUT",
 		"UBUS_STATUS_NOT_SUPPORTED",
 		"UBUS_STATUS_UNKNOWN_ERROR",
-		"UBUS_STATUS_CONNECTION_FAILED"
+		"UBUS_STATUS_CONNECTION_FAILED",
+		"UBUS_STATUS_BUSY"
 	}; 
 	if(status < 0 || status > sizeof(code) / sizeof(code[0])) status = UBUS_STATUS_UNKNOWN_ERROR; 
 	return code[status]; 
@@ -13,6 +13,7 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <libutype/avl.h>
 #include <blobpack/blobpack.h>
 
@@ -27,6 +28,10 @@
 #include "ubus_context.h"
 
 #define UBUS_DEFAULT_SOCKET "/var/run/ubus.sock"
+// default time in ms that a request waits for a reply
+#define UBUS_DEFAULT_TIMEOUT 5000
+// default bytes of chunks that may be queued for a peer (see ubus_set_chunk_backlog())
+#define UBUS_DEFAULT_CHUNK_BACKLOG (256 * 1024)
 
 struct ubus_context {
 	struct avl_tree peers_by_id;
@@ -39,6 +44,8 @@ struct ubus_context {
 	struct list_head requests;
 	struct list_head pending; 
 	struct list_head pending_incoming; 
+	// incoming calls relayed to other peers with ubus_forward_request()
+	struct list_head forwards; 
 
 	struct ubus_socket *socket; 
 
@@ -48,19 +55,93 @@ struct ubus_context {
 
 	char *name; // connection name for this context
 
+	// calls that each peer may have outstanding with us before it gets UBUS_STATUS_BUSY
+	uint32_t window; 
+	// bytes that may be queued for a peer before ubus_request_send_chunk() returns UBUS_STATUS_BUSY
+	size_t chunk_backlog; 
+
+	// replies of handlers running on an executor (lock free stack, pushed by workers)
+	struct ubus_request_event *completions; 
+	int handlers_running; 
+	struct list_head handlers; 
+
+	// requests sent from other threads (lock free stack, pushed by the sending threads)
+	struct ubus_request_event *submissions; 
+	// reply queues of all threads that have sent requests through this context
+	struct ubus_reply_queue *reply_queues; 
+	pthread_key_t reply_key; 
+	// thread that calls ubus_handle_events()
+	pthread_t event_thread; 
+	// eventfd in the wait set of ubus_wait_events(). Written when other threads have work for the event thread. 
+	int wake_fd; 
+
 	void *user_data; 
 };
 
 struct ubus_context *ubus_new(const char *name, struct ubus_object **root);
 void ubus_delete(struct ubus_context **self); 
+//! Path picks the transport (see ubus_socket.h). Prefix it with UBUS_SOCKET_SHM_PREFIX for shared memory. 
 int ubus_connect(struct ubus_context *self, const char *path, uint32_t *peer_id); 
 int ubus_listen(struct ubus_context *self, const char *path); 
+//! Serve connections of the transport that path asks for that are accepted elsewhere and handed over with ubus_adopt(). Path is not listened on.
+int ubus_serve(struct ubus_context *self, const char *path); 
+//! Hand a connection accepted elsewhere to a context that serves (see ubus_serve()). Any thread may call this. Takes the fd.
+int ubus_adopt(struct ubus_context *self, int fd); 
 
 int ubus_set_peer_localname(struct ubus_context *self, uint32_t peer, const char *localname); 
+/**
+Set how many calls every peer may have outstanding with us. The window is announced to all
+peers (and to every peer that connects later) with the ubus.peer.window signal. Peers queue
+further calls locally until replies free up credits. Calls from a peer that ignores the window
+are rejected with UBUS_STATUS_BUSY. 
+**/
+void ubus_set_peer_window(struct ubus_context *self, uint32_t window); 
+//! Set how many bytes may be queued for a peer before methods that stream chunks to it are held back (see ubus_request_send_chunk()). 
+void ubus_set_chunk_backlog(struct ubus_context *self, size_t bytes); 
 
 int ubus_send_request(struct ubus_context *self, struct ubus_request **req); 
+/**
+Send several requests at once. All requests that go to the same peer are packed into a single
+json-rpc batch (an array of calls) and the peer sends all replies back in one array as well.
+Callbacks of each request are called as usual. Takes ownership of all requests in reqs. 
+**/
+int ubus_send_request_batch(struct ubus_context *self, struct ubus_request **reqs, int count); 
+/**
+Relay an incoming call (req) to object and method on another peer. Unlike sending a new
+request this does not create a request for the relayed call: args are written straight into
+the outgoing message and the reply of the other peer resolves or rejects req as it arrives.
+Chunks are passed on as well. Must be called from the event thread. Returns -1 if the call can
+not go out right away (unknown peer or no flow control credits left) in which case the caller
+should fall back to ubus_send_request(). 
+**/
+int ubus_forward_request(struct ubus_context *self, struct ubus_request *req, const char *peer, const char *object, const char *method, struct blob_field *args); 
+/**
+Call a method and wait for the reply. Sleeps on the socket while waiting (other incoming
+calls and replies are still dispatched). The reply (or error) is copied into reply if it is
+not NULL. Timeout is in ms (0 for default). Returns UBUS_STATUS_OK on success, the status code
+sent by the other side if the call failed or UBUS_STATUS_TIMEOUT if no reply came in time.
+Called from a thread other than the event thread it sleeps on that thread's reply queue instead. 
+**/
+int ubus_call_sync(struct ubus_context *self, const char *peer, const char *object, const char *method, struct blob_field *args, int timeout, struct blob *reply); 
 //uint32_t ubus_add_object(struct ubus_context *self, struct ubus_object **obj); 
 int ubus_handle_events(struct ubus_context *self); 
+//! Sleep on the sockets until a message arrives or timeout (ms) runs out. Returns right away if requests from other threads or replies of handlers are waiting. 
+int ubus_wait_events(struct ubus_context *self, int timeout); 
+//! Make ubus_wait_events() return right away. Any thread may call this. 
+void ubus_wakeup(struct ubus_context *self); 
+
+/**
+Any thread may send requests through a context that another thread is handling events for.
+Requests sent from such a thread are handed to the event thread through a lock free queue and
+the replies are routed back to a queue that belongs to the sending thread. The callbacks of the
+request run on the sending thread when it calls ubus_process_replies(). ubus_call_sync() does
+all of this by itself. The event thread is the one that last called ubus_handle_events() (or
+the thread that created the context if it has not been called yet). 
+**/
+//! Run callbacks for replies to requests sent from the calling thread. Returns number of replies processed. 
+int ubus_process_replies(struct ubus_context *self); 
+//! Sleep until replies for the calling thread arrive or timeout (ms) runs out. Returns > 0 if there are replies. 
+int ubus_wait_replies(struct ubus_context *self, int timeout); 
 
 const char *ubus_status_to_string(int8_t status); 
 
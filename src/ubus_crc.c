@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+
+#include "ubus_crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC16_POLY 0x1021
+#define CRC32C_POLY 0x82F63B78 // reflected castagnoli polynomial
+
+static uint16_t _crc16_table[256]; 
+static uint32_t _crc32c_table[8][256]; 
+
+static uint32_t _crc32c_sw(uint32_t crc, const uint8_t *data, size_t length); 
+static uint32_t (*_crc32c_impl)(uint32_t crc, const uint8_t *data, size_t length) = _crc32c_sw; 
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_hw(uint32_t crc, const uint8_t *data, size_t length){
+	uint64_t c = crc; 
+	// align to 8 bytes so that the wide loop does not straddle cache lines
+	while(length && ((uintptr_t)data & 7)){
+		c = _mm_crc32_u8((uint32_t)c, *data++); 
+		length--; 
+	}
+	while(length >= 8){
+		uint64_t v; 
+		memcpy(&v, data, sizeof(v)); 
+		c = _mm_crc32_u64(c, v); 
+		data += 8; 
+		length -= 8; 
+	}
+	while(length--){
+		c = _mm_crc32_u8((uint32_t)c, *data++); 
+	}
+	return (uint32_t)c; 
+}
+#endif
+
+__attribute__((constructor))
+static void _ubus_crc_init(void){
+	for(int i = 0; i < 256; i++){
+		uint16_t c = i << 8; 
+		for(int j = 0; j < 8; j++)
+			c = (c & 0x8000)?((c << 1) ^ CRC16_POLY):(c << 1); 
+		_crc16_table[i] = c; 
+	}
+
+	for(int i = 0; i < 256; i++){
+		uint32_t c = i; 
+		for(int j = 0; j < 8; j++)
+			c = (c & 1)?((c >> 1) ^ CRC32C_POLY):(c >> 1); 
+		_crc32c_table[0][i] = c; 
+	}
+	for(int i = 0; i < 256; i++){
+		for(int k = 1; k < 8; k++){
+			uint32_t c = _crc32c_table[k - 1][i]; 
+			_crc32c_table[k][i] = (c >> 8) ^ _crc32c_table[0][c & 0xff]; 
+		}
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init(); 
+	if(__builtin_cpu_supports("sse4.2")) _crc32c_impl = _crc32c_hw; 
+#endif
+}
+
+uint16_t ubus_crc16(const void *data, size_t length){
+	const uint8_t *p = data; 
+	uint16_t crc = 0xFFFF; 
+	while(length--){
+		crc = (crc << 8) ^ _crc16_table[((crc >> 8) ^ *p++) & 0xff]; 
+	}
+	return crc; 
+}
+
+static uint32_t _crc32c_sw(uint32_t crc, const uint8_t *data, size_t length){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// slice-by-8: consume 8 bytes per iteration using 8 lookup tables
+	while(length >= 8){
+		uint64_t v; 
+		memcpy(&v, data, sizeof(v)); 
+		v ^= crc; 
+		crc = _crc32c_table[7][v & 0xff] ^
+			_crc32c_table[6][(v >> 8) & 0xff] ^
+			_crc32c_table[5][(v >> 16) & 0xff] ^
+			_crc32c_table[4][(v >> 24) & 0xff] ^
+			_crc32c_table[3][(v >> 32) & 0xff] ^
+			_crc32c_table[2][(v >> 40) & 0xff] ^
+			_crc32c_table[1][(v >> 48) & 0xff] ^
+			_crc32c_table[0][v >> 56]; 
+		data += 8; 
+		length -= 8; 
+	}
+#endif
+	while(length--){
+		crc = (crc >> 8) ^ _crc32c_table[0][(crc ^ *data++) & 0xff]; 
+	}
+	return crc; 
+}
+
+uint32_t ubus_crc32c(uint32_t crc, const void *data, size_t length){
+	return ~_crc32c_impl(~crc, data, length); 
+}
+
+uint32_t ubus_crc32c_sw(uint32_t crc, const void *data, size_t length){
+	return ~_crc32c_sw(~crc, data, length); 
+}
+
+uint32_t ubus_frame_checksum(enum ubus_frame_check type, const void *data, size_t length){
+	switch(type){
+		case UBUS_FRAME_CHECK_CRC16: return ubus_crc16(data, length); 
+		case UBUS_FRAME_CHECK_CRC32C: return ubus_crc32c(0, data, length); 
+		default:
+			break; 
+	}
+	return 0; 
+}
+
+const char *ubus_frame_check_name(enum ubus_frame_check type){
+	static const char *names[] = {
+		[UBUS_FRAME_CHECK_NONE] = "none",
+		[UBUS_FRAME_CHECK_CRC16] = "crc16",
+		[UBUS_FRAME_CHECK_CRC32C] = "crc32c"
+	}; 
+	if(type >= __UBUS_FRAME_CHECK_LAST) return "invalid"; 
+	return names[type]; 
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+Integrity check that is applied to the data portion of a binary frame. The type
+is carried in every frame header so that the receiving side can verify the frame
+with the same algorithm. The first frame of a connection fixes the check for the
+rest of it (see ubus_srv_blob.h).
+**/
+enum ubus_frame_check {
+	UBUS_FRAME_CHECK_NONE, 		// no check at all (only accepted on trusted local sockets)
+	UBUS_FRAME_CHECK_CRC16, 	// legacy ccitt crc16
+	UBUS_FRAME_CHECK_CRC32C, 	// castagnoli crc32 (sse4.2 when available, slice-by-8 otherwise)
+	__UBUS_FRAME_CHECK_LAST
+};
+
+uint16_t ubus_crc16(const void *data, size_t length);
+uint32_t ubus_crc32c(uint32_t crc, const void *data, size_t length);
+//! Portable slice-by-8 crc32c. ubus_crc32c() uses hardware instructions instead when the cpu has them.
+uint32_t ubus_crc32c_sw(uint32_t crc, const void *data, size_t length);
+
+//! Calculate checksum of a buffer using specified check type. Returns 0 for UBUS_FRAME_CHECK_NONE.
+uint32_t ubus_frame_checksum(enum ubus_frame_check type, const void *data, size_t length);
+
+const char *ubus_frame_check_name(enum ubus_frame_check type);
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ubus_executor.h"
+
+#define UBUS_EXECUTOR_QUEUE_MIN 64
+
+struct ubus_executor_worker {
+	struct ubus_executor *pool; 
+	pthread_t thread; 
+	int index; 
+	// task queue. Owner works at the tail, thieves take from the head.
+	pthread_mutex_t lock; 
+	struct ubus_executor_task **tasks; 
+	uint32_t head, tail, mask; 
+}; 
+
+struct ubus_executor {
+	struct ubus_executor_worker *workers; 
+	int count; 
+	uint32_t next; 			// round robin for tasks from outside of the pool
+	uint32_t queued; 		// tasks sitting in any of the queues
+	uint32_t sleeping; 		// workers waiting for work
+	bool stop; 
+	pthread_mutex_t sleep_lock; 
+	pthread_cond_t wake; 
+}; 
+
+// worker that the calling thread belongs to (if any)
+static __thread struct ubus_executor_worker *_current_worker = NULL; 
+
+static void _worker_push(struct ubus_executor_worker *self, struct ubus_executor_task *task){
+	pthread_mutex_lock(&self->lock); 
+	if(self->tail - self->head > self->mask){
+		// queue is full so we double it and unwrap the contents to the start
+		uint32_t size = (self->mask + 1) * 2; 
+		struct ubus_executor_task **tasks = calloc(size, sizeof(*tasks)); 
+		uint32_t count = self->tail - self->head; 
+		for(uint32_t c = 0; c < count; c++){
+			tasks[c] = self->tasks[(self->head + c) & self->mask]; 
+		}
+		free(self->tasks); 
+		self->tasks = tasks; 
+		self->head = 0; 
+		self->tail = count; 
+		self->mask = size - 1; 
+	}
+	self->tasks[self->tail++ & self->mask] = task; 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+// newest task first so that the data it works on is still in the cache
+static struct ubus_executor_task *_worker_pop(struct ubus_executor_worker *self){
+	struct ubus_executor_task *task = NULL; 
+	pthread_mutex_lock(&self->lock); 
+	if(self->tail != self->head) task = self->tasks[--self->tail & self->mask]; 
+	pthread_mutex_unlock(&self->lock); 
+	return task; 
+}
+
+// oldest task first so that the thief and the owner do not keep fighting over the same end
+static struct ubus_executor_task *_worker_steal(struct ubus_executor_worker *self){
+	struct ubus_executor_task *task = NULL; 
+	pthread_mutex_lock(&self->lock); 
+	if(self->tail != self->head) task = self->tasks[self->head++ & self->mask]; 
+	pthread_mutex_unlock(&self->lock); 
+	return task; 
+}
+
+static struct ubus_executor_task *_worker_find_task(struct ubus_executor_worker *self){
+	struct ubus_executor *pool = self->pool; 
+	struct ubus_executor_task *task = _worker_pop(self); 
+	for(int c = 1; !task && c < pool->count; c++){
+		task = _worker_steal(&pool->workers[(self->index + c) % pool->count]); 
+	}
+	if(task) __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST); 
+	return task; 
+}
+
+static void *_worker_thread(void *ptr){
+	struct ubus_executor_worker *self = (struct ubus_executor_worker*)ptr; 
+	struct ubus_executor *pool = self->pool; 
+	_current_worker = self; 
+
+	while(true){
+		struct ubus_executor_task *task = _worker_find_task(self); 
+		if(task){
+			task->run(task); 
+			continue; 
+		}
+
+		pthread_mutex_lock(&pool->sleep_lock); 
+		// submitters check the sleeping count after queueing so one of us always sees the other
+		__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST); 
+		if(!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) && !pool->stop){
+			pthread_cond_wait(&pool->wake, &pool->sleep_lock); 
+		}
+		__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST); 
+		bool stop = pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST); 
+		pthread_mutex_unlock(&pool->sleep_lock); 
+		if(stop) break; 
+	}
+	return NULL; 
+}
+
+struct ubus_executor *ubus_executor_new(int threads){
+	if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN); 
+	if(threads <= 0) threads = 1; 
+
+	struct ubus_executor *self = calloc(1, sizeof(struct ubus_executor)); 
+	self->count = threads; 
+	self->workers = calloc(threads, sizeof(struct ubus_executor_worker)); 
+	pthread_mutex_init(&self->sleep_lock, NULL); 
+	pthread_cond_init(&self->wake, NULL); 
+	for(int c = 0; c < threads; c++){
+		struct ubus_executor_worker *w = &self->workers[c]; 
+		w->pool = self; 
+		w->index = c; 
+		pthread_mutex_init(&w->lock, NULL); 
+		w->tasks = calloc(UBUS_EXECUTOR_QUEUE_MIN, sizeof(*w->tasks)); 
+		w->mask = UBUS_EXECUTOR_QUEUE_MIN - 1; 
+	}
+	// all queues have to exist before the first worker starts stealing
+	for(int c = 0; c < threads; c++){
+		pthread_create(&self->workers[c].thread, NULL, _worker_thread, &self->workers[c]); 
+	}
+	return self; 
+}
+
+void ubus_executor_delete(struct ubus_executor **_self){
+	struct ubus_executor *self = *_self; 
+	pthread_mutex_lock(&self->sleep_lock); 
+	self->stop = true; 
+	pthread_cond_broadcast(&self->wake); 
+	pthread_mutex_unlock(&self->sleep_lock); 
+	for(int c = 0; c < self->count; c++){
+		pthread_join(self->workers[c].thread, NULL); 
+	}
+	for(int c = 0; c < self->count; c++){
+		pthread_mutex_destroy(&self->workers[c].lock); 
+		free(self->workers[c].tasks); 
+	}
+	pthread_mutex_destroy(&self->sleep_lock); 
+	pthread_cond_destroy(&self->wake); 
+	free(self->workers); 
+	free(self); 
+	*_self = NULL;
+}
+
+int ubus_executor_submit(struct ubus_executor *self, struct ubus_executor_task *task){
+	struct ubus_executor_worker *w = _current_worker; 
+	if(!w || w->pool != self){
+		w = &self->workers[__atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED) % self->count]; 
+	}
+	// counted before it is visible so that the count never drops below zero when a worker is quick to take it
+	__atomic_add_fetch(&self->queued, 1, __ATOMIC_SEQ_CST); 
+	_worker_push(w, task); 
+	if(__atomic_load_n(&self->sleeping, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&self->sleep_lock); 
+		pthread_cond_signal(&self->wake); 
+		pthread_mutex_unlock(&self->sleep_lock); 
+	}
+	return 0; 
+}
+
+int ubus_executor_size(struct ubus_executor *self){
+	return self->count; 
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+Thread pool used to run method handlers off the thread that handles events.
+
+Every worker has its own queue of tasks. Workers take new work from the back of their own
+queue and when that is empty they steal from the front of the queue of another worker, so a
+burst of calls is spread over all cores without one shared queue that every thread fights
+over. Tasks submitted from a worker (for example a handler that splits up its work) go to
+that worker's own queue. Tasks submitted from any other thread are spread round robin.
+
+A task is embedded into whatever object it belongs to and gets back to it with
+container_of() in its run callback. The executor never frees tasks.
+**/
+
+struct ubus_executor; 
+struct ubus_executor_task; 
+
+typedef void (*ubus_executor_fn_t)(struct ubus_executor_task *task); 
+
+struct ubus_executor_task {
+	ubus_executor_fn_t run; 
+}; 
+
+static inline void ubus_executor_task_init(struct ubus_executor_task *self, ubus_executor_fn_t run){
+	self->run = run; 
+}
+
+//! Start a pool with the given number of worker threads. Zero uses one thread for every online cpu.
+struct ubus_executor *ubus_executor_new(int threads); 
+//! Run all tasks that are still queued, then stop and join all workers.
+void ubus_executor_delete(struct ubus_executor **self); 
+
+//! Queue a task. It will be run exactly once on one of the workers.
+int ubus_executor_submit(struct ubus_executor *self, struct ubus_executor_task *task); 
+
+//! Number of worker threads in the pool
+int ubus_executor_size(struct ubus_executor *self); 
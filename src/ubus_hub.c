@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <libutype/avl-cmp.h>
+#include <libusys/usock.h>
+
+#include "ubus_context.h"
+#include "ubus_socket.h"
+#include "internal.h"
+#include "ubus_cache.h"
+#include "ubus_hub.h"
+
+// object published by a peer of one of the shards
+struct ubus_hub_entry {
+	struct avl_node avl; 
+	int shard; // shard that owns the peer that published the object
+	const char *client; // interned
+	const char *object_name; // interned
+	struct ubus_object *object; 
+}; 
+
+static void _ubus_hub_entry_delete(struct ubus_hub_entry **_self){
+	struct ubus_hub_entry *self = *_self; 
+	ubus_intern_release(self->client); 
+	ubus_intern_release(self->object_name); 
+	ubus_object_delete(&self->object); 
+	free(self); 
+	*_self = NULL;
+}
+
+static void _on_hub_forward_resolve(struct ubus_request *req, struct blob_field *res){
+	ubus_request_resolve((struct ubus_request*)ubus_request_get_userdata(req), res); 
+}
+
+static void _on_hub_forward_reject(struct ubus_request *req, struct blob_field *res){
+	ubus_request_reject((struct ubus_request*)ubus_request_get_userdata(req), res); 
+}
+
+static void _on_hub_forward_chunk(struct ubus_request *req, struct blob_field *res){
+	ubus_request_forward_chunk((struct ubus_request*)ubus_request_get_userdata(req), res); 
+}
+
+/**
+Call relayed on behalf of one or more incoming requests. While it is in flight every identical
+call (same object, method and arguments) that comes in on the same shard is attached to it
+instead of going out again, and all of them are answered from its one reply. Flights live on the
+shard that created them and are only touched by its thread since the replies of relayed calls are
+always picked up by the shard that sent them. 
+**/
+struct ubus_hub_flight_key {
+	uint64_t hash; 
+	const char *object; // interned
+	const char *method; // interned
+	struct blob_field *args; // compared byte for byte when the hashes are the same
+}; 
+
+struct ubus_hub_flight {
+	struct avl_node avl; 
+	struct ubus_hub_flight_key key; 
+	struct ubus_hub_shard *shard; 
+	// set if the reply goes into the cache
+	struct ubus_cache *cache; 
+	struct ubus_request **reqs; 
+	int count, size; 
+	bool attached; // still in the flights of the shard so that new calls can join
+	// a reply that came in chunks can not be replayed from the cache
+	bool chunked; 
+}; 
+
+static int _ubus_hub_flight_cmp(const void *k1, const void *k2, void *ptr){
+	const struct ubus_hub_flight_key *a = k1, *b = k2; 
+	if(a->hash != b->hash) return (a->hash < b->hash)?-1:1; 
+	int ret = strcmp(a->object, b->object); 
+	if(ret) return ret; 
+	if((ret = strcmp(a->method, b->method))) return ret; 
+	if(!a->args || !b->args) return (a->args != NULL) - (b->args != NULL); 
+	uint32_t alen = blob_field_raw_len(a->args), blen = blob_field_raw_len(b->args); 
+	if(alen != blen) return (alen < blen)?-1:1; 
+	return memcmp(a->args, b->args, alen); 
+}
+
+static void _ubus_hub_flight_join(struct ubus_hub_flight *self, struct ubus_request *req){
+	if(self->count == self->size){
+		self->size = (self->size)?self->size * 2:4; 
+		self->reqs = realloc(self->reqs, sizeof(*self->reqs) * self->size); 
+	}
+	self->reqs[self->count++] = req; 
+}
+
+static struct ubus_hub_flight *_ubus_hub_flight_new(struct ubus_hub_shard *shard, struct ubus_request *req, struct ubus_cache *cache, const char *object, const char *method, uint64_t hash, struct blob_field *args){
+	struct ubus_hub_flight *self = calloc(1, sizeof(struct ubus_hub_flight)); 
+	self->shard = shard; 
+	self->cache = cache; 
+	self->key.args = ubus_cache_args_dup(args); 
+	self->key.hash = hash; 
+	self->key.object = ubus_intern(object); 
+	self->key.method = ubus_intern_ref(method); 
+	self->avl.key = &self->key; 
+	_ubus_hub_flight_join(self, req); 
+	self->attached = avl_insert(&shard->flights, &self->avl) == 0; 
+	return self; 
+}
+
+static void _ubus_hub_flight_detach(struct ubus_hub_flight *self){
+	if(!self->attached) return; 
+	avl_delete(&self->shard->flights, &self->avl); 
+	self->attached = false; 
+}
+
+static void _ubus_hub_flight_delete(struct ubus_hub_flight **_self){
+	struct ubus_hub_flight *self = *_self; 
+	_ubus_hub_flight_detach(self); 
+	ubus_intern_release(self->key.object); 
+	ubus_intern_release(self->key.method); 
+	free(self->key.args); 
+	free(self->reqs); 
+	free(self); 
+	*_self = NULL; 
+}
+
+static struct ubus_hub_flight *_ubus_hub_find_flight(struct ubus_hub_shard *shard, const char *object, const char *method, uint64_t hash, struct blob_field *args){
+	struct ubus_hub_flight_key key = { .hash = hash, .object = object, .method = method, .args = args }; 
+	struct avl_node *avl = avl_find(&shard->flights, &key); 
+	if(!avl) return NULL; 
+	return container_of(avl, struct ubus_hub_flight, avl); 
+}
+
+static void _on_hub_flight_resolve(struct ubus_request *req, struct blob_field *res){
+	struct ubus_hub_flight *flight = (struct ubus_hub_flight*)ubus_request_get_userdata(req); 
+	_ubus_hub_flight_detach(flight); 
+	if(flight->cache && !flight->chunked) ubus_cache_put(flight->cache, flight->key.object, flight->key.method, flight->key.hash, flight->key.args, res); 
+	for(int c = 0; c < flight->count; c++) ubus_request_resolve(flight->reqs[c], res); 
+	_ubus_hub_flight_delete(&flight); 
+}
+
+static void _on_hub_flight_reject(struct ubus_request *req, struct blob_field *res){
+	struct ubus_hub_flight *flight = (struct ubus_hub_flight*)ubus_request_get_userdata(req); 
+	_ubus_hub_flight_detach(flight); 
+	for(int c = 0; c < flight->count; c++) ubus_request_reject(flight->reqs[c], res); 
+	_ubus_hub_flight_delete(&flight); 
+}
+
+static void _on_hub_flight_chunk(struct ubus_request *req, struct blob_field *res){
+	struct ubus_hub_flight *flight = (struct ubus_hub_flight*)ubus_request_get_userdata(req); 
+	// calls that join now would miss the chunks that have already gone out
+	_ubus_hub_flight_detach(flight); 
+	flight->chunked = true; 
+	for(int c = 0; c < flight->count; c++) ubus_request_forward_chunk(flight->reqs[c], res); 
+}
+
+// methods of published objects are only used for their signature. Calls are dispatched in _on_hub_call.
+static int _on_hub_method(struct ubus_method *m, struct ubus_context *ctx, struct ubus_object *obj, struct ubus_request *req, struct blob_field *msg){
+	return UBUS_STATUS_NOT_SUPPORTED; 
+}
+
+static int _on_hub_call(struct ubus_method *_method, struct ubus_context *ctx, struct ubus_object *_obj, struct ubus_request *req, struct blob_field *msg){
+	struct ubus_hub_shard *shard = (struct ubus_hub_shard*)ubus_get_userdata(ctx); 
+	struct ubus_hub *self = shard->hub; 
+
+	// arg 0: object path
+	// arg 1: method name
+	// arg 2: arguments
+	struct blob_field *attr = blob_field_first_child(msg); 
+	const char *object = blob_field_get_string(attr); 
+	attr = blob_field_next_child(msg, attr); 
+	const char *method = blob_field_get_string(attr); 
+	attr = blob_field_next_child(msg, attr); 
+	if(!object || !method) return UBUS_STATUS_INVALID_ARGUMENT; 
+
+	// reads that the cache has a rule for are answered without going to the peer at all
+	bool cached = self->cache && ubus_cache_ttl(self->cache, object, method) > 0; 
+	// and they are always safe to share with identical calls that are already in flight
+	bool shared = cached || self->coalesce; 
+	uint64_t hash = 0; 
+	if(shared) hash = ubus_cache_hash(attr); 
+	struct blob_field *hit = (cached)?ubus_cache_get(self->cache, object, method, hash, attr, &shard->buf):NULL; 
+	if(hit){
+		ubus_request_resolve(req, hit); 
+		return 0; 
+	}
+
+	pthread_rwlock_rdlock(&self->lock); 
+	struct avl_node *avl = avl_find(&self->objects, object); 
+	if(!avl){
+		pthread_rwlock_unlock(&self->lock); 
+		return UBUS_STATUS_NOT_FOUND; 
+	}
+	struct ubus_hub_entry *entry = container_of(avl, struct ubus_hub_entry, avl); 
+	struct ubus_method *m = ubus_object_find_method(entry->object, method); 
+	if(!m){
+		pthread_rwlock_unlock(&self->lock); 
+		return UBUS_STATUS_METHOD_NOT_FOUND; 
+	}
+	// the peer would only reject it. Replies in the cache went to the same arguments, which were checked here before. 
+	if(!ubus_method_validate(m, attr)){
+		pthread_rwlock_unlock(&self->lock); 
+		return UBUS_STATUS_INVALID_ARGUMENT; 
+	}
+	// only a call that would go out itself may wait for the reply of an identical one
+	if(shared){
+		struct ubus_hub_flight *flight = _ubus_hub_find_flight(shard, object, method, hash, attr); 
+		if(flight){
+			pthread_rwlock_unlock(&self->lock); 
+			_ubus_hub_flight_join(flight, req); 
+			return 0; 
+		}
+	}
+	// the entry may be replaced as soon as we let go of the lock so we keep our own references
+	struct ubus_hub_shard *owner = &self->shards[entry->shard]; 
+	const char *client = ubus_intern_ref(entry->client); 
+	const char *object_name = ubus_intern_ref(entry->object_name); 
+	const char *method_name = ubus_intern_ref(m->name); 
+	pthread_rwlock_unlock(&self->lock); 
+
+	// peer is ours so the arguments go out as they are. Replies that are shared have to come back to us first. 
+	if(shared || owner != shard || ubus_forward_request(ctx, req, client, object_name, method_name, attr) != 0){
+		// to a peer of another shard this goes through the request queue of that shard and the
+		// reply comes back on the reply queue that we have there (picked up in _ubus_hub_thread)
+		struct ubus_request *r = ubus_request_new_interned(client, object_name, method_name, attr); 
+		if(shared){
+			ubus_request_on_resolve(r, &_on_hub_flight_resolve); 
+			ubus_request_on_reject(r, &_on_hub_flight_reject); 
+			ubus_request_on_chunk(r, &_on_hub_flight_chunk); 
+			ubus_request_set_userdata(r, _ubus_hub_flight_new(shard, req, (cached)?self->cache:NULL, object, method_name, hash, attr)); 
+		} else {
+			ubus_request_on_resolve(r, &_on_hub_forward_resolve); 
+			ubus_request_on_reject(r, &_on_hub_forward_reject); 
+			ubus_request_on_chunk(r, &_on_hub_forward_chunk); 
+			ubus_request_set_userdata(r, req); 
+		}
+		ubus_request_set_priority(r, req->priority); 
+		ubus_send_request(owner->ctx, &r); 
+	}
+
+	ubus_intern_release(client); 
+	ubus_intern_release(object_name); 
+	ubus_intern_release(method_name); 
+	return 0; 
+}
+
+static int _on_hub_nick(struct ubus_method *_method, struct ubus_context *ctx, struct ubus_object *_obj, struct ubus_request *req, struct blob_field *msg){
+	// arg 0: nick
+	struct blob_field *attr = blob_field_first_child(msg); 
+	ubus_set_peer_localname(ctx, req->src_id, blob_field_get_string(attr)); 
+	ubus_request_resolve(req, NULL); 
+	return 0; 
+}
+
+static int _on_hub_list(struct ubus_method *m, struct ubus_context *ctx, struct ubus_object *_obj, struct ubus_request *req, struct blob_field *msg){
+	struct ubus_hub *self = ((struct ubus_hub_shard*)ubus_get_userdata(ctx))->hub; 
+	struct blob buf; 
+	blob_init(&buf, 0, 0); 
+
+	struct ubus_hub_entry *entry; 
+	blob_offset_t tbl = blob_open_table(&buf); 
+	pthread_rwlock_rdlock(&self->lock); 
+	avl_for_each_element(&self->objects, entry, avl){
+		blob_put_string(&buf, entry->object->name); 
+		ubus_object_serialize(entry->object, &buf); 
+	}
+	pthread_rwlock_unlock(&self->lock); 
+	blob_close_table(&buf, tbl); 
+
+	ubus_request_resolve(req, blob_head(&buf)); 
+	blob_free(&buf); 
+	return 0; 
+}
+
+static int _on_hub_publish(struct ubus_method *m, struct ubus_context *ctx, struct ubus_object *_obj, struct ubus_request *req, struct blob_field *msg){
+	struct ubus_hub_shard *shard = (struct ubus_hub_shard*)ubus_get_userdata(ctx); 
+	struct ubus_hub *self = shard->hub; 
+	char path[255]; 
+	struct blob_field *params[3]; 
+
+	msg = blob_field_first_child(msg); 
+	if(!blob_field_parse(msg, "s{sa}", params, 2)) {
+		return UBUS_STATUS_INVALID_ARGUMENT; 
+	}
+	const char *objname = blob_field_get_string(params[0]); 
+	snprintf(path, sizeof(path), "%s.%s", req->dst_name, objname); 
+
+	// the object is built before taking the lock so calls on other shards are not held up by it
+	struct ubus_object *obj = ubus_object_new(path); 
+	struct blob_field *mname, *margs; 
+	blob_field_for_each_kv(params[1], mname, margs){
+		struct ubus_method *method = ubus_method_new(blob_field_get_string(mname), _on_hub_method); 
+		struct blob_field *arg, *fields[3]; 
+		// add each argument again so that calls are checked here already before they are forwarded
+		blob_field_for_each_child(margs, arg){
+			if(!blob_field_parse(arg, "iss", fields, 3)) continue; 
+			switch(blob_field_get_int(fields[0])){
+				case UBUS_METHOD_PARAM_IN: ubus_method_add_param(method, blob_field_get_string(fields[1]), blob_field_get_string(fields[2])); break; 
+				case UBUS_METHOD_PARAM_OUT: ubus_method_add_return(method, blob_field_get_string(fields[1]), blob_field_get_string(fields[2])); break; 
+			}
+		}
+		ubus_object_add_method(obj, &method); 
+	}
+
+	struct ubus_hub_entry *entry = calloc(1, sizeof(struct ubus_hub_entry)); 
+	entry->shard = shard->index; 
+	entry->client = ubus_intern_ref(req->dst_name); 
+	entry->object_name = ubus_intern(objname); 
+	entry->object = obj; 
+	entry->avl.key = obj->name; 
+
+	// a peer that publishes again (for example after it reconnected to another shard) replaces its old entry
+	struct ubus_hub_entry *old = NULL; 
+	pthread_rwlock_wrlock(&self->lock); 
+	struct avl_node *avl = avl_find(&self->objects, obj->name); 
+	if(avl){
+		old = container_of(avl, struct ubus_hub_entry, avl); 
+		avl_delete(&self->objects, &old->avl); 
+	}
+	avl_insert(&self->objects, &entry->avl); 
+	pthread_rwlock_unlock(&self->lock); 
+
+	if(old) _ubus_hub_entry_delete(&old); 
+
+	ubus_request_resolve(req, NULL); 
+	return 0; 
+}
+
+static void *_ubus_hub_thread(void *ptr){
+	struct ubus_hub_shard *self = (struct ubus_hub_shard*)ptr; 
+	struct ubus_hub *hub = self->hub; 
+
+	while(!__atomic_load_n(&hub->shutdown, __ATOMIC_RELAXED)){
+		ubus_handle_events(self->ctx); 
+		// replies to calls that we have handed to other shards
+		int replies = 0; 
+		for(int c = 0; c < hub->count; c++){
+			if(c != self->index) replies += ubus_process_replies(hub->shards[c].ctx); 
+		}
+		if(!replies) ubus_wait_events(self->ctx, UBUS_HUB_IDLE_WAIT); 
+	}
+	return NULL; 
+}
+
+// hand every connection waiting on a listening socket to the next shard
+static void _ubus_hub_accept(struct ubus_hub *self, int listen_fd){
+	int fd; 
+	while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		struct ubus_hub_shard *shard = &self->shards[self->next_shard]; 
+		self->next_shard = (self->next_shard + 1) % self->count; 
+		if(ubus_adopt(shard->ctx, fd) < 0) fprintf(stderr, "hub: shard %d could not take a connection\n", shard->index); 
+	}
+}
+
+static void *_ubus_hub_acceptor(void *ptr){
+	struct ubus_hub *self = (struct ubus_hub*)ptr; 
+	int count = self->nlisteners + 1; 
+	struct pollfd *pfd = alloca(sizeof(struct pollfd) * count); 
+	for(int c = 0; c < self->nlisteners; c++){
+		pfd[c] = (struct pollfd){ .fd = self->listeners[c], .events = POLLIN }; 
+	}
+	pfd[count - 1] = (struct pollfd){ .fd = self->wake_fd, .events = POLLIN }; 
+
+	while(!__atomic_load_n(&self->shutdown, __ATOMIC_RELAXED)){
+		if(poll(pfd, count, -1) <= 0) continue; 
+		for(int c = 0; c < self->nlisteners; c++){
+			if(pfd[c].revents & POLLIN) _ubus_hub_accept(self, self->listeners[c]); 
+		}
+	}
+	return NULL; 
+}
+
+// open a listening socket on path the way the transport that path asks for would
+static int _ubus_hub_open_listener(const char *path, bool shm){
+	if(shm){
+		path += strlen(UBUS_SOCKET_SHM_PREFIX); 
+		umask(0177); 
+		unlink(path); 
+		return usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, path, NULL); 
+	}
+	char proto[NAME_MAX], host[NAME_MAX], file[NAME_MAX], service[16]; 
+	int port = 5303; 
+	if(!url_scanf(path, proto, host, &port, file)){
+		fprintf(stderr, "Could not parse url: %s\n", path); 
+		return -1; 
+	}
+	snprintf(service, sizeof(service), "%d", port); 
+	return usock(USOCK_TCP | USOCK_SERVER | USOCK_NONBLOCK, NULL, service); 
+}
+
+struct ubus_hub *ubus_hub_new(const char *name, int shards){
+	if(shards <= 0) shards = sysconf(_SC_NPROCESSORS_ONLN); 
+	if(shards <= 0) shards = 1; 
+
+	struct ubus_hub *self = calloc(1, sizeof(struct ubus_hub)); 
+	pthread_rwlock_init(&self->lock, NULL); 
+	avl_init(&self->objects, avl_strcmp, false, NULL); 
+	self->count = shards; 
+	self->shards = calloc(shards, sizeof(struct ubus_hub_shard)); 
+	self->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+
+	for(int c = 0; c < shards; c++){
+		struct ubus_hub_shard *shard = &self->shards[c]; 
+		shard->hub = self; 
+		shard->index = c; 
+		blob_init(&shard->buf, 0, 0); 
+		avl_init(&shard->flights, _ubus_hub_flight_cmp, false, NULL); 
+
+		struct ubus_object *obj = ubus_object_new("root"); 
+		struct ubus_method *method = ubus_method_new("publish", _on_hub_publish); 
+		ubus_method_add_param(method, "name", "s"); 
+		ubus_method_add_param(method, "signature", "{sa}"); 
+		ubus_object_add_method(obj, &method); 
+
+		method = ubus_method_new("call", _on_hub_call); 
+		ubus_object_add_method(obj, &method); 
+
+		method = ubus_method_new("nick", _on_hub_nick); 
+		ubus_object_add_method(obj, &method); 
+
+		method = ubus_method_new("list", _on_hub_list); 
+		ubus_object_add_method(obj, &method); 
+		ubus_object_set_userdata(obj, shard); 
+
+		shard->ctx = ubus_new(name, &obj); 
+		ubus_set_userdata(shard->ctx, shard); 
+	}
+	return self; 
+}
+
+void ubus_hub_delete(struct ubus_hub **_self){
+	struct ubus_hub *self = *_self; 
+	__atomic_store_n(&self->shutdown, true, __ATOMIC_RELAXED); 
+	if(self->running && self->nlisteners){
+		uint64_t one = 1; 
+		if(write(self->wake_fd, &one, sizeof(one)) < 0){
+			// can only fail if the counter is full in which case the acceptor is awake anyway
+		}
+		pthread_join(self->acceptor, NULL); 
+	}
+	for(int c = 0; c < self->nlisteners; c++) close(self->listeners[c]); 
+	free(self->listeners); 
+	close(self->wake_fd); 
+	for(int c = 0; self->running && c < self->count; c++){
+		ubus_wakeup(self->shards[c].ctx); 
+		pthread_join(self->shards[c].thread, NULL); 
+	}
+	// requests that shards have sent to each other point into contexts so all of them have to be stopped first
+	for(int c = 0; c < self->count; c++){
+		ubus_delete(&self->shards[c].ctx); 
+		blob_free(&self->shards[c].buf); 
+		// their requests went away with the context
+		struct ubus_hub_flight *flight, *ftmp; 
+		avl_for_each_element_safe(&self->shards[c].flights, flight, avl, ftmp){
+			_ubus_hub_flight_delete(&flight); 
+		}
+	}
+	struct ubus_hub_entry *entry, *tmp; 
+	avl_for_each_element_safe(&self->objects, entry, avl, tmp){
+		avl_delete(&self->objects, &entry->avl); 
+		_ubus_hub_entry_delete(&entry); 
+	}
+	pthread_rwlock_destroy(&self->lock); 
+	free(self->shards); 
+	free(self); 
+	*_self = NULL;
+}
+
+int ubus_hub_listen(struct ubus_hub *self, const char *path){
+	assert(!self->running); 
+	bool shm = strncmp(path, UBUS_SOCKET_SHM_PREFIX, strlen(UBUS_SOCKET_SHM_PREFIX)) == 0; 
+	// every shard only serves one transport
+	if(self->nlisteners && shm != self->shm) return -1; 
+	int *listeners = realloc(self->listeners, sizeof(int) * (self->nlisteners + 1)); 
+	if(!listeners) return -1; 
+	self->listeners = listeners; 
+	int fd = _ubus_hub_open_listener(path, shm); 
+	if(fd < 0) return -1; 
+	for(int c = 0; !self->nlisteners && c < self->count; c++){
+		if(ubus_serve(self->shards[c].ctx, path) < 0){
+			close(fd); 
+			return -1; 
+		}
+	}
+	self->shm = shm; 
+	self->listeners[self->nlisteners++] = fd; 
+	return 0; 
+}
+
+int ubus_hub_start(struct ubus_hub *self){
+	if(self->running) return 0; 
+	for(int c = 0; c < self->count; c++){
+		if(pthread_create(&self->shards[c].thread, NULL, _ubus_hub_thread, &self->shards[c]) != 0){
+			// stop the ones that did start
+			__atomic_store_n(&self->shutdown, true, __ATOMIC_RELAXED); 
+			for(int j = 0; j < c; j++){
+				ubus_wakeup(self->shards[j].ctx); 
+				pthread_join(self->shards[j].thread, NULL); 
+			}
+			return -1; 
+		}
+	}
+	// shards are running so they can take connections right away
+	if(self->nlisteners && pthread_create(&self->acceptor, NULL, _ubus_hub_acceptor, self) != 0){
+		__atomic_store_n(&self->shutdown, true, __ATOMIC_RELAXED); 
+		for(int c = 0; c < self->count; c++){
+			ubus_wakeup(self->shards[c].ctx); 
+			pthread_join(self->shards[c].thread, NULL); 
+		}
+		return -1; 
+	}
+	self->running = true; 
+	return 0; 
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <libutype/avl.h>
+#include <blobpack/blobpack.h>
+
+/**
+Hub that spreads its peers over several threads (shards) instead of running everything on one
+context.
+
+Every shard has its own context and thread and owns the peers that connected to it. Objects a
+peer publishes are entered into the directory of the hub with the shard of that peer as their
+owner. The directory is shared by all shards and behind a read/write lock so looking up an
+object on every call never waits for other calls, only for publishing.
+
+A call for an object owned by the shard that received it is relayed to the publishing peer
+right there. A call for an object owned by another shard is handed to that shard through the
+lock free request queue of its context and the reply comes back through the reply queue that
+the calling shard has on that context (see ubus_process_replies()). So shards never take a lock
+to talk to each other.
+
+The hub opens the listening socket of every path itself and accepts on it on a thread of its
+own. Each new connection is handed to the next shard in turn (see ubus_adopt()), so websocket
+and shared memory listeners are spread over the shards the same way. All paths of a hub have to
+ask for the same transport since the context of a shard only wraps one.
+**/
+
+// longest time in ms that an idle shard sleeps. Traffic, calls and replies from other shards and
+// shutdown all wake it up right away, so this is only a safety net. 
+#define UBUS_HUB_IDLE_WAIT 1000
+
+struct ubus_context; 
+struct ubus_hub; 
+struct ubus_cache; 
+
+struct ubus_hub_shard {
+	struct ubus_hub *hub; 
+	struct ubus_context *ctx; 
+	pthread_t thread; 
+	int index; 
+	// replies taken from the cache
+	struct blob buf; 
+	// relayed calls that identical calls can still join
+	struct avl_tree flights; 
+}; 
+
+struct ubus_hub {
+	struct ubus_hub_shard *shards; 
+	int count; 
+
+	// published objects of all shards by path
+	pthread_rwlock_t lock; 
+	struct avl_tree objects; 
+
+	// replies of read only methods (see ubus_hub_set_cache())
+	struct ubus_cache *cache; 
+	// share relayed calls between identical calls (see ubus_hub_set_coalesce())
+	bool coalesce; 
+
+	// listening sockets of all paths. Connections accepted on them are handed to the shards in turn. 
+	int *listeners; 
+	int nlisteners; 
+	bool shm; // transport the shards serve
+	int next_shard; 
+	pthread_t acceptor; 
+	int wake_fd; // wakes the acceptor for shutdown
+
+	bool running; 
+	bool shutdown; 
+}; 
+
+//! Create a hub with the given number of shards. Zero uses one shard for every online cpu.
+struct ubus_hub *ubus_hub_new(const char *name, int shards); 
+//! Stop and join all shards and free the hub
+void ubus_hub_delete(struct ubus_hub **self); 
+
+//! Listen on path. Must be called before ubus_hub_start(). Returns -1 if path asks for another transport than an earlier one.
+int ubus_hub_listen(struct ubus_hub *self, const char *path); 
+//! Start the thread of every shard
+int ubus_hub_start(struct ubus_hub *self); 
+
+//! Answer calls that the cache has rules for from the cache. Calls that miss fill it in once they are resolved. The hub does not take ownership of the cache.
+static inline void ubus_hub_set_cache(struct ubus_hub *self, struct ubus_cache *cache){ self->cache = cache; }
+
+/**
+Attach calls to an identical call (same object, method and arguments) that is already on its way
+to the peer instead of sending them again. All of them get the reply of the one call. This is
+always done for calls that the cache has a rule for. Turning it on for all calls is only right
+if no method changes anything when it is called more than once with the same arguments. 
+**/
+static inline void ubus_hub_set_coalesce(struct ubus_hub *self, bool on){ self->coalesce = on; }
+
+static inline int ubus_hub_shard_count(struct ubus_hub *self){ return self->count; }
@@ -11,17 +11,110 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include <libutype/avl-cmp.h>
 
 //#include "ubusmsg.h"
 #include "libubus2.h"
 #include "ubus_id.h"
 
-static int random_fd = -1;
+/*
+ * Ids are drawn from a per thread xoshiro128** generator. It is seeded from the
+ * kernel and reseeded every UBUS_ID_RESEED_INTERVAL ids and after fork() so that
+ * allocating an id normally costs no system call at all.
+ */
+#define UBUS_ID_RESEED_INTERVAL (1 << 16)
+
+struct ubus_id_rng {
+	uint32_t s[4];
+	uint32_t left;
+	unsigned int generation;
+};
+
+static __thread struct ubus_id_rng id_rng;
+// bumped in the child after fork() so that every thread state gets reseeded there
+static unsigned int id_rng_generation = 1;
+
+static void ubus_id_rng_atfork_child(void)
+{
+	__atomic_add_fetch(&id_rng_generation, 1, __ATOMIC_RELAXED);
+}
+
+__attribute__((constructor))
+static void ubus_id_rng_init(void)
+{
+	pthread_atfork(NULL, NULL, ubus_id_rng_atfork_child);
+}
+
+static bool ubus_id_rng_seed(struct ubus_id_rng *rng)
+{
+	size_t got = 0;
+
+#ifdef SYS_getrandom
+	while (got < sizeof(rng->s)) {
+		long rc = syscall(SYS_getrandom, (char *)rng->s + got, sizeof(rng->s) - got, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		got += rc;
+	}
+#endif
+	if (got < sizeof(rng->s)) {
+		// kernel without getrandom()
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		got = read(fd, rng->s, sizeof(rng->s));
+		close(fd);
+		if (got != sizeof(rng->s))
+			return false;
+	}
+
+	// all zero state would only ever produce zeros
+	if (!(rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]))
+		rng->s[0] = 1;
+
+	rng->left = UBUS_ID_RESEED_INTERVAL;
+	rng->generation = __atomic_load_n(&id_rng_generation, __ATOMIC_RELAXED);
+	return true;
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+static bool ubus_id_rng_next(uint32_t *out)
+{
+	struct ubus_id_rng *rng = &id_rng;
+	uint32_t *s = rng->s;
+
+	// child processes must not hand out the same ids as their parent
+	if (!rng->left || rng->generation != __atomic_load_n(&id_rng_generation, __ATOMIC_RELAXED)) {
+		if (!ubus_id_rng_seed(rng))
+			return false;
+	}
+	rng->left--;
+
+	*out = rotl(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+	return true;
+}
 
 static int ubus_cmp_id(const void *k1, const void *k2, void *ptr){
 	const uint32_t *id1 = k1, *id2 = k2;
@@ -38,14 +131,6 @@ void ubus_id_string_tree_init(struct avl_tree *tree, bool dup)
 }
 
 void ubus_id_tree_init(struct avl_tree *tree){
-	if (random_fd < 0) {
-		random_fd = open("/dev/urandom", O_RDONLY);
-		if (random_fd < 0) {
-			perror("open");
-			exit(1);
-		}
-	}
-
 	avl_init(tree, ubus_cmp_id, false, NULL);
 }
 
@@ -57,7 +142,7 @@ bool ubus_id_alloc(struct avl_tree *tree, struct ubus_id *id, uint32_t val){
 	}
 
 	do {
-		if (read(random_fd, &id->id, sizeof(id->id)) != sizeof(id->id))
+		if (!ubus_id_rng_next(&id->id))
 			return false;
 		id->id &= 0x7fffffff; // limit to only positive 32 bit ints
 	} while (avl_insert(tree, &id->avl) != 0);
@@ -79,3 +164,98 @@ struct ubus_id *ubus_id_find(struct avl_tree *tree, uint32_t id){
 	return container_of(avl, struct ubus_id, avl);
 }
 
+#define UBUS_ID_MAP_MIN_SIZE 16
+
+static void ubus_id_map_insert_slot(struct ubus_id_map_slot *slots, uint32_t mask, uint32_t id, struct ubus_id *ptr)
+{
+	uint32_t i = (id * 0x9e3779b1u) & mask;
+
+	while (slots[i].ptr)
+		i = (i + 1) & mask;
+	slots[i].id = id;
+	slots[i].ptr = ptr;
+}
+
+static void ubus_id_map_resize(struct ubus_id_map *map, uint32_t size)
+{
+	struct ubus_id_map_slot *slots = calloc(size, sizeof(*slots));
+
+	for (uint32_t i = 0; map->slots && i <= map->mask; i++) {
+		if (map->slots[i].ptr)
+			ubus_id_map_insert_slot(slots, size - 1, map->slots[i].id, map->slots[i].ptr);
+	}
+	free(map->slots);
+	map->slots = slots;
+	map->mask = size - 1;
+}
+
+void ubus_id_map_init(struct ubus_id_map *map){
+	map->slots = NULL;
+	map->count = 0;
+	ubus_id_map_resize(map, UBUS_ID_MAP_MIN_SIZE);
+}
+
+void ubus_id_map_destroy(struct ubus_id_map *map){
+	free(map->slots);
+	map->slots = NULL;
+	map->mask = 0;
+	map->count = 0;
+}
+
+bool ubus_id_map_alloc(struct ubus_id_map *map, struct ubus_id *id, uint32_t val){
+	// keep load factor at or below one half so that probe sequences stay short
+	if ((map->count + 1) * 2 > map->mask + 1)
+		ubus_id_map_resize(map, (map->mask + 1) * 2);
+
+	if (val) {
+		if (ubus_id_map_find(map, val))
+			return false;
+		id->id = val;
+	} else {
+		do {
+			if (!ubus_id_rng_next(&id->id))
+				return false;
+			id->id &= 0x7fffffff; // limit to only positive 32 bit ints
+		} while (ubus_id_map_find(map, id->id));
+	}
+
+	ubus_id_map_insert_slot(map->slots, map->mask, id->id, id);
+	map->count++;
+	return true;
+}
+
+void ubus_id_map_free(struct ubus_id_map *map, struct ubus_id *id){
+	uint32_t i = ubus_id_map_hash(map, id->id);
+
+	while (map->slots[i].ptr != id) {
+		if (!map->slots[i].ptr)
+			return;
+		i = (i + 1) & map->mask;
+	}
+
+	// pull back every following entry that would otherwise no longer be reachable from its home slot
+	uint32_t j = i;
+	for (;;) {
+		j = (j + 1) & map->mask;
+		if (!map->slots[j].ptr)
+			break;
+		uint32_t home = ubus_id_map_hash(map, map->slots[j].id);
+		if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+	map->slots[i].ptr = NULL;
+	map->count--;
+
+	if (map->mask + 1 > UBUS_ID_MAP_MIN_SIZE && map->count * 8 < map->mask + 1)
+		ubus_id_map_resize(map, (map->mask + 1) / 2);
+}
+
+struct ubus_id *ubus_id_map_first(struct ubus_id_map *map){
+	for (uint32_t i = 0; map->count && i <= map->mask; i++) {
+		if (map->slots[i].ptr)
+			return map->slots[i].ptr;
+	}
+	return NULL;
+}
@@ -27,3 +27,58 @@ bool ubus_id_alloc(struct avl_tree *tree, struct ubus_id *id, uint32_t val);
 void ubus_id_free(struct avl_tree *tree, struct ubus_id *id); 
 struct ubus_id *ubus_id_find(struct avl_tree *tree, uint32_t id); 
 
+
+/*
+ * Open addressing id map. Same job as an id tree but lookups probe a flat array
+ * of (id, pointer) slots instead of walking tree nodes. Uses linear probing and
+ * backward shift deletion so there are no tombstones.
+ *
+ * Entries move around when other entries are removed, so the map must not be
+ * modified while iterating over it with ubus_id_map_for_each(). To remove all
+ * entries use ubus_id_map_first() in a loop instead.
+ */
+struct ubus_id_map_slot {
+	uint32_t id;
+	struct ubus_id *ptr;
+};
+
+struct ubus_id_map {
+	struct ubus_id_map_slot *slots;
+	uint32_t mask;
+	uint32_t count;
+};
+
+void ubus_id_map_init(struct ubus_id_map *map);
+void ubus_id_map_destroy(struct ubus_id_map *map);
+//! Insert id into the map. Picks a random unused id if val is zero. Returns false if val is already taken.
+bool ubus_id_map_alloc(struct ubus_id_map *map, struct ubus_id *id, uint32_t val);
+void ubus_id_map_free(struct ubus_id_map *map, struct ubus_id *id);
+struct ubus_id *ubus_id_map_first(struct ubus_id_map *map);
+
+static inline uint32_t ubus_id_map_hash(const struct ubus_id_map *map, uint32_t id)
+{
+	// fibonacci hashing spreads sequential ids that are passed in explicitly
+	return (id * 0x9e3779b1u) & map->mask;
+}
+
+static inline struct ubus_id *ubus_id_map_find(const struct ubus_id_map *map, uint32_t id)
+{
+	uint32_t i = ubus_id_map_hash(map, id);
+
+	for (;; i = (i + 1) & map->mask) {
+		const struct ubus_id_map_slot *slot = &map->slots[i];
+		if (!slot->ptr)
+			return NULL;
+		if (slot->id == id)
+			return slot->ptr;
+	}
+}
+
+static inline uint32_t ubus_id_map_size(const struct ubus_id_map *map)
+{
+	return map->count;
+}
+
+#define ubus_id_map_for_each(map, element, idx) \
+	for (idx = 0; idx <= (map)->mask; idx++) \
+		if (((element) = (map)->slots[idx].ptr) != NULL)
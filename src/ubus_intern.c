@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ubus_intern.h"
+
+#define UBUS_INTERN_MIN_BUCKETS 64
+// slots in the per thread cache of recently interned strings. Must be a power of two. 
+#define UBUS_INTERN_CACHE_SIZE 64
+
+struct ubus_intern_entry {
+	struct ubus_intern_entry *next; 
+	uint32_t hash; 
+	uint32_t refcount; 
+	char str[]; 
+}; 
+
+static struct {
+	pthread_mutex_t lock; 
+	struct ubus_intern_entry **buckets; 
+	uint32_t mask; 
+	size_t count; 
+} _table = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.buckets = NULL,
+	.mask = 0,
+	.count = 0
+}; 
+
+/**
+Every thread keeps the strings it interned lately in a small direct mapped cache. Each slot holds
+a reference of its own, so the string can not go away while it is cached and a hit only has to
+take another reference. Requests intern the same few peer, object and method names over and over
+so most calls never touch the table lock. The references are dropped when the thread exits. 
+**/
+struct ubus_intern_cache {
+	uint32_t hash[UBUS_INTERN_CACHE_SIZE]; 
+	const char *str[UBUS_INTERN_CACHE_SIZE]; 
+}; 
+
+static __thread struct ubus_intern_cache *_cache = NULL; 
+static pthread_key_t _cache_key; 
+static pthread_once_t _cache_once = PTHREAD_ONCE_INIT; 
+
+static void _ubus_intern_cache_free(void *ptr){
+	struct ubus_intern_cache *cache = ptr; 
+	_cache = NULL; 
+	for(int c = 0; c < UBUS_INTERN_CACHE_SIZE; c++) ubus_intern_release(cache->str[c]); 
+	free(cache); 
+}
+
+static void _ubus_intern_cache_init(void){
+	pthread_key_create(&_cache_key, _ubus_intern_cache_free); 
+}
+
+static struct ubus_intern_cache *_ubus_intern_get_cache(void){
+	if(_cache) return _cache; 
+	pthread_once(&_cache_once, _ubus_intern_cache_init); 
+	_cache = calloc(1, sizeof(struct ubus_intern_cache)); 
+	// destructor only runs for threads that set the key so the cache is freed at thread exit
+	if(_cache) pthread_setspecific(_cache_key, _cache); 
+	return _cache; 
+}
+
+static inline struct ubus_intern_entry *_ubus_intern_entry(const char *str){
+	return (struct ubus_intern_entry*)(str - offsetof(struct ubus_intern_entry, str)); 
+}
+
+// fnv-1a
+static uint32_t _ubus_intern_hash(const char *str, size_t *len){
+	uint32_t hash = 2166136261u; 
+	const char *p = str; 
+	for(; *p; p++){
+		hash ^= (uint8_t)*p; 
+		hash *= 16777619u; 
+	}
+	*len = p - str;
+	return hash; 
+}
+
+// must be called with the table locked
+static void _ubus_intern_resize(uint32_t size){
+	struct ubus_intern_entry **buckets = calloc(size, sizeof(*buckets)); 
+	if(!buckets) return; 
+	for(uint32_t c = 0; _table.buckets && c <= _table.mask; c++){
+		struct ubus_intern_entry *e = _table.buckets[c], *next; 
+		for(; e; e = next){
+			next = e->next; 
+			e->next = buckets[e->hash & (size - 1)]; 
+			buckets[e->hash & (size - 1)] = e; 
+		}
+	}
+	free(_table.buckets); 
+	_table.buckets = buckets; 
+	_table.mask = size - 1; 
+}
+
+static const char *_ubus_intern_locked(const char *str, size_t len, uint32_t hash){
+	pthread_mutex_lock(&_table.lock); 
+	if(!_table.buckets) _ubus_intern_resize(UBUS_INTERN_MIN_BUCKETS); 
+	struct ubus_intern_entry *e = _table.buckets[hash & _table.mask]; 
+	for(; e; e = e->next){
+		if(e->hash == hash && strcmp(e->str, str) == 0){
+			__atomic_add_fetch(&e->refcount, 1, __ATOMIC_RELAXED); 
+			pthread_mutex_unlock(&_table.lock); 
+			return e->str; 
+		}
+	}
+	e = malloc(sizeof(struct ubus_intern_entry) + len + 1); 
+	if(!e){
+		pthread_mutex_unlock(&_table.lock); 
+		return NULL; 
+	}
+	e->hash = hash; 
+	e->refcount = 1; 
+	memcpy(e->str, str, len + 1); 
+	e->next = _table.buckets[hash & _table.mask]; 
+	_table.buckets[hash & _table.mask] = e; 
+	if(++_table.count > _table.mask) _ubus_intern_resize((_table.mask + 1) * 2); 
+	pthread_mutex_unlock(&_table.lock); 
+	return e->str; 
+}
+
+const char *ubus_intern(const char *str){
+	if(!str) return NULL; 
+	size_t len = 0; 
+	uint32_t hash = _ubus_intern_hash(str, &len); 
+
+	struct ubus_intern_cache *cache = _ubus_intern_get_cache(); 
+	uint32_t slot = hash & (UBUS_INTERN_CACHE_SIZE - 1); 
+	if(cache && cache->str[slot] && cache->hash[slot] == hash && strcmp(cache->str[slot], str) == 0){
+		return ubus_intern_ref(cache->str[slot]); 
+	}
+
+	const char *ret = _ubus_intern_locked(str, len, hash); 
+	if(cache && ret){
+		// the string that was in the slot before may be freed here so this happens outside of the lock
+		ubus_intern_release(cache->str[slot]); 
+		cache->str[slot] = ubus_intern_ref(ret); 
+		cache->hash[slot] = hash; 
+	}
+	return ret; 
+}
+
+const char *ubus_intern_ref(const char *str){
+	if(!str) return NULL; 
+	// caller already holds a reference so the entry can not go away under us
+	__atomic_add_fetch(&_ubus_intern_entry(str)->refcount, 1, __ATOMIC_RELAXED); 
+	return str; 
+}
+
+void ubus_intern_release(const char *str){
+	if(!str) return; 
+	struct ubus_intern_entry *e = _ubus_intern_entry(str); 
+
+	// only the last reference has to go through the table lock
+	uint32_t refs = __atomic_load_n(&e->refcount, __ATOMIC_RELAXED); 
+	while(refs > 1){
+		if(__atomic_compare_exchange_n(&e->refcount, &refs, refs - 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return; 
+	}
+
+	pthread_mutex_lock(&_table.lock); 
+	// somebody may have interned the same string again before we got the lock
+	if(__atomic_sub_fetch(&e->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+		struct ubus_intern_entry **pp = &_table.buckets[e->hash & _table.mask]; 
+		while(*pp && *pp != e) pp = &(*pp)->next; 
+		if(*pp) *pp = e->next; 
+		free(e); 
+		_table.count--; 
+	}
+	pthread_mutex_unlock(&_table.lock); 
+}
+
+size_t ubus_intern_count(void){
+	pthread_mutex_lock(&_table.lock); 
+	size_t count = _table.count; 
+	pthread_mutex_unlock(&_table.lock); 
+	return count; 
+}
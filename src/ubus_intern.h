@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+/**
+Process wide table of interned strings used for peer, object and method names.
+
+Interning a string returns a pointer to the one shared copy of it. Two interned strings are
+equal if and only if the pointers are equal, so routing code can compare names without
+strcmp. Every interned pointer holds a reference and must be handed back with
+ubus_intern_release() once it is no longer used. Taking another reference to a string that is
+already interned does not touch the table at all, so passing names from peers and objects on
+to requests costs no allocation. Each thread also caches the strings it interned lately (holding
+a reference to them until it exits), so interning a name that is in use a lot does not take the
+table lock either.
+**/
+
+//! Get the shared copy of str and take a reference to it. Returns NULL if str is NULL.
+const char *ubus_intern(const char *str); 
+//! Take another reference to an already interned string (cheaper than ubus_intern)
+const char *ubus_intern_ref(const char *str); 
+//! Drop a reference. The string is removed from the table when the last reference goes away.
+void ubus_intern_release(const char *str); 
+
+//! Number of distinct strings currently in the table
+size_t ubus_intern_count(void); 
+
+//! Compare two strings where a is interned and b may or may not be
+static inline bool ubus_intern_equal(const char *a, const char *b){
+	return a == b || (a && b && strcmp(a, b) == 0); 
+}
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "ubus_json.h"
+
+// longest text a real is ever written as
+#define UBUS_JSON_REAL_MAX 32
+
+// character that follows the backslash for bytes that have to be escaped, 'u' for \u00XX and 0 for bytes that go out as they are
+static const char _escape[256] = {
+	[0 ... 0x1f] = 'u',
+	['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r', ['\t'] = 't',
+	['"'] = '"', ['\\'] = '\\'
+}; 
+
+static const char _hex[] = "0123456789abcdef"; 
+
+static const char _digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899"; 
+
+static const char _base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"; 
+
+static inline int _ubus_json_uint_len(unsigned long long v){
+	int len = 1; 
+	while(v >= 100){ v /= 100; len += 2; }
+	return (v >= 10)?len + 1:len; 
+}
+
+// writes the digits of v so that they end right before end
+static inline void _ubus_json_put_digits(char *end, unsigned long long v){
+	while(v >= 100){
+		const char *pair = _digit_pairs + (v % 100) * 2; 
+		*--end = pair[1];
+		*--end = pair[0];
+		v /= 100; 
+	}
+	if(v >= 10){
+		*--end = _digit_pairs[v * 2 + 1];
+		*--end = _digit_pairs[v * 2];
+	} else {
+		*--end = '0' + v;
+	}
+}
+
+static inline size_t _ubus_json_int_size(long long v){
+	// negating in unsigned also works for the smallest value
+	return (v < 0)?1 + _ubus_json_uint_len(-(unsigned long long)v):_ubus_json_uint_len(v); 
+}
+
+static inline char *_ubus_json_put_int(char *p, long long v){
+	unsigned long long u = v; 
+	if(v < 0){
+		*p++ = '-';
+		u = -(unsigned long long)v; 
+	}
+	p += _ubus_json_uint_len(u); 
+	_ubus_json_put_digits(p, u); 
+	return p; 
+}
+
+/**
+Most reals that go over ubus have only a few decimals (load averages, temperatures, ratios). If
+the value is exactly some integer divided by a small power of ten it is written from that integer
+without going through printf. The text then reads back into the same double because it is the
+exact decimal for the same fraction. Everything else is printed with the fewest digits that still
+read back the same. A decimal point is always kept so that the value stays a real when parsed.
+**/
+static int _ubus_json_format_real(double v, char *out){
+	if(!isfinite(v)){
+		memcpy(out, "null", 4); 
+		return 4; 
+	}
+	double a = fabs(v); 
+	double scale = 1; 
+	for(int dec = 0; dec <= 6 && a * scale < 1e15; dec++, scale *= 10){
+		double s = a * scale; 
+		unsigned long long n = (unsigned long long)s; 
+		if((double)n != s || (double)n / scale != a) continue; 
+		char *p = out; 
+		if(v < 0) *p++ = '-'; 
+		unsigned long long div = (unsigned long long)scale; 
+		p = _ubus_json_put_int(p, n / div); 
+		*p++ = '.';
+		if(dec == 0){
+			*p++ = '0';
+		} else {
+			// fraction keeps its leading zeros
+			unsigned long long frac = n % div; 
+			for(int c = dec - 1; c >= 0; c--, frac /= 10) p[c] = '0' + frac % 10; 
+			p += dec; 
+		}
+		return p - out; 
+	}
+	int len = snprintf(out, UBUS_JSON_REAL_MAX, "%.15g", v); 
+	if(strtod(out, NULL) != v) len = snprintf(out, UBUS_JSON_REAL_MAX, "%.17g", v); 
+	if(!strpbrk(out, ".e")){
+		out[len++] = '.'; 
+		out[len++] = '0'; 
+	}
+	return len; 
+}
+
+static size_t _ubus_json_string_size(const char *str){
+	size_t size = 2; 
+	for(const unsigned char *p = (const unsigned char*)str; *p; p++){
+		char e = _escape[*p]; 
+		size += (!e)?1:(e == 'u')?6:2; 
+	}
+	return size; 
+}
+
+static char *_ubus_json_put_string(char *p, const char *str){
+	*p++ = '"';
+	for(const unsigned char *s = (const unsigned char*)str; *s; s++){
+		char e = _escape[*s]; 
+		if(!e){
+			*p++ = *s;
+			continue; 
+		}
+		*p++ = '\\';
+		*p++ = e;
+		if(e == 'u'){
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = _hex[*s >> 4];
+			*p++ = _hex[*s & 0xf];
+		}
+	}
+	*p++ = '"';
+	return p; 
+}
+
+static char *_ubus_json_put_base64(char *p, const unsigned char *data, size_t len){
+	*p++ = '"';
+	size_t c = 0; 
+	for(; c + 2 < len; c += 3){
+		uint32_t v = (data[c] << 16) | (data[c + 1] << 8) | data[c + 2]; 
+		*p++ = _base64[(v >> 18) & 0x3f];
+		*p++ = _base64[(v >> 12) & 0x3f];
+		*p++ = _base64[(v >> 6) & 0x3f];
+		*p++ = _base64[v & 0x3f];
+	}
+	if(c < len){
+		uint32_t v = data[c] << 16; 
+		if(c + 1 < len) v |= data[c + 1] << 8; 
+		*p++ = _base64[(v >> 18) & 0x3f];
+		*p++ = _base64[(v >> 12) & 0x3f];
+		*p++ = (c + 1 < len)?_base64[(v >> 6) & 0x3f]:'=';
+		*p++ = '=';
+	}
+	*p++ = '"';
+	return p; 
+}
+
+size_t ubus_json_size(struct blob_field *field){
+	switch(blob_field_type(field)){
+		case BLOB_FIELD_STRING:
+			return _ubus_json_string_size(blob_field_get_string(field)); 
+		case BLOB_FIELD_BINARY:
+			return 2 + (blob_field_data_len(field) + 2) / 3 * 4; 
+		case BLOB_FIELD_INT8: {
+			// bools are int8 fields holding 0 or 1. Any other int8 is a number (as in the msgpack codec). 
+			long long v = blob_field_get_int(field); 
+			if(v == 0 || v == 1) return (v)?4:5; 
+			return _ubus_json_int_size(v); 
+		}
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64:
+			return _ubus_json_int_size(blob_field_get_int(field)); 
+		case BLOB_FIELD_FLOAT32:
+		case BLOB_FIELD_FLOAT64: {
+			// formatted twice but reals are rare enough that it is not worth keeping the text around
+			char tmp[UBUS_JSON_REAL_MAX]; 
+			return _ubus_json_format_real(blob_field_get_real(field), tmp); 
+		}
+		case BLOB_FIELD_ARRAY:
+		case BLOB_FIELD_TABLE: {
+			// brackets and one separator (comma or colon) between every two children
+			size_t size = 2; 
+			int count = 0; 
+			struct blob_field *child; 
+			blob_field_for_each_child(field, child){
+				size += ubus_json_size(child); 
+				count++; 
+			}
+			return (count)?size + count - 1:size; 
+		}
+		default:
+			return 4; 
+	}
+}
+
+static char *_ubus_json_put(char *p, struct blob_field *field){
+	switch(blob_field_type(field)){
+		case BLOB_FIELD_STRING:
+			return _ubus_json_put_string(p, blob_field_get_string(field)); 
+		case BLOB_FIELD_BINARY:
+			return _ubus_json_put_base64(p, blob_field_data(field), blob_field_data_len(field)); 
+		case BLOB_FIELD_INT8: {
+			long long v = blob_field_get_int(field); 
+			if(v == 1){
+				memcpy(p, "true", 4); 
+				return p + 4; 
+			}
+			if(v == 0){
+				memcpy(p, "false", 5); 
+				return p + 5; 
+			}
+			return _ubus_json_put_int(p, v); 
+		}
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64:
+			return _ubus_json_put_int(p, blob_field_get_int(field)); 
+		case BLOB_FIELD_FLOAT32:
+		case BLOB_FIELD_FLOAT64: {
+			char tmp[UBUS_JSON_REAL_MAX]; 
+			int len = _ubus_json_format_real(blob_field_get_real(field), tmp); 
+			memcpy(p, tmp, len); 
+			return p + len; 
+		}
+		case BLOB_FIELD_ARRAY:
+		case BLOB_FIELD_TABLE: {
+			bool table = blob_field_type(field) == BLOB_FIELD_TABLE; 
+			int c = 0; 
+			struct blob_field *child; 
+			*p++ = (table)?'{':'[';
+			blob_field_for_each_child(field, child){
+				// keys and values alternate in tables
+				if(c) *p++ = (table && (c & 1))?':':','; 
+				p = _ubus_json_put(p, child); 
+				c++; 
+			}
+			*p++ = (table)?'}':']';
+			return p; 
+		}
+		default:
+			memcpy(p, "null", 4); 
+			return p + 4; 
+	}
+}
+
+size_t ubus_json_encode(struct blob_field *field, char *out){
+	return _ubus_json_put(out, field) - out; 
+}
+
+/**
+Parser. Works in two stages like simdjson does.
+
+Stage one goes over the text 64 bytes at a time and finds every structural character ({}[]:,)
+that is not inside of a string and every quote that is not escaped. Whether a byte is inside a
+string is worked out for the whole block at once: quotes that are escaped are found from the
+runs of backslashes in front of them and a prefix xor over the remaining quotes gives the mask
+of bytes between an opening and a closing quote. Classifying the bytes is done with avx2 or
+sse2 if the cpu has them and one byte at a time otherwise. The rest is plain 64 bit arithmetic.
+
+Stage two walks the list of positions and builds the blob. It never has to look at the bytes of
+a string to find where it ends (the closing quote is the next position) and only goes over them
+again if they contain an escape. Numbers and literals are whatever lies between two positions.
+**/
+
+struct ubus_json_block {
+	uint64_t structural; 
+	uint64_t quote; 
+	uint64_t backslash; 
+}; 
+
+// buffers that are kept by every thread from one message to the next
+struct ubus_json_scratch {
+	uint32_t *idx; 
+	size_t idx_size; 
+	char *str; 
+	size_t str_size; 
+}; 
+
+static __thread struct ubus_json_scratch _scratch; 
+
+static const uint8_t _class[256] = {
+	['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1, [':'] = 1, [','] = 1,
+	['"'] = 2,
+	['\\'] = 4
+}; 
+
+static inline void _ubus_json_classify_scalar(const char *p, struct ubus_json_block *b){
+	uint64_t s = 0, q = 0, bs = 0; 
+	for(int c = 0; c < 64; c++){
+		uint64_t k = _class[(uint8_t)p[c]]; 
+		s |= (k & 1) << c; 
+		q |= ((k >> 1) & 1) << c; 
+		bs |= (k >> 2) << c; 
+	}
+	b->structural = s; 
+	b->quote = q; 
+	b->backslash = bs; 
+}
+
+#if defined(__x86_64__)
+// '[' and ']' are '{' and '}' with bit 5 cleared so or-ing that bit in saves two compares
+static inline void _ubus_json_classify_sse2(const char *p, struct ubus_json_block *b){
+	const __m128i bit5 = _mm_set1_epi8(0x20); 
+	b->structural = b->quote = b->backslash = 0; 
+	for(int c = 0; c < 4; c++){
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + c * 16)); 
+		__m128i l = _mm_or_si128(v, bit5); 
+		__m128i s = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(l, _mm_set1_epi8('{')), _mm_cmpeq_epi8(l, _mm_set1_epi8('}'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(',')))); 
+		b->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << (c * 16); 
+		b->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << (c * 16); 
+		b->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << (c * 16); 
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void _ubus_json_classify_avx2(const char *p, struct ubus_json_block *b){
+	const __m256i bit5 = _mm256_set1_epi8(0x20); 
+	b->structural = b->quote = b->backslash = 0; 
+	for(int c = 0; c < 2; c++){
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + c * 32)); 
+		__m256i l = _mm256_or_si256(v, bit5); 
+		__m256i s = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(l, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(l, _mm256_set1_epi8('}'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')))); 
+		b->structural |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (c * 32); 
+		b->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << (c * 32); 
+		b->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << (c * 32); 
+	}
+}
+#endif
+
+// bytes that follow an odd number of backslashes. prev_escaped carries a pending escape over into the next block.
+static inline uint64_t _ubus_json_escaped(uint64_t backslash, uint64_t *prev_escaped){
+	const uint64_t even_bits = 0x5555555555555555ULL; 
+	// a backslash that is itself escaped does not start a run
+	backslash &= ~*prev_escaped; 
+	uint64_t follows_escape = (backslash << 1) | *prev_escaped; 
+	// adding the starts of runs that begin on odd bits carries them to the end of the run
+	uint64_t odd_starts = backslash & ~even_bits & ~follows_escape; 
+	uint64_t even_runs; 
+	*prev_escaped = __builtin_add_overflow(odd_starts, backslash, &even_runs);
+	return (even_bits ^ (even_runs << 1)) & follows_escape; 
+}
+
+static inline uint64_t _ubus_json_prefix_xor(uint64_t x){
+	x ^= x << 1; 
+	x ^= x << 2; 
+	x ^= x << 4; 
+	x ^= x << 8; 
+	x ^= x << 16; 
+	x ^= x << 32; 
+	return x; 
+}
+
+// fills idx with the position of every structural character and quote. Returns their number or -1 if a string is not closed.
+static inline __attribute__((always_inline)) ssize_t _ubus_json_stage1(const char *json, size_t len, uint32_t *idx,
+		void (*classify)(const char *p, struct ubus_json_block *b)){
+	uint64_t prev_escaped = 0, prev_in_string = 0; 
+	size_t count = 0; 
+	struct ubus_json_block b; 
+	char tail[64]; 
+	for(size_t base = 0; base < len; base += 64){
+		const char *p = json + base; 
+		// last block is padded with white space so that nothing is read past the end
+		if(len - base < 64){
+			memset(tail, ' ', sizeof(tail)); 
+			memcpy(tail, p, len - base); 
+			p = tail; 
+		}
+		classify(p, &b); 
+		uint64_t quote = b.quote & ~_ubus_json_escaped(b.backslash, &prev_escaped); 
+		uint64_t in_string = _ubus_json_prefix_xor(quote) ^ prev_in_string; 
+		prev_in_string = (uint64_t)((int64_t)in_string >> 63); 
+		uint64_t mask = (b.structural & ~in_string) | quote; 
+		while(mask){
+			idx[count++] = base + __builtin_ctzll(mask); 
+			mask &= mask - 1; 
+		}
+	}
+	return (prev_in_string)?-1:(ssize_t)count; 
+}
+
+static ssize_t _ubus_json_stage1_scalar(const char *json, size_t len, uint32_t *idx){
+	return _ubus_json_stage1(json, len, idx, _ubus_json_classify_scalar); 
+}
+
+#if defined(__x86_64__)
+static ssize_t _ubus_json_stage1_sse2(const char *json, size_t len, uint32_t *idx){
+	return _ubus_json_stage1(json, len, idx, _ubus_json_classify_sse2); 
+}
+
+__attribute__((target("avx2")))
+static ssize_t _ubus_json_stage1_avx2(const char *json, size_t len, uint32_t *idx){
+	return _ubus_json_stage1(json, len, idx, _ubus_json_classify_avx2); 
+}
+
+// sse2 is always there on x86_64
+static ssize_t (*_ubus_json_stage1_impl)(const char *json, size_t len, uint32_t *idx) = _ubus_json_stage1_sse2; 
+#else
+static ssize_t (*_ubus_json_stage1_impl)(const char *json, size_t len, uint32_t *idx) = _ubus_json_stage1_scalar; 
+#endif
+
+__attribute__((constructor))
+static void _ubus_json_init(void){
+#if defined(__x86_64__)
+	__builtin_cpu_init(); 
+	if(__builtin_cpu_supports("avx2")) _ubus_json_stage1_impl = _ubus_json_stage1_avx2; 
+#endif
+	// keep the scalar version referenced on platforms where it is only the fallback
+	(void)_ubus_json_stage1_scalar; 
+}
+
+struct ubus_json_reader {
+	const char *json; 
+	size_t len; 
+	const uint32_t *idx; 
+	size_t count; 
+	size_t pos; // next structural position
+	struct blob *out; 
+}; 
+
+static inline bool _ubus_json_ws(char c){
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t'; 
+}
+
+static inline size_t _ubus_json_skip_ws(struct ubus_json_reader *self, size_t i){
+	while(i < self->len && _ubus_json_ws(self->json[i])) i++; 
+	return i; 
+}
+
+// character of the next structural position or 0 if there are none left
+static inline char _ubus_json_peek(struct ubus_json_reader *self){
+	return (self->pos < self->count)?self->json[self->idx[self->pos]]:0; 
+}
+
+// true if the next structural position is the first thing after i that is not white space
+static inline bool _ubus_json_next_at(struct ubus_json_reader *self, size_t i){
+	return self->pos < self->count && _ubus_json_skip_ws(self, i) == self->idx[self->pos]; 
+}
+
+static char *_ubus_json_scratch_str(size_t size){
+	if(size > _scratch.str_size){
+		char *str = realloc(_scratch.str, size); 
+		if(!str) return NULL; 
+		_scratch.str = str; 
+		_scratch.str_size = size; 
+	}
+	return _scratch.str; 
+}
+
+static inline int _ubus_json_hex(char c){
+	if(c >= '0' && c <= '9') return c - '0'; 
+	c |= 0x20; 
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10; 
+	return -1; 
+}
+
+static bool _ubus_json_get_u16(const char *p, const char *end, uint32_t *v){
+	if(end - p < 4) return false; 
+	*v = 0;
+	for(int c = 0; c < 4; c++){
+		int h = _ubus_json_hex(p[c]); 
+		if(h < 0) return false; 
+		*v = (*v << 4) | h;
+	}
+	return true; 
+}
+
+// escapes only ever make the text shorter so out needs no more room than the escaped text
+static bool _ubus_json_unescape(const char *p, const char *end, char *out){
+	while(p < end){
+		if(*p != '\\'){
+			*out++ = *p++;
+			continue; 
+		}
+		if(++p == end) return false; 
+		char e = *p++; 
+		uint32_t cp; 
+		switch(e){
+			case '"': case '\\': case '/': *out++ = e; continue; 
+			case 'b': *out++ = '\b'; continue; 
+			case 'f': *out++ = '\f'; continue; 
+			case 'n': *out++ = '\n'; continue; 
+			case 'r': *out++ = '\r'; continue; 
+			case 't': *out++ = '\t'; continue; 
+			case 'u': break; 
+			default: return false; 
+		}
+		if(!_ubus_json_get_u16(p, end, &cp)) return false; 
+		p += 4; 
+		if(cp >= 0xd800 && cp < 0xdc00){
+			// high surrogate has to be followed by a low one
+			uint32_t lo; 
+			if(end - p < 6 || p[0] != '\\' || p[1] != 'u' || !_ubus_json_get_u16(p + 2, end, &lo) || lo < 0xdc00 || lo > 0xdfff) return false; 
+			p += 6; 
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00); 
+		} else if(cp >= 0xdc00 && cp <= 0xdfff){
+			return false; 
+		}
+		// blob strings end at the first zero
+		if(cp == 0) return false; 
+		if(cp < 0x80){
+			*out++ = cp;
+		} else if(cp < 0x800){
+			*out++ = 0xc0 | (cp >> 6);
+			*out++ = 0x80 | (cp & 0x3f);
+		} else if(cp < 0x10000){
+			*out++ = 0xe0 | (cp >> 12);
+			*out++ = 0x80 | ((cp >> 6) & 0x3f);
+			*out++ = 0x80 | (cp & 0x3f);
+		} else {
+			*out++ = 0xf0 | (cp >> 18);
+			*out++ = 0x80 | ((cp >> 12) & 0x3f);
+			*out++ = 0x80 | ((cp >> 6) & 0x3f);
+			*out++ = 0x80 | (cp & 0x3f);
+		}
+	}
+	*out = 0;
+	return true; 
+}
+
+// string that opens at the current position. Returns the position right after it or 0 on error.
+static size_t _ubus_json_read_string(struct ubus_json_reader *self){
+	if(self->pos + 1 >= self->count) return 0; 
+	size_t open = self->idx[self->pos], close = self->idx[self->pos + 1]; 
+	// anything else that was found inside of a string would have been masked out in stage one
+	if(self->json[close] != '"') return 0; 
+	self->pos += 2; 
+	const char *start = self->json + open + 1; 
+	size_t len = close - open - 1; 
+	char *str = _ubus_json_scratch_str(len + 1); 
+	if(!str) return 0; 
+	if(memchr(start, '\\', len)){
+		if(!_ubus_json_unescape(start, start + len, str)) return 0; 
+	} else {
+		memcpy(str, start, len); 
+		str[len] = 0; 
+	}
+	blob_put_string(self->out, str); 
+	return close + 1; 
+}
+
+static bool _ubus_json_read_number(struct ubus_json_reader *self, const char *p, size_t len){
+	const char *end = p + len, *s = p; 
+	bool neg = false, real = false; 
+	if(s < end && *s == '-') { neg = true; s++; }
+	if(s == end || *s < '0' || *s > '9') return false; 
+	// no leading zeros
+	if(*s == '0' && s + 1 < end && s[1] >= '0' && s[1] <= '9') return false; 
+	unsigned long long v = 0; 
+	int digits = 0; 
+	for(; s < end && *s >= '0' && *s <= '9'; s++, digits++) v = v * 10 + (*s - '0'); 
+	if(s < end && *s == '.'){
+		real = true; 
+		if(++s == end || *s < '0' || *s > '9') return false; 
+		while(s < end && *s >= '0' && *s <= '9') s++; 
+	}
+	if(s < end && (*s == 'e' || *s == 'E')){
+		real = true; 
+		if(++s < end && (*s == '+' || *s == '-')) s++; 
+		if(s == end || *s < '0' || *s > '9') return false; 
+		while(s < end && *s >= '0' && *s <= '9') s++; 
+	}
+	if(s != end) return false; 
+
+	// up to 18 digits always fit, 19 only if the value is in range
+	if(!real && (digits < 19 || (digits == 19 && v <= (unsigned long long)INT64_MAX + neg))){
+		blob_put_int(self->out, (neg)?(long long)(0 - v):(long long)v); 
+		return true; 
+	}
+	// the text is not terminated where the number ends
+	char tmp[64]; 
+	if(len >= sizeof(tmp)) return false; 
+	memcpy(tmp, p, len); 
+	tmp[len] = 0; 
+	blob_put_real(self->out, strtod(tmp, NULL)); 
+	return true; 
+}
+
+// number or literal that starts at i. Returns the position after it or 0 on error.
+static size_t _ubus_json_read_atom(struct ubus_json_reader *self, size_t i){
+	// ends where the next structural begins
+	size_t end = (self->pos < self->count)?self->idx[self->pos]:self->len; 
+	while(end > i && _ubus_json_ws(self->json[end - 1])) end--; 
+	const char *p = self->json + i; 
+	size_t len = end - i; 
+	if(len == 4 && memcmp(p, "true", 4) == 0) blob_put_bool(self->out, true); 
+	else if(len == 5 && memcmp(p, "false", 5) == 0) blob_put_bool(self->out, false); 
+	// blobs have no null. Same as the msgpack codec does with nil.
+	else if(len == 4 && memcmp(p, "null", 4) == 0) blob_put_bool(self->out, false); 
+	else if(!_ubus_json_read_number(self, p, len)) return 0; 
+	return end; 
+}
+
+static size_t _ubus_json_read_value(struct ubus_json_reader *self, size_t start, int depth); 
+
+static size_t _ubus_json_read_container(struct ubus_json_reader *self, bool table, int depth){
+	if(depth >= UBUS_JSON_MAX_DEPTH) return 0; 
+	char close = (table)?'}':']'; 
+	size_t after = self->idx[self->pos++] + 1; 
+	blob_offset_t o = (table)?blob_open_table(self->out):blob_open_array(self->out); 
+	if(_ubus_json_next_at(self, after) && _ubus_json_peek(self) == close){
+		after = self->idx[self->pos++] + 1; 
+	} else {
+		while(true){
+			if(table){
+				if(!_ubus_json_next_at(self, after) || _ubus_json_peek(self) != '"') return 0; 
+				if(!(after = _ubus_json_read_string(self))) return 0; 
+				if(!_ubus_json_next_at(self, after) || _ubus_json_peek(self) != ':') return 0; 
+				after = self->idx[self->pos++] + 1; 
+			}
+			if(!(after = _ubus_json_read_value(self, after, depth + 1))) return 0; 
+			if(!_ubus_json_next_at(self, after)) return 0; 
+			char c = _ubus_json_peek(self); 
+			after = self->idx[self->pos++] + 1; 
+			if(c == close) break; 
+			if(c != ',') return 0; 
+		}
+	}
+	if(table) blob_close_table(self->out, o); 
+	else blob_close_array(self->out, o); 
+	return after; 
+}
+
+// value that starts at the first byte after start that is not white space. Returns the position after it or 0 on error.
+static size_t _ubus_json_read_value(struct ubus_json_reader *self, size_t start, int depth){
+	size_t i = _ubus_json_skip_ws(self, start); 
+	if(i >= self->len) return 0; 
+	char c = self->json[i]; 
+	if(c == '{' || c == '[' || c == '"'){
+		if(self->pos >= self->count || self->idx[self->pos] != i) return 0; 
+		if(c == '"') return _ubus_json_read_string(self); 
+		return _ubus_json_read_container(self, c == '{', depth); 
+	}
+	return _ubus_json_read_atom(self, i); 
+}
+
+bool ubus_json_parse(struct blob *out, const char *json, size_t len){
+	if(len >= UINT32_MAX) return false; 
+	// there is never more than one structural per byte
+	if(len + 1 > _scratch.idx_size){
+		uint32_t *idx = realloc(_scratch.idx, (len + 1) * sizeof(uint32_t)); 
+		if(!idx) return false; 
+		_scratch.idx = idx; 
+		_scratch.idx_size = len + 1; 
+	}
+	ssize_t count = _ubus_json_stage1_impl(json, len, _scratch.idx); 
+	if(count < 0) return false; 
+
+	struct ubus_json_reader reader = {
+		.json = json,
+		.len = len,
+		.idx = _scratch.idx,
+		.count = count,
+		.pos = 0,
+		.out = out
+	}; 
+	size_t end = _ubus_json_read_value(&reader, 0, 0); 
+	return end && _ubus_json_skip_ws(&reader, end) == len && reader.pos == reader.count; 
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <blobpack/blobpack.h>
+
+// nesting that the parser accepts before it gives up on a message
+#define UBUS_JSON_MAX_DEPTH 32
+
+/**
+Json writer for the frames of the json transports. Works like the msgpack codec: the exact size
+of the text is worked out first so that the transport can allocate its frame once (with any
+headroom it needs in front, like the padding libwebsockets wants) and then the text is written
+straight into it. There is no intermediate string, no strlen and no second copy.
+
+Output is compact json. Int8 fields are bools (see RFC-ubus.md), binary fields are base64
+strings and floats that are not finite are written as null since json has no way to say them.
+**/
+
+//! Number of bytes ubus_json_encode() will write for field. No terminating zero is counted.
+size_t ubus_json_size(struct blob_field *field); 
+//! Write field as json into out which must have room for ubus_json_size() bytes. Returns the number of bytes written. The text is not zero terminated.
+size_t ubus_json_encode(struct blob_field *field, char *out); 
+
+/**
+Parser for the json that comes in on the json transports. Finds all structural characters of the
+text with simd instructions first (avx2 or sse2, picked at startup, one byte at a time on other
+cpus) and then builds the blob from that list without going over most of the text again.
+**/
+//! Parse len bytes of json and put the value into out the same way blob_put_json() does. The text does not have to be zero terminated. Returns false if it is not valid json.
+bool ubus_json_parse(struct blob *out, const char *json, size_t len); 
@@ -11,18 +11,84 @@
  * GNU General Public License for more details.
  */
 
+#include <string.h>
+
 #include "ubus_message.h"
+#include "ubus_slab.h"
 
-struct ubus_message *ubus_message_new(){
-	struct ubus_message *self = calloc(1, sizeof(struct ubus_message)); 
+/**
+Messages come from a slab so that transports can receive frames straight into buffers 
+that have already grown to a suitable size. The buffer is set up once when the slab 
+creates the message and survives every delete. Once the slab is warm, receiving a 
+message does not allocate memory. 
+**/
+static void _ubus_message_ctor(void *obj){
+	struct ubus_message *self = obj; 
 	blob_init(&self->buf, 0, 0); 
 	INIT_LIST_HEAD(&self->list); 
+	self->peer = 0; 
+	self->priority = UBUS_MSG_PRIO_NORMAL; 
+}
+
+static struct ubus_slab _message_slab = UBUS_SLAB_INITIALIZER("message", struct ubus_message, _ubus_message_ctor); 
+
+struct ubus_message *ubus_message_new(){
+	struct ubus_message *self = ubus_slab_alloc(&_message_slab); 
+	self->peer = 0; 
+	self->priority = UBUS_MSG_PRIO_NORMAL; 
 	return self; 
 }
 
+int ubus_message_peer_priority(int priority, int type){
+	if(priority < 0 || priority >= __UBUS_MSG_PRIO_LAST) return UBUS_MSG_PRIO_NORMAL; 
+	switch(type){
+		// peer management is small and only ever comes from the library
+		case UBUS_MSG_SIGNAL: return priority; 
+		// replies come at the priority we sent our call with but are never peer management
+		case UBUS_MSG_METHOD_RETURN: 
+		case UBUS_MSG_ERROR: 
+		case UBUS_MSG_METHOD_CHUNK: return (priority < UBUS_MSG_PRIO_HIGH)?UBUS_MSG_PRIO_HIGH:priority; 
+		// calls may ask to go slower but not faster than everybody else
+		default: return (priority < UBUS_MSG_PRIO_NORMAL)?UBUS_MSG_PRIO_NORMAL:priority; 
+	}
+}
+
+static int _ubus_call_priority(struct blob_field *msg, bool from_peer){
+	struct blob_field *key, *value; 
+	bool id = false, method = false; 
+	int prio = UBUS_MSG_PRIO_NORMAL; 
+	blob_field_for_each_kv(msg, key, value){
+		const char *k = blob_field_get_string(key); 
+		if(strcmp(k, "priority") == 0) prio = blob_field_get_int(value); 
+		else if(strcmp(k, "method") == 0) method = true; 
+		else if(strcmp(k, "id") == 0) id = blob_field_get_int(value) != 0; 
+	}
+	if(!from_peer) return (prio >= 0 && prio < __UBUS_MSG_PRIO_LAST)?prio:UBUS_MSG_PRIO_NORMAL; 
+	int type = (method)?((id)?UBUS_MSG_METHOD_CALL:UBUS_MSG_SIGNAL):UBUS_MSG_METHOD_RETURN; 
+	return ubus_message_peer_priority(prio, type); 
+}
+
+int ubus_message_envelope_priority(struct blob_field *msg, bool from_peer){
+	if(!msg) return UBUS_MSG_PRIO_NORMAL; 
+	if(blob_field_type(msg) != BLOB_FIELD_ARRAY) return _ubus_call_priority(msg, from_peer); 
+	int prio = __UBUS_MSG_PRIO_LAST; 
+	struct blob_field *child; 
+	blob_field_for_each_child(msg, child){
+		int p = _ubus_call_priority(child, from_peer); 
+		if(p < prio) prio = p; 
+	}
+	return (prio < __UBUS_MSG_PRIO_LAST)?prio:UBUS_MSG_PRIO_NORMAL; 
+}
+
 void ubus_message_delete(struct ubus_message **self){
-	blob_free(&(*self)->buf); 
-	list_del_init(&(*self)->list); 
-	free(*self); 
+	struct ubus_message *msg = *self; 
 	*self = 0; 
+	list_del_init(&msg->list); 
+	// keep the buffer memory but drop the content, unless one huge message grew it past what the slab should hold on to
+	if(msg->buf.memlen > UBUS_SLAB_MAX_BUFFER){
+		blob_free(&msg->buf); 
+		blob_init(&msg->buf, 0, 0); 
+	}
+	blob_reset(&msg->buf); 
+	ubus_slab_free(&_message_slab, msg); 
 }
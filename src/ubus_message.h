@@ -16,6 +16,7 @@
 #define __UBUSMSG_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <blobpack/blobpack.h>
 #include <libutype/list.h>
 
@@ -35,28 +36,106 @@ enum ubus_msg_type {
 	// asynchronous signal message
 	UBUS_MSG_SIGNAL,
 
+	// part of a streamed reply. Final part is sent as a normal method return. 
+	UBUS_MSG_METHOD_CHUNK, 
+
 	/** APPLICATION MESSAGES (ONLY for use by library to signal callback. Never over network!) **/
 	UBUS_MSG_PEER_CONNECTED,
 	UBUS_MSG_PEER_DISCONNECTED, 
 	__UBUS_MSG_LAST
 }; 
 
+/**
+Messages carry a priority that transports honour in their tx and rx queues so that small
+control traffic is not stuck behind large replies. The priority travels in the json-rpc
+envelope as a "priority" key (left out for normal messages) and binary transports also put it
+into their frame header so the receiver can queue a frame before looking inside of it. 
+
+A priority that a peer asks for is only a hint (see ubus_message_peer_priority()). Otherwise any
+client could mark all of its calls urgent and starve everybody else. 
+**/
+enum ubus_msg_priority {
+	UBUS_MSG_PRIO_CONTROL, 	// peer management (names, windows). Always goes first. 
+	UBUS_MSG_PRIO_HIGH, 	// latency sensitive calls
+	UBUS_MSG_PRIO_NORMAL, 
+	UBUS_MSG_PRIO_BULK, 	// large transfers that should not hold up anything else
+	__UBUS_MSG_PRIO_LAST
+}; 
+
 struct ubus_message {
 	struct list_head list; 
 	struct blob buf; 
 	int32_t peer; 
+	uint8_t priority; 
 }; 
 
+//! Get a message from the message slab. The buffer of a recycled message is empty but keeps its memory. 
 struct ubus_message *ubus_message_new(); 
+//! Return message to the message slab. 
 void ubus_message_delete(struct ubus_message **self); 
 static inline struct blob *ubus_message_blob(struct ubus_message *self) { return &self->buf; }
+//! Priority a message of type (UBUS_MSG_*) that came from a peer gets. Signals may use any lane, replies may be high but calls never go ahead of normal traffic. 
+int ubus_message_peer_priority(int priority, int type); 
+//! Get the priority of an encoded message from its envelope (limited by ubus_message_peer_priority() if it came from a peer). A batch gets the priority of its most urgent call. 
+int ubus_message_envelope_priority(struct blob_field *msg, bool from_peer); 
+//! Set the priority of a received message from its envelope and return it. 
+static inline int ubus_message_read_priority(struct ubus_message *self){
+	self->priority = ubus_message_envelope_priority(blob_head(&self->buf), true); 
+	return self->priority; 
+}
+
+/**
+Queue with one fifo lane for every priority. Items are plain list heads so the queue works for
+messages as well as for the frames of each transport. Items of the same priority stay in order. 
+**/
+struct ubus_prio_queue {
+	struct list_head lanes[__UBUS_MSG_PRIO_LAST]; 
+}; 
+
+static inline void ubus_prio_queue_init(struct ubus_prio_queue *self){
+	for(int c = 0; c < __UBUS_MSG_PRIO_LAST; c++) INIT_LIST_HEAD(&self->lanes[c]); 
+}
+
+static inline void ubus_prio_queue_add(struct ubus_prio_queue *self, struct list_head *item, int priority){
+	if(priority < 0 || priority >= __UBUS_MSG_PRIO_LAST) priority = UBUS_MSG_PRIO_NORMAL; 
+	list_add_tail(item, &self->lanes[priority]); 
+}
+
+static inline bool ubus_prio_queue_empty(struct ubus_prio_queue *self){
+	for(int c = 0; c < __UBUS_MSG_PRIO_LAST; c++) if(!list_empty(&self->lanes[c])) return false; 
+	return true; 
+}
+
+//! First item of the most urgent lane that is not empty (NULL if the queue is empty). Item stays queued. 
+static inline struct list_head *ubus_prio_queue_first(struct ubus_prio_queue *self){
+	for(int c = 0; c < __UBUS_MSG_PRIO_LAST; c++) if(!list_empty(&self->lanes[c])) return self->lanes[c].next; 
+	return NULL; 
+}
+
+//! Remove and return the next item (NULL if the queue is empty)
+static inline struct list_head *ubus_prio_queue_pop(struct ubus_prio_queue *self){
+	struct list_head *item = ubus_prio_queue_first(self); 
+	if(item) list_del_init(item); 
+	return item; 
+}
+
+#define ubus_prio_queue_first_entry(queue, type, member) ({ \
+	struct list_head *_item = ubus_prio_queue_first(queue); \
+	(_item)?list_entry(_item, type, member):NULL; \
+})
+
+#define ubus_prio_queue_pop_entry(queue, type, member) ({ \
+	struct list_head *_item = ubus_prio_queue_pop(queue); \
+	(_item)?list_entry(_item, type, member):NULL; \
+})
 
 static __attribute__((unused)) const char *ubus_message_types[] = {
 	"UBUS_MSG_HELLO",
 	"UBUS_MSG_METHOD_CALL", 
 	"UBUS_MSG_METHOD_RETURN",
 	"UBUS_MSG_ERROR", 
-	"UBUS_MSG_SIGNAL"
+	"UBUS_MSG_SIGNAL", 
+	"UBUS_MSG_METHOD_CHUNK"
 }; 
 
 enum ubus_msg_status {
@@ -71,6 +150,7 @@ enum ubus_msg_status {
 	UBUS_STATUS_NOT_SUPPORTED,
 	UBUS_STATUS_UNKNOWN_ERROR,
 	UBUS_STATUS_CONNECTION_FAILED,
+	UBUS_STATUS_BUSY,
 	__UBUS_STATUS_LAST
 };
 
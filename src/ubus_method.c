@@ -16,6 +16,7 @@
 #define _XOPEN_SOURCE_EXTENDED
 
 #include "ubus_method.h"
+#include "ubus_intern.h"
 
 #include <string.h>
 
@@ -32,24 +33,27 @@ void ubus_method_delete(struct ubus_method **self){
 }
 
 void ubus_method_init(struct ubus_method *self, const char *name, ubus_method_handler_t cb){
-	if(name) self->name = strdup(name); 
-	else self->name = 0; 
+	self->name = ubus_intern(name); 
 	self->handler = cb; 
 	blob_init(&self->signature, 0, 0); 
+	ubus_validator_init(&self->validator); 
 }
 
 void ubus_method_destroy(struct ubus_method *self){
-	if(self->name) free(self->name); 
+	ubus_intern_release(self->name); 
+	self->name = 0; 
 	blob_free(&self->signature); 
+	ubus_validator_destroy(&self->validator); 
 	self->handler = 0; 
 }
 
-void ubus_method_add_param(struct ubus_method *self, const char *name, const char *signature){
+bool ubus_method_add_param(struct ubus_method *self, const char *name, const char *signature){
 	blob_offset_t ofs = blob_open_array(&self->signature); 
 		blob_put_int(&self->signature, UBUS_METHOD_PARAM_IN); 
 		blob_put_string(&self->signature, name); 
 		blob_put_string(&self->signature, signature); 
 	blob_close_array(&self->signature, ofs); 
+	return ubus_validator_add(&self->validator, signature); 
 }
 
 void ubus_method_add_return(struct ubus_method *self, const char *name, const char *signature){
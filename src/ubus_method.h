@@ -16,6 +16,7 @@
 
 #include "ubus_object.h"
 #include "ubus_request.h"
+#include "ubus_validator.h"
 
 #define UBUS_METHOD_PARAM_IN 1
 #define UBUS_METHOD_PARAM_OUT 2
@@ -34,9 +35,13 @@ typedef int (*ubus_method_handler_t)(
 	struct blob_field *msg);		// the message of the request 
 
 struct ubus_method {
-	char *name;
+	const char *name; // interned
 	ubus_method_handler_t handler;
+	// if set the handler runs on this thread pool instead of the thread that handles events
+	struct ubus_executor *executor; 
 	struct blob signature; 
+	// parameter signatures compiled for checking calls (see ubus_validator.h)
+	struct ubus_validator validator; 
 	
 	// list head for the list of methods (TODO: maybe use avl for this?) 
 	struct list_head list; 
@@ -45,14 +50,24 @@ struct ubus_method {
 struct ubus_method *ubus_method_new(const char *name, ubus_method_handler_t cb);  
 void ubus_method_delete(struct ubus_method **self); 
 
-//! Add a parameter to list of parameters for the method. 
-void ubus_method_add_param(struct ubus_method *self, const char *name, const char *signature); 
+//! Add a parameter to list of parameters for the method. Calls with parameters that do not match the signature are rejected before they reach the handler. Returns false if the signature is not valid (the parameter is then added but accepts anything).
+bool ubus_method_add_param(struct ubus_method *self, const char *name, const char *signature); 
 //! Add a return value to list of return values
 void ubus_method_add_return(struct ubus_method *self, const char *name, const char *signature); 
 
+/**
+Run the handler of this method on a thread pool. The handler may block without holding up any
+other calls. It must only use the request it was given (resolve, reject or send chunks from
+any thread) and must not touch the context. Replies are sent out by the context thread. 
+**/
+static inline void ubus_method_set_executor(struct ubus_method *self, struct ubus_executor *executor){ self->executor = executor; }
+
 void ubus_method_init(struct ubus_method *self, const char *name, ubus_method_handler_t cb); 
 void ubus_method_destroy(struct ubus_method *self); 
 
+//! Check parameters of a call against the signatures of the parameters of the method
+static inline bool ubus_method_validate(struct ubus_method *self, struct blob_field *msg){ return ubus_validator_check(&self->validator, msg); }
+
 static inline int ubus_method_invoke(struct ubus_method *self, struct ubus_context *ctx, struct ubus_object *obj, struct ubus_request *req, struct blob_field *msg){
 	if(self->handler) return self->handler(self, ctx, obj, req, msg); 
 	return 0; 
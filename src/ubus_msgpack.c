@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ubus_msgpack.h"
+
+static int _ubus_msgpack_count(struct blob_field *field){
+	int count = 0; 
+	struct blob_field *child; 
+	blob_field_for_each_child(field, child) count++; 
+	return count; 
+}
+
+static inline size_t _ubus_msgpack_int_size(long long v){
+	if(v >= 0){
+		if(v < 128) return 1; 
+		if(v <= UINT8_MAX) return 2; 
+		if(v <= UINT16_MAX) return 3; 
+		if(v <= UINT32_MAX) return 5; 
+		return 9; 
+	}
+	if(v >= -32) return 1; 
+	if(v >= INT8_MIN) return 2; 
+	if(v >= INT16_MIN) return 3; 
+	if(v >= INT32_MIN) return 5; 
+	return 9; 
+}
+
+// size of the header of a string, binary, array or map of len items. Fix variants only exist up to fix_max (-1 if there are none).
+static inline size_t _ubus_msgpack_head_size(size_t len, long fix_max, bool has_8){
+	if((long)len <= fix_max) return 1; 
+	if(has_8 && len <= UINT8_MAX) return 2; 
+	if(len <= UINT16_MAX) return 3; 
+	return 5; 
+}
+
+static inline bool _ubus_msgpack_is_bool(struct blob_field *field){
+	if(blob_field_type(field) != BLOB_FIELD_INT8) return false; 
+	long long v = blob_field_get_int(field); 
+	return v == 0 || v == 1; 
+}
+
+size_t ubus_msgpack_size(struct blob_field *field){
+	switch(blob_field_type(field)){
+		case BLOB_FIELD_STRING: {
+			size_t len = strlen(blob_field_get_string(field)); 
+			return _ubus_msgpack_head_size(len, 31, true) + len; 
+		}
+		case BLOB_FIELD_BINARY: {
+			size_t len = blob_field_data_len(field); 
+			return _ubus_msgpack_head_size(len, -1, true) + len; 
+		}
+		case BLOB_FIELD_INT8:
+			if(_ubus_msgpack_is_bool(field)) return 1; 
+			// fall through
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64:
+			return _ubus_msgpack_int_size(blob_field_get_int(field)); 
+		case BLOB_FIELD_FLOAT32:
+			return 5; 
+		case BLOB_FIELD_FLOAT64:
+			return 9; 
+		case BLOB_FIELD_ARRAY:
+		case BLOB_FIELD_TABLE: {
+			int count = 0; 
+			size_t size = 0; 
+			struct blob_field *child; 
+			blob_field_for_each_child(field, child){
+				size += ubus_msgpack_size(child); 
+				count++; 
+			}
+			if(blob_field_type(field) == BLOB_FIELD_TABLE) count /= 2; 
+			return _ubus_msgpack_head_size(count, 15, false) + size; 
+		}
+		default:
+			// fields that have no meaning outside of blobpack go out as nil
+			return 1; 
+	}
+}
+
+static inline uint8_t *_ubus_msgpack_put_be(uint8_t *p, uint64_t v, int bytes){
+	for(int c = bytes - 1; c >= 0; c--){
+		p[c] = v & 0xff; 
+		v >>= 8; 
+	}
+	return p + bytes; 
+}
+
+static uint8_t *_ubus_msgpack_put_int(uint8_t *p, long long v){
+	if(v >= 0){
+		if(v < 128) { *p++ = v; return p; }
+		if(v <= UINT8_MAX) { *p++ = 0xcc; return _ubus_msgpack_put_be(p, v, 1); }
+		if(v <= UINT16_MAX) { *p++ = 0xcd; return _ubus_msgpack_put_be(p, v, 2); }
+		if(v <= UINT32_MAX) { *p++ = 0xce; return _ubus_msgpack_put_be(p, v, 4); }
+		*p++ = 0xcf;
+		return _ubus_msgpack_put_be(p, v, 8); 
+	}
+	if(v >= -32) { *p++ = (uint8_t)(int8_t)v; return p; }
+	if(v >= INT8_MIN) { *p++ = 0xd0; return _ubus_msgpack_put_be(p, (uint64_t)v, 1); }
+	if(v >= INT16_MIN) { *p++ = 0xd1; return _ubus_msgpack_put_be(p, (uint64_t)v, 2); }
+	if(v >= INT32_MIN) { *p++ = 0xd2; return _ubus_msgpack_put_be(p, (uint64_t)v, 4); }
+	*p++ = 0xd3;
+	return _ubus_msgpack_put_be(p, (uint64_t)v, 8); 
+}
+
+// fix is the type byte of the fix variant and wide8 the one of the 8 bit variant (0 if there is none). The 32 bit variant always follows the 16 bit one.
+static uint8_t *_ubus_msgpack_put_head(uint8_t *p, size_t len, uint8_t fix, size_t fix_max, uint8_t wide8, uint8_t wide16){
+	if(fix && len <= fix_max) { *p++ = fix | len; return p; }
+	if(wide8 && len <= UINT8_MAX) { *p++ = wide8; return _ubus_msgpack_put_be(p, len, 1); }
+	if(len <= UINT16_MAX) { *p++ = wide16; return _ubus_msgpack_put_be(p, len, 2); }
+	*p++ = wide16 + 1;
+	return _ubus_msgpack_put_be(p, len, 4); 
+}
+
+static uint8_t *_ubus_msgpack_put(uint8_t *p, struct blob_field *field){
+	switch(blob_field_type(field)){
+		case BLOB_FIELD_STRING: {
+			const char *str = blob_field_get_string(field); 
+			size_t len = strlen(str); 
+			p = _ubus_msgpack_put_head(p, len, 0xa0, 31, 0xd9, 0xda); 
+			memcpy(p, str, len); 
+			return p + len; 
+		}
+		case BLOB_FIELD_BINARY: {
+			size_t len = blob_field_data_len(field); 
+			p = _ubus_msgpack_put_head(p, len, 0, 0, 0xc4, 0xc5); 
+			memcpy(p, blob_field_data(field), len); 
+			return p + len; 
+		}
+		case BLOB_FIELD_INT8:
+			if(_ubus_msgpack_is_bool(field)){
+				*p++ = (blob_field_get_int(field))?0xc3:0xc2;
+				return p; 
+			}
+			// fall through
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64:
+			return _ubus_msgpack_put_int(p, blob_field_get_int(field)); 
+		case BLOB_FIELD_FLOAT32: {
+			union { float f; uint32_t u; } v = { .f = blob_field_get_real(field) }; 
+			*p++ = 0xca;
+			return _ubus_msgpack_put_be(p, v.u, 4); 
+		}
+		case BLOB_FIELD_FLOAT64: {
+			union { double f; uint64_t u; } v = { .f = blob_field_get_real(field) }; 
+			*p++ = 0xcb;
+			return _ubus_msgpack_put_be(p, v.u, 8); 
+		}
+		case BLOB_FIELD_ARRAY:
+			p = _ubus_msgpack_put_head(p, _ubus_msgpack_count(field), 0x90, 15, 0, 0xdc); 
+			break; 
+		case BLOB_FIELD_TABLE:
+			p = _ubus_msgpack_put_head(p, _ubus_msgpack_count(field) / 2, 0x80, 15, 0, 0xde); 
+			break; 
+		default:
+			*p++ = 0xc0;
+			return p; 
+	}
+	struct blob_field *child; 
+	blob_field_for_each_child(field, child){
+		p = _ubus_msgpack_put(p, child); 
+	}
+	return p; 
+}
+
+size_t ubus_msgpack_encode(struct blob_field *field, void *out){
+	return _ubus_msgpack_put(out, field) - (uint8_t*)out; 
+}
+
+struct ubus_msgpack_reader {
+	const uint8_t *pos; 
+	const uint8_t *end; 
+	struct blob *out; 
+	// strings are not terminated on the wire so they are copied here first
+	char *str; 
+	size_t str_size; 
+}; 
+
+enum {
+	_READ_ERROR = -1,
+	_READ_SHORT = 0,
+	_READ_OK = 1
+}; 
+
+static inline bool _ubus_msgpack_take(struct ubus_msgpack_reader *self, size_t len, const uint8_t **data){
+	if((size_t)(self->end - self->pos) < len) return false; 
+	*data = self->pos;
+	self->pos += len; 
+	return true; 
+}
+
+static inline bool _ubus_msgpack_get_be(struct ubus_msgpack_reader *self, int bytes, uint64_t *v){
+	const uint8_t *p; 
+	if(!_ubus_msgpack_take(self, bytes, &p)) return false; 
+	*v = 0;
+	for(int c = 0; c < bytes; c++) *v = (*v << 8) | p[c]; 
+	return true; 
+}
+
+static int _ubus_msgpack_put_string(struct ubus_msgpack_reader *self, size_t len){
+	const uint8_t *data; 
+	if(!_ubus_msgpack_take(self, len, &data)) return _READ_SHORT; 
+	if(len >= self->str_size){
+		char *str = realloc(self->str, len + 1); 
+		if(!str) return _READ_ERROR; 
+		self->str = str; 
+		self->str_size = len + 1; 
+	}
+	memcpy(self->str, data, len); 
+	self->str[len] = 0; 
+	blob_put_string(self->out, self->str); 
+	return _READ_OK; 
+}
+
+static int _ubus_msgpack_read(struct ubus_msgpack_reader *self, int depth); 
+
+static int _ubus_msgpack_read_items(struct ubus_msgpack_reader *self, uint64_t count, bool map, int depth){
+	if(depth >= UBUS_MSGPACK_MAX_DEPTH) return _READ_ERROR; 
+	blob_offset_t o = (map)?blob_open_table(self->out):blob_open_array(self->out); 
+	for(uint64_t c = 0; c < count; c++){
+		if(map){
+			// keys of blob tables can only be strings
+			if(self->pos == self->end) return _READ_SHORT; 
+			uint8_t t = *self->pos; 
+			if(!((t & 0xe0) == 0xa0 || (t >= 0xd9 && t <= 0xdb))) return _READ_ERROR; 
+		}
+		int ret = _ubus_msgpack_read(self, depth + 1); 
+		if(ret != _READ_OK) return ret; 
+		if(map && (ret = _ubus_msgpack_read(self, depth + 1)) != _READ_OK) return ret; 
+	}
+	if(map) blob_close_table(self->out, o); 
+	else blob_close_array(self->out, o); 
+	return _READ_OK; 
+}
+
+static int _ubus_msgpack_read(struct ubus_msgpack_reader *self, int depth){
+	const uint8_t *data; 
+	uint64_t v; 
+	if(!_ubus_msgpack_take(self, 1, &data)) return _READ_SHORT; 
+	uint8_t t = *data; 
+
+	if(t < 0x80) { blob_put_int(self->out, t); return _READ_OK; }
+	if(t >= 0xe0) { blob_put_int(self->out, (int8_t)t); return _READ_OK; }
+	if((t & 0xf0) == 0x80) return _ubus_msgpack_read_items(self, t & 0x0f, true, depth); 
+	if((t & 0xf0) == 0x90) return _ubus_msgpack_read_items(self, t & 0x0f, false, depth); 
+	if((t & 0xe0) == 0xa0) return _ubus_msgpack_put_string(self, t & 0x1f); 
+
+	switch(t){
+		case 0xc0:
+		case 0xc2: blob_put_bool(self->out, false); return _READ_OK; 
+		case 0xc3: blob_put_bool(self->out, true); return _READ_OK; 
+		case 0xc4:
+		case 0xc5:
+		case 0xc6: {
+			if(!_ubus_msgpack_get_be(self, 1 << (t - 0xc4), &v)) return _READ_SHORT; 
+			if(!_ubus_msgpack_take(self, v, &data)) return _READ_SHORT; 
+			blob_put_binary(self->out, data, v); 
+			return _READ_OK; 
+		}
+		case 0xca: {
+			if(!_ubus_msgpack_get_be(self, 4, &v)) return _READ_SHORT; 
+			union { uint32_t u; float f; } f = { .u = v }; 
+			blob_put_real(self->out, f.f); 
+			return _READ_OK; 
+		}
+		case 0xcb: {
+			if(!_ubus_msgpack_get_be(self, 8, &v)) return _READ_SHORT; 
+			union { uint64_t u; double f; } f = { .u = v }; 
+			blob_put_real(self->out, f.f); 
+			return _READ_OK; 
+		}
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			if(!_ubus_msgpack_get_be(self, 1 << (t - 0xcc), &v)) return _READ_SHORT; 
+			// there is no unsigned 64 bit blob type so the very largest values end up as reals
+			if(v > INT64_MAX) blob_put_real(self->out, (double)v); 
+			else blob_put_int(self->out, (long long)v); 
+			return _READ_OK; 
+		case 0xd0:
+			if(!_ubus_msgpack_get_be(self, 1, &v)) return _READ_SHORT; 
+			blob_put_int(self->out, (int8_t)v); 
+			return _READ_OK; 
+		case 0xd1:
+			if(!_ubus_msgpack_get_be(self, 2, &v)) return _READ_SHORT; 
+			blob_put_int(self->out, (int16_t)v); 
+			return _READ_OK; 
+		case 0xd2:
+			if(!_ubus_msgpack_get_be(self, 4, &v)) return _READ_SHORT; 
+			blob_put_int(self->out, (int32_t)v); 
+			return _READ_OK; 
+		case 0xd3:
+			if(!_ubus_msgpack_get_be(self, 8, &v)) return _READ_SHORT; 
+			blob_put_int(self->out, (int64_t)v); 
+			return _READ_OK; 
+		case 0xd9:
+		case 0xda:
+		case 0xdb:
+			if(!_ubus_msgpack_get_be(self, 1 << (t - 0xd9), &v)) return _READ_SHORT; 
+			return _ubus_msgpack_put_string(self, v); 
+		case 0xdc:
+		case 0xdd:
+			if(!_ubus_msgpack_get_be(self, 2 << (t - 0xdc), &v)) return _READ_SHORT; 
+			return _ubus_msgpack_read_items(self, v, false, depth); 
+		case 0xde:
+		case 0xdf:
+			if(!_ubus_msgpack_get_be(self, 2 << (t - 0xde), &v)) return _READ_SHORT; 
+			return _ubus_msgpack_read_items(self, v, true, depth); 
+		default:
+			// 0xc1 and extension types
+			return _READ_ERROR; 
+	}
+}
+
+ssize_t ubus_msgpack_decode(struct blob *out, const void *data, size_t size){
+	struct ubus_msgpack_reader reader = {
+		.pos = data,
+		.end = (const uint8_t*)data + size,
+		.out = out,
+		.str = NULL,
+		.str_size = 0
+	}; 
+	int ret = _ubus_msgpack_read(&reader, 0); 
+	free(reader.str); 
+	if(ret == _READ_OK) return reader.pos - (const uint8_t*)data; 
+	return (ret == _READ_SHORT)?0:-1; 
+}
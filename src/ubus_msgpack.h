@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <blobpack/blobpack.h>
+
+/**
+Msgpack codec that goes straight between struct blob and msgpack bytes without any json in
+between. Messages come out at a bit over half the size of the same message in json.
+
+Types are mapped like the json converter does it so that a message looks the same to the
+receiver no matter which codec it came in with: integers are packed as small as they fit and
+come back the way blob_put_int() packs them, int8 fields that hold 0 or 1 are bools,
+floats keep their width on the wire and come back as float64, binary fields are msgpack bin.
+Nil becomes false since blobs have no null. Table keys must be strings and extension types are
+refused.
+
+Which codec a connection uses is agreed on separately by every transport:
+- json stream sockets: the client sends UBUS_MSGPACK_MAGIC followed by a new line, a server
+  that understands it answers the same way and from then on both sides may send msgpack.
+  Receivers tell the two apart by the first byte of every message (msgpack maps and arrays
+  always start at 0x80 or above, json never does), so nothing in flight is lost.
+- websocket: the client asks for the UBUS_MSGPACK_WS_PROTOCOL subprotocol and gets binary frames.
+- binary frames (ubus_srv_blob): every frame header names the codec of its body and replies use the codec of the peer.
+**/
+
+// never used by msgpack and can not start a json text
+#define UBUS_MSGPACK_MAGIC 0xc1
+// websocket subprotocol that selects msgpack frames
+#define UBUS_MSGPACK_WS_PROTOCOL "ubus.msgpack"
+// nesting that the decoder accepts before it gives up on a message
+#define UBUS_MSGPACK_MAX_DEPTH 32
+
+enum ubus_codec {
+	UBUS_CODEC_DEFAULT, 	// whatever the transport has always used (json or blobpack)
+	UBUS_CODEC_MSGPACK,
+	__UBUS_CODEC_LAST
+}; 
+
+//! Number of bytes ubus_msgpack_encode() will write for field
+size_t ubus_msgpack_size(struct blob_field *field); 
+//! Encode field into out which must have room for ubus_msgpack_size() bytes. Returns the number of bytes written.
+size_t ubus_msgpack_encode(struct blob_field *field, void *out); 
+
+/**
+Decode one value from data and put it into out the same way blob_put_json() does. Returns the
+number of bytes the value took up, 0 if data ends before the value does (read more and try
+again with out reset) or -1 if data is not valid msgpack or can not be represented as a blob.
+**/
+ssize_t ubus_msgpack_decode(struct blob *out, const void *data, size_t size); 
@@ -29,7 +29,7 @@ void ubus_object_delete(struct ubus_object **self){
 
 void ubus_object_init(struct ubus_object *self, const char *name){
 	memset(self, 0, sizeof(*self)); 
-	self->name = strdup(name); 
+	self->name = ubus_intern(name); 
 	self->avl.key = self->name; 
 	INIT_LIST_HEAD(&self->methods); 
 }
@@ -39,7 +39,7 @@ void ubus_object_destroy(struct ubus_object *self){
 	list_for_each_entry_safe(m, tmp, &self->methods, list){
 		ubus_method_delete(&m); 
 	}
-	free(self->name); 
+	ubus_intern_release(self->name); 
 }
 
 void ubus_object_add_method(struct ubus_object *self, struct ubus_method **method){
@@ -49,8 +49,10 @@ void ubus_object_add_method(struct ubus_object *self, struct ubus_method **metho
 
 struct ubus_method *ubus_object_find_method(struct ubus_object *self, const char *name){
 	struct ubus_method *m; 
+	// method names are interned but names parsed out of incoming messages are not, so this
+	// only saves the strcmp when the caller passes an interned name
 	list_for_each_entry(m, &self->methods, list){
-		if(strcmp(m->name, name) == 0) return m; 
+		if(ubus_intern_equal(m->name, name)) return m; 
 	}
 	return NULL; 
 }
@@ -17,19 +17,24 @@
 #include <inttypes.h>
 #include <libutype/avl.h>
 #include "ubus_id.h"
+#include "ubus_intern.h"
 
 struct blob; 
 struct ubus_context; 
 struct ubus_method; 
+struct ubus_executor; 
 
 struct ubus_object {
 	struct avl_node avl;
 	struct ubus_id id; 
 
-	char *name;
+	const char *name; // interned
 
 	struct list_head methods; 
 
+	// executor used for methods that do not have their own (see ubus_method_set_executor())
+	struct ubus_executor *executor; 
+
 	void *priv; // private data to attach to owner of the object 
 };
 
@@ -43,6 +48,7 @@ void ubus_object_add_method(struct ubus_object *obj, struct ubus_method **method
 struct ubus_method *ubus_object_find_method(struct ubus_object *obj, const char *name); 
 void ubus_object_publish_method(struct ubus_object *obj, struct ubus_method **method); 
 
+static inline void ubus_object_set_executor(struct ubus_object *self, struct ubus_executor *executor) { self->executor = executor; }
 static inline void ubus_object_set_userdata(struct ubus_object *self, void *ptr) { self->priv = ptr; }
 static inline void* ubus_object_get_userdata(struct ubus_object *self) { return self->priv;  }
 
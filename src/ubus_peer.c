@@ -16,11 +16,13 @@
 #include <libutype/avl-cmp.h>
 
 #include "ubus_peer.h"
+#include "ubus_intern.h"
 
 struct ubus_peer *ubus_peer_new(const char *key, uint32_t id){
 	struct ubus_peer *self = calloc(1, sizeof(struct ubus_peer)); 
-	self->name = strdup(key); 
+	self->name = ubus_intern(key); 
 	self->id = id; 
+	self->window = UBUS_PEER_DEFAULT_WINDOW; 
 	self->avl_name.key = self->name; 
 	self->avl_id.key = &self->id; 
 	avl_init(&self->objects, avl_strcmp, false, NULL); 
@@ -49,14 +51,15 @@ static void ubus_rawsocket_client_delete(struct ubus_rawsocket_client **self){
 void ubus_peer_delete(struct ubus_peer **_self){
 	assert(_self); 
 	struct ubus_peer *self = *_self; 
-	free(self->name); 
+	ubus_intern_release(self->name); 
 	free(self); 
 	*_self = NULL; 
 }
 
 void ubus_peer_set_name(struct ubus_peer *self, const char *name){
-	free(self->name); 
-	self->name = strdup(name); 
+	const char *old = self->name; 
+	self->name = ubus_intern(name); 
+	ubus_intern_release(old); 
 	self->avl_name.key = self->name; 
 }
 
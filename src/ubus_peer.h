@@ -15,12 +15,20 @@
 
 #include <libutype/avl.h>
 
+// number of calls a peer may have outstanding with us until it announces something else
+#define UBUS_PEER_DEFAULT_WINDOW 64
+
 struct ubus_peer {
 	struct avl_node avl_id; 
 	struct avl_node avl_name; 
 	struct avl_tree objects; 
-	char *name; 
+	const char *name; // interned
 	uint32_t id; 
+
+	// flow control (see ubus_context.c)
+	uint32_t window; 	// calls the peer allows us to have outstanding with it
+	uint32_t sent; 		// our calls that wait for a reply from the peer
+	uint32_t received; 	// calls from the peer that we are still handling
 }; 
 
 struct ubus_peer *ubus_peer_new(const char *name, uint32_t id); 
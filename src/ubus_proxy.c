@@ -11,141 +11,795 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <libusys/usock.h>
+#include <libusys/uloop_timeout.h>
 #include "ubus_proxy.h"
 #include "ubus_message.h"
+#include "ubus_cache.h"
+#include "ubus_intern.h"
+#include "ubus_context.h"
+
+// one of the connections to the upstream path that the calls of incoming peers go out on
+struct ubus_proxy_upstream {
+	struct ubus_id id; // peer id of the connection on the outgoing socket
+	struct list_head list; // in the dedicated list of the proxy if it has an owner
+	bool connected; 
+	int clients; 
+	// incoming peer that has this connection to itself because it publishes objects (0 if it is shared)
+	uint32_t owner; 
+	uint16_t next_seq; 
+	// calls sent on this connection that wait for a reply, by the id we gave them
+	struct ubus_id_map calls; 
+	// same calls oldest first so that ones that never get a reply can be dropped
+	struct list_head pending; 
+	// ubus.peer.* signals upstream sent on a shared connection so that peers bound to it later get them as well
+	struct blob signals; 
+}; 
+
+// call of an incoming peer that went out on an upstream connection under a new id
+struct ubus_proxy_call {
+	struct ubus_id id; 
+	struct list_head list; 
+	uint32_t inpeer; 
+	uint32_t seq; // id the incoming peer gave the call
+	utick_t timeout; 
+	// set if the reply goes into the cache
+	const char *object; // interned
+	const char *method; // interned
+	uint64_t hash; 
+	struct blob_field *args; 
+	bool chunked; 
+}; 
 
 struct ubus_proxy_peer {
 	struct ubus_id id_in; 
-	struct ubus_id id_out; 
+	struct list_head list; 
 	uint32_t inpeer; 
-	uint32_t outpeer; 
+	// NULL until it sends something after the connection it was bound to went away
+	struct ubus_proxy_upstream *upstream; 
+	// calls passed on for it that still wait for a reply
+	int calls; 
+	utick_t last_seen; 
+	// its own ubus.peer.* signals. Passed on once it gets a connection of its own. 
+	struct blob signals; 
 }; 
 
-struct ubus_proxy_peer *ubus_proxy_peer_new(uint32_t inpeer, uint32_t outpeer){
+static void _ubus_proxy_peer_bind(struct ubus_proxy_peer *self, struct ubus_proxy_upstream *upstream){
+	self->upstream = upstream; 
+	upstream->clients++; 
+}
+
+static void _ubus_proxy_peer_unbind(struct ubus_proxy_peer *self){
+	if(!self->upstream) return; 
+	self->upstream->clients--; 
+	self->upstream = NULL; 
+}
+
+struct ubus_proxy_peer *ubus_proxy_peer_new(uint32_t inpeer, struct ubus_proxy_upstream *upstream){
 	struct ubus_proxy_peer *self = calloc(1, sizeof(struct ubus_proxy_peer)); 
+	INIT_LIST_HEAD(&self->list); 
 	self->inpeer = inpeer; 
-	self->outpeer = outpeer; 
+	self->last_seen = utick_now(); 
+	blob_init(&self->signals, 0, 0); 
+	blob_set_type(&self->signals, BLOB_FIELD_ARRAY); 
+	_ubus_proxy_peer_bind(self, upstream); 
 	return self; 
 }
 
 void ubus_proxy_peer_delete(struct ubus_proxy_peer **self){
+	_ubus_proxy_peer_unbind(*self); 
+	blob_free(&(*self)->signals); 
 	free(*self); 
 	*self = NULL; 
 }
 
+static struct ubus_proxy_peer *_ubus_proxy_find_peer(struct ubus_proxy *self, uint32_t inpeer){
+	struct ubus_id *id = ubus_id_map_find(&self->clients_in, inpeer); 
+	if(!id) return NULL; 
+	return container_of(id, struct ubus_proxy_peer, id_in); 
+}
+
+static void _ubus_proxy_release_peer(struct ubus_proxy *self, struct ubus_proxy_peer **p){
+	ubus_id_map_free(&self->clients_in, &(*p)->id_in); 
+	list_del_init(&(*p)->list); 
+	ubus_proxy_peer_delete(p); 
+}
+
+static void _ubus_proxy_call_delete(struct ubus_proxy *self, struct ubus_proxy_upstream *up, struct ubus_proxy_call **_call){
+	struct ubus_proxy_call *call = *_call; 
+	struct ubus_proxy_peer *p = _ubus_proxy_find_peer(self, call->inpeer); 
+	if(p && p->calls > 0) p->calls--; 
+	ubus_id_map_free(&up->calls, &call->id); 
+	list_del_init(&call->list); 
+	ubus_intern_release(call->object); 
+	ubus_intern_release(call->method); 
+	free(call->args); 
+	free(call); 
+	*_call = NULL; 
+}
+
+static struct ubus_proxy_call *_ubus_proxy_call_new(struct ubus_proxy_upstream *up, uint32_t inpeer, uint32_t seq){
+	struct ubus_proxy_call *call = calloc(1, sizeof(struct ubus_proxy_call)); 
+	INIT_LIST_HEAD(&call->list); 
+	call->inpeer = inpeer; 
+	call->seq = seq; 
+	call->timeout = utick_now() + (utick_t)UBUS_PROXY_CALL_TIMEOUT * 1000UL; 
+	// request ids only have 16 bits on the other side so we can not let the map pick a random one. 
+	// One pass over all of them is enough to know that every id is taken. 
+	uint16_t id = 0; 
+	for(int c = 0; c < UINT16_MAX; c++){
+		id = ++up->next_seq; 
+		if(id && !ubus_id_map_find(&up->calls, id)) break; 
+		id = 0; 
+	}
+	if(!id){
+		free(call); 
+		return NULL; 
+	}
+	ubus_id_map_alloc(&up->calls, &call->id, id); 
+	list_add_tail(&call->list, &up->pending); 
+	return call; 
+}
+
+static void _ubus_proxy_upstream_init(struct ubus_proxy_upstream *up){
+	INIT_LIST_HEAD(&up->list); 
+	ubus_id_map_init(&up->calls); 
+	INIT_LIST_HEAD(&up->pending); 
+	blob_init(&up->signals, 0, 0); 
+	blob_set_type(&up->signals, BLOB_FIELD_ARRAY); 
+}
+
+static void _ubus_proxy_upstream_destroy(struct ubus_proxy *self, struct ubus_proxy_upstream *up){
+	struct ubus_proxy_call *call, *tmp; 
+	list_for_each_entry_safe(call, tmp, &up->pending, list){
+		_ubus_proxy_call_delete(self, up, &call); 
+	}
+	ubus_id_map_destroy(&up->calls); 
+	blob_free(&up->signals); 
+}
+
+static bool _ubus_proxy_upstream_connect(struct ubus_proxy *self, struct ubus_proxy_upstream *up){
+	uint32_t outpeer = 0; 
+	if(ubus_socket_connect(self->outsock, self->outpath, &outpeer) < 0){
+		printf("proxy: could not connect to outgoing socket! %s\n", self->outpath); 
+		return false; 
+	}
+	ubus_id_map_alloc(&self->clients_out, &up->id, outpeer); 
+	up->connected = true; 
+	return true; 
+}
+
+// send every signal kept in signals to peer as a message of its own
+static bool _ubus_proxy_send_signals(ubus_socket_t sock, uint32_t peer, struct blob *signals){
+	struct blob_field *child; 
+	blob_field_for_each_child(blob_head(signals), child){
+		if(ubus_socket_send(sock, peer, child) < 0) return false; 
+	}
+	return true; 
+}
+
+// shared upstream connection for a peer: the one with the fewest peers. Connected on first use. 
+static struct ubus_proxy_upstream *_ubus_proxy_get_upstream(struct ubus_proxy *self){
+	if(!self->upstream){
+		self->upstream = calloc(self->pool_size, sizeof(struct ubus_proxy_upstream)); 
+		for(int c = 0; c < self->pool_size; c++){
+			_ubus_proxy_upstream_init(&self->upstream[c]); 
+		}
+	}
+	struct ubus_proxy_upstream *up = &self->upstream[0]; 
+	for(int c = 1; c < self->pool_size; c++){
+		if(self->upstream[c].clients < up->clients) up = &self->upstream[c]; 
+	}
+	if(!up->connected && !_ubus_proxy_upstream_connect(self, up)) return NULL; 
+	return up; 
+}
+
+// copy the fields of a json-rpc message into buf with its id (if it has one) replaced
+static void _ubus_proxy_put_message(struct blob *buf, struct blob_field *msg, uint32_t seq){
+	struct blob_field *key, *value; 
+	blob_field_for_each_kv(msg, key, value){
+		blob_put_attr(buf, key); 
+		if(strcmp(blob_field_get_string(key), "id") == 0) blob_put_int(buf, seq); 
+		else blob_put_attr(buf, value); 
+	}
+}
+
+struct ubus_proxy_rpc {
+	bool has_id; 
+	uint32_t seq; 
+	const char *method; 
+	struct blob_field *params; 
+	struct blob_field *result; 
+	bool chunk; 
+}; 
+
+static void _ubus_proxy_parse(struct blob_field *msg, struct ubus_proxy_rpc *rpc){
+	struct blob_field *key, *value; 
+	memset(rpc, 0, sizeof(*rpc)); 
+	blob_field_for_each_kv(msg, key, value){
+		const char *k = blob_field_get_string(key); 
+		if(strcmp(k, "id") == 0){ rpc->has_id = true; rpc->seq = blob_field_get_int(value); }
+		else if(strcmp(k, "method") == 0) rpc->method = blob_field_get_string(value); 
+		else if(strcmp(k, "params") == 0) rpc->params = value; 
+		else if(strcmp(k, "result") == 0) rpc->result = value; 
+		else if(strcmp(k, "chunk") == 0) rpc->chunk = true; 
+	}
+}
+
+// remember a signal in place of an earlier one with the same name. Nothing new is taken once the list is full. 
+static void _ubus_proxy_keep_signal(struct blob *signals, struct blob_field *msg, const char *method){
+	struct blob buf; 
+	blob_init(&buf, 0, 0); 
+	blob_set_type(&buf, BLOB_FIELD_ARRAY); 
+	struct blob_field *child; 
+	struct ubus_proxy_rpc rpc; 
+	blob_field_for_each_child(blob_head(signals), child){
+		_ubus_proxy_parse(child, &rpc); 
+		if(rpc.method && strcmp(rpc.method, method) == 0) continue; 
+		blob_put_attr(&buf, child); 
+	}
+	if(blob_field_raw_pad_len(blob_head(&buf)) + blob_field_raw_pad_len(msg) <= UBUS_PROXY_SIGNALS_SIZE) blob_put_attr(&buf, msg); 
+	blob_free(signals); 
+	*signals = buf; 
+}
+
+// true if msg (a single call or a batch) publishes an object
+static bool _ubus_proxy_publishes(struct blob_field *msg){
+	if(blob_field_type(msg) == BLOB_FIELD_ARRAY){
+		struct blob_field *child; 
+		blob_field_for_each_child(msg, child){
+			if(_ubus_proxy_publishes(child)) return true; 
+		}
+		return false; 
+	}
+	struct ubus_proxy_rpc rpc; 
+	_ubus_proxy_parse(msg, &rpc); 
+	if(!rpc.method || !rpc.params || strcmp(rpc.method, "call") != 0) return false; 
+	// params of a call are object, method and arguments
+	struct blob_field *f = blob_field_first_child(rpc.params); 
+	if(f) f = blob_field_next_child(rpc.params, f); 
+	return f && strcmp(blob_field_get_string(f), "publish") == 0; 
+}
+
+// answer a call with an error instead of passing it on
+static void _ubus_proxy_send_error(struct ubus_proxy *self, ubus_socket_t sock, uint32_t peer, uint32_t seq, int status){
+	struct blob buf; 
+	blob_init(&buf, 0, 0); 
+	blob_set_type(&buf, BLOB_FIELD_TABLE); 
+	blob_put_string(&buf, "jsonrpc"); 
+	blob_put_string(&buf, "2.0"); 
+	blob_put_string(&buf, "id"); 
+	blob_put_int(&buf, seq); 
+	blob_put_string(&buf, "error"); 
+	blob_offset_t arr = blob_open_array(&buf); 
+	blob_put_int(&buf, status); 
+	blob_put_string(&buf, ubus_status_to_string(status)); 
+	blob_close_array(&buf, arr); 
+	if(ubus_socket_send(sock, peer, blob_head(&buf)) < 0){
+		if(self->debug) printf("proxy: could not send error to %08x\n", peer); 
+	}
+	blob_free(&buf); 
+}
+
+// fail every call in msg (a single call or a batch) that expects a reply
+static void _ubus_proxy_fail_calls(struct ubus_proxy *self, uint32_t inpeer, struct blob_field *msg, int status){
+	struct ubus_proxy_rpc rpc; 
+	if(blob_field_type(msg) != BLOB_FIELD_ARRAY){
+		_ubus_proxy_parse(msg, &rpc); 
+		if(rpc.method && rpc.has_id) _ubus_proxy_send_error(self, self->insock, inpeer, rpc.seq, status); 
+		return; 
+	}
+	struct blob_field *child; 
+	blob_field_for_each_child(msg, child){
+		_ubus_proxy_parse(child, &rpc); 
+		if(rpc.method && rpc.has_id) _ubus_proxy_send_error(self, self->insock, inpeer, rpc.seq, status); 
+	}
+}
+
+// an upstream connection went away. Calls that wait on it will never get a reply and its peers are bound again once they send something. 
+static void _ubus_proxy_upstream_failed(struct ubus_proxy *self, struct ubus_proxy_upstream *up){
+	if(self->debug) printf("proxy: upstream connection %08x lost\n", up->id.id); 
+	struct ubus_proxy_call *call, *tmp; 
+	list_for_each_entry_safe(call, tmp, &up->pending, list){
+		_ubus_proxy_send_error(self, self->insock, call->inpeer, call->seq, UBUS_STATUS_CONNECTION_FAILED); 
+		_ubus_proxy_call_delete(self, up, &call); 
+	}
+	ubus_socket_disconnect(self->outsock, up->id.id); 
+	ubus_id_map_free(&self->clients_out, &up->id); 
+	up->connected = false; 
+	blob_reset(&up->signals); 
+	blob_set_type(&up->signals, BLOB_FIELD_ARRAY); 
+	struct ubus_proxy_peer *p; 
+	list_for_each_entry(p, &self->peers, list){
+		if(p->upstream == up) _ubus_proxy_peer_unbind(p); 
+	}
+	// objects published over it are gone. The owner gets a new connection if it publishes again. 
+	if(up->owner){
+		list_del_init(&up->list); 
+		_ubus_proxy_upstream_destroy(self, up); 
+		free(up); 
+	}
+}
+
+// give a peer that publishes objects a connection of its own so that calls for them and everything else upstream
+// has to say to it find their way back. Calls it already has out on the shared connection get their replies there. 
+static bool _ubus_proxy_make_dedicated(struct ubus_proxy *self, struct ubus_proxy_peer *p){
+	if(p->upstream && p->upstream->owner) return true; 
+	struct ubus_proxy_upstream *up = calloc(1, sizeof(struct ubus_proxy_upstream)); 
+	_ubus_proxy_upstream_init(up); 
+	if(!_ubus_proxy_upstream_connect(self, up)){
+		_ubus_proxy_upstream_destroy(self, up); 
+		free(up); 
+		return false; 
+	}
+	up->owner = p->inpeer; 
+	list_add_tail(&up->list, &self->dedicated); 
+	_ubus_proxy_peer_unbind(p); 
+	_ubus_proxy_peer_bind(p, up); 
+	// upstream names what the peer publishes after it so it has to know who the peer is first
+	if(!_ubus_proxy_send_signals(self->outsock, up->id.id, &p->signals)){
+		_ubus_proxy_upstream_failed(self, up); 
+		return false; 
+	}
+	return true; 
+}
+
+// answer a call with the reply that was just taken from the cache
+static void _ubus_proxy_send_cached(struct ubus_proxy *self, struct ubus_proxy_peer *p, uint32_t seq, struct blob_field *result){
+	struct blob buf; 
+	blob_init(&buf, 0, 0); 
+	blob_set_type(&buf, BLOB_FIELD_TABLE); 
+	blob_put_string(&buf, "jsonrpc"); 
+	blob_put_string(&buf, "2.0"); 
+	blob_put_string(&buf, "id"); 
+	blob_put_int(&buf, seq); 
+	blob_put_string(&buf, "result"); 
+	blob_put_attr(&buf, result); 
+	if(ubus_socket_send(self->insock, p->inpeer, blob_head(&buf)) < 0){
+		if(self->debug) printf("proxy: could not send cached reply to %08x\n", p->inpeer); 
+	}
+	blob_free(&buf); 
+}
+
+// add a message to buf unchanged (as a table of its own if nested)
+static void _ubus_proxy_put_unchanged(struct blob *buf, struct blob_field *msg, struct ubus_proxy_rpc *rpc, bool nested){
+	blob_offset_t tbl = (nested)?blob_open_table(buf):0; 
+	_ubus_proxy_put_message(buf, msg, rpc->seq); 
+	if(nested) blob_close_table(buf, tbl); 
+}
+
+// add a message of an incoming peer to buf, calls under a new id (as a table of its own if nested). Returns false if it is not passed on. 
+static bool _ubus_proxy_put_call(struct ubus_proxy *self, struct ubus_proxy_peer *p, struct blob *buf, struct blob_field *msg, bool nested){
+	struct ubus_proxy_rpc rpc; 
+	_ubus_proxy_parse(msg, &rpc); 
+	bool dedicated = p->upstream->owner != 0; 
+	// replies to calls from upstream. Those only come in for objects of a peer that has a connection of its own. 
+	if(!rpc.method){
+		if(!dedicated) return false; 
+		_ubus_proxy_put_unchanged(buf, msg, &rpc, nested); 
+		return true; 
+	}
+	// signals that describe the peer are kept for when it gets a connection of its own. Until then the
+	// connection they would describe is shared with other peers. 
+	if(strncmp(rpc.method, "ubus.peer.", 10) == 0){
+		_ubus_proxy_keep_signal(&p->signals, msg, rpc.method); 
+		if(!dedicated) return false; 
+		_ubus_proxy_put_unchanged(buf, msg, &rpc, nested); 
+		return true; 
+	}
+	// notifications have no id and get no reply
+	uint32_t seq = 0; 
+	if(rpc.has_id){
+		// params of a call are object, method and arguments
+		const char *object = NULL, *method = NULL; 
+		struct blob_field *args = NULL; 
+		uint64_t hash = 0; 
+		if(self->cache && rpc.params && strcmp(rpc.method, "call") == 0){
+			struct blob_field *f = blob_field_first_child(rpc.params); 
+			if(f){ object = blob_field_get_string(f); f = blob_field_next_child(rpc.params, f); }
+			if(f){ method = blob_field_get_string(f); args = blob_field_next_child(rpc.params, f); }
+		}
+		if(method && ubus_cache_ttl(self->cache, object, method) > 0){
+			hash = ubus_cache_hash(args); 
+			struct blob_field *hit = ubus_cache_get(self->cache, object, method, hash, args, &self->cached); 
+			if(hit){
+				_ubus_proxy_send_cached(self, p, rpc.seq, hit); 
+				return false; 
+			}
+		} else {
+			method = NULL; 
+		}
+
+		struct ubus_proxy_call *call = _ubus_proxy_call_new(p->upstream, p->inpeer, rpc.seq); 
+		if(!call){
+			// every id on the upstream connection is waiting for a reply
+			_ubus_proxy_send_error(self, self->insock, p->inpeer, rpc.seq, UBUS_STATUS_BUSY); 
+			return false; 
+		}
+		p->calls++; 
+		if(method){
+			call->object = ubus_intern(object); 
+			call->method = ubus_intern(method); 
+			call->hash = hash; 
+			call->args = ubus_cache_args_dup(args); 
+		}
+		seq = call->id.id; 
+	}
+	blob_offset_t tbl = (nested)?blob_open_table(buf):0; 
+	_ubus_proxy_put_message(buf, msg, seq); 
+	if(nested) blob_close_table(buf, tbl); 
+	return true; 
+}
+
+// signal from upstream on a shared connection. It is about upstream itself so every peer on the connection gets it. 
+static void _ubus_proxy_upstream_signal(struct ubus_proxy *self, struct ubus_proxy_upstream *up, struct blob_field *msg, const char *method){
+	if(strncmp(method, "ubus.peer.", 10) == 0) _ubus_proxy_keep_signal(&up->signals, msg, method); 
+	struct ubus_proxy_peer *p; 
+	list_for_each_entry(p, &self->peers, list){
+		if(p->upstream != up) continue; 
+		if(ubus_socket_send(self->insock, p->inpeer, msg) < 0){
+			if(self->debug) printf("proxy: could not send signal to %08x\n", p->inpeer); 
+		}
+	}
+}
+
+// add a message from upstream to buf, replies with the id the peer gave the call. Returns false if it is not for anyone. 
+static bool _ubus_proxy_put_reply(struct ubus_proxy *self, struct ubus_proxy_upstream *up, struct blob *buf, struct blob_field *msg, bool nested, uint32_t *inpeer){
+	struct ubus_proxy_rpc rpc; 
+	_ubus_proxy_parse(msg, &rpc); 
+	if(rpc.method){
+		// calls for objects of the owner of the connection and anything else upstream has to say to it
+		if(up->owner){
+			*inpeer = up->owner; 
+			_ubus_proxy_put_unchanged(buf, msg, &rpc, nested); 
+			return true; 
+		}
+		if(!rpc.has_id) _ubus_proxy_upstream_signal(self, up, msg, rpc.method); 
+		// nobody on a shared connection has published anything that could be called
+		else _ubus_proxy_send_error(self, self->outsock, up->id.id, rpc.seq, UBUS_STATUS_NOT_FOUND); 
+		return false; 
+	}
+	if(!rpc.has_id) return false; 
+	struct ubus_id *id = ubus_id_map_find(&up->calls, rpc.seq); 
+	if(!id) return false; 
+	struct ubus_proxy_call *call = container_of(id, struct ubus_proxy_call, id); 
+	*inpeer = call->inpeer; 
+	blob_offset_t tbl = (nested)?blob_open_table(buf):0; 
+	_ubus_proxy_put_message(buf, msg, call->seq); 
+	if(nested) blob_close_table(buf, tbl); 
+	if(call->method && !call->chunked && !rpc.chunk && rpc.result){
+		ubus_cache_put(self->cache, call->object, call->method, call->hash, call->args, rpc.result); 
+	}
+	if(rpc.chunk){
+		// a reply that comes in chunks can not be replayed from the cache
+		call->chunked = true; 
+		// more is coming so it gets a new lease
+		call->timeout = utick_now() + (utick_t)UBUS_PROXY_CALL_TIMEOUT * 1000UL; 
+		list_del_init(&call->list); 
+		list_add_tail(&call->list, &up->pending); 
+	} else {
+		_ubus_proxy_call_delete(self, up, &call); 
+	}
+	return true; 
+}
+
+// one connection relayed in passthrough mode
+struct ubus_proxy_pipe {
+	struct list_head list; 
+	int in_fd; 
+	int out_fd; 
+	// kernel pipes for each direction. Data is spliced from one socket into the pipe and from the pipe into the other socket. 
+	int up[2]; 
+	int down[2]; 
+	size_t up_len; 
+	size_t down_len; 
+	// source of that direction has nothing more to give. What is left in the pipe is still delivered. 
+	bool up_eof; 
+	bool down_eof; 
+}; 
+
+static struct ubus_proxy_pipe *ubus_proxy_pipe_new(int in_fd, int out_fd){
+	struct ubus_proxy_pipe *self = calloc(1, sizeof(struct ubus_proxy_pipe)); 
+	INIT_LIST_HEAD(&self->list); 
+	self->in_fd = in_fd; 
+	self->out_fd = out_fd; 
+	if(pipe2(self->up, O_NONBLOCK | O_CLOEXEC) < 0 || pipe2(self->down, O_NONBLOCK | O_CLOEXEC) < 0){
+		free(self); 
+		return NULL; 
+	}
+	fcntl(self->up[1], F_SETPIPE_SZ, UBUS_PROXY_PIPE_SIZE); 
+	fcntl(self->down[1], F_SETPIPE_SZ, UBUS_PROXY_PIPE_SIZE); 
+	return self; 
+}
+
+static void ubus_proxy_pipe_delete(struct ubus_proxy_pipe **_self){
+	struct ubus_proxy_pipe *self = *_self; 
+	close(self->in_fd); 
+	close(self->out_fd); 
+	close(self->up[0]); close(self->up[1]); 
+	close(self->down[0]); close(self->down[1]); 
+	free(self); 
+	*_self = NULL; 
+}
+
+// move whatever we can from src through the pipe to dst. Eof or an error on src only ends reading
+// (*eof is set) and the bytes already in the pipe still go out. Returns false if dst has failed. 
+static bool _ubus_proxy_pipe_pump(int src, int dst, int pipe[2], size_t *len, bool *eof, short src_events){
+	if(!*eof && (src_events & (POLLIN | POLLHUP | POLLERR)) && *len < UBUS_PROXY_PIPE_SIZE){
+		ssize_t ret = splice(src, NULL, pipe[1], NULL, UBUS_PROXY_PIPE_SIZE - *len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK); 
+		if(ret == 0 || (ret < 0 && errno != EAGAIN)) *eof = true; 
+		if(ret > 0) *len += ret; 
+	}
+	// try right away as well since the other side is usually ready for it
+	if(*len){
+		ssize_t ret = splice(pipe[0], NULL, dst, NULL, *len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK); 
+		if(ret < 0 && errno != EAGAIN) return false; 
+		if(ret > 0) *len -= ret; 
+	}
+	// everything src sent has been passed on so dst gets to see the eof as well
+	if(*eof && !*len) shutdown(dst, SHUT_WR); 
+	return true; 
+}
+
+// open a socket to (or listening on) a path the way the socket implementations parse it
+static int _ubus_proxy_open(const char *path, int flags){
+	const char *p = strstr(path, "://"); 
+	if(p) path = p + 3; 
+	char *address = alloca(strlen(path) + 1); 
+	strcpy(address, path); 
+	char *port = NULL; 
+	if(address[0] == '/' || address[0] == '.'){
+		flags |= USOCK_UNIX; 
+		if(flags & USOCK_SERVER) unlink(address); 
+	} else {
+		char *c = strrchr(address, ':'); 
+		if(c){ *c = 0; port = c + 1; }
+	}
+	int fd = usock(flags, address, port); 
+	if(fd < 0) return -1; 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); 
+	fcntl(fd, F_SETFD, FD_CLOEXEC); 
+	return fd; 
+}
+
+static void _ubus_proxy_accept(struct ubus_proxy *self){
+	int fd; 
+	while((fd = accept4(self->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		int out = (self->outpath)?_ubus_proxy_open(self->outpath, 0):-1; 
+		struct ubus_proxy_pipe *p = (out >= 0)?ubus_proxy_pipe_new(fd, out):NULL; 
+		if(!p){
+			printf("proxy: could not connect to outgoing socket! %s\n", self->outpath); 
+			if(out >= 0) close(out); 
+			close(fd); 
+			continue; 
+		}
+		list_add_tail(&p->list, &self->pipes); 
+	}
+}
+
+static int _ubus_proxy_handle_passthrough(struct ubus_proxy *self, int timeout){
+	int count = 1; 
+	struct ubus_proxy_pipe *p, *tmp; 
+	list_for_each_entry(p, &self->pipes, list) count += 2; 
+	struct pollfd *pfd = alloca(sizeof(struct pollfd) * count); 
+	pfd[0] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN }; 
+	int c = 1; 
+	list_for_each_entry(p, &self->pipes, list){
+		// only read from a side while it is open and its pipe has room and only wait to write while there is
+		// something to write. A side we want nothing from is left out, its hangup would wake us up for nothing. 
+		short in_events = ((!p->up_eof && p->up_len < UBUS_PROXY_PIPE_SIZE)?POLLIN:0) | ((p->down_len)?POLLOUT:0); 
+		short out_events = ((!p->down_eof && p->down_len < UBUS_PROXY_PIPE_SIZE)?POLLIN:0) | ((p->up_len)?POLLOUT:0); 
+		pfd[c++] = (struct pollfd){ .fd = (in_events)?p->in_fd:-1, .events = in_events }; 
+		pfd[c++] = (struct pollfd){ .fd = (out_events)?p->out_fd:-1, .events = out_events }; 
+	}
+	if(poll(pfd, count, timeout) <= 0) return 0; 
+
+	if(pfd[0].revents & POLLIN) _ubus_proxy_accept(self); 
+
+	c = 1; 
+	list_for_each_entry_safe(p, tmp, &self->pipes, list){
+		// pipes accepted above are not in pfd yet
+		if(c >= count) break; 
+		short in_ev = pfd[c++].revents, out_ev = pfd[c++].revents; 
+		if(!in_ev && !out_ev) continue; 
+		bool ok = _ubus_proxy_pipe_pump(p->in_fd, p->out_fd, p->up, &p->up_len, &p->up_eof, in_ev) && 
+			_ubus_proxy_pipe_pump(p->out_fd, p->in_fd, p->down, &p->down_len, &p->down_eof, out_ev); 
+		// done once both sides have said all they had to say and all of it has been delivered
+		if(!ok || (p->up_eof && p->down_eof && !p->up_len && !p->down_len)){
+			list_del_init(&p->list); 
+			ubus_proxy_pipe_delete(&p); 
+		}
+	}
+	return 0; 
+}
+
 struct ubus_proxy *ubus_proxy_new(ubus_socket_t *insock, ubus_socket_t *outsock){
 	struct ubus_proxy *self = calloc(1, sizeof(struct ubus_proxy)); 
-	ubus_id_tree_init(&self->clients_in); 
-	ubus_id_tree_init(&self->clients_out); 
-	self->insock = *insock; *insock = NULL; 
-	self->outsock = *outsock; *outsock = NULL; 
+	ubus_id_map_init(&self->clients_in); 
+	ubus_id_map_init(&self->clients_out); 
+	INIT_LIST_HEAD(&self->peers); 
+	INIT_LIST_HEAD(&self->dedicated); 
+	INIT_LIST_HEAD(&self->pipes); 
+	self->listen_fd = -1; 
+	self->pool_size = UBUS_PROXY_DEFAULT_POOL; 
+	blob_init(&self->buf, 0, 0); 
+	blob_init(&self->cached, 0, 0); 
+	// sockets are not needed in passthrough mode
+	if(insock){ self->insock = *insock; *insock = NULL; }
+	if(outsock){ self->outsock = *outsock; *outsock = NULL; }
 	return self; 
 }
 
 void ubus_proxy_delete(struct ubus_proxy **self){
 	if((*self)->outpath) free((*self)->outpath); 
-	ubus_socket_delete((*self)->insock); 
-	ubus_socket_delete((*self)->outsock); 
-	struct ubus_id *id = 0, *ptr; 
-	avl_for_each_element_safe(&(*self)->clients_in, id, avl, ptr){
-		struct ubus_proxy_peer *peer = container_of(id, struct ubus_proxy_peer, id_in); 
-		ubus_proxy_peer_delete(&peer); 
+	if((*self)->insock) ubus_socket_delete((*self)->insock); 
+	if((*self)->outsock) ubus_socket_delete((*self)->outsock); 
+	if((*self)->listen_fd >= 0) close((*self)->listen_fd); 
+	struct ubus_proxy_pipe *p, *tmp; 
+	list_for_each_entry_safe(p, tmp, &(*self)->pipes, list){
+		list_del_init(&p->list); 
+		ubus_proxy_pipe_delete(&p); 
+	}
+	struct ubus_proxy_peer *peer, *ptmp; 
+	list_for_each_entry_safe(peer, ptmp, &(*self)->peers, list){
+		_ubus_proxy_release_peer(*self, &peer); 
 	}
+	for(int c = 0; (*self)->upstream && c < (*self)->pool_size; c++){
+		_ubus_proxy_upstream_destroy(*self, &(*self)->upstream[c]); 
+	}
+	free((*self)->upstream); 
+	struct ubus_proxy_upstream *up, *utmp; 
+	list_for_each_entry_safe(up, utmp, &(*self)->dedicated, list){
+		list_del_init(&up->list); 
+		_ubus_proxy_upstream_destroy(*self, up); 
+		free(up); 
+	}
+	ubus_id_map_destroy(&(*self)->clients_in); 
+	ubus_id_map_destroy(&(*self)->clients_out); 
+	blob_free(&(*self)->buf); 
+	blob_free(&(*self)->cached); 
 	free(*self); 
 	*self = NULL; 
 }
 
 static void _on_in_message_received(ubus_socket_t socket, uint32_t peer, struct blob_field *msg){
 	struct ubus_proxy *self = (struct ubus_proxy*)ubus_socket_get_userdata(socket); 
-	struct ubus_id *id = ubus_id_find(&self->clients_in, peer); 
-	struct ubus_proxy_peer *p = NULL; 
-	if(id){
-		p = container_of(id, struct ubus_proxy_peer, id_in); 
-	} else {
-		if(!self->outsock) return; 
-		uint32_t outpeer = 0; 
-		if(ubus_socket_connect(self->outsock, self->outpath, &outpeer) < 0){
-			printf("proxy: could not connect to outgoing socket! %s\n", self->outpath);
+	if(!self->outsock) return; 
+	struct ubus_proxy_peer *p = _ubus_proxy_find_peer(self, peer); 
+	if(!p || !p->upstream){
+		struct ubus_proxy_upstream *up = _ubus_proxy_get_upstream(self); 
+		if(!up){
+			// nobody else is going to tell the peer that its calls went nowhere
+			_ubus_proxy_fail_calls(self, peer, msg, UBUS_STATUS_CONNECTION_FAILED); 
 			return; 
 		}
-		p = ubus_proxy_peer_new(peer, outpeer); 	
-		ubus_id_alloc(&self->clients_in, &p->id_in, peer); 
-		ubus_id_alloc(&self->clients_out, &p->id_out, outpeer); 
-		printf("proxy: peer connected %08x!\n", p->id_in.id); 
-		//printf("proxy: set up connection between %08x and %08x\n", peer, outpeer); 
+		if(p){
+			_ubus_proxy_peer_bind(p, up); 
+		} else {
+			p = ubus_proxy_peer_new(peer, up); 
+			ubus_id_map_alloc(&self->clients_in, &p->id_in, peer); 
+			list_add_tail(&p->list, &self->peers); 
+			if(self->debug) printf("proxy: peer connected %08x!\n", p->id_in.id); 
+		}
+		// what upstream said about itself when the connection was made
+		_ubus_proxy_send_signals(self->insock, peer, &up->signals); 
+	}
+	p->last_seen = utick_now(); 
+	if(_ubus_proxy_publishes(msg) && !_ubus_proxy_make_dedicated(self, p)){
+		_ubus_proxy_fail_calls(self, peer, msg, UBUS_STATUS_CONNECTION_FAILED); 
+		return; 
+	}
+	if(self->debug){
+		printf("proxy: proxy request from %08x to %08x\n", peer, p->upstream->id.id); 
+		printf("proxy request message: "); blob_field_dump_json(msg); 
+	}
 
-	} 
-	printf("proxy: proxy request from %08x to %08x\n", peer, p->outpeer); 
-	printf("proxy request message: "); blob_field_dump_json(msg); 
-	if(ubus_socket_send(self->outsock, p->outpeer, msg) < 0){
+	// rewrite the ids of all calls so that replies can be told apart from those of other peers on the same connection
+	int count = 0; 
+	blob_reset(&self->buf); 
+	if(blob_field_type(msg) == BLOB_FIELD_ARRAY){
+		blob_set_type(&self->buf, BLOB_FIELD_ARRAY); 
+		struct blob_field *child; 
+		blob_field_for_each_child(msg, child){
+			if(_ubus_proxy_put_call(self, p, &self->buf, child, true)) count++; 
+		}
+	} else {
+		blob_set_type(&self->buf, BLOB_FIELD_TABLE); 
+		if(_ubus_proxy_put_call(self, p, &self->buf, msg, false)) count++; 
+	}
+	if(!count) return; 
+
+	if(ubus_socket_send(self->outsock, p->upstream->id.id, blob_head(&self->buf)) < 0){
 		printf("proxy message send failed to outsocket\n"); 
+		_ubus_proxy_upstream_failed(self, p->upstream); 
 	}
-	
-	return; 
-	//TODO: fix client connect/disconnect
-	/*switch(type){
-		case UBUS_MSG_PEER_CONNECTED: {
-			// TODO: handle disconnects
-			if(!self->outsock) break; 
-			uint32_t outpeer = 0; 
-			ubus_socket_connect(self->outsock, self->outpath, &outpeer); 	
-			struct ubus_proxy_peer *p = ubus_proxy_peer_new(peer, outpeer); 	
-			ubus_id_alloc(&self->clients_in, &p->id_in, peer); 
-			ubus_id_alloc(&self->clients_out, &p->id_out, outpeer); 
-			printf("proxy: peer connected %08x!\n", p->id_in.id); 
-			//printf("proxy: set up connection between %08x and %08x\n", peer, outpeer); 
-			break; 
-		}
-		case UBUS_MSG_PEER_DISCONNECTED: {
-			// remove the client binding and close connection to the main server as well
-			struct ubus_id *id = ubus_id_find(&self->clients_in, peer); 
-			if(id){
-				printf("proxy: peer disconnect %08x!\n", id->id); 
-				struct ubus_proxy_peer *p = container_of(id, struct ubus_proxy_peer, id_in); 
-				ubus_socket_disconnect(self->outsock, p->id_out.id); 
-				ubus_id_free(&self->clients_out, &p->id_out); 
-				ubus_id_free(&self->clients_in, &p->id_in); 
-				ubus_proxy_peer_delete(&p); 
-			}
-			break; 
-		}
-		default: {
-			struct ubus_id *id = ubus_id_find(&self->clients_in, peer); 
-			if(!id) break; 
-			struct ubus_proxy_peer *p = container_of(id, struct ubus_proxy_peer, id_in); 
-			printf("proxy: proxy request from %08x to %08x\n", peer, p->outpeer); 
-			ubus_socket_send(self->outsock, p->outpeer, msg); 
-			break; 
-		}
-	}*/
 }
 
 static void _on_out_message_received(ubus_socket_t socket, uint32_t peer, struct blob_field *msg){
 	struct ubus_proxy *self = (struct ubus_proxy*)ubus_socket_get_userdata(socket); 
-	struct ubus_id *id = ubus_id_find(&self->clients_out, peer); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients_out, peer); 
 	if(!id) return; 
-	struct ubus_proxy_peer *p = container_of(id, struct ubus_proxy_peer, id_out); 
-	//printf("proxy: proxy response from %08x to %08x\n", peer, p->inpeer); 
-	printf("proxy return message: "); blob_field_dump_json(msg); 
-	if(ubus_socket_send(self->insock, p->inpeer, msg) < 0){
-		ubus_socket_disconnect(self->outsock, p->id_out.id); 
-		ubus_id_free(&self->clients_out, &p->id_out); 
-		ubus_id_free(&self->clients_in, &p->id_in); 
-		ubus_proxy_peer_delete(&p); 
+	struct ubus_proxy_upstream *up = container_of(id, struct ubus_proxy_upstream, id); 
+	if(self->debug){
+		printf("proxy return message: "); blob_field_dump_json(msg); 
+	}
+
+	// all replies of a batch belong to the peer that sent the batch
+	uint32_t inpeer = 0; 
+	int count = 0; 
+	blob_reset(&self->buf); 
+	if(blob_field_type(msg) == BLOB_FIELD_ARRAY){
+		blob_set_type(&self->buf, BLOB_FIELD_ARRAY); 
+		struct blob_field *child; 
+		blob_field_for_each_child(msg, child){
+			if(_ubus_proxy_put_reply(self, up, &self->buf, child, true, &inpeer)) count++; 
+		}
+	} else {
+		blob_set_type(&self->buf, BLOB_FIELD_TABLE); 
+		if(_ubus_proxy_put_reply(self, up, &self->buf, msg, false, &inpeer)) count++; 
+	}
+	if(!count) return; 
+
+	struct ubus_proxy_peer *p = _ubus_proxy_find_peer(self, inpeer); 
+	if(!p) return; 
+	if(ubus_socket_send(self->insock, p->inpeer, blob_head(&self->buf)) < 0){
+		// calls it still has out are dropped when their replies come in. A connection it had
+		// to itself is of no use to anyone else. 
+		if(p->upstream && p->upstream->owner == p->inpeer) _ubus_proxy_upstream_failed(self, p->upstream); 
+		_ubus_proxy_release_peer(self, &p); 
 
-		printf("proxy peer disconnected!\n"); 
+		if(self->debug) printf("proxy peer disconnected!\n"); 
 	}
 }
 
 int ubus_proxy_handle_events(struct ubus_proxy *self){
+	if(self->passthrough) return _ubus_proxy_handle_passthrough(self, 0); 
 	ubus_socket_handle_events(self->insock, 0); 	
 	ubus_socket_handle_events(self->outsock, 0); 	
+	// forget calls that upstream never answered
+	struct ubus_proxy_call *call, *tmp; 
+	for(int c = 0; self->upstream && c < self->pool_size; c++){
+		struct ubus_proxy_upstream *up = &self->upstream[c]; 
+		list_for_each_entry_safe(call, tmp, &up->pending, list){
+			if(!utick_expired(call->timeout)) break; 
+			_ubus_proxy_call_delete(self, up, &call); 
+		}
+	}
+	struct ubus_proxy_upstream *up; 
+	list_for_each_entry(up, &self->dedicated, list){
+		list_for_each_entry_safe(call, tmp, &up->pending, list){
+			if(!utick_expired(call->timeout)) break; 
+			_ubus_proxy_call_delete(self, up, &call); 
+		}
+	}
+	// we hear nothing when a peer goes away so peers on a shared connection that have nothing out are forgotten after a while.
+	// Those with a connection of their own wait for calls for their objects and are only dropped when sending to them fails. 
+	if(utick_expired(self->idle_check)){
+		struct ubus_proxy_peer *p, *ptmp; 
+		list_for_each_entry_safe(p, ptmp, &self->peers, list){
+			if(p->calls || (p->upstream && p->upstream->owner)) continue; 
+			if(!utick_expired(p->last_seen + (utick_t)UBUS_PROXY_PEER_IDLE_TIMEOUT * 1000UL)) continue; 
+			_ubus_proxy_release_peer(self, &p); 
+		}
+		self->idle_check = utick_now() + 1000000UL; 
+	}
 	return 0; 
 }
 
 int ubus_proxy_listen(struct ubus_proxy *self, const char *path){
+	if(self->passthrough){
+		self->listen_fd = _ubus_proxy_open(path, USOCK_SERVER); 
+		return (self->listen_fd < 0)?-1:0; 
+	}
 	ubus_socket_listen(self->insock, path); 
 	ubus_socket_set_userdata(self->insock, self); 
 	ubus_socket_on_message(self->insock, _on_in_message_received); 
@@ -154,6 +808,7 @@ int ubus_proxy_listen(struct ubus_proxy *self, const char *path){
 
 int ubus_proxy_connect(struct ubus_proxy *self, const char *path){
 	self->outpath = strdup(path); 
+	if(self->passthrough) return 0; 
 	ubus_socket_set_userdata(self->outsock, self); 
 	ubus_socket_on_message(self->outsock, _on_out_message_received); 
 	return 0; 
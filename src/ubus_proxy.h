@@ -13,15 +13,56 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <libutype/list.h>
+#include <libusys/uloop_timeout.h>
+#include <blobpack/blobpack.h>
 #include "ubus_id.h"
 #include "ubus_srv.h"
 
+struct ubus_proxy_upstream; 
+struct ubus_cache; 
+
+// number of connections to the upstream path that incoming peers share
+#define UBUS_PROXY_DEFAULT_POOL 4
+// time in ms after which a call that upstream has not answered is forgotten
+#define UBUS_PROXY_CALL_TIMEOUT 60000
+// time in ms after which a peer on a shared connection that has no calls out is forgotten
+#define UBUS_PROXY_PEER_IDLE_TIMEOUT 300000
+// bytes of ubus.peer.* signals kept for each peer and upstream connection
+#define UBUS_PROXY_SIGNALS_SIZE 4096
+
+// bytes that can sit in each direction of a passthrough connection before we stop reading from the sender
+#define UBUS_PROXY_PIPE_SIZE (64 * 1024)
+
 struct ubus_proxy {
-	struct avl_tree clients_in; 
-	struct avl_tree clients_out; 
+	struct ubus_id_map clients_in; 
+	struct ubus_id_map clients_out; 
 	struct ubus_socket *insock; 
 	struct ubus_socket *outsock; 
 	char *outpath; 
+
+	// upstream connections that calls of all incoming peers are multiplexed over
+	struct ubus_proxy_upstream *upstream; 
+	int pool_size; 
+	// connections of peers that publish objects and so need one to themselves
+	struct list_head dedicated; 
+	// all incoming peers we know of
+	struct list_head peers; 
+	utick_t idle_check; 
+	struct blob buf; 
+
+	// replies of read only methods (see ubus_proxy_set_cache())
+	struct ubus_cache *cache; 
+	struct blob cached; 
+
+	// passthrough mode (see ubus_proxy_set_passthrough())
+	bool passthrough; 
+	int listen_fd; 
+	struct list_head pipes; 
+
+	// print every relayed message
+	bool debug; 
 }; 
 
 struct ubus_proxy *ubus_proxy_new(struct ubus_socket **insock, struct ubus_socket **outsock); 
@@ -32,3 +73,31 @@ int ubus_proxy_handle_events(struct ubus_proxy *self);
 int ubus_proxy_listen(struct ubus_proxy *self, const char *path); 
 int ubus_proxy_connect(struct ubus_proxy *self, const char *path); 
 
+/**
+Calls of all incoming peers go out over a small pool of connections to the upstream path
+instead of one connection per peer. Each peer is bound to the connection with the fewest peers
+and the id of every call is rewritten to one that is unique on that connection so the reply can
+be sent back to the right peer under its original id. Signals that describe a peer
+(ubus.peer.*) are kept back since the connection they would describe is shared and those
+upstream sends on a shared connection go to every peer on it. A peer that publishes an object
+gets a connection of its own (with its signals passed on first) so that calls for the object
+find their way back to it. Peers on a shared connection that have no calls out are forgotten
+after UBUS_PROXY_PEER_IDLE_TIMEOUT and calls waiting on a connection that is lost are failed
+with UBUS_STATUS_CONNECTION_FAILED. Must be set before the first peer sends anything. 
+**/
+static inline void ubus_proxy_set_pool_size(struct ubus_proxy *self, int size){ if(size > 0) self->pool_size = size; }
+
+//! Answer calls that the cache has rules for from the cache. Calls that miss fill it in once they are resolved. The proxy does not take ownership of the cache.
+static inline void ubus_proxy_set_cache(struct ubus_proxy *self, struct ubus_cache *cache){ self->cache = cache; }
+
+/**
+Relay connections byte for byte instead of decoding every message on one leg and encoding it
+again on the other. Only works when both legs use the same wire format. Every incoming
+connection gets its own connection to the upstream path and data moves between the two with
+splice() through a pipe in the kernel so it is never copied into the proxy at all. The sockets
+passed to ubus_proxy_new() are not used in this mode. Must be set before ubus_proxy_listen(). 
+**/
+static inline void ubus_proxy_set_passthrough(struct ubus_proxy *self, bool on){ self->passthrough = on; }
+//! Print every relayed message (not available in passthrough mode where messages are never decoded)
+static inline void ubus_proxy_set_debug(struct ubus_proxy *self, bool on){ self->debug = on; }
+
@@ -14,44 +14,91 @@
 #include "libubus2.h"
 #include "ubus_request.h"
 #include <blobpack/blobpack.h>
+#include "ubus_slab.h"
+#include "ubus_intern.h"
 
-struct ubus_request *ubus_request_new(const char *client, const char *object, const char *method, struct blob_field *msg){
-	struct ubus_request *self = calloc(1, sizeof(struct ubus_request)); 
-	self->dst_name = strdup(client); 
-	self->object = strdup(object); 
-	self->method = strdup(method); 
-	blob_init(&self->buf, 0, 0); 	
+static void _ubus_request_ctor(void *obj){
+	struct ubus_request *self = obj; 
+	memset(self, 0, sizeof(*self)); 
+	blob_init(&self->buf, 0, 0); 
+}
+
+static struct ubus_slab _request_slab = UBUS_SLAB_INITIALIZER("request", struct ubus_request, _ubus_request_ctor); 
+
+static struct ubus_request *_ubus_request_alloc(struct blob_field *msg){
+	struct ubus_request *self = ubus_slab_alloc(&_request_slab); 
+	// recycled requests keep their buffer memory but everything else starts out clean
+	struct blob buf = self->buf; 
+	memset(self, 0, sizeof(*self)); 
+	self->buf = buf; 
+	self->priority = UBUS_MSG_PRIO_NORMAL; 
+	blob_reset(&self->buf); 
+	INIT_LIST_HEAD(&self->list); 
 	blob_put_attr(&self->buf, msg); 
 	return self; 
 }
 
+struct ubus_request *ubus_request_new(const char *client, const char *object, const char *method, struct blob_field *msg){
+	struct ubus_request *self = _ubus_request_alloc(msg); 
+	self->dst_name = ubus_intern(client); 
+	self->object = ubus_intern(object); 
+	self->method = ubus_intern(method); 
+	return self; 
+}
+
+struct ubus_request *ubus_request_new_interned(const char *client, const char *object, const char *method, struct blob_field *msg){
+	struct ubus_request *self = _ubus_request_alloc(msg); 
+	self->dst_name = ubus_intern_ref(client); 
+	self->object = ubus_intern_ref(object); 
+	self->method = ubus_intern_ref(method); 
+	return self; 
+}
+
 void ubus_request_delete(struct ubus_request **_self){
 	struct ubus_request *self = *_self; 
-	free(self->dst_name); 
-	free(self->object); 
-	free(self->method); 
-	blob_free(&self->buf); 
-	free(self); 
+	ubus_intern_release(self->dst_name); 
+	ubus_intern_release(self->object); 
+	ubus_intern_release(self->method); 
+	// small buffers are kept for the next request, a large reply does not get to pin its memory in the slab
+	if(self->buf.memlen > UBUS_SLAB_MAX_BUFFER){
+		blob_free(&self->buf); 
+		blob_init(&self->buf, 0, 0); 
+	}
+	ubus_slab_free(&_request_slab, self); 
 	*_self = NULL; 
 }
 
 void ubus_request_resolve(struct ubus_request *self, struct blob_field *msg){
+	if(self->resolved || self->failed) return; 
 	// TODO: decide whether we should have it like this
 	if(!msg){
 		blob_reset(&self->buf); 
 		msg = blob_head(&self->buf); 
 	}
-	if(self->on_resolve) self->on_resolve(self, msg); 
+	// flag goes first. Request may be handed to another thread by the callback. 
 	self->resolved = true; 
+	if(self->on_resolve) self->on_resolve(self, msg); 
 }
 
 void ubus_request_reject(struct ubus_request *self, struct blob_field *msg){
+	if(self->resolved || self->failed) return; 
 	// TODO: decide whether we should have it like this
 	if(!msg){
 		blob_reset(&self->buf); 
 		msg = blob_head(&self->buf); 
 	}
-	if(self->on_fail) self->on_fail(self, msg); 
 	self->failed = true; 
+	if(self->on_fail) self->on_fail(self, msg); 
+}
+
+int ubus_request_send_chunk(struct ubus_request *self, struct blob_field *msg){
+	if(self->resolved || self->failed || !msg) return -1; 
+	if(self->chunk_busy && self->chunk_busy(self)) return UBUS_STATUS_BUSY; 
+	if(self->on_chunk) self->on_chunk(self, msg); 
+	return UBUS_STATUS_OK; 
 }
 
+void ubus_request_forward_chunk(struct ubus_request *self, struct blob_field *msg){
+	if(self->resolved || self->failed || !msg) return; 
+	if(self->on_chunk) self->on_chunk(self, msg); 
+}
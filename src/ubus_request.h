@@ -16,19 +16,25 @@
 #include <blobpack/blobpack.h>
 #include <libusys/uloop_timeout.h>
 
+#include "ubus_message.h"
+
 struct ubus_request; 
+struct ubus_reply_queue; 
 
 typedef void (*ubus_request_cb_t)(struct ubus_request *req, struct blob_field *msg); 
+typedef bool (*ubus_request_busy_cb_t)(struct ubus_request *req); 
 
 struct ubus_request {
 	struct list_head list; 
-	char *object; 
-	char *method; 
+	// routing names are interned (see ubus_intern.h) so they can be compared by pointer
+	const char *object; 
+	const char *method; 
 	struct blob buf; 
 	uint16_t seq; 
+	uint8_t priority; // enum ubus_msg_priority. Replies go out with the priority of the call. 
 
 	uint32_t src_id; 
-	char *dst_name; 
+	const char *dst_name; 
 	uint32_t dst_id; 
 
 	bool resolved; 
@@ -38,12 +44,21 @@ struct ubus_request {
 
 	ubus_request_cb_t on_resolve; 
 	ubus_request_cb_t on_fail; 
+	ubus_request_cb_t on_chunk; 
+	// set by the context on calls it serves. True while too much of the reply is still queued for the caller. 
+	ubus_request_busy_cb_t chunk_busy; 
+
+	// set for requests sent from a thread other than the one that handles events of the context.
+	// Callbacks of those requests run on the sending thread (see ubus_process_replies()). 
+	struct ubus_reply_queue *reply_queue; 
 
 	void *user_data; 
 }; 
 
 #define UBUS_LOCAL_BUS (NULL)
 struct ubus_request *ubus_request_new(const char *client, const char *object, const char *method, struct blob_field *msg); 
+//! Same as ubus_request_new() but client, object and method must already be interned. Does not touch the intern table.
+struct ubus_request *ubus_request_new_interned(const char *client, const char *object, const char *method, struct blob_field *msg); 
 void ubus_request_delete(struct ubus_request **self); 
 
 static inline void ubus_request_set_userdata(struct ubus_request *self, void *ptr){
@@ -54,8 +69,26 @@ static inline void* ubus_request_get_userdata(struct ubus_request *self) {
 	return self->user_data; 
 }
 
+//! Answer the request. Only the first resolve or reject of a request has any effect. 
 void ubus_request_resolve(struct ubus_request *self, struct blob_field *msg); 
 void ubus_request_reject(struct ubus_request *self, struct blob_field *msg); 
+/**
+Send part of a reply before the request is resolved. Each chunk reaches the caller through its
+on_chunk callback as soon as it arrives so a method can stream a large reply without building
+all of it in memory. The request must still be resolved (or rejected) after the last chunk. 
+
+Returns UBUS_STATUS_OK once the chunk is on its way and -1 if the request has been answered
+already. While more than the chunk backlog of the context (see ubus_set_chunk_backlog()) is
+still queued for the caller the chunk is not sent and UBUS_STATUS_BUSY is returned. The method
+has to send the same chunk again later. 
+**/
+int ubus_request_send_chunk(struct ubus_request *self, struct blob_field *msg); 
+//! Pass on a chunk without looking at the backlog. For chunks that are relayed from another peer and can not be held back. 
+void ubus_request_forward_chunk(struct ubus_request *self, struct blob_field *msg); 
+
+static inline void ubus_request_set_priority(struct ubus_request *self, enum ubus_msg_priority prio){
+	self->priority = prio; 
+}
 
 static inline void ubus_request_on_resolve(struct ubus_request *self, ubus_request_cb_t cb){
 	self->on_resolve = cb; 
@@ -65,3 +98,8 @@ static inline void ubus_request_on_reject(struct ubus_request *self, ubus_reques
 	self->on_fail = cb; 
 }
 
+//! Called for every chunk of a streamed reply. Without it chunks are dropped and only the final reply is seen. 
+static inline void ubus_request_on_chunk(struct ubus_request *self, ubus_request_cb_t cb){
+	self->on_chunk = cb; 
+}
+
@@ -20,8 +20,8 @@
 struct ubus_forward_info {
 	struct list_head list; 
 	uint32_t attached_id; 
-	char *client; 
-	char *object_name; 
+	const char *client; // interned
+	const char *object_name; // interned
 	struct ubus_object *object; 
 }; 
 
@@ -58,6 +58,11 @@ void _on_forward_failed(struct ubus_request *req, struct blob_field *res){
 	ubus_request_reject(or, res); 
 }
 
+void _on_forward_chunk(struct ubus_request *req, struct blob_field *res){
+	struct ubus_request *or = (struct ubus_request*)ubus_request_get_userdata(req); 
+	ubus_request_forward_chunk(or, res); 
+}
+
 struct ubus_object *_find_object(struct ubus_server *self, const char *path){
 	struct ubus_forward_info *info; 
 	list_for_each_entry(info, &self->objects, list){
@@ -70,10 +75,13 @@ static int _on_forward_call(struct ubus_method *self, struct ubus_context *ctx,
 	struct ubus_forward_info *info = ubus_object_get_userdata(obj); 
 	assert(info); 
 
-	printf("forward call from %s to %s %s\n", req->dst_name, info->client, info->object_name); 
-	struct ubus_request *r = ubus_request_new(info->client, info->object_name, self->name, msg); 
+	// relay the arguments as they are. Only builds a full request when the peer can not take the call right now. 
+	if(ubus_forward_request(ctx, req, info->client, info->object_name, self->name, msg) == 0) return 0; 
+
+	struct ubus_request *r = ubus_request_new_interned(info->client, info->object_name, self->name, msg); 
 	ubus_request_on_resolve(r, &_on_forward_response); 
 	ubus_request_on_reject(r, &_on_forward_failed); 
+	ubus_request_on_chunk(r, &_on_forward_chunk); 
 	ubus_request_set_userdata(r, req); 
 	ubus_send_request(ctx, &r); 
 
@@ -128,8 +136,8 @@ static int _on_call(struct ubus_method *_method, struct ubus_context *ctx, struc
 		return 0; 
 	}
 	
-	int ret; 
-	if((ret = ubus_method_invoke(m, ctx, obj, req, attr)) != 0){
+	int ret = UBUS_STATUS_INVALID_ARGUMENT; 
+	if(!ubus_method_validate(m, attr) || (ret = ubus_method_invoke(m, ctx, obj, req, attr)) != 0){
 		blob_reset(&buf); 
 		blob_put_int(&buf, ret); 
 		blob_put_string(&buf, ubus_status_to_string(ret));  
@@ -193,17 +201,21 @@ static int _on_publish_object(struct ubus_method *m, struct ubus_context *ctx, s
 	struct blob_field *mname, *margs; 
 	blob_field_for_each_kv(params[1], mname, margs){
 		struct ubus_method *method = ubus_method_new(blob_field_get_string(mname), _on_forward_call); 
-		struct blob_field *arg; 
-		// copy over each argument 
+		struct blob_field *arg, *fields[3]; 
+		// add each argument again so that calls are checked here already before they are forwarded
 		blob_field_for_each_child(margs, arg){ 
-			blob_put_attr(&method->signature, arg); 
+			if(!blob_field_parse(arg, "iss", fields, 3)) continue; 
+			switch(blob_field_get_int(fields[0])){
+				case UBUS_METHOD_PARAM_IN: ubus_method_add_param(method, blob_field_get_string(fields[1]), blob_field_get_string(fields[2])); break; 
+				case UBUS_METHOD_PARAM_OUT: ubus_method_add_return(method, blob_field_get_string(fields[1]), blob_field_get_string(fields[2])); break; 
+			}
 		}
 		ubus_object_add_method(obj, &method); 
 	}
 
 	struct ubus_forward_info *info = forward_info_new(); 
-	info->client = strdup(req->dst_name); 
-	info->object_name = strdup(objname); 
+	info->client = ubus_intern_ref(req->dst_name); 
+	info->object_name = ubus_intern(objname); 
 	info->object = obj; 
 	ubus_object_set_userdata(obj, info); 
 
@@ -247,7 +259,7 @@ struct ubus_server *ubus_server_new(const char *name){
 	struct ubus_object *obj = ubus_object_new("root"); 
 	struct ubus_method *method = ubus_method_new("publish", _on_publish_object); 
 	ubus_method_add_param(method, "name", "s"); 
-	ubus_method_add_param(method, "signature", "[sa]"); 
+	ubus_method_add_param(method, "signature", "{sa}"); 
 	ubus_object_add_method(obj, &method); 
 
 	method = ubus_method_new("call", _on_call); 
@@ -279,8 +291,9 @@ void ubus_server_delete(struct ubus_server **self){
 	// free the info objects but we can only do this like this because we also free objects
 	// otherwise we would have to look up each object as well and set userdata to null!
 	list_for_each_entry_safe(info, tmp, &(*self)->objects, list){
-		free(info->client); 
-		free(info->object); 
+		ubus_intern_release(info->client); 
+		ubus_intern_release(info->object_name); 
+		ubus_object_delete(&info->object); 
 		free(info); 
 	}
 
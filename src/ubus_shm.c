@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <blobpack/blobpack.h>
+
+#include "ubus_shm.h"
+
+#define UBUS_SHM_RING_MASK (UBUS_SHM_RING_SIZE - 1)
+#define UBUS_SHM_RECORD_WRAP 0xffffffff
+#define UBUS_SHM_RECORD_MORE 0x80000000
+#define UBUS_SHM_RECORD_ALIGN(x) (((x) + 7) & ~7)
+#define UBUS_SHM_CACHELINE 64
+
+/**
+Head and tail are free running byte counters. Producer only writes head, consumer only
+writes tail and waiting. Each lives on its own cache line so that the two sides do not
+keep stealing the line from each other.
+
+Every record is a 32 bit length followed by data and padded to 8 bytes. If a record does
+not fit before the end of the ring then a wrap marker is written and the record starts
+at the beginning of the ring instead. Messages that do not fit into one record are split
+into fragments and every fragment except the last one has the top bit of its length set.
+**/
+struct ubus_shm_ring {
+	uint64_t head __attribute__((aligned(UBUS_SHM_CACHELINE))); 
+	uint64_t tail __attribute__((aligned(UBUS_SHM_CACHELINE))); 
+	uint32_t waiting __attribute__((aligned(UBUS_SHM_CACHELINE))); 
+	char data[UBUS_SHM_RING_SIZE] __attribute__((aligned(UBUS_SHM_CACHELINE))); 
+}; 
+
+static void _ubus_shm_ring_init(struct ubus_shm_ring *self){
+	self->head = 0; 
+	self->tail = 0; 
+	self->waiting = 0; 
+}
+
+static int _ubus_shm_ring_write(struct ubus_shm_ring *self, const void *data, uint32_t size, uint32_t flags){
+	uint32_t rec = UBUS_SHM_RECORD_ALIGN(sizeof(uint32_t) + size); 
+	if(rec > UBUS_SHM_RING_SIZE / 2) return -EMSGSIZE; 
+
+	uint64_t head = self->head; 
+	uint64_t tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE); 
+	uint32_t pos = head & UBUS_SHM_RING_MASK; 
+	uint32_t contiguous = UBUS_SHM_RING_SIZE - pos; 
+	uint32_t needed = (rec > contiguous)?(contiguous + rec):rec; 
+
+	if(UBUS_SHM_RING_SIZE - (head - tail) < needed) return -EAGAIN; 
+
+	if(rec > contiguous){
+		*(uint32_t*)(self->data + pos) = UBUS_SHM_RECORD_WRAP;
+		head += contiguous; 
+		pos = 0; 
+	}
+
+	*(uint32_t*)(self->data + pos) = size | flags;
+	memcpy(self->data + pos + sizeof(uint32_t), data, size); 
+
+	__atomic_store_n(&self->head, head + rec, __ATOMIC_RELEASE); 
+	return 0; 
+}
+
+/**
+Head and every record length are written by the other process, so none of them are trusted.
+Anything that the writer above would never produce is a protocol error and the caller drops
+the connection. Every length is loaded exactly once so the peer can not change it between the
+check and the copy. The record stays in the ring until it is consumed.
+**/
+static int _ubus_shm_ring_peek(struct ubus_shm_ring *self, const char **data, uint32_t *len, uint64_t *next){
+	uint64_t tail = self->tail; 
+	uint64_t head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE); 
+	if(head == tail) return -EAGAIN; 
+
+	uint64_t used = head - tail; 
+	if(used > UBUS_SHM_RING_SIZE) return -EPROTO; 
+
+	uint32_t pos = tail & UBUS_SHM_RING_MASK; 
+	uint32_t size = __atomic_load_n((uint32_t*)(self->data + pos), __ATOMIC_RELAXED); 
+	if(size == UBUS_SHM_RECORD_WRAP){
+		// a wrap marker is always followed by a record at the start of the ring
+		uint32_t skip = UBUS_SHM_RING_SIZE - pos; 
+		if(used <= skip) return -EPROTO; 
+		used -= skip; 
+		tail += skip; 
+		pos = 0; 
+		size = __atomic_load_n((uint32_t*)(self->data + pos), __ATOMIC_RELAXED); 
+	}
+
+	// records are never empty, never larger than half the ring and never run past its end
+	uint32_t data_size = size & ~UBUS_SHM_RECORD_MORE; 
+	if(data_size == 0 || data_size > UBUS_SHM_RING_SIZE / 2) return -EPROTO; 
+	uint32_t rec = UBUS_SHM_RECORD_ALIGN(sizeof(uint32_t) + data_size); 
+	if(rec > used || pos + rec > UBUS_SHM_RING_SIZE) return -EPROTO; 
+
+	*data = self->data + pos + sizeof(uint32_t); 
+	*len = size; 
+	*next = tail + rec; 
+	return 1; 
+}
+
+static void _ubus_shm_ring_consume(struct ubus_shm_ring *self, uint64_t next){
+	__atomic_store_n(&self->tail, next, __ATOMIC_RELEASE); 
+}
+
+static bool _ubus_shm_ring_empty(struct ubus_shm_ring *self){
+	return __atomic_load_n(&self->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&self->tail, __ATOMIC_SEQ_CST); 
+}
+
+static int _ubus_shm_channel_map(struct ubus_shm_channel *self, int memfd, bool creator){
+	self->mem_size = 2 * sizeof(struct ubus_shm_ring); 
+	self->mem = mmap(NULL, self->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0); 
+	if(self->mem == MAP_FAILED){
+		self->mem = NULL; 
+		return -1; 
+	}
+	struct ubus_shm_ring *rings = (struct ubus_shm_ring*)self->mem; 
+	// first ring always goes from connecting side to listening side
+	self->tx = (creator)?&rings[0]:&rings[1]; 
+	self->rx = (creator)?&rings[1]:&rings[0]; 
+	return 0; 
+}
+
+int ubus_shm_channel_connect(struct ubus_shm_channel *self, int sock){
+	memset(self, 0, sizeof(*self)); 
+	blob_init(&self->rx_buf, 0, 0); 
+	self->sock = sock; 
+	self->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	self->tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+
+	int memfd = memfd_create("ubus-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING); 
+	if(memfd < 0 || self->rx_efd < 0 || self->tx_efd < 0) goto fail; 
+	if(ftruncate(memfd, 2 * sizeof(struct ubus_shm_ring)) < 0) goto fail; 
+	// the listening side refuses memory that could still be shrunk under its mapping
+	if(fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) goto fail; 
+	if(_ubus_shm_channel_map(self, memfd, true) < 0) goto fail; 
+
+	_ubus_shm_ring_init(self->tx); 
+	_ubus_shm_ring_init(self->rx); 
+
+	// pass memfd and both eventfds over to the other side. Our tx eventfd is their rx eventfd.
+	int fds[3] = { memfd, self->tx_efd, self->rx_efd }; 
+	char cbuf[CMSG_SPACE(sizeof(fds))]; 
+	char magic = 'U'; 
+	struct iovec iov = { .iov_base = &magic, .iov_len = 1 }; 
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) }; 
+	memset(cbuf, 0, sizeof(cbuf)); 
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); 
+	cmsg->cmsg_level = SOL_SOCKET; 
+	cmsg->cmsg_type = SCM_RIGHTS; 
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds)); 
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds)); 
+	if(sendmsg(sock, &mh, MSG_NOSIGNAL) != 1) goto fail; 
+
+	close(memfd); 
+	return 0; 
+fail:
+	if(memfd >= 0) close(memfd); 
+	ubus_shm_channel_destroy(self); 
+	return -1; 
+}
+
+int ubus_shm_channel_accept(struct ubus_shm_channel *self, int sock){
+	memset(self, 0, sizeof(*self)); 
+	blob_init(&self->rx_buf, 0, 0); 
+	self->sock = sock; 
+	self->rx_efd = self->tx_efd = -1; 
+
+	int fds[3] = { -1, -1, -1 }; 
+	char cbuf[CMSG_SPACE(sizeof(fds))]; 
+	char magic = 0; 
+	struct iovec iov = { .iov_base = &magic, .iov_len = 1 }; 
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) }; 
+	ssize_t ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT); 
+	// nothing sent yet. The socket stays with self until the next try.
+	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -EAGAIN; 
+
+	struct cmsghdr *cmsg = (ret == 1)?CMSG_FIRSTHDR(&mh):NULL; 
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+		// whatever we were sent is ours to close, even if it is not what we expected
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); 
+		int *recvd = (int*)CMSG_DATA(cmsg); 
+		if(n != 3){
+			for(size_t c = 0; c < n && c < 3; c++) close(recvd[c]); 
+			goto fail; 
+		}
+		memcpy(fds, recvd, sizeof(fds)); 
+	}
+	self->rx_efd = fds[1]; 
+	self->tx_efd = fds[2]; 
+	if(magic != 'U' || fds[0] < 0 || (mh.msg_flags & MSG_CTRUNC)) goto fail; 
+
+	// memory must be exactly the two rings and sealed so that the peer can not shrink it under our mapping
+	struct stat st; 
+	int seals = fcntl(fds[0], F_GET_SEALS); 
+	if(fstat(fds[0], &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != 2 * sizeof(struct ubus_shm_ring)) goto fail; 
+	if(seals < 0 || !(seals & F_SEAL_SHRINK)) goto fail; 
+	if(_ubus_shm_channel_map(self, fds[0], false) < 0) goto fail; 
+
+	close(fds[0]); 
+	return 0; 
+fail:
+	if(fds[0] >= 0) close(fds[0]); 
+	ubus_shm_channel_destroy(self); 
+	return -1; 
+}
+
+void ubus_shm_channel_destroy(struct ubus_shm_channel *self){
+	if(self->mem) munmap(self->mem, self->mem_size); 
+	if(self->rx_efd >= 0) close(self->rx_efd); 
+	if(self->tx_efd >= 0) close(self->tx_efd); 
+	if(self->sock >= 0) close(self->sock); 
+	blob_free(&self->rx_buf); 
+	self->rx_total = self->rx_have = self->tx_done = 0; 
+	self->mem = NULL; 
+	self->rx = self->tx = NULL; 
+	self->rx_efd = self->tx_efd = self->sock = -1; 
+}
+
+int ubus_shm_channel_write(struct ubus_shm_channel *self, const void *data, uint32_t size){
+	if(size == 0 || size > UBUS_SHM_MAX_MESSAGE) return -EMSGSIZE; 
+
+	int ret = 0; 
+	bool wrote = false; 
+	if(!self->tx_done && UBUS_SHM_RECORD_ALIGN(sizeof(uint32_t) + size) <= UBUS_SHM_RING_SIZE / 2){
+		ret = _ubus_shm_ring_write(self->tx, data, size, 0); 
+		wrote = ret == 0; 
+	} else {
+		// fragments go in as long as there is room. The rest follows on the next call.
+		while(self->tx_done < size){
+			uint32_t len = size - self->tx_done; 
+			if(len > UBUS_SHM_FRAGMENT_SIZE) len = UBUS_SHM_FRAGMENT_SIZE; 
+			uint32_t flags = (self->tx_done + len < size)?UBUS_SHM_RECORD_MORE:0; 
+			if((ret = _ubus_shm_ring_write(self->tx, (const char*)data + self->tx_done, len, flags)) < 0) break; 
+			self->tx_done += len; 
+			wrote = true; 
+		}
+		if(self->tx_done == size) self->tx_done = 0; 
+	}
+	if(!wrote) return ret; 
+
+	// only pay for a system call if the other side is sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); 
+	if(__atomic_load_n(&self->tx->waiting, __ATOMIC_SEQ_CST)){
+		uint64_t one = 1; 
+		if(write(self->tx_efd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+			perror("eventfd"); 
+		}
+	}
+	return ret; 
+}
+
+/**
+A message that came in one record is copied straight into msg. Fragments are collected in
+rx_buf which is then swapped with the buffer of msg. The size of the whole message is taken
+from the field header in the first fragment and every following fragment has to fit into it.
+**/
+int ubus_shm_channel_read(struct ubus_shm_channel *self, struct ubus_message *msg){
+	while(1){
+		const char *data; 
+		uint32_t len; 
+		uint64_t next; 
+		int ret = _ubus_shm_ring_peek(self->rx, &data, &len, &next); 
+		if(ret < 0) return ret; 
+
+		bool more = len & UBUS_SHM_RECORD_MORE; 
+		len &= ~UBUS_SHM_RECORD_MORE; 
+
+		if(!self->rx_total && !more){
+			if(len < sizeof(struct blob_field)) return -EPROTO; 
+			if(!blob_resize(&msg->buf, len)) return -ENOMEM; 
+			memcpy(blob_head(&msg->buf), data, len); 
+			// the field has to fit into what was copied or whoever parses it next reads past the buffer
+			if(blob_field_raw_pad_len(blob_head(&msg->buf)) > len) return -EPROTO; 
+			_ubus_shm_ring_consume(self->rx, next); 
+			return 1; 
+		}
+
+		if(!self->rx_total){
+			struct blob_field hdr; 
+			if(len < sizeof(hdr)) return -EPROTO; 
+			memcpy(&hdr, data, sizeof(hdr)); 
+			uint32_t total = blob_field_raw_pad_len(&hdr); 
+			if(total <= len || total > UBUS_SHM_MAX_MESSAGE) return -EPROTO; 
+			if(!blob_resize(&self->rx_buf, total)) return -ENOMEM; 
+			self->rx_total = total; 
+			self->rx_have = 0; 
+		}
+
+		if(len > self->rx_total - self->rx_have) return -EPROTO; 
+		memcpy((char*)blob_head(&self->rx_buf) + self->rx_have, data, len); 
+		self->rx_have += len; 
+		_ubus_shm_ring_consume(self->rx, next); 
+
+		if(more){
+			if(self->rx_have == self->rx_total) return -EPROTO; 
+			continue; 
+		}
+		// the header may have been changed in the ring after its size was taken
+		if(self->rx_have != self->rx_total || blob_field_raw_pad_len(blob_head(&self->rx_buf)) != self->rx_total) return -EPROTO; 
+
+		struct blob tmp = msg->buf; 
+		msg->buf = self->rx_buf; 
+		self->rx_buf = tmp; 
+		self->rx_total = self->rx_have = 0; 
+		return 1; 
+	}
+}
+
+bool ubus_shm_channel_prepare_wait(struct ubus_shm_channel *self){
+	__atomic_store_n(&self->rx->waiting, 1, __ATOMIC_SEQ_CST); 
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); 
+	if(!_ubus_shm_ring_empty(self->rx)){
+		__atomic_store_n(&self->rx->waiting, 0, __ATOMIC_RELAXED); 
+		return false; 
+	}
+	return true; 
+}
+
+void ubus_shm_channel_finish_wait(struct ubus_shm_channel *self){
+	uint64_t val; 
+	__atomic_store_n(&self->rx->waiting, 0, __ATOMIC_RELAXED); 
+	if(read(self->rx_efd, &val, sizeof(val)) < 0 && errno != EAGAIN){
+		perror("eventfd"); 
+	}
+}
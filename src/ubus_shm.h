@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ubus_message.h"
+
+/**
+Shared memory channel between two processes on the same host.
+
+The connecting side creates a memfd holding two single producer / single consumer
+rings (one for each direction) and two eventfds and passes them to the listening
+side over a unix socket. After that the unix socket is only used to detect that the
+other side has gone away.
+
+Messages are copied into the ring by the sender and out of the ring by the receiver
+without any system calls. An eventfd is only signalled when the receiving side has
+announced that it is about to go to sleep.
+**/
+
+// size of the data area of each ring. Must be a power of two.
+#define UBUS_SHM_RING_SIZE (1024 * 1024)
+// messages larger than half the ring go in as fragments of this size
+#define UBUS_SHM_FRAGMENT_SIZE (UBUS_SHM_RING_SIZE / 4)
+// largest message either side accepts
+#define UBUS_SHM_MAX_MESSAGE (64 * 1024 * 1024)
+
+struct ubus_shm_ring; 
+
+struct ubus_shm_channel {
+	struct ubus_shm_ring *rx; 
+	struct ubus_shm_ring *tx; 
+	int rx_efd; // signalled by other side when it has written to rx
+	int tx_efd; // signalled by us when we have written to tx
+	int sock; 	// unix socket used for handshake and hangup detection
+	void *mem; 
+	size_t mem_size; 
+	uint32_t tx_done; // bytes of a fragmented message that are already in tx
+	struct blob rx_buf; // fragments of a message that is not complete yet
+	uint32_t rx_total; 
+	uint32_t rx_have; 
+}; 
+
+//! Create shared memory for a new channel and pass it to the listening side over connected unix socket. Takes ownership of sock.
+int ubus_shm_channel_connect(struct ubus_shm_channel *self, int sock); 
+//! Receive shared memory of a new channel from an accepted unix socket. Takes ownership of sock. Does not block: returns -EAGAIN if the peer has not sent anything yet (call again once sock is readable) and -1 if the handshake failed.
+int ubus_shm_channel_accept(struct ubus_shm_channel *self, int sock); 
+void ubus_shm_channel_destroy(struct ubus_shm_channel *self); 
+
+//! Write a message into the tx ring. Returns 0 once all of it is in, -EAGAIN if there is currently not enough space and -EMSGSIZE if it is larger than UBUS_SHM_MAX_MESSAGE. A large message can go in partly: after -EAGAIN the same message has to be written again before any other.
+int ubus_shm_channel_write(struct ubus_shm_channel *self, const void *data, uint32_t size); 
+//! Read next message from rx ring into msg. Returns 1 if a message was read, -EAGAIN if ring is empty and -EPROTO if the peer has corrupted the ring (drop the connection).
+int ubus_shm_channel_read(struct ubus_shm_channel *self, struct ubus_message *msg); 
+
+//! Announce that we are about to sleep on rx_efd. Returns false if data arrived in the meantime and we should not sleep.
+bool ubus_shm_channel_prepare_wait(struct ubus_shm_channel *self); 
+//! Clear sleep announcement and drain the eventfd after waking up.
+void ubus_shm_channel_finish_wait(struct ubus_shm_channel *self); 
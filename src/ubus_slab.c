@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubus_slab.h"
+
+// free objects are linked through a word that sits right after the object so that free does not clobber constructed state
+struct ubus_slab_free {
+	struct ubus_slab_free *next; 
+}; 
+
+#define _ubus_slab_link_offset(self) (((self)->size + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+static inline struct ubus_slab_free *_ubus_slab_link(struct ubus_slab *self, void *obj){
+	return (struct ubus_slab_free*)((char*)obj + _ubus_slab_link_offset(self)); 
+}
+
+static inline void _ubus_slab_push(struct ubus_slab *self, void *obj){
+	_ubus_slab_link(self, obj)->next = self->free_list; 
+	self->free_list = obj; 
+	self->stats.free++; 
+}
+
+static inline void *_ubus_slab_pop(struct ubus_slab *self){
+	void *obj = self->free_list; 
+	if(!obj) return NULL; 
+	self->free_list = _ubus_slab_link(self, obj)->next; 
+	self->stats.free--; 
+	return obj; 
+}
+
+struct ubus_slab_chunk {
+	struct ubus_slab_chunk *next; 
+	// objects follow
+}; 
+
+struct ubus_slab_magazine {
+	void *objs[UBUS_SLAB_MAGAZINE_SIZE]; 
+	int count; 
+	uint32_t allocs; 
+	uint32_t frees; 
+}; 
+
+static struct {
+	pthread_mutex_t lock; 
+	struct ubus_slab *slabs[UBUS_SLAB_MAX]; 
+	int count; 
+	pthread_key_t key; 
+	pthread_once_t once; 
+} _registry = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.count = 0,
+	.once = PTHREAD_ONCE_INIT
+}; 
+
+static __thread struct ubus_slab_magazine _magazines[UBUS_SLAB_MAX]; 
+static __thread int _magazines_registered = 0; 
+
+static void _ubus_slab_thread_exit(void *arg){
+	ubus_slab_flush_thread(); 
+}
+
+static void _ubus_slab_registry_init(void){
+	pthread_key_create(&_registry.key, _ubus_slab_thread_exit); 
+}
+
+static int _ubus_slab_register(struct ubus_slab *self){
+	pthread_mutex_lock(&_registry.lock); 
+	if(self->index < 0 && _registry.count < UBUS_SLAB_MAX){
+		_registry.slabs[_registry.count] = self; 
+		__atomic_store_n(&self->index, _registry.count, __ATOMIC_RELEASE); 
+		_registry.count++; 
+	}
+	pthread_mutex_unlock(&_registry.lock); 
+	return self->index; 
+}
+
+static size_t _ubus_slab_obj_size(struct ubus_slab *self){
+	return (_ubus_slab_link_offset(self) + sizeof(struct ubus_slab_free) + 15) & ~(size_t)15; 
+}
+
+// must be called with the slab locked
+static void _ubus_slab_grow(struct ubus_slab *self){
+	size_t obj_size = _ubus_slab_obj_size(self); 
+	size_t hdr_size = (sizeof(struct ubus_slab_chunk) + 15) & ~(size_t)15; 
+	struct ubus_slab_chunk *chunk = calloc(1, hdr_size + obj_size * UBUS_SLAB_CHUNK_OBJECTS); 
+	if(!chunk) return; 
+	chunk->next = self->chunks; 
+	self->chunks = chunk; 
+	char *objs = (char*)chunk + hdr_size; 
+	for(int c = UBUS_SLAB_CHUNK_OBJECTS - 1; c >= 0; c--){
+		void *obj = objs + c * obj_size; 
+		if(self->ctor) self->ctor(obj); 
+		_ubus_slab_push(self, obj); 
+	}
+	self->stats.chunks++; 
+	self->stats.objects += UBUS_SLAB_CHUNK_OBJECTS; 
+}
+
+static void _ubus_slab_refill(struct ubus_slab *self, struct ubus_slab_magazine *mag){
+	pthread_mutex_lock(&self->lock); 
+	self->stats.refills++; 
+	self->stats.allocs += mag->allocs; 
+	self->stats.frees += mag->frees; 
+	mag->allocs = mag->frees = 0; 
+	// take half a magazine so that the next few frees do not immediately flush it again
+	while(mag->count < UBUS_SLAB_MAGAZINE_SIZE / 2){
+		if(!self->free_list) _ubus_slab_grow(self); 
+		void *obj = _ubus_slab_pop(self); 
+		if(!obj) break; 
+		mag->objs[mag->count++] = obj; 
+	}
+	pthread_mutex_unlock(&self->lock); 
+}
+
+static void _ubus_slab_flush(struct ubus_slab *self, struct ubus_slab_magazine *mag, int keep){
+	pthread_mutex_lock(&self->lock); 
+	self->stats.flushes++; 
+	self->stats.allocs += mag->allocs; 
+	self->stats.frees += mag->frees; 
+	mag->allocs = mag->frees = 0; 
+	while(mag->count > keep){
+		_ubus_slab_push(self, mag->objs[--mag->count]); 
+	}
+	pthread_mutex_unlock(&self->lock); 
+}
+
+static struct ubus_slab_magazine *_ubus_slab_magazine(struct ubus_slab *self){
+	int index = __atomic_load_n(&self->index, __ATOMIC_ACQUIRE); 
+	if(index < 0) index = _ubus_slab_register(self); 
+	if(index < 0) return NULL; 
+	if(!_magazines_registered){
+		// make sure that objects cached by this thread are handed back when it exits
+		pthread_once(&_registry.once, _ubus_slab_registry_init); 
+		pthread_setspecific(_registry.key, (void*)1); 
+		_magazines_registered = 1; 
+	}
+	return &_magazines[index]; 
+}
+
+void *ubus_slab_alloc(struct ubus_slab *self){
+	struct ubus_slab_magazine *mag = _ubus_slab_magazine(self); 
+	if(!mag){
+		// more slabs than thread caches. Go straight to the shared list.
+		pthread_mutex_lock(&self->lock); 
+		if(!self->free_list) _ubus_slab_grow(self); 
+		void *obj = _ubus_slab_pop(self); 
+		if(obj) self->stats.allocs++; 
+		pthread_mutex_unlock(&self->lock); 
+		return obj; 
+	}
+	if(!mag->count) _ubus_slab_refill(self, mag); 
+	if(!mag->count) return NULL; 
+	mag->allocs++; 
+	return mag->objs[--mag->count]; 
+}
+
+void ubus_slab_free(struct ubus_slab *self, void *obj){
+	if(!obj) return; 
+	struct ubus_slab_magazine *mag = _ubus_slab_magazine(self); 
+	if(!mag){
+		pthread_mutex_lock(&self->lock); 
+		_ubus_slab_push(self, obj); 
+		self->stats.frees++; 
+		pthread_mutex_unlock(&self->lock); 
+		return; 
+	}
+	if(mag->count == UBUS_SLAB_MAGAZINE_SIZE) _ubus_slab_flush(self, mag, UBUS_SLAB_MAGAZINE_SIZE / 2); 
+	mag->frees++; 
+	mag->objs[mag->count++] = obj; 
+}
+
+void ubus_slab_flush_thread(void){
+	pthread_mutex_lock(&_registry.lock); 
+	int count = _registry.count; 
+	pthread_mutex_unlock(&_registry.lock); 
+	for(int c = 0; c < count; c++){
+		struct ubus_slab_magazine *mag = &_magazines[c]; 
+		if(mag->count || mag->allocs || mag->frees) _ubus_slab_flush(_registry.slabs[c], mag, 0); 
+	}
+}
+
+void ubus_slab_get_stats(struct ubus_slab *self, struct ubus_slab_stats *stats){
+	pthread_mutex_lock(&self->lock); 
+	memcpy(stats, &self->stats, sizeof(*stats)); 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void ubus_slab_dump_stats(FILE *out){
+	pthread_mutex_lock(&_registry.lock); 
+	int count = _registry.count; 
+	pthread_mutex_unlock(&_registry.lock); 
+	fprintf(out, "%-16s %6s %8s %8s %8s %12s %12s %10s %10s\n", "slab", "size", "chunks", "objects", "free", "allocs", "frees", "refills", "flushes"); 
+	for(int c = 0; c < count; c++){
+		struct ubus_slab_stats st; 
+		ubus_slab_get_stats(_registry.slabs[c], &st); 
+		fprintf(out, "%-16s %6zu %8u %8u %8u %12llu %12llu %10llu %10llu\n", _registry.slabs[c]->name, st.obj_size,
+			st.chunks, st.objects, st.free, (unsigned long long)st.allocs, (unsigned long long)st.frees,
+			(unsigned long long)st.refills, (unsigned long long)st.flushes); 
+	}
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+Slab allocator for the small fixed size objects that are created and destroyed for every
+message (messages, requests, transport frames).
+
+Objects are carved out of larger chunks that are never given back to the system, so the
+heap does not fragment under load. Every thread keeps a small cache (magazine) of free
+objects for each slab so that most allocations do not touch the shared lock at all. The
+magazine exchanges objects with the shared free list in batches.
+
+An optional constructor runs once when an object is first carved out of a chunk. Objects
+are not cleared when they are freed so anything the constructor set up (like a blob
+buffer) survives and is reused by the next allocation.
+**/
+
+// maximum number of slabs in the process (each gets a magazine in every thread)
+#define UBUS_SLAB_MAX 16
+// number of free objects cached per thread per slab
+#define UBUS_SLAB_MAGAZINE_SIZE 32
+// number of objects allocated at once when slab runs out of free objects
+#define UBUS_SLAB_CHUNK_OBJECTS 64
+// objects whose blob buffer has grown past this give it back before they return to their slab
+#define UBUS_SLAB_MAX_BUFFER (64 * 1024)
+
+typedef void (*ubus_slab_ctor_t)(void *obj); 
+
+struct ubus_slab_stats {
+	size_t obj_size; 
+	uint32_t chunks; 	// chunks allocated from the system
+	uint32_t objects; 	// total objects in all chunks
+	uint32_t free; 		// objects on the shared free list (does not include thread caches)
+	uint64_t allocs; 	// updated in batches as thread caches exchange objects with the shared list
+	uint64_t frees; 
+	uint64_t refills; 	// number of times a thread cache had to go to the shared list
+	uint64_t flushes; 	// number of times a thread cache returned objects to the shared list
+}; 
+
+struct ubus_slab {
+	const char *name; 
+	size_t size; 
+	ubus_slab_ctor_t ctor; 
+	int index; 
+	pthread_mutex_t lock; 
+	void *free_list; 
+	void *chunks; 
+	struct ubus_slab_stats stats; 
+}; 
+
+#define UBUS_SLAB_INITIALIZER(_name, _type, _ctor) { \
+	.name = _name, \
+	.size = sizeof(_type), \
+	.ctor = _ctor, \
+	.index = -1, \
+	.lock = PTHREAD_MUTEX_INITIALIZER, \
+	.free_list = NULL, \
+	.chunks = NULL, \
+	.stats = { .obj_size = sizeof(_type) } \
+}
+
+//! Get an object from the slab. Object is either freshly constructed or in the state it was freed in.
+void *ubus_slab_alloc(struct ubus_slab *self); 
+//! Return an object to the slab it was allocated from.
+void ubus_slab_free(struct ubus_slab *self, void *obj); 
+//! Return objects cached by the calling thread to the shared free lists. Also done automatically on thread exit.
+void ubus_slab_flush_thread(void); 
+
+void ubus_slab_get_stats(struct ubus_slab *self, struct ubus_slab_stats *stats); 
+//! Print statistics of every slab that has been used so far.
+void ubus_slab_dump_stats(FILE *out); 
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ubus_socket.h"
+#include "ubus_srv_shm.h"
+#include "ubus_srv_ws.h"
+#include "ubus_cli_shm.h"
+#include "ubus_cli_js.h"
+
+// strips the prefix off path if the shared memory transport is asked for
+static bool _is_shm_path(const char **path){
+	size_t len = strlen(UBUS_SOCKET_SHM_PREFIX); 
+	if(strncmp(*path, UBUS_SOCKET_SHM_PREFIX, len) != 0) return false; 
+	*path += len; 
+	return true; 
+}
+
+struct ubus_socket *ubus_socket_new(void){
+	struct ubus_socket *self = calloc(1, sizeof(struct ubus_socket)); 
+	return self; 
+}
+
+void ubus_socket_delete(struct ubus_socket **self){
+	if((*self)->server) ubus_server_delete((*self)->server); 
+	if((*self)->client) ubus_client_delete((*self)->client); 
+	free(*self); 
+	*self = NULL;
+}
+
+int ubus_socket_listen(struct ubus_socket *self, const char *path){
+	// a socket only ever wraps one transport
+	if(self->server || self->client) return -1; 
+	self->server = (_is_shm_path(&path))?ubus_srv_shm_new():ubus_srv_ws_new(NULL); 
+	if(ubus_server_listen(self->server, path) < 0){
+		ubus_server_delete(self->server); 
+		return -1; 
+	}
+	return 0; 
+}
+
+int ubus_socket_serve(struct ubus_socket *self, const char *path){
+	if(self->server || self->client) return -1; 
+	self->server = (_is_shm_path(&path))?ubus_srv_shm_new():ubus_srv_ws_new(NULL); 
+	return 0; 
+}
+
+int ubus_socket_adopt(struct ubus_socket *self, int fd){
+	if(!self->server || ubus_server_adopt(self->server, fd) < 0){
+		close(fd); 
+		return -1; 
+	}
+	return 0; 
+}
+
+int ubus_socket_connect(struct ubus_socket *self, const char *path, uint32_t *peer){
+	if(self->server || self->client) return -1; 
+	self->client = (_is_shm_path(&path))?ubus_cli_shm_new():ubus_cli_js_new(); 
+	if(ubus_client_connect(self->client, path) < 0){
+		ubus_client_delete(self->client); 
+		return -1; 
+	}
+	if(peer) *peer = UBUS_TARGET_PEER; 
+	return 0; 
+}
+
+int ubus_socket_send(struct ubus_socket *self, struct ubus_message **msg){
+	int ret = -1; 
+	if(self->server) ret = ubus_server_send(self->server, msg); 
+	else if(self->client) ret = ubus_client_send(self->client, msg); 
+	// transports leave the message with us when they fail
+	if(*msg) ubus_message_delete(msg); 
+	return ret; 
+}
+
+int ubus_socket_recv(struct ubus_socket *self, struct ubus_message **msg){
+	if(self->server) return ubus_server_recv(self->server, msg); 
+	if(self->client){
+		int ret = ubus_client_recv(self->client, msg); 
+		if(ret > 0) (*msg)->peer = UBUS_TARGET_PEER; 
+		return ret; 
+	}
+	return -1; 
+}
+
+size_t ubus_socket_backlog(struct ubus_socket *self, uint32_t peer){
+	if(self->server) return ubus_server_backlog(self->server, peer); 
+	if(self->client) return ubus_client_backlog(self->client); 
+	return 0; 
+}
+
+int ubus_socket_wait(struct ubus_socket *self, int wake_fd, int timeout){
+	if(self->server) return ubus_server_wait(self->server, wake_fd, timeout); 
+	if(self->client) return ubus_client_wait(self->client, wake_fd, timeout); 
+	return -1; 
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include "ubus_message.h"
+#include "ubus_srv.h"
+#include "ubus_cli.h"
+
+/**
+Socket that a context sends and receives its messages through. It is a thin layer over one
+transport: listening creates a server and connecting creates a client. Listening starts a
+websocket server and connecting opens a json stream (over a unix socket if the path starts with
+'/' or '.'). The shared memory transports have to be asked for with UBUS_SOCKET_SHM_PREFIX in
+front of the path of their unix socket (as in "shm:/var/run/ubus.shm") because only peers that
+speak it can connect to them. Messages received from the server on the other end of a client
+connection come from peer UBUS_TARGET_PEER.
+**/
+#define UBUS_SOCKET_SHM_PREFIX "shm:"
+
+struct ubus_socket {
+	ubus_server_t server; 
+	ubus_client_t client; 
+}; 
+
+struct ubus_socket *ubus_socket_new(void); 
+void ubus_socket_delete(struct ubus_socket **self); 
+
+int ubus_socket_listen(struct ubus_socket *self, const char *path); 
+//! Start the server that path asks for without listening on path. It serves connections that are handed to it with ubus_socket_adopt().
+int ubus_socket_serve(struct ubus_socket *self, const char *path); 
+//! Hand a connection that was accepted elsewhere to the server. Any thread may call this. The socket takes the fd even if it fails.
+int ubus_socket_adopt(struct ubus_socket *self, int fd); 
+//! Connect to a server. Peer is set to the id that messages from the server carry.
+int ubus_socket_connect(struct ubus_socket *self, const char *path, uint32_t *peer); 
+
+//! Message to fill in and hand to ubus_socket_send()
+static inline struct ubus_message *ubus_socket_new_message(struct ubus_socket *self){ return ubus_message_new(); }
+//! Send a message to msg->peer. Always takes the message, it is freed if it can not be sent. 
+int ubus_socket_send(struct ubus_socket *self, struct ubus_message **msg); 
+//! Returns > 0 and sets msg if a message was received.
+int ubus_socket_recv(struct ubus_socket *self, struct ubus_message **msg); 
+//! Bytes of messages to peer that the transport still holds. Used to hold back producers of chunks. 
+size_t ubus_socket_backlog(struct ubus_socket *self, uint32_t peer); 
+//! Block until ubus_socket_recv() has something to return, wake_fd (unless -1) becomes readable or timeout (ms) expires. Returns > 0 when ready or woken, 0 on timeout and < 0 on error.
+int ubus_socket_wait(struct ubus_socket *self, int wake_fd, int timeout); 
@@ -27,6 +27,12 @@ struct ubus_server_api {
 	int 	(*connect)(ubus_server_t ptr, const char *path);
 	int 	(*send)(ubus_server_t ptr, struct ubus_message **msg); 
 	int 	(*recv)(ubus_server_t ptr, struct ubus_message **msg); 
+	//! block until recv has something to return, wake_fd (unless -1) becomes readable or timeout (ms) expires. Returns > 0 when ready or woken, 0 on timeout and < 0 on error. wake_fd is not read. 
+	int 	(*wait)(ubus_server_t ptr, int wake_fd, int timeout); 
+	//! bytes of messages to peer that are queued and not written out yet
+	size_t	(*backlog)(ubus_server_t ptr, uint32_t peer); 
+	//! take over a connection that was accepted on a listening socket we do not own. Any thread may call this. 
+	int 	(*adopt)(ubus_server_t ptr, int fd); 
 	void*	(*userdata)(ubus_server_t ptr, void *data); 
 }; 
 
@@ -38,5 +44,8 @@ struct ubus_server_api {
 #define ubus_server_connect(sock, path) (*sock)->connect(sock, path) 
 #define ubus_server_send(sock, msg) (*sock)->send(sock, msg)
 #define ubus_server_recv(sock, msg) (*sock)->recv(sock, msg)
+#define ubus_server_wait(sock, wake_fd, timeout) (*sock)->wait(sock, wake_fd, timeout)
+#define ubus_server_backlog(sock, peer) (((*sock)->backlog)?(*sock)->backlog(sock, peer):0)
+#define ubus_server_adopt(sock, fd) (((*sock)->adopt)?(*sock)->adopt(sock, fd):-1)
 #define ubus_server_get_userdata(sock) (*sock)->userdata(sock, NULL)
 #define ubus_server_set_userdata(sock, ptr) (*sock)->userdata(sock, ptr)
@@ -1,6 +1,6 @@
 /*
  * Copyright (C) 2015 Martin Schröder <mkschreder.uk@gmail.com>
- * 
+ *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU Lesser General Public License version 2.1
  * as published by the Free Software Foundation
@@ -19,216 +19,813 @@
 #ifdef FreeBSD
 #include <sys/param.h>
 #endif
-#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <libusys/usock.h>
-
+#include <libutype/list.h>
 #include <blobpack/blobpack.h>
 
-#include "ubus_socket.h"
-#include "ubus_rawsocket.h"
-
-#define STATIC_IOV(_var) { .iov_base = (char *) &(_var), .iov_len = sizeof(_var) }
+#include "ubus_srv_blob.h"
+#include "ubus_srv.h"
+#include "ubus_id.h"
+#include "ubus_slab.h"
+#include "ubus_message.h"
+#include "internal.h"
 
-#define UBUS_MSGBUF_REDUCTION_INTERVAL	16
+#ifdef CONFIG_IO_URING
+#include "ubus_uring.h"
+#endif
 
 /**
-Raw socket handles binary framed messages and guarantees full message transmission and delivery. 
+Stream socket server that exchanges binary framed blobs. Every frame is a header followed by
+the data portion. There are two headers and the first byte (hdr_size) tells them apart:
+- struct ubus_msg_header_v1 is what peers have always sent. The data is blobpack with a crc16.
+- struct ubus_msg_header also names the check and codec of the data and its priority.
+
+The first frame of a peer fixes the header and the check for the rest of the connection. A
+check that is weaker than the one we are configured with is refused and so is any later frame
+that uses another one, so nothing on the wire can talk a connection down to a weaker check.
+Until the peer has sent something we use the configured check ourselves (and the v1 header
+if that is crc16 so that old peers can read it).
+
+Built with CONFIG_IO_URING the server is driven by an io_uring (see ubus_uring.h) if the kernel
+has one. Accept and recv are armed once per socket, received bytes go through the same frame
+parser as with recv() and all frames queued for a client go out as one chain of linked sends.
+A client that goes away waits on the closing list until the kernel is done with its buffers.
 **/
 
-struct ubus_rawsocket {
-	int fd; 
+// largest data portion either side accepts
+#define UBUS_SRV_BLOB_MAX_FRAME (64 * 1024 * 1024)
+// submission queue entries of the ring
+#define UBUS_SRV_BLOB_URING_ENTRIES 1024
 
-	struct list_head tx_queue; 
+struct ubus_msg_header_v1 {
+	uint8_t hdr_size; 	// works as a magic. Always sizeof(struct ubus_msg_header_v1)
+	uint16_t crc; 		// crc16 of the blob in the data portion
+	uint32_t data_size;	// length of the data that follows
+} __attribute__((packed)) __attribute__((__aligned__(4))); 
 
-	// receive state 
-	int recv_count;  
-	struct ubus_msg_header hdr; 
-	struct ubus_message *msg; 
+struct ubus_msg_header {
+	uint8_t hdr_size; 	// works as a magic. Always sizeof(struct ubus_msg_header)
+	uint8_t check; 		// integrity check type of the data portion (enum ubus_frame_check)
+	uint8_t priority; 	// enum ubus_msg_priority + 1. Zero means the sender does not set priorities.
+	uint8_t codec; 		// encoding of the data portion (enum ubus_codec). Zero is blobpack.
+	uint32_t crc; 		// checksum of the data portion
+	uint32_t data_size;	// length of the data that follows
+} __attribute__((packed)) __attribute__((__aligned__(4))); 
 
-	bool disconnected; 
+union ubus_srv_blob_header {
+	uint8_t raw[sizeof(struct ubus_msg_header)]; 
+	struct ubus_msg_header_v1 v1; 
+	struct ubus_msg_header ext; 
+}; 
 
+// what a received header says once the two formats are out of the way
+struct ubus_srv_blob_info {
+	bool extended; 
+	enum ubus_frame_check check; 
+	enum ubus_codec codec; 
+	uint32_t crc; 
+	uint32_t data_size; 
+}; 
+
+struct ubus_srv_blob {
+	int listen_fd; 
+	struct ubus_id_map clients; 
+	pthread_mutex_t adopt_lock; 
+	struct list_head adopted; 	// connections handed to us from other threads (under adopt_lock)
+	bool reap; 			// some clients are marked as disconnected
+	struct ubus_prio_queue rx_queue; 
+	// weakest check a connection may settle on. Also used until the peer has sent its first frame.
+	enum ubus_frame_check check; 
+	// codec used until the peer has sent its first frame
+	enum ubus_codec codec; 
+	// received msgpack bodies are decoded here before they replace the body of the message
+	struct blob unpack; 
+#ifdef CONFIG_IO_URING
+	struct ubus_uring *uring; 	// NULL if the kernel has no io_uring. We poll then.
+	struct ubus_uring_op accept_op; 
+	struct ubus_uring_op wake_op; 
+	bool woken; 
+	struct list_head closing; 	// clients that are gone but still have operations in flight
+#endif
+	const struct ubus_server_api *api; 
 	void *user_data; 
+}; 
 
-	const struct ubus_socket_api *api; 
+struct ubus_srv_blob_frame {
+	struct list_head list; 
+	union ubus_srv_blob_header hdr; 
+	uint8_t *data; 
+	uint32_t size; 
+	uint32_t send_count; 
 }; 
 
-struct ubus_msg_header {
-	uint8_t hdr_size; 	// works as a magic. Must always be sizeof(struct ubus_msg_header)
-	uint16_t crc; 		// sum of the data portion
-	uint32_t data_size;	// length of the data that follows 
-} __attribute__((packed)) __attribute__((__aligned__(4))); 
+struct ubus_srv_blob_client {
+	struct ubus_id id; 
+	int fd; 
+	struct list_head list; 		// on the adopted list until the server thread takes it
+	// header and check of the connection. Fixed by the first frame of the peer.
+	bool settled; 
+	bool extended; 
+	enum ubus_frame_check check; 
+	// codec of our frames. Follows the peer.
+	enum ubus_codec codec; 
+	// receive state
+	union ubus_srv_blob_header hdr; 
+	struct ubus_srv_blob_info info; 
+	uint32_t recv_count; 
+	struct ubus_message *msg; 
+	bool readable; 
+	struct ubus_prio_queue tx_queue; 
+	// frame that is partly written. It has to be finished before a more urgent one can go out.
+	struct ubus_srv_blob_frame *tx_current; 
+	size_t tx_bytes; 		// data of tx_current and all frames on tx_queue
+	bool disconnected; 
+#ifdef CONFIG_IO_URING
+	struct ubus_srv_blob *server; 
+	struct ubus_uring_op recv_op; 
+	struct ubus_uring_op send_op; 
+	struct list_head tx_inflight; 	// frames of the send chain that the kernel is working on
+#endif
+}; 
 
-uint16_t _crc16(char* data_p, uint32_t length){
-    unsigned char x;
-    uint16_t crc = 0xFFFF;
+// bytes that the ring has received for a client
+struct ubus_srv_blob_source {
+	const uint8_t *data; 
+	size_t size; 
+}; 
+
+static struct ubus_slab _blob_frame_slab = UBUS_SLAB_INITIALIZER("blob_frame", struct ubus_srv_blob_frame, NULL); 
 
-    while (length--){
-        x = crc >> 8 ^ *data_p++;
-        x ^= x>>4;
-        crc = (crc << 8) ^ ((uint16_t)(x << 12)) ^ ((uint16_t)(x <<5)) ^ ((uint16_t)x);
-    }
-    return crc;
+static struct ubus_srv_blob_frame *ubus_srv_blob_frame_new(struct ubus_message *msg, bool extended, enum ubus_frame_check check, enum ubus_codec codec){
+	struct blob_field *field = blob_head(&msg->buf); 
+	struct ubus_srv_blob_frame *self = ubus_slab_alloc(&_blob_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
+	INIT_LIST_HEAD(&self->list); 
+	if(extended && codec == UBUS_CODEC_MSGPACK){
+		self->size = ubus_msgpack_size(field); 
+		self->data = malloc(self->size); 
+		ubus_msgpack_encode(field, self->data); 
+	} else {
+		self->size = blob_field_raw_pad_len(field); 
+		self->data = malloc(self->size); 
+		memcpy(self->data, field, self->size); 
+	}
+	if(!extended){
+		self->hdr.v1.hdr_size = sizeof(struct ubus_msg_header_v1); 
+		self->hdr.v1.crc = ubus_crc16(field, blob_field_raw_len(field)); 
+		self->hdr.v1.data_size = self->size; 
+		return self; 
+	}
+	self->hdr.ext.hdr_size = sizeof(struct ubus_msg_header); 
+	self->hdr.ext.check = check; 
+	self->hdr.ext.codec = codec; 
+	self->hdr.ext.priority = msg->priority + 1; 
+	// blobpack is checked over the blob it holds, anything else over the whole body
+	self->hdr.ext.crc = ubus_frame_checksum(check, self->data, (codec == UBUS_CODEC_MSGPACK)?self->size:blob_field_raw_len(field)); 
+	self->hdr.ext.data_size = self->size; 
+	return self; 
 }
 
-struct ubus_rawsocket_frame *ubus_rawsocket_frame_new(struct blob_field *msg){
-	assert(msg); 
-	struct ubus_rawsocket_frame *self = calloc(1, sizeof(struct ubus_rawsocket_frame)); 
-	blob_init(&self->data, (char*)msg, blob_field_raw_pad_len(msg)); 
+static void ubus_srv_blob_frame_delete(struct ubus_srv_blob_frame **self){
+	free((*self)->data); 
+	ubus_slab_free(&_blob_frame_slab, *self); 
+	*self = NULL; 
+}
+
+#ifdef CONFIG_IO_URING
+static void _blob_on_recv(struct ubus_uring_op *op, int res, const void *data, bool more); 
+static void _blob_on_send(struct ubus_uring_op *op, int res, const void *data, bool more); 
+#endif
+
+static struct ubus_srv_blob_client *ubus_srv_blob_client_new(struct ubus_srv_blob *server, int fd){
+	struct ubus_srv_blob_client *self = calloc(1, sizeof(struct ubus_srv_blob_client)); 
+	self->fd = fd; 
 	INIT_LIST_HEAD(&self->list); 
-	self->hdr.crc = _crc16((char*)msg, blob_field_raw_len(msg)); 
-	self->hdr.data_size = blob_field_raw_pad_len(msg); 
+	ubus_prio_queue_init(&self->tx_queue); 
+#ifdef CONFIG_IO_URING
+	self->server = server; 
+	ubus_uring_op_init(&self->recv_op, _blob_on_recv); 
+	ubus_uring_op_init(&self->send_op, _blob_on_send); 
+	INIT_LIST_HEAD(&self->tx_inflight); 
+#endif
 	return self; 
 }
 
-void ubus_rawsocket_frame_delete(struct ubus_rawsocket_frame **self){
-	blob_free(&(*self)->data); 
+static void ubus_srv_blob_client_delete(struct ubus_srv_blob_client **self){
+	struct ubus_srv_blob_frame *frame; 
+	while((frame = ubus_prio_queue_pop_entry(&(*self)->tx_queue, struct ubus_srv_blob_frame, list))){
+		ubus_srv_blob_frame_delete(&frame); 
+	}
+	if((*self)->tx_current) ubus_srv_blob_frame_delete(&(*self)->tx_current); 
+#ifdef CONFIG_IO_URING
+	struct ubus_srv_blob_frame *tmp; 
+	list_for_each_entry_safe(frame, tmp, &(*self)->tx_inflight, list){
+		list_del(&frame->list); 
+		ubus_srv_blob_frame_delete(&frame); 
+	}
+#endif
+	if((*self)->msg) ubus_message_delete(&(*self)->msg); 
+	if((*self)->fd >= 0) close((*self)->fd); 
 	free(*self); 
 	*self = NULL; 
 }
 
-void _rawsocket_destroy(ubus_socket_t socket){
-	struct ubus_rawsocket *self = container_of(socket, struct ubus_rawsocket, api); 
-	if(self->fd > 0) close(self->fd); 
-	free(self); 
+static size_t _blob_header_size(uint8_t hdr_size){
+	if(hdr_size == sizeof(struct ubus_msg_header_v1) || hdr_size == sizeof(struct ubus_msg_header)) return hdr_size; 
+	return 0; 
 }
 
-int _ubus_rawsocket_recv(struct ubus_rawsocket *self, struct ubus_message **msg){
-	// if we still have not received the header
-	if(!self->fd == -1) return -1; 
-
-	if(self->recv_count < sizeof(struct ubus_msg_header)){
-		int rc = recv(self->fd, ((char*)&self->hdr) + self->recv_count, sizeof(struct ubus_msg_header) - self->recv_count, 0); 
-		if(rc > 0){
-			self->recv_count += rc; 
-		} else if(rc == 0){
-			printf("recv disconnected!\n"); 
-			close(self->fd); 
-			self->fd = -1; 
-			return -1; 
-		}
+// header is complete. Check it against the connection and get a buffer for the data.
+static bool _blob_client_header(struct ubus_srv_blob *self, struct ubus_srv_blob_client *cl){
+	struct ubus_srv_blob_info *info = &cl->info; 
+	if(cl->hdr.raw[0] == sizeof(struct ubus_msg_header_v1)){
+		*info = (struct ubus_srv_blob_info){ .extended = false, .check = UBUS_FRAME_CHECK_CRC16, .codec = UBUS_CODEC_DEFAULT, .crc = cl->hdr.v1.crc, .data_size = cl->hdr.v1.data_size }; 
+	} else {
+		*info = (struct ubus_srv_blob_info){ .extended = true, .check = cl->hdr.ext.check, .codec = cl->hdr.ext.codec, .crc = cl->hdr.ext.crc, .data_size = cl->hdr.ext.data_size }; 
 	}
-	// if we have just received the header then we allocate the body based on size in the header
-	if(self->recv_count == sizeof(struct ubus_msg_header)){
-		// TODO: validate header here!
-
-		//printf("got frame size %d, correct: %d\n", self->hdr.data_size, be32_to_cpu(self->hdr.data_size)); 
-		//self->hdr.data_size = be32_to_cpu(self->hdr.data_size); 
-		//printf("receiving message of %d bytes\n", self->hdr.data_size); 
-		if(self->hdr.data_size <= 0){
-			//fprintf(stderr, "protocol error! null message!\n"); 
-			// fail with assertion failure
-			assert(self->hdr.data_size > 0); 
-		}
-		blob_resize(&self->data, self->hdr.data_size); 
-	}
-	// if we have received the header then we receive the body here
-	if(self->recv_count >= sizeof(struct ubus_msg_header)){
-		int rc = 0; 
-		int cursor = self->recv_count - sizeof(struct ubus_msg_header); 
-		while((rc = recv(self->fd, (char*)(blob_head(&self->data)) + cursor, self->hdr.data_size - cursor, 0)) > 0){
-			self->recv_count += rc; 
-			cursor = self->recv_count - sizeof(struct ubus_msg_header);
-			if(cursor == self->hdr.data_size) break; 
+	if(info->codec >= __UBUS_CODEC_LAST){
+		fprintf(stderr, "srv_blob: peer uses unsupported codec %d!\n", info->codec); 
+		return false; 
+	}
+	if(info->check >= __UBUS_FRAME_CHECK_LAST){
+		fprintf(stderr, "srv_blob: peer uses unsupported frame check %d!\n", info->check); 
+		return false; 
+	}
+	if(info->data_size == 0 || info->data_size > UBUS_SRV_BLOB_MAX_FRAME){
+		fprintf(stderr, "srv_blob: peer sent a frame of %u bytes!\n", info->data_size); 
+		return false; 
+	}
+	if(!cl->settled){
+		// the first frame decides. Unchecked frames are only taken if we have been configured without checks.
+		if(info->check < self->check){
+			fprintf(stderr, "srv_blob: peer uses %s but at least %s is required!\n", ubus_frame_check_name(info->check), ubus_frame_check_name(self->check)); 
+			return false; 
 		}
-		if(rc == 0){
-			close(self->fd); 	
-			self->fd = -1; 
+		cl->settled = true; 
+		cl->extended = info->extended; 
+		cl->check = info->check; 
+	} else if(info->extended != cl->extended || info->check != cl->check){
+		fprintf(stderr, "srv_blob: peer changed the frame check of the connection to %s!\n", ubus_frame_check_name(info->check)); 
+		return false; 
+	}
+	cl->codec = info->codec; 
+
+	// data is received directly into a pooled message buffer which is then handed over as is
+	if(!cl->msg) cl->msg = ubus_message_new(); 
+	blob_resize(&cl->msg->buf, info->data_size); 
+	return true; 
+}
+
+// replace the msgpack body of the received message with the blob that it stands for
+static bool _blob_unpack(struct ubus_srv_blob *self, struct ubus_message *msg, uint32_t size){
+	blob_reset(&self->unpack); 
+	if(ubus_msgpack_decode(&self->unpack, blob_head(&msg->buf), size) != size) return false; 
+	struct blob_field *field = blob_field_first_child(blob_head(&self->unpack)); 
+	if(!field) return false; 
+	blob_resize(&msg->buf, blob_field_raw_pad_len(field)); 
+	memcpy(blob_head(&msg->buf), field, blob_field_raw_pad_len(field)); 
+	return true; 
+}
+
+static bool _blob_client_frame_valid(struct ubus_srv_blob *self, struct ubus_srv_blob_client *cl){
+	struct ubus_srv_blob_info *info = &cl->info; 
+	struct blob_field *data = blob_head(&cl->msg->buf); 
+	bool packed = info->codec != UBUS_CODEC_DEFAULT; 
+	if(!packed && (info->data_size < sizeof(struct blob_field) ||
+		blob_field_raw_len(data) < sizeof(struct blob_field) || blob_field_raw_len(data) > info->data_size)){
+		fprintf(stderr, "srv_blob: blob does not fit the frame it came in!\n"); 
+		return false; 
+	}
+	// blobpack is checked over the blob it holds, anything else over the whole body
+	size_t len = (packed)?info->data_size:blob_field_raw_len(data); 
+	if((packed || blob_field_data_len(data) > 0) && info->check != UBUS_FRAME_CHECK_NONE &&
+		info->crc != ubus_frame_checksum(info->check, data, len)){
+		fprintf(stderr, "srv_blob: CRC mismatch!\n"); 
+		return false; 
+	}
+	if(packed && !_blob_unpack(self, cl->msg, info->data_size)){
+		fprintf(stderr, "srv_blob: could not decode frame!\n"); 
+		return false; 
+	}
+	return true; 
+}
+
+// read from the socket or, if src is set, take what the ring has received
+static ssize_t _blob_client_read(struct ubus_srv_blob_client *cl, struct ubus_srv_blob_source *src, void *buf, size_t len){
+	if(!src) return recv(cl->fd, buf, len, MSG_DONTWAIT); 
+	if(!src->size){
+		errno = EAGAIN; 
+		return -1; 
+	}
+	if(len > src->size) len = src->size; 
+	memcpy(buf, src->data, len); 
+	src->data += len; 
+	src->size -= len; 
+	return len; 
+}
+
+// receive what there is of the current frame. Returns 1 once a whole frame is in, -EAGAIN if the rest has not arrived yet and -1 if the connection has to be dropped.
+static int _blob_client_recv(struct ubus_srv_blob *self, struct ubus_srv_blob_client *cl, struct ubus_srv_blob_source *src){
+	// until the first byte is in we do not know which of the headers is coming
+	size_t hdr_size = (cl->recv_count)?_blob_header_size(cl->hdr.raw[0]):1; 
+	ssize_t rc; 
+	while(cl->recv_count < hdr_size){
+		rc = _blob_client_read(cl, src, cl->hdr.raw + cl->recv_count, hdr_size - cl->recv_count); 
+		if(rc <= 0) goto error; 
+		cl->recv_count += rc; 
+		if(cl->recv_count == 1 && !(hdr_size = _blob_header_size(cl->hdr.raw[0]))){
+			fprintf(stderr, "srv_blob: invalid header size %d!\n", cl->hdr.raw[0]); 
 			return -1; 
 		}
-		// if we have received the full message then we call the message callback
-		if(self->recv_count == (sizeof(struct ubus_msg_header) + self->hdr.data_size)){
-			struct blob_field *msg = blob_head(&self->data); 
-			if(blob_field_data_len(msg) > 0 && self->hdr.crc != _crc16((char*)msg, blob_field_raw_len(msg))){
-				fprintf(stderr, "CRC mismatch!\n"); 
-				//blob_field_dump_json(msg); 
-				close(self->fd); 
-				self->fd = -1; 
-				return -1;  
-			} else {
-				*msg = self->msg; 
-				
-			}
-			self->recv_count = 0; 
-		}
+		if(cl->recv_count == hdr_size && !_blob_client_header(self, cl)) return -1; 
 	}
-	return -EAGAIN; 
+	while(cl->recv_count - hdr_size < cl->info.data_size){
+		uint32_t cursor = cl->recv_count - hdr_size; 
+		rc = _blob_client_read(cl, src, (char*)blob_head(&cl->msg->buf) + cursor, cl->info.data_size - cursor); 
+		if(rc <= 0) goto error; 
+		cl->recv_count += rc; 
+	}
+	cl->recv_count = 0; 
+	return (_blob_client_frame_valid(self, cl))?1:-1; 
+error:
+	if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return -EAGAIN; 
+	return -1; 
+}
+
+// hand a whole frame over to the server queue
+static void _blob_client_deliver(struct ubus_srv_blob *self, struct ubus_srv_blob_client *cl){
+	struct ubus_message *msg = cl->msg; 
+	cl->msg = NULL; 
+	msg->peer = cl->id.id; 
+	ubus_prio_queue_add(&self->rx_queue, &msg->list, ubus_message_read_priority(msg)); 
 }
 
-void _ubus_rawsocket_client_send(struct ubus_rawsocket_client *self){
-	if(list_empty(&self->tx_queue)){
+#ifdef CONFIG_IO_URING
+// hand everything that is queued to the kernel as one chain of linked sends. The next chain only starts once this one has completed so frames never overtake each other.
+static void _blob_client_submit(struct ubus_srv_blob_client *self){
+	struct ubus_uring *uring = self->server->uring; 
+	if(self->disconnected || self->send_op.pending || ubus_prio_queue_empty(&self->tx_queue)) return; 
+	// header and data of every frame are two sends
+	if(ubus_uring_reserve(uring, UBUS_URING_CHAIN_MAX * 2) < 0) return; 
+	struct ubus_srv_blob_frame *frame; 
+	int count = 0; 
+	while(count++ < UBUS_URING_CHAIN_MAX && (frame = ubus_prio_queue_pop_entry(&self->tx_queue, struct ubus_srv_blob_frame, list))){
+		list_add_tail(&frame->list, &self->tx_inflight); 
+	}
+	list_for_each_entry(frame, &self->tx_inflight, list){
+		bool last = frame->list.next == &self->tx_inflight; 
+		ubus_uring_send(uring, &self->send_op, self->fd, frame->hdr.raw, frame->hdr.raw[0], true); 
+		ubus_uring_send(uring, &self->send_op, self->fd, frame->data, frame->size, !last); 
+	}
+}
+
+static void _blob_on_send(struct ubus_uring_op *op, int res, const void *data, bool more){
+	struct ubus_srv_blob_client *cl = container_of(op, struct ubus_srv_blob_client, send_op); 
+	// a failed send cancels the rest of the chain. Frames stay on the inflight list until the client is freed.
+	if(res < 0 || cl->disconnected){
+		cl->disconnected = true; 
+		cl->server->reap = true; 
 		return; 
 	}
+	// links complete in order so this is the header or the data of the first frame
+	struct ubus_srv_blob_frame *frame = list_first_entry(&cl->tx_inflight, struct ubus_srv_blob_frame, list); 
+	frame->send_count += res; 
+	if(frame->send_count == frame->hdr.raw[0] + frame->size){
+		list_del(&frame->list); 
+		cl->tx_bytes -= frame->size; 
+		ubus_srv_blob_frame_delete(&frame); 
+	}
+	if(op->pending) return; 
+	// anything left did not go out whole (a short write would let the next frame overtake it)
+	if(!list_empty(&cl->tx_inflight)){
+		cl->disconnected = true; 
+		cl->server->reap = true; 
+		return; 
+	}
+	_blob_client_submit(cl); 
+}
 
-	struct ubus_rawsocket_frame *req = list_first_entry(&self->tx_queue, struct ubus_rawsocket_frame, list);
-	if(req->send_count < sizeof(struct ubus_msg_header)){
-		int sc = send(self->fd, ((char*)&req->hdr) + req->send_count, sizeof(struct ubus_msg_header) - req->send_count, MSG_NOSIGNAL); 
-		if(sc > 0){
-			req->send_count += sc; 
-		}
-		if(sc == 0) {
-			self->disconnected = true; 
+static void _blob_on_recv(struct ubus_uring_op *op, int res, const void *data, bool more){
+	struct ubus_srv_blob_client *cl = container_of(op, struct ubus_srv_blob_client, recv_op); 
+	struct ubus_srv_blob *self = cl->server; 
+	if(cl->disconnected) return; 
+	struct ubus_srv_blob_source src = { .data = data, .size = (res > 0)?res:0 }; 
+	while(src.size){
+		int ret = _blob_client_recv(self, cl, &src); 
+		if(ret > 0){
+			_blob_client_deliver(self, cl); 
+		} else if(ret != -EAGAIN){
+			cl->disconnected = true; 
+			self->reap = true; 
 			return; 
 		}
 	}
-	if(req->send_count >= sizeof(struct ubus_msg_header)){
-		int cursor = req->send_count - sizeof(struct ubus_msg_header); 
-		int sc; 
-		int buf_size = blob_field_raw_pad_len(blob_head(&req->data)); 
-		while((sc = send(self->fd, blob_head(&req->data) + cursor, buf_size - cursor, MSG_NOSIGNAL)) > 0){
-			req->send_count += sc; 
-			cursor = req->send_count - sizeof(struct ubus_msg_header);
-			if(cursor == buf_size) break; 
+	if(more) return; 
+	// kernel has dropped the multishot recv. Either it ran out of buffers or the peer is gone.
+	if(res > 0 || res == -ENOBUFS){
+		ubus_uring_recv(self->uring, op, cl->fd); 
+	} else {
+		cl->disconnected = true; 
+		self->reap = true; 
+	}
+}
+#endif
+
+// write out as much as the socket takes. Most urgent frames go first unless a frame is already partly written.
+static void _blob_client_flush(struct ubus_srv_blob_client *self){
+#ifdef CONFIG_IO_URING
+	if(self->server->uring){
+		_blob_client_submit(self); 
+		return; 
+	}
+#endif
+	while(true){
+		if(!self->tx_current) self->tx_current = ubus_prio_queue_pop_entry(&self->tx_queue, struct ubus_srv_blob_frame, list); 
+		struct ubus_srv_blob_frame *frame = self->tx_current; 
+		if(!frame) return; 
+		uint32_t hdr_size = frame->hdr.raw[0]; 
+		struct iovec iov[2]; 
+		int niov = 0; 
+		if(frame->send_count < hdr_size){
+			iov[niov++] = (struct iovec){ .iov_base = frame->hdr.raw + frame->send_count, .iov_len = hdr_size - frame->send_count }; 
+			iov[niov++] = (struct iovec){ .iov_base = frame->data, .iov_len = frame->size }; 
+		} else {
+			uint32_t cursor = frame->send_count - hdr_size; 
+			iov[niov++] = (struct iovec){ .iov_base = frame->data + cursor, .iov_len = frame->size - cursor }; 
 		}
-		if(sc == 0) {
-			self->disconnected = true; 
+		struct msghdr mh = { .msg_iov = iov, .msg_iovlen = niov }; 
+		ssize_t sc = sendmsg(self->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT); 
+		if(sc < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) self->disconnected = true; 
 			return; 
 		}
+		frame->send_count += sc; 
+		if(frame->send_count < hdr_size + frame->size) return; 
+		self->tx_bytes -= frame->size; 
+		self->tx_current = NULL; 
+		ubus_srv_blob_frame_delete(&frame); 
+	}
+}
 
-		if(req->send_count == (sizeof(struct ubus_msg_header) + buf_size)){
-			// full buffer was transmitted so we destroy the request
-			list_del_init(&req->list); 
-			//printf("removed completed request from queue! %d bytes\n", req->send_count); 
-			ubus_rawsocket_frame_delete(&req); 
+static void _blob_remove_client(struct ubus_srv_blob *self, struct ubus_srv_blob_client *client){
+	ubus_id_map_free(&self->clients, &client->id); 
+#ifdef CONFIG_IO_URING
+	if(self->uring){
+		// kernel may still write into our buffers so the client is only freed once nothing is pending
+		ubus_uring_cancel(self->uring, client->fd); 
+		list_add_tail(&client->list, &self->closing); 
+		return; 
+	}
+#endif
+	ubus_srv_blob_client_delete(&client); 
+}
+
+#ifdef CONFIG_IO_URING
+static void _blob_free_closed(struct ubus_srv_blob *self){
+	struct ubus_srv_blob_client *cl, *tmp; 
+	list_for_each_entry_safe(cl, tmp, &self->closing, list){
+		if(cl->recv_op.pending || cl->send_op.pending) continue; 
+		list_del(&cl->list); 
+		ubus_srv_blob_client_delete(&cl); 
+	}
+}
+#endif
+
+// drop clients that have hung up or sent something we do not accept
+static void _blob_reap_clients(struct ubus_srv_blob *self){
+	if(!self->reap) return; 
+	self->reap = false; 
+	struct ubus_srv_blob_client **dead = alloca(sizeof(void*) * (ubus_id_map_size(&self->clients) + 1)); 
+	int count = 0; 
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_blob_client *client = container_of(id, struct ubus_srv_blob_client, id); 
+		if(client->disconnected) dead[count++] = client; 
+	}
+	while(count--) _blob_remove_client(self, dead[count]); 
+}
+
+static void _blob_add_client(struct ubus_srv_blob *self, struct ubus_srv_blob_client *cl){
+	ubus_id_map_alloc(&self->clients, &cl->id, 0); 
+#ifdef CONFIG_IO_URING
+	if(self->uring){
+		ubus_uring_recv(self->uring, &cl->recv_op, cl->fd); 
+		return; 
+	}
+#endif
+	// peer usually sends its first frame right after connecting
+	cl->readable = true; 
+}
+
+static void _blob_accept_connections(struct ubus_srv_blob *self){
+	while(true){
+		int fd = accept4(self->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK); 
+		if(fd < 0) return; 
+		_blob_add_client(self, ubus_srv_blob_client_new(self, fd)); 
+	}
+}
+
+#ifdef CONFIG_IO_URING
+static void _blob_on_accept(struct ubus_uring_op *op, int res, const void *data, bool more){
+	struct ubus_srv_blob *self = container_of(op, struct ubus_srv_blob, accept_op); 
+	if(res >= 0) _blob_add_client(self, ubus_srv_blob_client_new(self, res)); 
+	if(!more && self->listen_fd >= 0) ubus_uring_accept(self->uring, op, self->listen_fd); 
+}
+
+static void _blob_on_wake(struct ubus_uring_op *op, int res, const void *data, bool more){
+	struct ubus_srv_blob *self = container_of(op, struct ubus_srv_blob, wake_op); 
+	self->woken = true; 
+}
+
+// submit what is queued and run the completions that are ready or, if timeout is not 0, wait for some
+static void _blob_uring_run(struct ubus_srv_blob *self, int timeout){
+	ubus_uring_run(self->uring, timeout); 
+	_blob_reap_clients(self); 
+	_blob_free_closed(self); 
+}
+
+// returns true if we were woken up through wake_fd
+static bool _blob_uring_wait(struct ubus_srv_blob *self, int wake_fd, int timeout){
+	if(wake_fd >= 0 && !self->wake_op.pending) ubus_uring_poll(self->uring, &self->wake_op, wake_fd); 
+	_blob_uring_run(self, timeout); 
+	bool woken = self->woken; 
+	self->woken = false; 
+	return woken; 
+}
+#endif
+
+static void _blob_take_adopted(struct ubus_srv_blob *self){
+	LIST_HEAD(adopted); 
+	pthread_mutex_lock(&self->adopt_lock); 
+	list_splice_tail_init(&self->adopted, &adopted); 
+	pthread_mutex_unlock(&self->adopt_lock); 
+	struct ubus_srv_blob_client *cl, *tmp; 
+	list_for_each_entry_safe(cl, tmp, &adopted, list){
+		list_del_init(&cl->list); 
+		_blob_add_client(self, cl); 
+	}
+}
+
+// read at most one frame from each client so that a busy peer can not starve the others
+static void _blob_read_clients(struct ubus_srv_blob *self){
+#ifdef CONFIG_IO_URING
+	// frames are parsed as the completions come in
+	if(self->uring){
+		_blob_uring_run(self, 0); 
+		return; 
+	}
+#endif
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_blob_client *client = container_of(id, struct ubus_srv_blob_client, id); 
+		if(client->disconnected || !client->readable) continue; 
+		int ret = _blob_client_recv(self, client, NULL); 
+		if(ret > 0){
+			_blob_client_deliver(self, client); 
+		} else if(ret == -EAGAIN){
+			client->readable = false; 
+		} else {
+			client->disconnected = true; 
+			self->reap = true; 
 		}
 	}
+	_blob_reap_clients(self); 
+}
+
+static int _blob_pop_message(struct ubus_srv_blob *self, struct ubus_message **msg){
+	if(!(*msg = ubus_prio_queue_pop_entry(&self->rx_queue, struct ubus_message, list))) return -EAGAIN; 
+	return 1; 
 }
 
-int ubus_rawsocket_send(ubus_socket_t socket, struct blob_field *msg){
-	struct ubus_rawsocket *self = container_of(socket, struct ubus_rawsocket, api); 
+// returns true if we were woken up through wake_fd
+static bool _blob_wait(struct ubus_srv_blob *self, int wake_fd, int timeout){
+	_blob_take_adopted(self); 
+#ifdef CONFIG_IO_URING
+	if(self->uring) return _blob_uring_wait(self, wake_fd, timeout); 
+#endif
+	int count = ubus_id_map_size(&self->clients); 
+	int nfds = count + 2; 
+	struct pollfd *pfd = alloca(sizeof(struct pollfd) * nfds); 
+	struct ubus_srv_blob_client **clients = alloca(sizeof(void*) * (count + 1)); 
+	pfd[0] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN }; 
+	// poll skips a wake_fd of -1
+	pfd[nfds - 1] = (struct pollfd){ .fd = wake_fd, .events = POLLIN }; 
+
+	int c = 0; 
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_blob_client *client = container_of(id, struct ubus_srv_blob_client, id); 
+		clients[c] = client; 
+		pfd[1 + c] = (struct pollfd){ .fd = client->fd, .events = POLLIN }; 
+		if(client->tx_current || !ubus_prio_queue_empty(&client->tx_queue)) pfd[1 + c].events |= POLLOUT; 
+		// something is left over from the last read so there is no point in sleeping
+		if(client->readable) timeout = 0; 
+		c++; 
+	}
 
-	list_add(&req->list, &self->tx_queue); 
-	return 0; 	
+	int ret = poll(pfd, nfds, timeout); 
+	if(ret <= 0) return false; 
+
+	for(c = 0; c < count; c++){
+		short revents = pfd[1 + c].revents; 
+		// hangup and errors show up in the next read so that frames that are already in are not lost
+		if(revents & (POLLIN | POLLHUP | POLLERR)) clients[c]->readable = true; 
+		if(revents & POLLNVAL) clients[c]->disconnected = true; 
+		if(revents & POLLOUT) _blob_client_flush(clients[c]); 
+		if(clients[c]->disconnected) self->reap = true; 
+	}
+	_blob_reap_clients(self); 
+
+	if(pfd[0].revents & POLLIN) _blob_accept_connections(self); 
+	return pfd[nfds - 1].revents; 
 }
 
-static void _rawsocket_on_message(ubus_socket_t socket, ubus_socket_msg_cb_t cb){
-	struct ubus_rawsocket *self = container_of(socket, struct ubus_rawsocket, api); 
-	self->on_message = cb; 
+static int _blob_recv(ubus_server_t socket, struct ubus_message **msg){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+
+	if(_blob_pop_message(self, msg) > 0) return 1; 
+
+	_blob_read_clients(self); 
+	if(_blob_pop_message(self, msg) > 0) return 1; 
+
+	return -EAGAIN; 
 }
 
-static void *_rawsocket_userdata(ubus_socket_t socket, void *ptr){
-	struct ubus_rawsocket *self = container_of(socket, struct ubus_rawsocket, api); 
+static int _blob_wait_ready(ubus_server_t socket, int wake_fd, int timeout){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+
+	if(!ubus_prio_queue_empty(&self->rx_queue)) return 1; 
+	_blob_read_clients(self); 
+	if(!ubus_prio_queue_empty(&self->rx_queue)) return 1; 
+
+	bool woken = _blob_wait(self, wake_fd, timeout); 
+	_blob_read_clients(self); 
+	return woken || !ubus_prio_queue_empty(&self->rx_queue); 
+}
+
+static int _blob_send(ubus_server_t socket, struct ubus_message **msg){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, (*msg)->peer); 
+	if(!id) return -1; 
+
+	struct ubus_srv_blob_client *client = container_of(id, struct ubus_srv_blob_client, id); 
+	// too large for the peer to ever accept. The message stays with the caller.
+	if(blob_field_raw_pad_len(blob_head(&(*msg)->buf)) > UBUS_SRV_BLOB_MAX_FRAME) return -1; 
+
+	struct ubus_srv_blob_frame *frame; 
+	if(client->settled){
+		frame = ubus_srv_blob_frame_new(*msg, client->extended, client->check, client->codec); 
+	} else {
+		// an old peer can only read the v1 header so that is what we use as long as it does not make the check weaker
+		bool extended = self->check > UBUS_FRAME_CHECK_CRC16 || self->check == UBUS_FRAME_CHECK_NONE || self->codec != UBUS_CODEC_DEFAULT; 
+		frame = ubus_srv_blob_frame_new(*msg, extended, self->check, self->codec); 
+	}
+	ubus_prio_queue_add(&client->tx_queue, &frame->list, (*msg)->priority); 
+	client->tx_bytes += frame->size; 
+	ubus_message_delete(msg); 
+	_blob_client_flush(client); 
+	if(client->disconnected) self->reap = true; 
+	return 0; 
+}
+
+static size_t _blob_backlog(ubus_server_t socket, uint32_t peer){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, peer); 
+	if(!id) return 0; 
+	return container_of(id, struct ubus_srv_blob_client, id)->tx_bytes; 
+}
+
+static int _blob_listen(ubus_server_t socket, const char *path){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	if(path[0] == '/' || (path[0] == '.' && path[1] == '/')){
+		umask(0177); 
+		unlink(path); 
+		self->listen_fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, path, NULL); 
+	} else {
+		char proto[NAME_MAX], host[NAME_MAX], file[NAME_MAX], service[16]; 
+		int port = 5303; 
+		if(!url_scanf(path, proto, host, &port, file)){
+			fprintf(stderr, "Could not parse url: %s\n", path); 
+			return -1; 
+		}
+		snprintf(service, sizeof(service), "%d", port); 
+		self->listen_fd = usock(USOCK_TCP | USOCK_SERVER | USOCK_NONBLOCK, NULL, service); 
+	}
+	if(self->listen_fd < 0){
+		perror("usock"); 
+		return -1; 
+	}
+#ifdef CONFIG_IO_URING
+	if(self->uring) ubus_uring_accept(self->uring, &self->accept_op, self->listen_fd); 
+#endif
+	return 0; 
+}
+
+static int _blob_adopt(ubus_server_t socket, int fd){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); 
+	struct ubus_srv_blob_client *cl = ubus_srv_blob_client_new(self, fd); 
+	pthread_mutex_lock(&self->adopt_lock); 
+	list_add_tail(&cl->list, &self->adopted); 
+	pthread_mutex_unlock(&self->adopt_lock); 
+	return 0; 
+}
+
+static int _blob_connect(ubus_server_t socket, const char *path){
+	// this is only the listening side of the protocol
+	return -1; 
+}
+
+static void *_blob_userdata(ubus_server_t socket, void *ptr){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
 	if(!ptr) return self->user_data; 
 	self->user_data = ptr; 
 	return ptr; 
 }
 
-ubus_socket_t ubus_rawsocket_new(void){
-	struct ubus_rawsocket *self = calloc(1, sizeof(struct ubus_rawsocket)); 
-	// virtual api 
-	static const struct ubus_socket_api api = {
-		.destroy = _rawsocket_destroy, 
-		.listen = _rawsocket_listen, 
-		.connect = _rawsocket_connect, 
-		.disconnect = _rawsocket_disconnect, 
-		.send = _rawsocket_send, 
-		.handle_events = _rawsocket_handle_events, 
-		.on_message = _rawsocket_on_message, 
-		.userdata = _rawsocket_userdata
+static void _blob_destroy(ubus_server_t socket){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+#ifdef CONFIG_IO_URING
+	// nothing is in flight once the ring is gone so every client can be freed right away
+	if(self->uring) ubus_uring_delete(&self->uring); 
+	struct ubus_srv_blob_client *closed, *next; 
+	list_for_each_entry_safe(closed, next, &self->closing, list){
+		list_del(&closed->list); 
+		ubus_srv_blob_client_delete(&closed); 
+	}
+#endif
+	struct ubus_id *id; 
+	while((id = ubus_id_map_first(&self->clients))){
+		struct ubus_srv_blob_client *client = container_of(id, struct ubus_srv_blob_client, id); 
+		ubus_id_map_free(&self->clients, &client->id); 
+		ubus_srv_blob_client_delete(&client); 
+	}
+	ubus_id_map_destroy(&self->clients); 
+	struct ubus_srv_blob_client *cl, *tmp; 
+	list_for_each_entry_safe(cl, tmp, &self->adopted, list){
+		list_del(&cl->list); 
+		ubus_srv_blob_client_delete(&cl); 
+	}
+	pthread_mutex_destroy(&self->adopt_lock); 
+	struct ubus_message *msg; 
+	while(_blob_pop_message(self, &msg) > 0){
+		ubus_message_delete(&msg); 
+	}
+	blob_free(&self->unpack); 
+	if(self->listen_fd >= 0) close(self->listen_fd); 
+	free(self); 
+}
+
+void ubus_srv_blob_set_frame_check(ubus_server_t socket, enum ubus_frame_check check){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	self->check = check; 
+}
+
+void ubus_srv_blob_set_codec(ubus_server_t socket, enum ubus_codec codec){
+	struct ubus_srv_blob *self = container_of(socket, struct ubus_srv_blob, api); 
+	self->codec = codec; 
+}
+
+ubus_server_t ubus_srv_blob_new(void){
+	struct ubus_srv_blob *self = calloc(1, sizeof(struct ubus_srv_blob)); 
+	self->listen_fd = -1; 
+	ubus_id_map_init(&self->clients); 
+	INIT_LIST_HEAD(&self->adopted); 
+	pthread_mutex_init(&self->adopt_lock, NULL); 
+	ubus_prio_queue_init(&self->rx_queue); 
+	// old peers only know crc16 so that is what we insist on unless told otherwise
+	self->check = UBUS_FRAME_CHECK_CRC16; 
+	blob_init(&self->unpack, 0, 0); 
+#ifdef CONFIG_IO_URING
+	INIT_LIST_HEAD(&self->closing); 
+	ubus_uring_op_init(&self->accept_op, _blob_on_accept); 
+	ubus_uring_op_init(&self->wake_op, _blob_on_wake); 
+	// falls back to poll() on kernels without io_uring
+	self->uring = ubus_uring_new(UBUS_SRV_BLOB_URING_ENTRIES); 
+#endif
+	static const struct ubus_server_api api = {
+		.destroy = _blob_destroy,
+		.listen = _blob_listen,
+		.connect = _blob_connect,
+		.send = _blob_send,
+		.recv = _blob_recv,
+		.wait = _blob_wait_ready,
+		.backlog = _blob_backlog,
+		.adopt = _blob_adopt,
+		.userdata = _blob_userdata
 	}; 
 	self->api = &api; 
 	return &self->api; 
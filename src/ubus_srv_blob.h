@@ -13,44 +13,14 @@
 
 #pragma once
 
-#include "ubus_socket.h"
-#include "ubus_message.h"
+#include "ubus_srv.h"
+#include "ubus_crc.h"
+#include "ubus_msgpack.h"
 
-#include <libutype/list.h>
+//! Create a server that exchanges binary framed blobs over a stream socket. Listen path is a unix socket path (starting with '/' or './') or a url whose port is used for tcp. 
+ubus_server_t ubus_srv_blob_new(void); 
 
-#include "ubus_id.h"
-
-#define UBUS_PEER_BROADCAST (-1)
-
-struct ubus_context; 
-struct ubus_request; 
-
-struct ubus_rawsocket; 
-
-//typedef void (*ubus_rawsocket_data_cb_t)(struct ubus_rawsocket *self, uint32_t peer, uint8_t type, uint32_t serial, struct blob_field *msg);  
-//typedef void (*ubus_rawsocket_client_cb_t)(struct ubus_rawsocket *self, uint32_t peer);  
-
-ubus_socket_t ubus_rawsocket_new(void); 
-/*void ubus_rawsocket_delete(struct ubus_rawsocket **self); 
-
-void ubus_rawsocket_init(struct ubus_rawsocket *self); 
-void ubus_rawsocket_destroy(struct ubus_rawsocket *self); 
-
-int ubus_rawsocket_listen(struct ubus_rawsocket *self, const char *path); 
-int ubus_rawsocket_connect(struct ubus_rawsocket *self, const char *path, uint32_t *id);
-
-
-int ubus_rawsocket_send(struct ubus_rawsocket *self, int32_t peer, int type, uint16_t serial, struct blob_field *msg); 
-static inline void ubus_rawsocket_on_message(struct ubus_rawsocket *self, ubus_rawsocket_data_cb_t cb){
-	self->on_message = cb; 
-}
-static inline void ubus_rawsocket_on_client_connected(struct ubus_rawsocket *self, ubus_rawsocket_client_cb_t cb){
-	self->on_client_connected = cb; 
-}
-
-void  ubus_rawsocket_poll(struct ubus_rawsocket *self, int timeout); 
-
-static inline void ubus_rawsocket_set_userdata(struct ubus_rawsocket *self, void *ptr){
-	self->user_data = ptr; 
-}
-*/
+//! Set the weakest integrity check a connection may use (crc16 by default so that old peers get in). The first frame of a peer fixes the check of its connection and frames that change it are refused. UBUS_FRAME_CHECK_NONE lets unchecked peers in and should only be used on trusted local sockets. 
+void ubus_srv_blob_set_frame_check(ubus_server_t socket, enum ubus_frame_check check); 
+//! Set encoding of outgoing frames until the peer has sent its first frame. After that replies use the codec of the peer. 
+void ubus_srv_blob_set_codec(ubus_server_t socket, enum ubus_codec codec); 
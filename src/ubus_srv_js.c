@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <netdb.h>
 
 #include <libusys/usock.h>
 #include <blobpack/blobpack.h>
@@ -33,9 +34,11 @@
 
 #include <blobpack/blobpack.h>
 
-#include "json_socket.h"
 #include "ubus_socket.h"
 #include "ubus_message.h"
+#include "ubus_slab.h"
+#include "ubus_msgpack.h"
+#include "ubus_json.h"
 #include <assert.h>
 
 #define STATIC_IOV(_var) { .iov_base = (char *) &(_var), .iov_len = sizeof(_var) }
@@ -43,7 +46,16 @@
 #define UBUS_MSGBUF_REDUCTION_INTERVAL	16
 
 
-struct ubus_socket_frame {
+struct json_socket {
+	struct ubus_id_map clients; 
+	struct blob buf; 
+	int listen_fd; 
+	ubus_socket_msg_cb_t on_message; 
+	void *user_data; 
+	const struct ubus_socket_api *api; 
+}; 
+
+struct ubus_json_frame {
 	struct list_head list; 
 
 	char *data; 
@@ -53,20 +65,24 @@ struct ubus_socket_frame {
 
 struct ubus_json_client {
 	struct ubus_id id; 
-	struct list_head tx_queue; 
+	struct ubus_prio_queue tx_queue; 
+	// frame that is partly written. It has to be finished before a more urgent one can go out. 
+	struct ubus_json_frame *tx_current; 
 	int fd; 
 
 	char *recv_buffer; 
 	int recv_size; 
 	int recv_count; 
 	struct blob buf; 
+	// codec of outgoing frames. Incoming ones may always be either. 
+	enum ubus_codec codec; 
 	//struct list_head rx_queue;
 }; 
 
 
 static struct ubus_json_client *ubus_json_client_new(int fd){
 	struct ubus_json_client *self = calloc(1, sizeof(struct ubus_json_client)); 
-	INIT_LIST_HEAD(&self->tx_queue); 
+	ubus_prio_queue_init(&self->tx_queue); 
 	self->fd = fd; 
 	self->recv_size = 16535; 
 	self->recv_buffer = calloc(1, self->recv_size); 
@@ -75,7 +91,14 @@ static struct ubus_json_client *ubus_json_client_new(int fd){
 	return self; 
 }
 
+void ubus_json_frame_delete(struct ubus_json_frame **self); 
+
 static void ubus_json_client_delete(struct ubus_json_client **self){
+	struct ubus_json_frame *frame; 
+	if((*self)->tx_current) ubus_json_frame_delete(&(*self)->tx_current); 
+	while((frame = ubus_prio_queue_pop_entry(&(*self)->tx_queue, struct ubus_json_frame, list))){
+		ubus_json_frame_delete(&frame); 
+	}
 	shutdown((*self)->fd, SHUT_RDWR); 
 	close((*self)->fd); 
 	blob_free(&(*self)->buf); 
@@ -84,38 +107,113 @@ static void ubus_json_client_delete(struct ubus_json_client **self){
 	*self = NULL;
 }
 
-struct ubus_json_frame *ubus_json_frame_new(struct blob_field *msg){
+static struct ubus_slab _json_frame_slab = UBUS_SLAB_INITIALIZER("srv_js_frame", struct ubus_json_frame, NULL); 
+
+struct ubus_json_frame *ubus_json_frame_new(struct blob_field *msg, enum ubus_codec codec){
 	assert(msg); 
-	struct ubus_json_frame *self = calloc(1, sizeof(struct ubus_json_frame)); 
-	char *json = blob_field_to_json(msg); 
-	self->data_size = strlen(json) + 1; 
-	self->data = calloc(1, self->data_size + 1); 
-	sprintf(self->data, "%s\n", json); 
-	//printf("new frame %s\n", self->data); 
-	free(json); 
+	struct ubus_json_frame *self = ubus_slab_alloc(&_json_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
+	if(codec == UBUS_CODEC_MSGPACK){
+		// msgpack values know their own length so they need no separator
+		self->data_size = ubus_msgpack_size(msg); 
+		self->data = malloc(self->data_size); 
+		ubus_msgpack_encode(msg, self->data); 
+	} else {
+		// json is written straight into the frame and followed by the separator
+		self->data_size = ubus_json_size(msg) + 1; 
+		self->data = malloc(self->data_size); 
+		ubus_json_encode(msg, self->data); 
+		self->data[self->data_size - 1] = '\n'; 
+	}
+	INIT_LIST_HEAD(&self->list); 
+	return self; 
+}
+
+// answer to the msgpack handshake of a peer. Peers that do not know about msgpack see an empty line. 
+static struct ubus_json_frame *ubus_json_frame_new_handshake(void){
+	struct ubus_json_frame *self = ubus_slab_alloc(&_json_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
+	self->data_size = 2; 
+	self->data = malloc(self->data_size); 
+	self->data[0] = (char)UBUS_MSGPACK_MAGIC; 
+	self->data[1] = '\n'; 
 	INIT_LIST_HEAD(&self->list); 
 	return self; 
 }
 
 void ubus_json_frame_delete(struct ubus_json_frame **self){
 	free((*self)->data); 
-	free(*self); 
+	ubus_slab_free(&_json_frame_slab, *self); 
 	*self = NULL; 
 }
 
+static void _json_socket_client_flush(struct json_socket *self, struct ubus_json_client *client); 
+
+/**
+Process as many messages as we can from the recv buffer and keep any partial message at the
+start of it. Json messages end with a new line. Anything that starts with a byte above ascii is
+a msgpack value which carries its own length. Returns false if the stream can not be read any
+further (msgpack has no separator to resync on). 
+**/
+static bool _ubus_json_client_process(struct ubus_json_client *self, struct json_socket *socket){
+	while(self->recv_count > 0){
+		uint8_t first = self->recv_buffer[0]; 
+		int pos = 0; 
+		if(first == UBUS_MSGPACK_MAGIC){
+			// peer reads msgpack. Tell it that we do too and answer in msgpack from now on. 
+			if(self->codec != UBUS_CODEC_MSGPACK){
+				self->codec = UBUS_CODEC_MSGPACK; 
+				struct ubus_json_frame *ack = ubus_json_frame_new_handshake(); 
+				ubus_prio_queue_add(&self->tx_queue, &ack->list, UBUS_MSG_PRIO_CONTROL); 
+				_json_socket_client_flush(socket, self); 
+			}
+			pos = 1; 
+		} else if(first >= 0x80){
+			blob_reset(&self->buf); 
+			ssize_t len = ubus_msgpack_decode(&self->buf, self->recv_buffer, self->recv_count); 
+			if(len < 0) return false; 
+			if(len == 0) break; 
+			if(socket->on_message)
+				socket->on_message(&socket->api, self->id.id, blob_field_first_child(blob_head(&self->buf)));  
+			pos = len; 
+		} else {
+			char *ch; 
+			char *end = self->recv_buffer + self->recv_count; 
+			for(ch = self->recv_buffer; 
+				ch < end && *ch && *ch != '\n'; ch++){
+			}
+			if(ch == end || *ch != '\n') break; 
+			blob_reset(&self->buf); 
+			if(ubus_json_parse(&self->buf, self->recv_buffer, ch - self->recv_buffer)){
+				if(socket->on_message)
+					socket->on_message(&socket->api, self->id.id, blob_field_first_child(blob_head(&self->buf)));  
+			}
+			pos = (ch - self->recv_buffer + 1); 
+		}
+
+		int rest_size = self->recv_count - pos; 
+		//printf("rest size %d\n", rest_size); 
+		// move the rest to the start of the buffer instead of allocating a new buffer
+		if(rest_size > 0) memmove(self->recv_buffer, self->recv_buffer + pos, rest_size); 
+		self->recv_count = rest_size; 
+	}
+	return true; 
+}
+
 static void json_socket_init(struct json_socket *self){
 	//INIT_LIST_HEAD(&self->clients); 
-	ubus_id_tree_init(&self->clients); 
+	ubus_id_map_init(&self->clients); 
 	blob_init(&self->buf, 0, 0); 
 }
 
 static void json_socket_destroy(struct json_socket *self){
-	struct ubus_id *id, *tmp; 
-	avl_for_each_element_safe(&self->clients, id, avl, tmp){
+	struct ubus_id *id; 
+	while((id = ubus_id_map_first(&self->clients))){
 		struct ubus_json_client *client = container_of(id, struct ubus_json_client, id);  
-		ubus_id_free(&self->clients, &client->id); 
+		ubus_id_map_free(&self->clients, &client->id); 
 		ubus_json_client_delete(&client); 
 	}
+	ubus_id_map_destroy(&self->clients); 
 	if(self->listen_fd) close(self->listen_fd);
 	blob_free(&self->buf); 
 }
@@ -145,7 +243,7 @@ static void _accept_connection(struct json_socket *self){
 		fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK | O_CLOEXEC);
 
 		struct ubus_json_client *cl = ubus_json_client_new(client); 
-		ubus_id_alloc(&self->clients, &cl->id, 0); 
+		ubus_id_map_alloc(&self->clients, &cl->id, 0); 
 		
 		//if(self->on_message){
 	//		self->on_message(&self->api, cl->id.id, UBUS_MSG_PEER_CONNECTED, 0, 0); 
@@ -163,6 +261,29 @@ static void _split_address_port(char *address, int addrlen, char **port){
 	}
 }
 
+// tcp listeners are bound with SO_REUSEPORT so that several sockets (one per hub shard) can listen
+// on the same port and the kernel spreads incoming connections over them
+static int _json_socket_listen_tcp(const char *host, const char *port){
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }; 
+	struct addrinfo *res = NULL, *ai; 
+	if(getaddrinfo(host, port, &hints, &res) != 0) return -1; 
+	int fd = -1; 
+	for(ai = res; ai; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol); 
+		if(fd < 0) continue; 
+		int one = 1; 
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); 
+#ifdef SO_REUSEPORT
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)); 
+#endif
+		if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break; 
+		close(fd); 
+		fd = -1; 
+	}
+	freeaddrinfo(res); 
+	return fd; 
+}
+
 static int _json_socket_listen(ubus_socket_t socket, const char *_address){
 	struct json_socket *self = container_of(socket, struct json_socket, api); 
 	assert(_address);
@@ -179,7 +300,8 @@ static int _json_socket_listen(ubus_socket_t socket, const char *_address){
 		_split_address_port(address, addrlen, &port); 
 	}
 	printf("trying to listen on %s %s\n", address, port); 
-	self->listen_fd = usock(flags, address, port);
+	if(flags & USOCK_UNIX) self->listen_fd = usock(flags, address, port); 
+	else self->listen_fd = _json_socket_listen_tcp(address, port); 
 	if (self->listen_fd < 0) {
 		perror("usock");
 		return -1; 
@@ -203,7 +325,7 @@ static int _json_socket_connect(ubus_socket_t socket, const char *_address, uint
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK | O_CLOEXEC);
 
 	struct ubus_json_client *cl = ubus_json_client_new(fd); 
-	ubus_id_alloc(&self->clients, &cl->id, 0); 
+	ubus_id_map_alloc(&self->clients, &cl->id, 0); 
 	
 	// connecting out generates the same event as connecting in
 	//if(self->on_message){
@@ -233,45 +355,18 @@ static bool _ubus_json_client_recv(struct ubus_json_client *self, struct json_so
 		}
 
 		// process as many messages as we can and save any extra data in the recv buffer 
-		while(true){
-			char *ch; 
-			for(ch = self->recv_buffer; 
-				*ch && *ch != '\n' && ch < (self->recv_buffer + self->recv_count); ch++){
-			}
-			if(*ch == '\n'){
-				*ch = 0; 
-				blob_reset(&self->buf); 
-				if(blob_put_json(&self->buf, self->recv_buffer)){
-					if(socket->on_message)
-						socket->on_message(&socket->api, self->id.id, blob_field_first_child(blob_head(&self->buf)));  
-				}
-
-				int pos = (ch - self->recv_buffer + 1); 
-				int rest_size = self->recv_count - pos; 
-				//printf("rest size %d\n", rest_size); 
-				if(rest_size > 0){
-					char *rest = calloc(1, self->recv_size); 
-					memcpy(rest, self->recv_buffer + pos, rest_size); 
-					free(self->recv_buffer); 
-					self->recv_buffer = rest; 
-					self->recv_count = rest_size; 
-					continue; 
-				} else {
-					self->recv_count = 0; 
-				}
-			} 
-			break; 
+		if(!_ubus_json_client_process(self, socket)){
+			printf("bad message from %08x!\n", self->id.id); 
+			return false; 
 		}
 	} 
 	return true; 
 }
 
 static void _ubus_json_client_send(struct ubus_json_client *self){
-	if(list_empty(&self->tx_queue)){
-		return; 
-	}
-
-	struct ubus_json_frame *req = list_first_entry(&self->tx_queue, struct ubus_json_frame, list);
+	if(!self->tx_current) self->tx_current = ubus_prio_queue_pop_entry(&self->tx_queue, struct ubus_json_frame, list); 
+	struct ubus_json_frame *req = self->tx_current; 
+	if(!req) return; 
 
 	int sc; 
 	while((sc = send(self->fd, req->data + req->send_count, req->data_size - req->send_count, MSG_NOSIGNAL)) > 0){
@@ -281,7 +376,7 @@ static void _ubus_json_client_send(struct ubus_json_client *self){
 	// TODO: handle disconnect
 	if(req->send_count == req->data_size){
 		// full buffer was transmitted so we destroy the request
-		list_del_init(&req->list); 
+		self->tx_current = NULL; 
 		//printf("removed completed request from queue! %d bytes\n", req->send_count); 
 		ubus_json_frame_delete(&req); 
 	}
@@ -289,16 +384,17 @@ static void _ubus_json_client_send(struct ubus_json_client *self){
 
 static int _json_socket_handle_events(ubus_socket_t socket, int timeout){
 	struct json_socket *self = container_of(socket, struct json_socket, api); 
-	int count = avl_size(&self->clients) + 1; 
+	int count = ubus_id_map_size(&self->clients) + 1; 
 	struct pollfd *pfd = alloca(sizeof(struct pollfd) * count); 
 	memset(pfd, 0, sizeof(struct pollfd) * count); 
-	struct ubus_json_client **clients = alloca(sizeof(void*)*100); 
+	struct ubus_json_client **clients = alloca(sizeof(void*) * count); 
 	pfd[0] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN | POLLERR }; 
 	clients[0] = 0; 
 
 	int c = 1; 
-	struct ubus_id *id;  
-	avl_for_each_element(&self->clients, id, avl){
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
 		struct ubus_json_client *client = (struct ubus_json_client*)container_of(id, struct ubus_json_client, id);  
 		pfd[c] = (struct pollfd){ .fd = client->fd, .events = POLLOUT | POLLIN | POLLERR };  
 		clients[c] = client;  
@@ -321,7 +417,7 @@ static int _json_socket_handle_events(ubus_socket_t socket, int timeout){
 				if(pfd[c].revents & POLLHUP || pfd[c].revents & POLLRDHUP){
 					printf("ERROR: peer hung up!\n"); 
 					_ubus_json_client_recv(clients[c], self); 
-					ubus_id_free(&self->clients, &clients[c]->id); 
+					ubus_id_map_free(&self->clients, &clients[c]->id); 
 					ubus_json_client_delete(&clients[c]); 
 					continue; 
 				} else if(pfd[c].revents & POLLERR){
@@ -330,7 +426,7 @@ static int _json_socket_handle_events(ubus_socket_t socket, int timeout){
 					// receive as much data as we can
 					if(!_ubus_json_client_recv(clients[c], self)){
 						printf("client %08x disconnected!\n", clients[c]->id.id); 
-						ubus_id_free(&self->clients, &clients[c]->id); 
+						ubus_id_map_free(&self->clients, &clients[c]->id); 
 						ubus_json_client_delete(&clients[c]); 
 					}
 				}
@@ -340,25 +436,31 @@ static int _json_socket_handle_events(ubus_socket_t socket, int timeout){
 	return 0; 
 }
 
+static void _json_socket_client_flush(struct json_socket *self, struct ubus_json_client *client){
+	_ubus_json_client_send(client); 
+}
+
 static int _json_socket_send(ubus_socket_t socket, int32_t peer, struct blob_field *msg){
 	struct json_socket *self = container_of(socket, struct json_socket, api); 
 	struct ubus_id *id;  
+	uint32_t idx; 
+	int prio = ubus_message_envelope_priority(msg, false); 
 	
 	if(peer == UBUS_PEER_BROADCAST){
-		avl_for_each_element(&self->clients, id, avl){
+		ubus_id_map_for_each(&self->clients, id, idx){
 			struct ubus_json_client *client = (struct ubus_json_client*)container_of(id, struct ubus_json_client, id);  
-			struct ubus_json_frame *req = ubus_json_frame_new(msg);
-			list_add(&req->list, &client->tx_queue); 
+			struct ubus_json_frame *req = ubus_json_frame_new(msg, client->codec); 
+			ubus_prio_queue_add(&client->tx_queue, &req->list, prio); 
 			// try to send as much as we can right away
-			_ubus_json_client_send(client); 
+			_json_socket_client_flush(self, client); 
 		}		
 	} else {
-		struct ubus_id *id = ubus_id_find(&self->clients, peer); 
+		struct ubus_id *id = ubus_id_map_find(&self->clients, peer); 
 		if(!id) return -1; 
 		struct ubus_json_client *client = (struct ubus_json_client*)container_of(id, struct ubus_json_client, id);  
-		struct ubus_json_frame *req = ubus_json_frame_new(msg);
-		list_add(&req->list, &client->tx_queue); 
-		_ubus_json_client_send(client); 
+		struct ubus_json_frame *req = ubus_json_frame_new(msg, client->codec); 
+		ubus_prio_queue_add(&client->tx_queue, &req->list, prio); 
+		_json_socket_client_flush(self, client); 
 	}
 	return 0; 	
 }
@@ -372,11 +474,11 @@ static void *_json_socket_userdata(ubus_socket_t socket, void *ptr){
 
 static int _json_socket_disconnect(ubus_socket_t socket, uint32_t client_id){
 	struct json_socket *self = container_of(socket, struct json_socket, api); 
-	struct ubus_id *id = ubus_id_find(&self->clients, client_id); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, client_id); 
 	if(!id) return -1; 
 	struct ubus_json_client *client = container_of(id, struct ubus_json_client, id); 
 	printf("client %08x disconnected!\n", client->id.id); 
-	ubus_id_free(&self->clients, &client->id); 
+	ubus_id_map_free(&self->clients, &client->id); 
 	ubus_json_client_delete(&client); 
 	return 0; 
 }
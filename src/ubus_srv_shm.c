@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libusys/usock.h>
+#include <libutype/list.h>
+#include <libutype/avl.h>
+#include <libusys/uloop_timeout.h>
+#include <blobpack/blobpack.h>
+
+#include "ubus_srv_shm.h"
+#include "ubus_message.h"
+#include "ubus_srv.h"
+#include "ubus_id.h"
+#include "ubus_shm.h"
+
+/**
+Shared memory server. Peers connect over a unix socket and hand us a memfd with a pair of
+rings. All messages after that go through the rings. We only block in poll() when none of
+the rings has any data. 
+
+New connections wait on the pending list until their descriptors arrive so that a peer which
+connects and then sends nothing does not hold up the loop. They are dropped if that takes
+longer than UBUS_SRV_SHM_HANDSHAKE_TIMEOUT. Connections accepted by somebody else (see
+ubus_server_adopt()) are put on the adopted list by whatever thread hands them to us and moved
+to the pending list the next time we wait. 
+**/
+
+// milliseconds a new connection has to hand over its shared memory
+#define UBUS_SRV_SHM_HANDSHAKE_TIMEOUT 5000
+
+struct ubus_srv_shm {
+	int listen_fd; 
+	struct ubus_id_map clients; 
+	struct list_head pending; 	// connections that have not finished the handshake
+	pthread_mutex_t adopt_lock; 
+	struct list_head adopted; 	// connections handed to us from other threads (under adopt_lock)
+	bool reap; 			// some clients are marked as disconnected
+	struct ubus_prio_queue rx_queue; 
+	const struct ubus_server_api *api; 
+	void *user_data; 
+}; 
+
+struct ubus_srv_shm_client {
+	struct ubus_id id; 
+	struct ubus_shm_channel chan; 
+	struct ubus_prio_queue tx_queue; // messages that did not fit into the ring yet
+	struct ubus_message *tx_msg; 	// message that is partly in the ring and has to be finished first
+	size_t tx_bytes; 		// size of tx_msg and all messages on tx_queue
+	struct list_head list; 		// on the pending list during the handshake
+	utick_t handshake_timeout; 
+	bool disconnected; 
+}; 
+
+static struct ubus_srv_shm_client *ubus_srv_shm_client_new(){
+	struct ubus_srv_shm_client *self = calloc(1, sizeof(struct ubus_srv_shm_client)); 
+	ubus_prio_queue_init(&self->tx_queue); 
+	INIT_LIST_HEAD(&self->list); 
+	self->chan.sock = self->chan.rx_efd = self->chan.tx_efd = -1; 
+	return self; 
+}
+
+static void ubus_srv_shm_client_delete(struct ubus_srv_shm_client **self){
+	struct ubus_message *msg; 
+	while((msg = ubus_prio_queue_pop_entry(&(*self)->tx_queue, struct ubus_message, list))){
+		ubus_message_delete(&msg); 
+	}
+	if((*self)->tx_msg) ubus_message_delete(&(*self)->tx_msg); 
+	ubus_shm_channel_destroy(&(*self)->chan); 
+	free(*self); 
+	*self = NULL; 
+}
+
+static int _shm_client_write(struct ubus_srv_shm_client *self, struct ubus_message *msg){
+	struct blob_field *data = blob_head(&msg->buf); 
+	return ubus_shm_channel_write(&self->chan, data, blob_field_raw_pad_len(data)); 
+}
+
+// write a message and keep it if only some of its fragments went in. Returns -EAGAIN if the message is not completely in the ring.
+static int _shm_client_put(struct ubus_srv_shm_client *self, struct ubus_message **msg){
+	int ret = _shm_client_write(self, *msg); 
+	if(ret == -EAGAIN && self->chan.tx_done){
+		list_del_init(&(*msg)->list); 
+		self->tx_msg = *msg; 
+		*msg = NULL; 
+	}
+	return ret; 
+}
+
+// most urgent messages get into the ring first once there is room again. Messages are checked against the size limit before they are queued so anything that fails here is dropped. 
+static void _shm_client_flush(struct ubus_srv_shm_client *self){
+	struct ubus_message *msg; 
+	if((msg = self->tx_msg)){
+		if(_shm_client_write(self, msg) == -EAGAIN) return; 
+		self->tx_bytes -= blob_field_raw_pad_len(blob_head(&msg->buf)); 
+		ubus_message_delete(&self->tx_msg); 
+	}
+	while((msg = ubus_prio_queue_first_entry(&self->tx_queue, struct ubus_message, list))){
+		size_t size = blob_field_raw_pad_len(blob_head(&msg->buf)); 
+		if(_shm_client_put(self, &msg) == -EAGAIN) break; 
+		self->tx_bytes -= size; 
+		ubus_message_delete(&msg); 
+	}
+}
+
+static void _shm_remove_client(struct ubus_srv_shm *self, struct ubus_srv_shm_client *client){
+	ubus_id_map_free(&self->clients, &client->id); 
+	ubus_srv_shm_client_delete(&client); 
+}
+
+// drop clients that have hung up or corrupted their ring
+static void _shm_reap_clients(struct ubus_srv_shm *self){
+	if(!self->reap) return; 
+	self->reap = false; 
+	struct ubus_srv_shm_client **dead = alloca(sizeof(void*) * (ubus_id_map_size(&self->clients) + 1)); 
+	int count = 0; 
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_shm_client *client = container_of(id, struct ubus_srv_shm_client, id); 
+		if(client->disconnected) dead[count++] = client; 
+	}
+	while(count--) _shm_remove_client(self, dead[count]); 
+}
+
+// try to finish the handshake of a pending connection. Returns false if it is still waiting for the peer.
+static bool _shm_handshake(struct ubus_srv_shm *self, struct ubus_srv_shm_client *cl){
+	int ret = ubus_shm_channel_accept(&cl->chan, cl->chan.sock); 
+	if(ret == -EAGAIN && !utick_expired(cl->handshake_timeout)) return false; 
+	list_del_init(&cl->list); 
+	if(ret < 0){
+		fprintf(stderr, "shm: handshake failed!\n"); 
+		ubus_srv_shm_client_delete(&cl); 
+		return true; 
+	}
+	ubus_id_map_alloc(&self->clients, &cl->id, 0); 
+	return true; 
+}
+
+static struct ubus_srv_shm_client *_shm_new_connection(int fd){
+	struct ubus_srv_shm_client *cl = ubus_srv_shm_client_new(); 
+	cl->chan.sock = fd; 
+	cl->handshake_timeout = utick_now() + (utick_t)UBUS_SRV_SHM_HANDSHAKE_TIMEOUT * 1000UL; 
+	return cl; 
+}
+
+static void _shm_accept_connections(struct ubus_srv_shm *self){
+	while(true){
+		int fd = accept4(self->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK); 
+		if(fd < 0) return; 
+
+		struct ubus_srv_shm_client *cl = _shm_new_connection(fd); 
+		list_add_tail(&cl->list, &self->pending); 
+		// peer usually sends its descriptors right after connecting
+		_shm_handshake(self, cl); 
+	}
+}
+
+static void _shm_take_adopted(struct ubus_srv_shm *self){
+	LIST_HEAD(adopted); 
+	pthread_mutex_lock(&self->adopt_lock); 
+	list_splice_tail_init(&self->adopted, &adopted); 
+	pthread_mutex_unlock(&self->adopt_lock); 
+	struct ubus_srv_shm_client *cl, *tmp; 
+	list_for_each_entry_safe(cl, tmp, &adopted, list){
+		list_del_init(&cl->list); 
+		list_add_tail(&cl->list, &self->pending); 
+		_shm_handshake(self, cl); 
+	}
+}
+
+// read at most one message from each client so that a busy peer can not starve the others
+static void _shm_read_clients(struct ubus_srv_shm *self){
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_shm_client *client = container_of(id, struct ubus_srv_shm_client, id); 
+		if(client->disconnected) continue; 
+		_shm_client_flush(client); 
+		struct ubus_message *msg = ubus_message_new(); 
+		int ret = ubus_shm_channel_read(&client->chan, msg); 
+		if(ret > 0){
+			msg->peer = client->id.id; 
+			ubus_prio_queue_add(&self->rx_queue, &msg->list, ubus_message_read_priority(msg)); 
+			continue; 
+		}
+		ubus_message_delete(&msg); 
+		if(ret != -EAGAIN){
+			fprintf(stderr, "shm: client %08x sent a corrupt ring\n", client->id.id); 
+			client->disconnected = true; 
+			self->reap = true; 
+		}
+	}
+	_shm_reap_clients(self); 
+}
+
+static int _shm_pop_message(struct ubus_srv_shm *self, struct ubus_message **msg){
+	if(!(*msg = ubus_prio_queue_pop_entry(&self->rx_queue, struct ubus_message, list))) return -EAGAIN; 
+	return 1; 
+}
+
+// returns true if we were woken up through wake_fd
+static bool _shm_wait(struct ubus_srv_shm *self, int wake_fd, int timeout){
+	_shm_take_adopted(self); 
+	int count = ubus_id_map_size(&self->clients), npending = 0; 
+	struct ubus_srv_shm_client *cl; 
+	list_for_each_entry(cl, &self->pending, list) npending++; 
+	int nfds = count * 2 + npending + 2; 
+	struct pollfd *pfd = alloca(sizeof(struct pollfd) * nfds); 
+	struct ubus_srv_shm_client **clients = alloca(sizeof(void*) * (count + npending + 1)); 
+	pfd[0] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN }; 
+	// poll skips a wake_fd of -1
+	pfd[nfds - 1] = (struct pollfd){ .fd = wake_fd, .events = POLLIN }; 
+
+	bool sleep = true; 
+	int c = 0; 
+	struct ubus_id *id; 
+	uint32_t idx; 
+	ubus_id_map_for_each(&self->clients, id, idx){
+		struct ubus_srv_shm_client *client = container_of(id, struct ubus_srv_shm_client, id); 
+		clients[c] = client; 
+		pfd[1 + c * 2] = (struct pollfd){ .fd = client->chan.rx_efd, .events = POLLIN }; 
+		pfd[2 + c * 2] = (struct pollfd){ .fd = client->chan.sock, .events = POLLIN }; 
+		c++; 
+		if(!ubus_shm_channel_prepare_wait(&client->chan)) sleep = false; 
+	}
+
+	// pending connections are polled for their descriptors and wake us up in time to be timed out
+	int p = 0; 
+	list_for_each_entry(cl, &self->pending, list){
+		clients[count + p] = cl; 
+		pfd[1 + count * 2 + p] = (struct pollfd){ .fd = cl->chan.sock, .events = POLLIN }; 
+		p++; 
+	}
+	if(npending && (timeout < 0 || timeout > UBUS_SRV_SHM_HANDSHAKE_TIMEOUT)) timeout = UBUS_SRV_SHM_HANDSHAKE_TIMEOUT; 
+
+	if(!sleep) timeout = 0; 
+	int ret = poll(pfd, nfds, timeout); 
+
+	for(c = 0; c < count; c++){
+		ubus_shm_channel_finish_wait(&clients[c]->chan); 
+		if(ret <= 0) continue; 
+		short revents = pfd[2 + c * 2].revents; 
+		// socket never carries any data after the handshake so hangup, error or eof all mean the peer is gone
+		if(revents & (POLLHUP | POLLERR | POLLNVAL)){
+			clients[c]->disconnected = true; 
+		} else if(revents & POLLIN){
+			char ch; 
+			ssize_t n = recv(clients[c]->chan.sock, &ch, 1, MSG_DONTWAIT | MSG_PEEK); 
+			if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) clients[c]->disconnected = true; 
+		}
+		if(clients[c]->disconnected) self->reap = true; 
+	}
+	_shm_reap_clients(self); 
+
+	// handshakes that have made progress or have run out of time
+	for(p = 0; p < npending; p++){
+		cl = clients[count + p]; 
+		if((ret > 0 && pfd[1 + count * 2 + p].revents) || utick_expired(cl->handshake_timeout)) _shm_handshake(self, cl); 
+	}
+
+	if(ret > 0 && (pfd[0].revents & POLLIN)) _shm_accept_connections(self); 
+	return ret > 0 && pfd[nfds - 1].revents; 
+}
+
+static int _shm_recv(ubus_server_t socket, struct ubus_message **msg){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+
+	if(_shm_pop_message(self, msg) > 0) return 1; 
+
+	_shm_read_clients(self); 
+	if(_shm_pop_message(self, msg) > 0) return 1; 
+
+	// does not sleep when the rings are empty. That is what wait is for. 
+	return -EAGAIN; 
+}
+
+static int _shm_wait_ready(ubus_server_t socket, int wake_fd, int timeout){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+
+	if(!ubus_prio_queue_empty(&self->rx_queue)) return 1; 
+	_shm_read_clients(self); 
+	if(!ubus_prio_queue_empty(&self->rx_queue)) return 1; 
+
+	bool woken = _shm_wait(self, wake_fd, timeout); 
+	_shm_read_clients(self); 
+	return woken || !ubus_prio_queue_empty(&self->rx_queue); 
+}
+
+static int _shm_send(ubus_server_t socket, struct ubus_message **msg){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, (*msg)->peer); 
+	if(!id) return -1; 
+
+	struct ubus_srv_shm_client *client = container_of(id, struct ubus_srv_shm_client, id); 
+	size_t size = blob_field_raw_pad_len(blob_head(&(*msg)->buf)); 
+	_shm_client_flush(client); 
+	if(!client->tx_msg && ubus_prio_queue_empty(&client->tx_queue)){
+		int ret = _shm_client_put(client, msg); 
+		if(ret == 0){
+			ubus_message_delete(msg); 
+			return 0; 
+		} else if(ret != -EAGAIN){
+			// too large for the peer to ever accept. The message stays with the caller.
+			return -1; 
+		}
+	} else if(size > UBUS_SHM_MAX_MESSAGE){
+		return -1; 
+	}
+	client->tx_bytes += size; 
+	if(!*msg) return 0; 
+	// ring is full so we keep the message until the peer has made some room
+	ubus_prio_queue_add(&client->tx_queue, &(*msg)->list, (*msg)->priority); 
+	*msg = NULL; 
+	return 0; 
+}
+
+static size_t _shm_backlog(ubus_server_t socket, uint32_t peer){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, peer); 
+	if(!id) return 0; 
+	return container_of(id, struct ubus_srv_shm_client, id)->tx_bytes; 
+}
+
+static int _shm_listen(ubus_server_t socket, const char *path){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	umask(0177); 
+	unlink(path); 
+	self->listen_fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, path, NULL); 
+	if(self->listen_fd < 0){
+		perror("usock"); 
+		return -1; 
+	}
+	return 0; 
+}
+
+static int _shm_adopt(ubus_server_t socket, int fd){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); 
+	struct ubus_srv_shm_client *cl = _shm_new_connection(fd); 
+	pthread_mutex_lock(&self->adopt_lock); 
+	list_add_tail(&cl->list, &self->adopted); 
+	pthread_mutex_unlock(&self->adopt_lock); 
+	return 0; 
+}
+
+static int _shm_connect(ubus_server_t socket, const char *path){
+	// outgoing connections are made using ubus_cli_shm
+	return -1; 
+}
+
+static void *_shm_userdata(ubus_server_t socket, void *ptr){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	if(!ptr) return self->user_data; 
+	self->user_data = ptr; 
+	return ptr; 
+}
+
+static void _shm_destroy(ubus_server_t socket){
+	struct ubus_srv_shm *self = container_of(socket, struct ubus_srv_shm, api); 
+	struct ubus_id *id; 
+	while((id = ubus_id_map_first(&self->clients))){
+		struct ubus_srv_shm_client *client = container_of(id, struct ubus_srv_shm_client, id); 
+		ubus_id_map_free(&self->clients, &client->id); 
+		ubus_srv_shm_client_delete(&client); 
+	}
+	ubus_id_map_destroy(&self->clients); 
+	struct ubus_srv_shm_client *cl, *tmp; 
+	list_for_each_entry_safe(cl, tmp, &self->pending, list){
+		list_del(&cl->list); 
+		ubus_srv_shm_client_delete(&cl); 
+	}
+	list_for_each_entry_safe(cl, tmp, &self->adopted, list){
+		list_del(&cl->list); 
+		ubus_srv_shm_client_delete(&cl); 
+	}
+	pthread_mutex_destroy(&self->adopt_lock); 
+	struct ubus_message *msg; 
+	while(_shm_pop_message(self, &msg) > 0){
+		ubus_message_delete(&msg); 
+	}
+	if(self->listen_fd >= 0) close(self->listen_fd); 
+	free(self); 
+}
+
+ubus_server_t ubus_srv_shm_new(void){
+	struct ubus_srv_shm *self = calloc(1, sizeof(struct ubus_srv_shm)); 
+	self->listen_fd = -1; 
+	ubus_id_map_init(&self->clients); 
+	INIT_LIST_HEAD(&self->pending); 
+	INIT_LIST_HEAD(&self->adopted); 
+	pthread_mutex_init(&self->adopt_lock, NULL); 
+	ubus_prio_queue_init(&self->rx_queue); 
+	static const struct ubus_server_api api = {
+		.destroy = _shm_destroy, 
+		.listen = _shm_listen, 
+		.connect = _shm_connect, 
+		.send = _shm_send, 
+		.recv = _shm_recv, 
+		.wait = _shm_wait_ready, 
+		.backlog = _shm_backlog, 
+		.adopt = _shm_adopt, 
+		.userdata = _shm_userdata
+	}; 
+	self->api = &api; 
+	return &self->api; 
+}
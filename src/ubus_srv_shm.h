@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once 
+
+#include <blobpack/blobpack.h>
+#include "ubus_srv.h"
+
+//! Create a server that exchanges blobs with peers on the same host over shared memory rings. Listen path is a unix socket path used for the handshake. 
+ubus_server_t ubus_srv_shm_new(void); 
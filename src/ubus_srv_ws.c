@@ -33,29 +33,40 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #include "internal.h"
+#include "ubus_slab.h"
+#include "ubus_msgpack.h"
+#include "ubus_json.h"
 
 struct lws_context; 
 struct ubus_srv_ws {
 	struct lws_context *ctx; 
 	struct lws_protocols *protocols; 
-	struct avl_tree clients; 
+	struct ubus_id_map clients; 
 	//struct blob buf; 
 	const struct ubus_server_api *api; 
 	bool shutdown; 
 	pthread_t thread; 
 	pthread_mutex_t qlock; 
-	pthread_cond_t rx_ready; 
-	struct list_head rx_queue; 
+	// written by the websocket thread for every message it puts on rx_queue
+	int rx_efd; 
+	struct ubus_prio_queue rx_queue; 
+	// connections handed to us with ubus_server_adopt(). The websocket thread takes them over. 
+	int *adopted; 
+	int nadopted; 
 	const char *www_root; 
 	void *user_data; 
 }; 
 
 struct ubus_srv_ws_client {
 	struct ubus_id id; 
-	struct list_head tx_queue; 
+	struct ubus_prio_queue tx_queue; 
+	size_t tx_bytes; // size of all frames on tx_queue
 	struct ubus_message *msg; // incoming message
+	enum ubus_codec codec; // picked by the subprotocol the client asked for
 	bool disconnect;
 }; 
 
@@ -64,18 +75,22 @@ struct ubus_srv_ws_frame {
 	uint8_t *buf; 
 	int len; 
 	int sent_count; 
+	bool binary; 
 }; 
 
-struct ubus_srv_ws_frame *ubus_srv_ws_frame_new(struct blob_field *msg){
+static struct ubus_slab _ws_frame_slab = UBUS_SLAB_INITIALIZER("ws_frame", struct ubus_srv_ws_frame, NULL); 
+
+struct ubus_srv_ws_frame *ubus_srv_ws_frame_new(struct blob_field *msg, enum ubus_codec codec){
 	assert(msg); 
-	struct ubus_srv_ws_frame *self = calloc(1, sizeof(struct ubus_srv_ws_frame)); 
+	struct ubus_srv_ws_frame *self = ubus_slab_alloc(&_ws_frame_slab); 
+	memset(self, 0, sizeof(*self)); 
 	INIT_LIST_HEAD(&self->list); 
-	char *json = blob_field_to_json(msg); 
-	//printf("frame: %s\n", json); 
-	self->len = strlen(json); 
-	self->buf = calloc(1, LWS_SEND_BUFFER_PRE_PADDING + self->len + LWS_SEND_BUFFER_POST_PADDING); 
-	memcpy(self->buf + LWS_SEND_BUFFER_PRE_PADDING, json, self->len); 
-	free(json); 
+	// encoded right into the frame behind the headroom that libwebsockets needs so there is nothing to copy
+	self->binary = codec == UBUS_CODEC_MSGPACK; 
+	self->len = (self->binary)?ubus_msgpack_size(msg):ubus_json_size(msg); 
+	self->buf = malloc(LWS_SEND_BUFFER_PRE_PADDING + self->len + LWS_SEND_BUFFER_POST_PADDING); 
+	if(self->binary) ubus_msgpack_encode(msg, self->buf + LWS_SEND_BUFFER_PRE_PADDING); 
+	else ubus_json_encode(msg, (char*)self->buf + LWS_SEND_BUFFER_PRE_PADDING); 
 	self->sent_count = 0; 
 	return self; 
 }
@@ -83,23 +98,23 @@ struct ubus_srv_ws_frame *ubus_srv_ws_frame_new(struct blob_field *msg){
 void ubus_srv_ws_frame_delete(struct ubus_srv_ws_frame **self){
 	assert(self && *self); 
 	free((*self)->buf); 
-	free(*self); 
+	ubus_slab_free(&_ws_frame_slab, *self); 
 	*self = NULL; 
 }
 
 
 static struct ubus_srv_ws_client *ubus_srv_ws_client_new(){
 	struct ubus_srv_ws_client *self = calloc(1, sizeof(struct ubus_srv_ws_client)); 
-	INIT_LIST_HEAD(&self->tx_queue); 
+	ubus_prio_queue_init(&self->tx_queue); 
 	self->msg = ubus_message_new(); 
 	return self; 
 }
 
 static __attribute__((unused)) void ubus_srv_ws_client_delete(struct ubus_srv_ws_client **self){
 	// TODO: free tx_queue
-	struct ubus_srv_ws_frame *pos, *tmp; 
-	list_for_each_entry_safe(pos, tmp, &(*self)->tx_queue, list){
-		ubus_srv_ws_frame_delete(&pos);  
+	struct ubus_srv_ws_frame *frame; 
+	while((frame = ubus_prio_queue_pop_entry(&(*self)->tx_queue, struct ubus_srv_ws_frame, list))){
+		ubus_srv_ws_frame_delete(&frame);  
 	}	
 	ubus_message_delete(&(*self)->msg); 
 	free(*self); 
@@ -119,7 +134,11 @@ static int _ubus_socket_callback(struct lws *wsi, enum lws_callback_reasons reas
 		case LWS_CALLBACK_ESTABLISHED: {
 			struct ubus_srv_ws *self = (struct ubus_srv_ws*)proto->user; 
 			struct ubus_srv_ws_client *client = ubus_srv_ws_client_new(lws_get_socket_fd(wsi)); 
-			ubus_id_alloc(&self->clients, &client->id, 0); 
+			if(proto->name && strcmp(proto->name, UBUS_MSGPACK_WS_PROTOCOL) == 0) client->codec = UBUS_CODEC_MSGPACK; 
+			// the map is searched by _websocket_send on the context thread so it only changes under the lock
+			pthread_mutex_lock(&self->qlock); 
+			ubus_id_map_alloc(&self->clients, &client->id, 0); 
+			pthread_mutex_unlock(&self->qlock); 
 			*user = client; 
 			char hostname[255], ipaddr[255]; 
 			lws_get_peer_addresses(wsi, peer_id, hostname, sizeof(hostname), ipaddr, sizeof(ipaddr)); 
@@ -135,24 +154,34 @@ static int _ubus_socket_callback(struct lws *wsi, enum lws_callback_reasons reas
 			printf("websocket: client disconnected %p %p\n", _user, *user); 
 			struct ubus_srv_ws *self = (struct ubus_srv_ws*)proto->user; 
 			//if(self->on_message) self->on_message(&self->api, (*user)->id.id, UBUS_MSG_PEER_DISCONNECTED, 0, NULL); 
-			ubus_id_free(&self->clients, &(*user)->id); 
+			// _websocket_send may be queueing a frame on this client right now
+			pthread_mutex_lock(&self->qlock); 
+			ubus_id_map_free(&self->clients, &(*user)->id); 
 			ubus_srv_ws_client_delete(user); 	
+			pthread_mutex_unlock(&self->qlock); 
 			*user = 0; 
 			break; 
 		}
 		case LWS_CALLBACK_SERVER_WRITEABLE: {
-			if(list_empty(&(*user)->tx_queue)){
+			struct ubus_srv_ws *self = (struct ubus_srv_ws*)proto->user; 
+			// most urgent frame goes first. Queue is filled by _websocket_send on the context thread. 
+			pthread_mutex_lock(&self->qlock); 
+			struct ubus_srv_ws_frame *frame = ubus_prio_queue_first_entry(&(*user)->tx_queue, struct ubus_srv_ws_frame, list); 
+			pthread_mutex_unlock(&self->qlock); 
+			if(!frame){
 				lws_callback_on_writable(wsi); 	
 				break; 
 			}
 			// TODO: handle partial writes correctly 
-			struct ubus_srv_ws_frame *frame = list_first_entry(&(*user)->tx_queue, struct ubus_srv_ws_frame, list);
-			int n = lws_write(wsi, &frame->buf[LWS_SEND_BUFFER_PRE_PADDING], frame->len, LWS_WRITE_TEXT);// | LWS_WRITE_NO_FIN);
+			int n = lws_write(wsi, &frame->buf[LWS_SEND_BUFFER_PRE_PADDING], frame->len, (frame->binary)?LWS_WRITE_BINARY:LWS_WRITE_TEXT);// | LWS_WRITE_NO_FIN); 
 			if(n < 0) return -1; 
 			//printf("wrote %d bytes of %d\n", n, frame->len); 
 			frame->sent_count += n; 
 			if(frame->sent_count >= frame->len){
+				pthread_mutex_lock(&self->qlock); 
 				list_del_init(&frame->list); 
+				(*user)->tx_bytes -= frame->len; 
+				pthread_mutex_unlock(&self->qlock); 
 				ubus_srv_ws_frame_delete(&frame); 
 			}
 			lws_callback_on_writable(wsi); 	
@@ -165,7 +194,10 @@ static int _ubus_socket_callback(struct lws *wsi, enum lws_callback_reasons reas
 			if(!user) break; 
 			struct ubus_srv_ws *self = (struct ubus_srv_ws*)proto->user; 
 			blob_reset(&(*user)->msg->buf); 
-			if(blob_put_json(&(*user)->msg->buf, in)){
+			bool valid = ((*user)->codec == UBUS_CODEC_MSGPACK)?
+				ubus_msgpack_decode(&(*user)->msg->buf, in, len) == (ssize_t)len:
+				ubus_json_parse(&(*user)->msg->buf, in, len); 
+			if(valid){
 				//struct blob_field *rpcobj = blob_field_first_child(blob_head(&self->buf)); 
 				//TODO: add message to queue
 				//printf("websocket message: "); 
@@ -174,10 +206,13 @@ static int _ubus_socket_callback(struct lws *wsi, enum lws_callback_reasons reas
 				// place the message on the queue
 				pthread_mutex_lock(&self->qlock); 
 				(*user)->msg->peer = (*user)->id.id; 
-				list_add(&(*user)->msg->list, &self->rx_queue); 
+				ubus_prio_queue_add(&self->rx_queue, &(*user)->msg->list, ubus_message_read_priority((*user)->msg)); 
 				(*user)->msg = ubus_message_new(); 
 				pthread_mutex_unlock(&self->qlock); 
-				pthread_cond_signal(&self->rx_ready); 
+				uint64_t one = 1; 
+				if(write(self->rx_efd, &one, sizeof(one)) < 0){
+					// counter only overflows if nobody ever waits, in which case nobody needs waking either
+				}
 			} else {
 				printf("got bad message\n"); 
 			}
@@ -229,13 +264,16 @@ void _websocket_destroy(ubus_server_t socket){
 	printf("joining..\n"); 
 	pthread_join(self->thread, NULL); 
 	pthread_mutex_destroy(&self->qlock); 
-	pthread_cond_destroy(&self->rx_ready); 
-	struct ubus_id *id, *tmp; 
-	avl_for_each_element_safe(&self->clients, id, avl, tmp){
+	close(self->rx_efd); 
+	struct ubus_id *id; 
+	while((id = ubus_id_map_first(&self->clients))){
 		struct ubus_srv_ws_client *client = container_of(id, struct ubus_srv_ws_client, id);  
-		ubus_id_free(&self->clients, &client->id); 
+		ubus_id_map_free(&self->clients, &client->id); 
 		ubus_srv_ws_client_delete(&client); 
 	}
+	ubus_id_map_destroy(&self->clients); 
+	for(int c = 0; c < self->nadopted; c++) close(self->adopted[c]); 
+	free(self->adopted); 
 
 	if(self->ctx) lws_context_destroy(self->ctx); 
 	printf("context destroyed\n"); 
@@ -243,18 +281,9 @@ void _websocket_destroy(ubus_server_t socket){
 	free(self);  
 }
 
-int _websocket_listen(ubus_server_t socket, const char *path){
-	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
+static struct lws_context *_websocket_create_context(struct ubus_srv_ws *self, int port){
 	struct lws_context_creation_info info; 
 	memset(&info, 0, sizeof(info)); 
-
-	char proto[NAME_MAX], host[NAME_MAX], file[NAME_MAX]; 
-	int port = 5303; 
-	if(!url_scanf(path, proto, host, &port, file)){
-		fprintf(stderr, "Could not parse url: %s\n", path); 
-		return -1; 
-	}
-
 	info.port = port;
 	info.gid = -1; 
 	info.uid = -1; 
@@ -262,12 +291,54 @@ int _websocket_listen(ubus_server_t socket, const char *path){
 	info.protocols = self->protocols; 
 	//info.extensions = lws_get_internal_extensions();
 	info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
+	return lws_create_context(&info); 
+}
 
-	self->ctx = lws_create_context(&info); 
+int _websocket_listen(ubus_server_t socket, const char *path){
+	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
+
+	char proto[NAME_MAX], host[NAME_MAX], file[NAME_MAX]; 
+	int port = 5303; 
+	if(!url_scanf(path, proto, host, &port, file)){
+		fprintf(stderr, "Could not parse url: %s\n", path); 
+		return -1; 
+	}
+
+	self->ctx = _websocket_create_context(self, port); 
 
 	return 0; 
 }
 
+static int _websocket_adopt(ubus_server_t socket, int fd){
+	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
+	pthread_mutex_lock(&self->qlock); 
+	int *adopted = realloc(self->adopted, sizeof(int) * (self->nadopted + 1)); 
+	if(adopted){
+		adopted[self->nadopted++] = fd; 
+		self->adopted = adopted; 
+	}
+	pthread_mutex_unlock(&self->qlock); 
+	return (adopted)?0:-1; 
+}
+
+// hand connections that were accepted by somebody else to libwebsockets. A server that does not
+// listen itself gets a context without a listening port for them. 
+static void _websocket_adopt_pending(struct ubus_srv_ws *self){
+	pthread_mutex_lock(&self->qlock); 
+	int *fds = self->adopted, count = self->nadopted; 
+	self->adopted = NULL; 
+	self->nadopted = 0; 
+	pthread_mutex_unlock(&self->qlock); 
+	if(!count) return; 
+	if(!self->ctx) self->ctx = _websocket_create_context(self, CONTEXT_PORT_NO_LISTEN); 
+	for(int c = 0; c < count; c++){
+		// libwebsockets closes the connection itself if it can not take it
+		if(!self->ctx) close(fds[c]); 
+		else lws_adopt_socket(self->ctx, fds[c]); 
+	}
+	free(fds); 
+}
+
 int _websocket_connect(ubus_server_t socket, const char *path){
 	//struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
 	return -1; 
@@ -276,8 +347,11 @@ int _websocket_connect(ubus_server_t socket, const char *path){
 static void *_websocket_server_thread(void *ptr){
 	struct ubus_srv_ws *self = (struct ubus_srv_ws*)ptr; 
 	while(!self->shutdown){
+		_websocket_adopt_pending(self); 
 		if(self->ctx) 
 			lws_service(self->ctx, 100);	
+		else
+			usleep(10000); // nothing to serve until a connection is handed to us
 	}
 	return 0; 
 }
@@ -285,20 +359,31 @@ static void *_websocket_server_thread(void *ptr){
 static int _websocket_send(ubus_server_t socket, struct ubus_message **msg){
 	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
 	pthread_mutex_lock(&self->qlock); 
-	struct ubus_id *id = ubus_id_find(&self->clients, (*msg)->peer); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, (*msg)->peer); 
 	if(!id) {
 		pthread_mutex_unlock(&self->qlock); 
 		return -1; 
 	}
 	
 	struct ubus_srv_ws_client *client = (struct ubus_srv_ws_client*)container_of(id, struct ubus_srv_ws_client, id);  
-	struct ubus_srv_ws_frame *frame = ubus_srv_ws_frame_new(blob_head(&(*msg)->buf)); 
-	list_add_tail(&frame->list, &client->tx_queue); 	
+	struct ubus_srv_ws_frame *frame = ubus_srv_ws_frame_new(blob_head(&(*msg)->buf), client->codec); 
+	ubus_prio_queue_add(&client->tx_queue, &frame->list, (*msg)->priority); 	
+	client->tx_bytes += frame->len; 
 	pthread_mutex_unlock(&self->qlock); 
 	ubus_message_delete(msg); 
 	return 0; 
 }
 
+static size_t _websocket_backlog(ubus_server_t socket, uint32_t peer){
+	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
+	size_t bytes = 0; 
+	pthread_mutex_lock(&self->qlock); 
+	struct ubus_id *id = ubus_id_map_find(&self->clients, peer); 
+	if(id) bytes = container_of(id, struct ubus_srv_ws_client, id)->tx_bytes; 
+	pthread_mutex_unlock(&self->qlock); 
+	return bytes; 
+}
+
 static void *_websocket_userdata(ubus_server_t socket, void *ptr){
 	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
 	if(!ptr) return self->user_data; 
@@ -306,28 +391,40 @@ static void *_websocket_userdata(ubus_server_t socket, void *ptr){
 	return ptr; 
 }
 
-static int _websocket_recv(ubus_server_t socket, struct ubus_message **msg){
+static int _websocket_wait(ubus_server_t socket, int wake_fd, int timeout){
 	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
 
-	struct timespec t; 
-	clock_gettime(CLOCK_REALTIME, &t); 
-	// delay of 100ms
-	t.tv_nsec+=100000000UL;
-
 	pthread_mutex_lock(&self->qlock); 
-	if(list_empty(&self->rx_queue)){
-		if(pthread_cond_timedwait(&self->rx_ready, &self->qlock, &t) == ETIMEDOUT){
-			//printf("timeout\n"); 
-			pthread_mutex_unlock(&self->qlock); 
-			return -EAGAIN; 
+	bool ready = !ubus_prio_queue_empty(&self->rx_queue); 
+	pthread_mutex_unlock(&self->qlock); 
+	if(ready) return 1; 
+
+	// a message queued after we looked has written the eventfd so we can not miss it. poll skips a wake_fd of -1. 
+	struct pollfd pfd[2] = {
+		{ .fd = self->rx_efd, .events = POLLIN }, 
+		{ .fd = wake_fd, .events = POLLIN }
+	}; 
+	int ret = poll(pfd, 2, timeout); 
+	if(ret < 0) return (errno == EINTR)?0:-1; 
+	if(pfd[0].revents){
+		uint64_t count; 
+		if(read(self->rx_efd, &count, sizeof(count)) < 0){
+			// somebody else has reset it already
 		}
 	}
-	if(list_empty(&self->rx_queue)) {
+	return ret; 
+}
+
+static int _websocket_recv(ubus_server_t socket, struct ubus_message **msg){
+	struct ubus_srv_ws *self = container_of(socket, struct ubus_srv_ws, api); 
+
+	// does not block. Sleeping until something arrives is what wait is for. 
+	pthread_mutex_lock(&self->qlock); 
+	struct ubus_message *m = ubus_prio_queue_pop_entry(&self->rx_queue, struct ubus_message, list); 
+	if(!m) {
 		pthread_mutex_unlock(&self->qlock); 
 		return -EAGAIN; 
 	}
-	struct ubus_message *m = list_first_entry(&self->rx_queue, struct ubus_message, list); 
-	list_del_init(&m->list); 
 	*msg = m; 
 	pthread_mutex_unlock(&self->qlock); 
 	return 1; 
@@ -337,23 +434,33 @@ static int _websocket_recv(ubus_server_t socket, struct ubus_message **msg){
 ubus_server_t ubus_srv_ws_new(const char *www_root){
 	struct ubus_srv_ws *self = calloc(1, sizeof(struct ubus_srv_ws)); 
 	self->www_root = (www_root)?www_root:"/www/"; 
-	self->protocols = calloc(2, sizeof(struct lws_protocols)); 
+	self->protocols = calloc(3, sizeof(struct lws_protocols)); 
 	self->protocols[0] = (struct lws_protocols){
 		.name = "",
 		.callback = _ubus_socket_callback,
 		.per_session_data_size = sizeof(struct ubus_srv_ws_client*),
 		.user = self
 	};
-	ubus_id_tree_init(&self->clients); 
+	// clients that ask for this subprotocol get binary msgpack frames instead of json text
+	self->protocols[1] = (struct lws_protocols){
+		.name = UBUS_MSGPACK_WS_PROTOCOL,
+		.callback = _ubus_socket_callback,
+		.per_session_data_size = sizeof(struct ubus_srv_ws_client*),
+		.user = self
+	}; 
+	ubus_id_map_init(&self->clients); 
 	pthread_mutex_init(&self->qlock, NULL); 
-	pthread_cond_init(&self->rx_ready, NULL); 
-	INIT_LIST_HEAD(&self->rx_queue); 
+	self->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	ubus_prio_queue_init(&self->rx_queue); 
 	static const struct ubus_server_api api = {
 		.destroy = _websocket_destroy, 
 		.listen = _websocket_listen, 
 		.connect = _websocket_connect, 
 		.send = _websocket_send, 
 		.recv = _websocket_recv, 
+		.wait = _websocket_wait, 
+		.backlog = _websocket_backlog, 
+		.adopt = _websocket_adopt, 
 		.userdata = _websocket_userdata
 	}; 
 	self->api = &api; 
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+#include <liburing.h>
+
+#include "ubus_uring.h"
+
+#define UBUS_URING_BUF_GROUP 0
+
+struct ubus_uring {
+	struct io_uring ring; 
+	struct io_uring_buf_ring *buf_ring; 
+	char *buf_mem; 
+}; 
+
+static void _ubus_uring_buf_recycle(struct ubus_uring *self, int bid){
+	io_uring_buf_ring_add(self->buf_ring, self->buf_mem + (size_t)bid * UBUS_URING_BUF_SIZE, UBUS_URING_BUF_SIZE,
+		bid, io_uring_buf_ring_mask(UBUS_URING_BUF_COUNT), 0); 
+	io_uring_buf_ring_advance(self->buf_ring, 1); 
+}
+
+struct ubus_uring *ubus_uring_new(unsigned int entries){
+	struct ubus_uring *self = calloc(1, sizeof(struct ubus_uring)); 
+
+	// multishot operations produce many completions per submission so the completion queue is made larger
+	struct io_uring_params params; 
+	memset(&params, 0, sizeof(params)); 
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN; 
+	params.cq_entries = entries * 8; 
+	int ret = io_uring_queue_init_params(entries, &self->ring, &params); 
+	if(ret == -EINVAL){
+		// older kernels do not know about cooperative task running
+		params.flags &= ~IORING_SETUP_COOP_TASKRUN; 
+		ret = io_uring_queue_init_params(entries, &self->ring, &params); 
+	}
+	if(ret < 0){
+		fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret)); 
+		free(self); 
+		return NULL; 
+	}
+
+	self->buf_mem = calloc(UBUS_URING_BUF_COUNT, UBUS_URING_BUF_SIZE); 
+	self->buf_ring = io_uring_setup_buf_ring(&self->ring, UBUS_URING_BUF_COUNT, UBUS_URING_BUF_GROUP, 0, &ret); 
+	if(!self->buf_ring){
+		fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret)); 
+		io_uring_queue_exit(&self->ring); 
+		free(self->buf_mem); 
+		free(self); 
+		return NULL; 
+	}
+	for(int c = 0; c < UBUS_URING_BUF_COUNT; c++){
+		io_uring_buf_ring_add(self->buf_ring, self->buf_mem + (size_t)c * UBUS_URING_BUF_SIZE, UBUS_URING_BUF_SIZE,
+			c, io_uring_buf_ring_mask(UBUS_URING_BUF_COUNT), c); 
+	}
+	io_uring_buf_ring_advance(self->buf_ring, UBUS_URING_BUF_COUNT); 
+	return self; 
+}
+
+void ubus_uring_delete(struct ubus_uring **self){
+	io_uring_free_buf_ring(&(*self)->ring, (*self)->buf_ring, UBUS_URING_BUF_COUNT, UBUS_URING_BUF_GROUP); 
+	io_uring_queue_exit(&(*self)->ring); 
+	free((*self)->buf_mem); 
+	free(*self); 
+	*self = NULL; 
+}
+
+static struct io_uring_sqe *_ubus_uring_get_sqe(struct ubus_uring *self){
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&self->ring); 
+	if(sqe) return sqe; 
+	// submission queue is full so hand what we have to the kernel and try again
+	io_uring_submit(&self->ring); 
+	return io_uring_get_sqe(&self->ring); 
+}
+
+int ubus_uring_reserve(struct ubus_uring *self, unsigned int count){
+	if(io_uring_sq_space_left(&self->ring) >= count) return 0; 
+	// a chain that is split over two submissions would lose its ordering so we submit before starting it
+	io_uring_submit(&self->ring); 
+	return (io_uring_sq_space_left(&self->ring) >= count)?0:-EBUSY; 
+}
+
+int ubus_uring_accept(struct ubus_uring *self, struct ubus_uring_op *op, int fd){
+	struct io_uring_sqe *sqe = _ubus_uring_get_sqe(self); 
+	if(!sqe) return -EBUSY; 
+	io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC); 
+	io_uring_sqe_set_data(sqe, op); 
+	op->type = UBUS_URING_OP_ACCEPT; 
+	op->fd = fd; 
+	op->pending++; 
+	return 0; 
+}
+
+int ubus_uring_recv(struct ubus_uring *self, struct ubus_uring_op *op, int fd){
+	struct io_uring_sqe *sqe = _ubus_uring_get_sqe(self); 
+	if(!sqe) return -EBUSY; 
+	io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0); 
+	sqe->flags |= IOSQE_BUFFER_SELECT; 
+	sqe->buf_group = UBUS_URING_BUF_GROUP; 
+	io_uring_sqe_set_data(sqe, op); 
+	op->type = UBUS_URING_OP_RECV; 
+	op->fd = fd; 
+	op->pending++; 
+	return 0; 
+}
+
+int ubus_uring_send(struct ubus_uring *self, struct ubus_uring_op *op, int fd, const void *data, size_t size, bool link){
+	struct io_uring_sqe *sqe = _ubus_uring_get_sqe(self); 
+	if(!sqe) return -EBUSY; 
+	// waitall makes a short write fail the link instead of letting the next frame overtake the rest of this one
+	io_uring_prep_send(sqe, fd, data, size, MSG_NOSIGNAL | MSG_WAITALL); 
+	if(link) sqe->flags |= IOSQE_IO_LINK; 
+	io_uring_sqe_set_data(sqe, op); 
+	op->type = UBUS_URING_OP_SEND; 
+	op->fd = fd; 
+	op->pending++; 
+	return 0; 
+}
+
+int ubus_uring_poll(struct ubus_uring *self, struct ubus_uring_op *op, int fd){
+	struct io_uring_sqe *sqe = _ubus_uring_get_sqe(self); 
+	if(!sqe) return -EBUSY; 
+	io_uring_prep_poll_add(sqe, fd, POLLIN); 
+	io_uring_sqe_set_data(sqe, op); 
+	op->type = UBUS_URING_OP_POLL; 
+	op->fd = fd; 
+	op->pending++; 
+	return 0; 
+}
+
+int ubus_uring_cancel(struct ubus_uring *self, int fd){
+	struct io_uring_sqe *sqe = _ubus_uring_get_sqe(self); 
+	if(!sqe) return -EBUSY; 
+	io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL); 
+	io_uring_sqe_set_data(sqe, NULL); 
+	return 0; 
+}
+
+int ubus_uring_run(struct ubus_uring *self, int timeout){
+	struct io_uring_cqe *cqe = NULL; 
+	struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L }; 
+	int ret = io_uring_submit_and_wait_timeout(&self->ring, &cqe, 1, (timeout < 0)?NULL:&ts, NULL); 
+	if(ret < 0 && ret != -ETIME && ret != -EINTR){
+		fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret)); 
+		return -1; 
+	}
+
+	int count = 0; 
+	unsigned head; 
+	io_uring_for_each_cqe(&self->ring, head, cqe){
+		struct ubus_uring_op *op = io_uring_cqe_get_data(cqe); 
+		count++; 
+		// cancel requests carry no op
+		if(!op) continue; 
+
+		bool more = !!(cqe->flags & IORING_CQE_F_MORE); 
+		if(!more) op->pending--; 
+
+		const void *data = NULL; 
+		int bid = -1; 
+		if(cqe->flags & IORING_CQE_F_BUFFER){
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT; 
+			data = self->buf_mem + (size_t)bid * UBUS_URING_BUF_SIZE; 
+		}
+
+		op->cb(op, cqe->res, data, more); 
+
+		// buffer goes back to the kernel as soon as the owner has consumed the data
+		if(bid >= 0) _ubus_uring_buf_recycle(self, bid); 
+	}
+	io_uring_cq_advance(&self->ring, count); 
+	return count; 
+}
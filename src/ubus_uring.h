@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+Optional io_uring event engine that ubus_srv_blob uses instead of poll() when the library is
+built with CONFIG_IO_URING=y.
+
+Accept and recv are armed once per socket as multishot operations. Received data lands in
+buffers that the kernel picks from a registered buffer ring, so no buffer has to be posted
+per read. Sends are queued as linked chains so that all frames queued for a socket are
+written in order by a single submission. Whoever owns the ring drives it: one call to
+ubus_uring_run() submits everything that was queued and then dispatches every completion
+that is ready.
+**/
+
+// number of provided receive buffers and the size of each (count must be a power of two)
+#define UBUS_URING_BUF_COUNT 256
+#define UBUS_URING_BUF_SIZE 16384
+// longest chain of linked sends queued at once for one socket
+#define UBUS_URING_CHAIN_MAX 32
+
+struct ubus_uring; 
+struct ubus_uring_op; 
+
+/**
+Completion callback. res is the result of the operation (new fd for accept, byte count for
+recv and send or negative errno). For recv data points to res bytes that are only valid
+until the callback returns. more is false when the kernel has dropped a multishot
+operation and it has to be armed again (or the owner can be freed once pending is zero).
+**/
+typedef void (*ubus_uring_cb_t)(struct ubus_uring_op *op, int res, const void *data, bool more); 
+
+enum ubus_uring_op_type {
+	UBUS_URING_OP_ACCEPT,
+	UBUS_URING_OP_RECV,
+	UBUS_URING_OP_SEND,
+	UBUS_URING_OP_POLL
+}; 
+
+//! Embedded into the object that owns an operation. Owner gets back to itself using container_of() in the callback.
+struct ubus_uring_op {
+	enum ubus_uring_op_type type; 
+	int fd; 
+	// number of submitted sqes that still reference this op
+	int pending; 
+	ubus_uring_cb_t cb; 
+}; 
+
+static inline void ubus_uring_op_init(struct ubus_uring_op *self, ubus_uring_cb_t cb){
+	self->pending = 0; 
+	self->fd = -1; 
+	self->cb = cb; 
+}
+
+//! Create a ring. Several transports can share one ring since every op carries its own callback. Returns NULL if the kernel does not support io_uring.
+struct ubus_uring *ubus_uring_new(unsigned int entries); 
+void ubus_uring_delete(struct ubus_uring **self); 
+
+//! Arm multishot accept on a listening socket
+int ubus_uring_accept(struct ubus_uring *self, struct ubus_uring_op *op, int fd); 
+//! Arm multishot recv using buffers from the provided buffer ring
+int ubus_uring_recv(struct ubus_uring *self, struct ubus_uring_op *op, int fd); 
+//! Make sure that count sqes can be queued without the queue being submitted in between. Must be called before queueing a linked chain.
+int ubus_uring_reserve(struct ubus_uring *self, unsigned int count); 
+//! Queue a send. If link is set then the next queued send on the same ring only starts after this one has fully completed.
+int ubus_uring_send(struct ubus_uring *self, struct ubus_uring_op *op, int fd, const void *data, size_t size, bool link); 
+//! Wait once for fd to become readable. res of the completion is the poll revents.
+int ubus_uring_poll(struct ubus_uring *self, struct ubus_uring_op *op, int fd); 
+//! Cancel all operations on a file descriptor. Completions for them are still delivered.
+int ubus_uring_cancel(struct ubus_uring *self, int fd); 
+
+//! Submit queued operations, wait up to timeout ms for at least one completion and dispatch all ready completions. Returns number of completions or -1.
+int ubus_uring_run(struct ubus_uring *self, int timeout); 
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubus_validator.h"
+
+/**
+Every type is one opcode. Arrays and tables with a type for their contents are followed by the
+length of that code (16 bit) so that the next type can be found without decoding the contents:
+
+	ARRAY_OF len <element type>
+	TABLE_OF len <value type>
+	TUPLE    len <type> <type> ...
+**/
+enum {
+	UBUS_VOP_STRING,
+	UBUS_VOP_INT,
+	UBUS_VOP_BOOL,
+	UBUS_VOP_NUMBER,
+	UBUS_VOP_ANY,
+	UBUS_VOP_ARRAY,
+	UBUS_VOP_TABLE,
+	// opcodes from here on have a length
+	UBUS_VOP_ARRAY_OF,
+	UBUS_VOP_TABLE_OF,
+	UBUS_VOP_TUPLE,
+	__UBUS_VOP_LAST
+}; 
+
+#define _T(type) (1u << (type))
+#define _T_INT (_T(BLOB_FIELD_INT8) | _T(BLOB_FIELD_INT16) | _T(BLOB_FIELD_INT32) | _T(BLOB_FIELD_INT64))
+
+// field types that every opcode accepts
+static const uint32_t _accept[__UBUS_VOP_LAST] = {
+	[UBUS_VOP_STRING] = _T(BLOB_FIELD_STRING),
+	[UBUS_VOP_INT] = _T_INT,
+	// bools are int8 (see RFC-ubus.md)
+	[UBUS_VOP_BOOL] = _T(BLOB_FIELD_INT8),
+	// json has no way of telling 1.0 from 1 so integers are numbers too
+	[UBUS_VOP_NUMBER] = _T_INT | _T(BLOB_FIELD_FLOAT32) | _T(BLOB_FIELD_FLOAT64),
+	[UBUS_VOP_ANY] = ~0u,
+	[UBUS_VOP_ARRAY] = _T(BLOB_FIELD_ARRAY),
+	[UBUS_VOP_TABLE] = _T(BLOB_FIELD_TABLE),
+	[UBUS_VOP_ARRAY_OF] = _T(BLOB_FIELD_ARRAY),
+	[UBUS_VOP_TABLE_OF] = _T(BLOB_FIELD_TABLE),
+	[UBUS_VOP_TUPLE] = _T(BLOB_FIELD_ARRAY)
+}; 
+
+void ubus_validator_init(struct ubus_validator *self){
+	memset(self, 0, sizeof(*self)); 
+}
+
+void ubus_validator_destroy(struct ubus_validator *self){
+	free(self->code); 
+	memset(self, 0, sizeof(*self)); 
+}
+
+static bool _ubus_validator_emit(struct ubus_validator *self, uint8_t byte){
+	if(!(self->size & 31)){
+		uint8_t *code = realloc(self->code, self->size + 32); 
+		if(!code) return false; 
+		self->code = code; 
+	}
+	self->code[self->size++] = byte; 
+	return true; 
+}
+
+static bool _ubus_validator_compile(struct ubus_validator *self, const char **sig, int depth); 
+
+// opcode with a length followed by the code that compile() emits for its contents
+static bool _ubus_validator_compile_block(struct ubus_validator *self, uint8_t op, const char **sig, char close, int depth){
+	if(depth >= UBUS_VALIDATOR_MAX_DEPTH) return false; 
+	size_t start = self->size; 
+	if(!_ubus_validator_emit(self, op) || !_ubus_validator_emit(self, 0) || !_ubus_validator_emit(self, 0)) return false; 
+	if(close){
+		while(**sig != close){
+			if(!_ubus_validator_compile(self, sig, depth + 1)) return false; 
+		}
+		(*sig)++; 
+	} else if(!_ubus_validator_compile(self, sig, depth + 1)){
+		return false; 
+	}
+	size_t len = self->size - start - 3; 
+	if(len > UINT16_MAX) return false; 
+	self->code[start + 1] = len >> 8; 
+	self->code[start + 2] = len & 0xff; 
+	return true; 
+}
+
+// table after the opening brace: either {} or {s<type>}
+static bool _ubus_validator_compile_table(struct ubus_validator *self, const char **sig, int depth){
+	if(**sig == '}'){
+		(*sig)++; 
+		return _ubus_validator_emit(self, UBUS_VOP_TABLE); 
+	}
+	if(**sig != 's') return false; 
+	(*sig)++; 
+	if(!_ubus_validator_compile_block(self, UBUS_VOP_TABLE_OF, sig, 0, depth)) return false; 
+	if(**sig != '}') return false; 
+	(*sig)++; 
+	return true; 
+}
+
+static bool _ubus_validator_compile(struct ubus_validator *self, const char **sig, int depth){
+	char c = **sig; 
+	// group that is not closed
+	if(!c) return false; 
+	(*sig)++; 
+	switch(c){
+		case 's': return _ubus_validator_emit(self, UBUS_VOP_STRING); 
+		case 'i': return _ubus_validator_emit(self, UBUS_VOP_INT); 
+		case 'b': return _ubus_validator_emit(self, UBUS_VOP_BOOL); 
+		case 'd': return _ubus_validator_emit(self, UBUS_VOP_NUMBER); 
+		case 'v': return _ubus_validator_emit(self, UBUS_VOP_ANY); 
+		case '{': return _ubus_validator_compile_table(self, sig, depth); 
+		case '[': 
+			if(**sig == ']'){
+				(*sig)++; 
+				return _ubus_validator_emit(self, UBUS_VOP_ARRAY); 
+			}
+			return _ubus_validator_compile_block(self, UBUS_VOP_TUPLE, sig, ']', depth); 
+		case 'a': 
+			// a bare 'a' (end of the signature or of a group) is an array of anything
+			if(!**sig || **sig == '}' || **sig == ']') return _ubus_validator_emit(self, UBUS_VOP_ARRAY); 
+			if(**sig == '{'){
+				(*sig)++; 
+				return _ubus_validator_compile_table(self, sig, depth); 
+			}
+			return _ubus_validator_compile_block(self, UBUS_VOP_ARRAY_OF, sig, 0, depth); 
+	}
+	return false; 
+}
+
+bool ubus_validator_add(struct ubus_validator *self, const char *signature){
+	size_t start = self->size; 
+	const char *sig = signature; 
+	self->params++; 
+	if(_ubus_validator_compile(self, &sig, 0) && *sig == 0) return true; 
+	// one parameter is one type. Anything else is not checked at all.
+	self->size = start; 
+	_ubus_validator_emit(self, UBUS_VOP_ANY); 
+	return false; 
+}
+
+static inline size_t _ubus_validator_len(const uint8_t *pc){
+	return (pc[1] << 8) | pc[2]; 
+}
+
+static inline const uint8_t *_ubus_validator_next(const uint8_t *pc){
+	return (*pc >= UBUS_VOP_ARRAY_OF)?(pc + 3 + _ubus_validator_len(pc)):(pc + 1); 
+}
+
+static bool _ubus_validator_run(const uint8_t *pc, struct blob_field *field){
+	if(!(_accept[*pc] & _T(blob_field_type(field)))) return false; 
+	switch(*pc){
+		case UBUS_VOP_ARRAY_OF: {
+			struct blob_field *child; 
+			blob_field_for_each_child(field, child){
+				if(!_ubus_validator_run(pc + 3, child)) return false; 
+			}
+			break; 
+		}
+		case UBUS_VOP_TABLE_OF: {
+			struct blob_field *key, *value; 
+			blob_field_for_each_kv(field, key, value){
+				if(!_ubus_validator_run(pc + 3, value)) return false; 
+			}
+			break; 
+		}
+		case UBUS_VOP_TUPLE: {
+			const uint8_t *item = pc + 3, *end = item + _ubus_validator_len(pc); 
+			struct blob_field *child; 
+			blob_field_for_each_child(field, child){
+				if(item == end || !_ubus_validator_run(item, child)) return false; 
+				item = _ubus_validator_next(item); 
+			}
+			// all elements are needed
+			return item == end; 
+		}
+	}
+	return true; 
+}
+
+bool ubus_validator_check(const struct ubus_validator *self, struct blob_field *params){
+	if(!self->params) return true; 
+	if(!params) return true; 
+	if(blob_field_type(params) != BLOB_FIELD_ARRAY) return false; 
+	const uint8_t *pc = self->code, *end = self->code + self->size; 
+	struct blob_field *child; 
+	blob_field_for_each_child(params, child){
+		if(pc == end || !_ubus_validator_run(pc, child)) return false; 
+		pc = _ubus_validator_next(pc); 
+	}
+	return true; 
+}
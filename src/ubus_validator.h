@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <blobpack/blobpack.h>
+
+/**
+Checks the parameters of a call against the signature of the method before the handler sees
+them. The signature of every parameter is compiled once when it is added (see
+ubus_method_add_param()) into a few bytes of code that are appended to the program of the
+method. Checking a call walks that code along with the fields of the message and compares the
+type of every field against a bit mask, the signature strings are never looked at again.
+
+Signature of a parameter:
+  s         string
+  i         integer of any width
+  b         bool
+  d         number (float or integer)
+  v         anything
+  a         array of anything, same as []
+  a<type>   array where every element is <type>
+  {s<type>} table where every value is <type>. Keys of tables are always strings.
+            a{s<type>} means the same (the dbus way of writing a dictionary).
+  {}        table of anything
+  [types]   array of exactly these elements in this order
+
+Parameters are positional. Like ubus has always done it, parameters at the end may be left out
+but the ones that are there have to match and there may not be more than were declared.
+**/
+
+// nesting of arrays and tables that a signature may have
+#define UBUS_VALIDATOR_MAX_DEPTH 16
+
+struct ubus_validator {
+	uint8_t *code; 
+	size_t size; 
+	int params; 	// number of parameters in the program
+}; 
+
+void ubus_validator_init(struct ubus_validator *self); 
+void ubus_validator_destroy(struct ubus_validator *self); 
+
+//! Compile the signature of the next parameter onto the end of the program. A signature that is not valid accepts anything and false is returned.
+bool ubus_validator_add(struct ubus_validator *self, const char *signature); 
+//! Check the array of parameters of a call. NULL means the call has no parameters. Always true if no parameters have been added.
+bool ubus_validator_check(const struct ubus_validator *self, struct blob_field *params); 